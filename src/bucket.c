@@ -21,9 +21,6 @@
 #include <stdint.h>
 #include <limits.h>
 
-#define GDBM_MAX_DIR_SIZE INT32_MAX
-#define GDBM_MAX_DIR_HALF (GDBM_MAX_DIR_SIZE / 2)
-
 /* Initializing a new hash buckets sets all bucket entries to -1 hash value. */
 void
 _gdbm_new_bucket (GDBM_FILE dbf, hash_bucket *bucket, int bits)
@@ -40,6 +37,11 @@ _gdbm_new_bucket (GDBM_FILE dbf, hash_bucket *bucket, int bits)
   /* Initialize all bucket elements. */
   for (index = 0; index < dbf->header->bucket_elems; index++)
     bucket->h_table[index].hash_value = -1;
+
+  /* The bucket is not chained. */
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_CHAIN))
+    memset ((char *) bucket + _gdbm_bucket_chain_offset (dbf), 0,
+	    GDBM_BUCKET_CHAIN_SIZE);
 }
 
 /* Bucket cache table functions */
@@ -169,22 +171,17 @@ cache_elem_new (GDBM_FILE dbf, off_t adr)
 
   elem->ca_prev = elem->ca_next = elem->ca_coll = NULL;
   elem->ca_hits = 0;
+  elem->ca_tombstones = 0;
   
   return elem;
 }
 
-/* Frees element ELEM.  Unlinks it from the cache tree and LRU list. */
+/* Remove ELEM from the cache hash table. */
 static void
-cache_elem_free (GDBM_FILE dbf, cache_elem *elem)
+cache_tab_unlink (GDBM_FILE dbf, cache_elem *elem)
 {
   size_t h = adrhash (elem->ca_adr, dbf->cache_bits);
   cache_elem **pp;
-  
-  lru_unlink_elem (dbf, elem);
-
-  elem->ca_next = dbf->cache_avail;
-  dbf->cache_avail = elem;
-  dbf->cache_num--;
 
   pp = &dbf->cache[h];
   while (*pp)
@@ -198,11 +195,41 @@ cache_elem_free (GDBM_FILE dbf, cache_elem *elem)
     }      
 }
 
-/* Free the least recently used cache entry. */
+/* Frees element ELEM.  Unlinks it from the cache tree and LRU list. */
+static void
+cache_elem_free (GDBM_FILE dbf, cache_elem *elem)
+{
+  lru_unlink_elem (dbf, elem);
+  if (elem->ca_changed)
+    dbf->cache_dirty--;
+  if (elem->ca_tombstones)
+    dbf->cache_tombstones--;
+
+  elem->ca_next = dbf->cache_avail;
+  dbf->cache_avail = elem;
+  dbf->cache_num--;
+
+  cache_tab_unlink (dbf, elem);
+}
+
+/* Free the least recently used cache entry.  Changed buckets with
+   tombstones are skipped: they can't be written before being reclaimed.
+   _gdbm_end_update makes sure enough other entries remain in the
+   cache.  Unchanged buckets can have only tombstones of expired records
+   (see _gdbm_elem_expired), which can be safely forgotten. */
 static inline int
 cache_lru_free (GDBM_FILE dbf)
 {
-  cache_elem *last = dbf->cache_lru;
+  cache_elem *last;
+
+  for (last = dbf->cache_lru; last && last->ca_changed && last->ca_tombstones;
+       last = last->ca_prev)
+    ;
+  if (!last)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BUCKET_CACHE_CORRUPTED, TRUE);
+      return -1;
+    }
   if (last->ca_changed)
     {
       if (_gdbm_write_bucket (dbf, last))
@@ -328,6 +355,11 @@ cache_lookup (GDBM_FILE dbf, off_t adr, cache_elem *ref, cache_elem **ret_elem)
 	    {
 	      rc = cache_failure;
 	    }
+	  else
+	    {
+	      /* The slot could belong to the freed element. */
+	      elp = cache_tab_lookup_slot (dbf, adr);
+	    }
 	}
       
       if (rc == cache_new)
@@ -339,11 +371,11 @@ cache_lookup (GDBM_FILE dbf, off_t adr, cache_elem *ref, cache_elem **ret_elem)
 
   /*
    * If the obtained bucket is not changed and is going to become current,
-   * flush all changed cache elements.  This ensures that changed cache
-   * elements form a contiguous sequence at the head of the cache list (see
-   * _gdbm_cache_flush).
+   * flush all changed cache elements, unless their writing is deferred
+   * (see _gdbm_end_update).  This ensures that changed cache elements
+   * normally form a contiguous sequence at the head of the cache list.
    */
-  if (ref == NULL && !elem->ca_changed)
+  if (ref == NULL && !elem->ca_changed && dbf->flush_budget == 0)
     _gdbm_cache_flush (dbf);
   
   lru_link_elem (dbf, elem, ref);
@@ -352,37 +384,15 @@ cache_lookup (GDBM_FILE dbf, off_t adr, cache_elem *ref, cache_elem **ret_elem)
   return rc;
 }
 
-/*
- * Find a bucket for DBF that is pointed to by the bucket directory from
- * location DIR_INDEX.   The bucket cache is first checked to see if it
- * is already in memory.  If not, the last recently used bucket may be
- * tossed (if the cache is full) to read the new bucket.
- *
- * On success, the cached entry with the requested bucket is placed at
- * the head of the cache list (cache_mru) and the requested bucket becomes
- * "current".
- *
- * On error, the current bucket remains unchanged.
- */
-int
-_gdbm_get_bucket (GDBM_FILE dbf, int dir_index)
+/* Read the bucket at ADR, unless it is in the cache, and make it
+   current.  On error, the current bucket remains unchanged. */
+static int
+read_bucket (GDBM_FILE dbf, off_t bucket_adr)
 {
   int rc;
-  off_t bucket_adr;	/* The address of the correct hash bucket.  */
   off_t	file_pos;	/* The return address for lseek. */
   hash_bucket *bucket;
   cache_elem *elem;
-  
-  if (!gdbm_dir_entry_valid_p (dbf, dir_index))
-    {
-      /* FIXME: negative caching? */
-      GDBM_SET_ERRNO (dbf, GDBM_BAD_DIR_ENTRY, TRUE);
-      return -1;
-    }
-  
-  /* Initial set up. */
-  dbf->bucket_dir = dir_index;
-  bucket_adr = dbf->dir[dir_index];
 
   switch (cache_lookup (dbf, bucket_adr, NULL, &elem))
     {
@@ -445,22 +455,536 @@ _gdbm_get_bucket (GDBM_FILE dbf, int dir_index)
   return 0;
 }
 
+/*
+ * Find a bucket for DBF that is pointed to by the bucket directory from
+ * location DIR_INDEX.   The bucket cache is first checked to see if it
+ * is already in memory.  If not, the last recently used bucket may be
+ * tossed (if the cache is full) to read the new bucket.
+ *
+ * On success, the cached entry with the requested bucket is placed at
+ * the head of the cache list (cache_mru) and the requested bucket becomes
+ * "current".
+ *
+ * On error, the current bucket remains unchanged.
+ */
+int
+_gdbm_get_bucket (GDBM_FILE dbf, int dir_index)
+{
+  /* Read in the directory page, if necessary.  Failure to do so
+     is reported as such, rather than as a bad directory entry. */
+  if (dir_index >= 0 && dir_index < GDBM_DIR_COUNT (dbf)
+      && _gdbm_dir_load (dbf, dir_index, 1))
+    return -1;
+
+  if (!gdbm_dir_entry_valid_p (dbf, dir_index))
+    {
+      /* FIXME: negative caching? */
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_DIR_ENTRY, TRUE);
+      return -1;
+    }
+  
+  /* Initial set up. */
+  dbf->bucket_dir = dir_index;
+  dbf->chain_pos = 0;
+
+  return read_bucket (dbf, _gdbm_dir_entry (dbf, dir_index));
+}
+
+/* Overflow chains.
+
+   In databases with the GDBM_FEAT_CHAIN feature, the bucket referenced
+   by the directory may be followed by overflow buckets of the same
+   depth, linked by their chain trailers.  Lookups search all buckets of
+   the chain.  A new element goes to the first of them that has room.
+   If all of them are full, the chain is split by the next bit of the
+   hash values, as a single bucket would be, unless that requires
+   doubling the directory and the split is uneven: then a new bucket is
+   appended to the chain instead.  Thus, keys with long common hash
+   prefixes make chains grow, rather than the directory.
+
+   Overflow buckets are written and relocated (see bucket_relocate) like
+   the others.  When one of them moves, the trailer of its predecessor
+   in the chain is updated. */
+
+/* A chain can't have more buckets than the file: a longer one is
+   cyclic. */
+#define CHAIN_MAX(dbf) ((dbf)->header->next_block / (dbf)->header->bucket_size)
+
+/* The bit of hash values that splits a chain of depth BITS. */
+#define CHAIN_SPLIT_BIT(bits) (1u << (GDBM_HASH_BITS - (bits) - 1))
+
+/* Make current the bucket that follows the current one in its overflow
+   chain.  The bucket_dir member is not changed.  Return 0 on success, 1
+   if the current bucket is the last one in its chain (as it always is
+   in databases without the GDBM_FEAT_CHAIN feature) and -1 on error. */
+int
+_gdbm_next_bucket (GDBM_FILE dbf)
+{
+  bucket_chain chain;
+  int bits;
+
+  if (!_gdbm_feature_p (dbf, GDBM_FEAT_CHAIN))
+    return 1;
+  _gdbm_bucket_chain_get (dbf, dbf->bucket, &chain);
+  if (chain.next == 0)
+    return 1;
+  if (chain.next < dbf->header->block_size
+      || !off_t_sum_ok (chain.next, dbf->header->bucket_size)
+      || dbf->chain_pos >= CHAIN_MAX (dbf))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_BUCKET, TRUE);
+      return -1;
+    }
+
+  bits = dbf->bucket->bucket_bits;
+  if (read_bucket (dbf, chain.next))
+    return -1;
+  dbf->chain_pos++;
+  if (dbf->bucket->bucket_bits != bits)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_BUCKET, TRUE);
+      return -1;
+    }
+  return 0;
+}
+
+/* Remove the bucket at ADR from the cache, if it is there.  Changes
+   made to it are lost. */
+static void
+cache_forget (GDBM_FILE dbf, off_t adr)
+{
+  cache_elem *elem = *cache_tab_lookup_slot (dbf, adr);
+
+  if (elem)
+    cache_elem_free (dbf, elem);
+}
+
+/* Return the bucket at ADR without changing the cache: the cached copy,
+   if any, whose cache element is stored in *PELEM, or else a copy read
+   into BUF, in which case *PELEM is set to NULL.  Return NULL on
+   error. */
+static hash_bucket *
+bucket_peek (GDBM_FILE dbf, off_t adr, hash_bucket *buf, cache_elem **pelem)
+{
+  *pelem = *cache_tab_lookup_slot (dbf, adr);
+  if (*pelem)
+    return (*pelem)->ca_bucket;
+
+  if (gdbm_file_seek (dbf, adr, SEEK_SET) != adr)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+      _gdbm_fatal (dbf, _("lseek error"));
+      return NULL;
+    }
+  if (_gdbm_full_read (dbf, buf, dbf->header->bucket_size))
+    {
+      dbf->need_recovery = TRUE;
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return NULL;
+    }
+  if (!(buf->count >= 0 && buf->count <= dbf->header->bucket_elems)
+      || gdbm_bucket_avail_table_validate (dbf, buf))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_BUCKET, TRUE);
+      return NULL;
+    }
+  return buf;
+}
+
+/* Write BUCKET to the file at ADR, bypassing the cache. */
+static int
+bucket_write_at (GDBM_FILE dbf, hash_bucket *bucket, off_t adr)
+{
+  int rc;
+
+  if (gdbm_file_seek (dbf, adr, SEEK_SET) != adr)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+      _gdbm_fatal (dbf, _("lseek error"));
+      return -1;
+    }
+  /* Stamp the bucket with the current generation.  Since the bucket is
+     written after it has been changed, the stamp is never older than
+     the change. */
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_GENERATION))
+    memcpy ((char *) bucket + dbf->header->bucket_size
+	    - GDBM_BUCKET_GEN_SIZE, &dbf->xheader->numsync,
+	    GDBM_BUCKET_GEN_SIZE);
+  rc = _gdbm_full_write (dbf, bucket, dbf->header->bucket_size);
+  if (rc)
+    {
+      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
+		  "%s: error writing bucket: %s",
+		  dbf->name, gdbm_db_strerror (dbf));	  
+      _gdbm_fatal (dbf, gdbm_strerror (rc));
+      return -1;
+    }
+  return 0;
+}
+
+/* Append a new empty bucket to the overflow chain of the current bucket,
+   which must be the last one of the chain, and make it current. */
+int
+_gdbm_chain_bucket (GDBM_FILE dbf)
+{
+  bucket_chain chain;
+  cache_elem *elem;
+  off_t adr;
+  int bits = dbf->bucket->bucket_bits;
+  int pos = dbf->chain_pos;
+
+  adr = _gdbm_alloc (dbf, dbf->header->bucket_size);
+  if (adr == 0)
+    return -1;
+  _gdbm_bucket_chain_get (dbf, dbf->bucket, &chain);
+  chain.next = adr;
+  _gdbm_bucket_chain_put (dbf, dbf->bucket, &chain);
+  _gdbm_current_bucket_changed (dbf);
+
+  switch (cache_lookup (dbf, adr, NULL, &elem))
+    {
+    case cache_new:
+      break;
+
+    case cache_found:
+      /* should not happen */
+      GDBM_SET_ERRNO (dbf, GDBM_BUCKET_CACHE_CORRUPTED, TRUE);
+      return -1;
+
+    case cache_failure:
+      return -1;
+    }
+  _gdbm_new_bucket (dbf, elem->ca_bucket, bits);
+  chain.next = 0;
+  _gdbm_bucket_chain_put (dbf, elem->ca_bucket, &chain);
+  _gdbm_cache_elem_changed (dbf, elem);
+  if (_gdbm_snapshot_active_p (dbf))
+    _gdbm_snapshot_fresh (dbf, adr);
+  dbf->chain_pos = pos + 1;
+  return 0;
+}
+
+/* Split the overflow chain of the hash value HASH in two by the next bit
+   of the hash values, growing the directory if necessary.  The buckets
+   of the new chains are written out at once, and those of the old one
+   are freed.  The first bucket of the new chain of HASH becomes
+   current. */
+static int
+chain_split (GDBM_FILE dbf, int hash)
+{
+  int elems = dbf->header->bucket_elems;
+  int size = dbf->header->bucket_size;
+  bucket_element *tab = NULL;	/* Elements of the chain. */
+  avail_elem *avail = NULL;	/* Avail entries of the chain. */
+  off_t *old = NULL;		/* Addresses of its buckets. */
+  off_t *adr = NULL;		/* Addresses of the new buckets. */
+  hash_bucket *buf;
+  size_t ntab = 0, navail = 0, nold = 0, max = 0;
+  off_t old_dir = 0;
+  int old_dir_size = 0;
+  unsigned bit;
+  int nb[2], bits, start, mid, end;
+  size_t i, j, k;
+  int side;
+  off_t next;
+  int rc = -1;
+
+  if (_gdbm_get_bucket (dbf, _gdbm_bucket_dir (dbf, hash)))
+    return -1;
+  bits = dbf->bucket->bucket_bits;
+  if (bits == dbf->header->dir_bits
+      && _gdbm_dir_grow (dbf, bits + 1, &old_dir, &old_dir_size))
+    return -1;
+  bit = CHAIN_SPLIT_BIT (bits);
+
+  buf = malloc (size);
+  if (!buf)
+    goto nomem;
+
+  /* Collect the elements and the avail entries of the chain.  Its
+     buckets are looked up without changing the cache, so that none of
+     them can be evicted, and moved, in the meantime. */
+  for (next = dbf->cache_mru->ca_adr; next; )
+    {
+      cache_elem *elem;
+      hash_bucket *bucket;
+      bucket_chain chain;
+
+      if (nold == max)
+	{
+	  size_t n = max ? 2 * max : 4;
+	  void *p;
+
+	  if (max > CHAIN_MAX (dbf))
+	    {
+	      GDBM_SET_ERRNO (dbf, GDBM_BAD_BUCKET, TRUE);
+	      goto end;
+	    }
+	  if ((p = realloc (old, n * sizeof (old[0]))) == NULL)
+	    goto nomem;
+	  old = p;
+	  if ((p = realloc (tab, n * elems * sizeof (tab[0]))) == NULL)
+	    goto nomem;
+	  tab = p;
+	  if ((p = realloc (avail, n * BUCKET_AVAIL * sizeof (avail[0])))
+	      == NULL)
+	    goto nomem;
+	  avail = p;
+	  max = n;
+	}
+
+      bucket = bucket_peek (dbf, next, buf, &elem);
+      if (!bucket)
+	goto end;
+      old[nold++] = next;
+      for (i = 0; i < elems; i++)
+	if (bucket->h_table[i].hash_value >= 0)
+	  tab[ntab++] = bucket->h_table[i];
+      memcpy (avail + navail, bucket->bucket_avail,
+	      bucket->av_count * sizeof (avail[0]));
+      navail += bucket->av_count;
+      _gdbm_bucket_chain_get (dbf, bucket, &chain);
+      next = chain.next;
+    }
+
+  /* Allocate the new buckets: as many as needed for each half, but at
+     least one. */
+  nb[0] = nb[1] = 0;
+  for (i = 0; i < ntab; i++)
+    nb[(tab[i].hash_value & bit) != 0]++;
+  for (side = 0; side < 2; side++)
+    nb[side] = nb[side] ? (nb[side] + elems - 1) / elems : 1;
+  adr = calloc (nb[0] + nb[1], sizeof (adr[0]));
+  if (!adr)
+    goto nomem;
+  for (k = 0; k < nb[0] + nb[1]; k++)
+    {
+      adr[k] = _gdbm_alloc_central (dbf, size);
+      if (adr[k] == 0)
+	goto end;
+    }
+
+  /* Fill the new buckets and write them out. */
+  k = 0;
+  for (side = 0; side < 2; side++)
+    {
+      bucket_chain chain;
+      int b;
+
+      memset (&chain, 0, sizeof (chain));
+      chain.hash = (hash & ~(2 * bit - 1)) | (side ? bit : 0);
+      for (b = 0, j = 0; b < nb[side]; b++, k++)
+	{
+	  memset (buf, 0, size);
+	  _gdbm_new_bucket (dbf, buf, bits + 1);
+	  for (; j < ntab && buf->count < elems; j++)
+	    {
+	      int loc;
+
+	      if (((tab[j].hash_value & bit) != 0) != side)
+		continue;
+	      loc = tab[j].hash_value % elems;
+	      while (buf->h_table[loc].hash_value != -1)
+		loc = (loc + 1) % elems;
+	      buf->h_table[loc] = tab[j];
+	      buf->count++;
+	    }
+	  while (navail > 0 && buf->av_count < BUCKET_AVAIL)
+	    _gdbm_put_av_elem (avail[--navail], buf->bucket_avail,
+			       &buf->av_count, dbf->coalesce_blocks);
+	  chain.next = b + 1 < nb[side] ? adr[k + 1] : 0;
+	  _gdbm_bucket_chain_put (dbf, buf, &chain);
+	  if (bucket_write_at (dbf, buf, adr[k]))
+	    goto end;
+	  if (_gdbm_snapshot_active_p (dbf))
+	    _gdbm_snapshot_fresh (dbf, adr[k]);
+	}
+    }
+
+  /* Replace the old chain with the new ones in the directory. */
+  for (i = 0; i < nold; i++)
+    cache_forget (dbf, old[i]);
+  _gdbm_bucket_dir_range (dbf, _gdbm_bucket_dir (dbf, hash), bits,
+			  &start, &end);
+  mid = start + (end - start) / 2;
+  if (_gdbm_dir_load (dbf, start, end - start)
+      || _gdbm_dir_set (dbf, start, mid, adr[0])
+      || _gdbm_dir_set (dbf, mid, end, adr[nb[0]])
+      || _gdbm_get_bucket (dbf, _gdbm_bucket_dir (dbf, hash)))
+    goto end;
+
+  /* Free the old buckets and the space that didn't fit into the avail
+     tables of the new ones. */
+  for (i = 0; i < nold; i++)
+    if (_gdbm_free (dbf, old[i], size))
+      goto end;
+  for (i = 0; i < navail; i++)
+    if (_gdbm_free (dbf, avail[i].av_adr, avail[i].av_size))
+      goto end;
+  if (old_dir && _gdbm_free (dbf, old_dir, old_dir_size))
+    goto end;
+  _gdbm_current_bucket_changed (dbf);
+  rc = 0;
+  goto end;
+
+ nomem:
+  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+ end:
+  free (buf);
+  free (tab);
+  free (avail);
+  free (old);
+  free (adr);
+  return rc;
+}
+
+/* Return true if the overflow chain of depth BITS had better be split,
+   rather than extended.  N[0] and N[1] are the numbers of its elements,
+   including the new one, that would go to either half.  A split is
+   always made, if possible, while it doesn't require growing the
+   directory.  Beyond that depth, the directory is doubled only if each
+   half gets at least a quarter of the elements: doubling it for a few
+   keys with a long common hash prefix would be wasteful, and would not
+   help them anyway. */
+static int
+chain_split_p (GDBM_FILE dbf, int bits, int n[2])
+{
+  int total = n[0] + n[1];
+
+  if (bits >= GDBM_HASH_BITS)
+    return 0;
+  if (bits < dbf->header->dir_bits)
+    return 1;
+  return dbf->header->dir_size <= (GDBM_MAX_DIR_SIZE >> 1)
+         && 4 * n[0] >= total && 4 * n[1] >= total;
+}
+
+/* Make current a bucket with room for a new element with hash value
+   HASH, reclaiming tombstones and splitting buckets as needed.  The
+   current bucket must be the one (or, in chained databases, one of
+   those) that HASH belongs to, as left by _gdbm_findkey. */
+int
+_gdbm_bucket_room (GDBM_FILE dbf, int hash)
+{
+  if (_gdbm_bucket_reclaim (dbf))
+    return -1;
+  if (dbf->bucket->count < dbf->header->bucket_elems)
+    return 0;
+  if (!_gdbm_feature_p (dbf, GDBM_FEAT_CHAIN))
+    return _gdbm_split_bucket (dbf, hash);
+
+  for (;;)
+    {
+      int n[2] = { 0, 0 };
+      int bits, i, rc;
+
+      /* Look for room in the whole chain. */
+      if (_gdbm_get_bucket (dbf, _gdbm_bucket_dir (dbf, hash)))
+	return -1;
+      bits = dbf->bucket->bucket_bits;
+      do
+	{
+	  if (_gdbm_bucket_reclaim (dbf))
+	    return -1;
+	  if (dbf->bucket->count < dbf->header->bucket_elems)
+	    return 0;
+	  if (bits < GDBM_HASH_BITS)
+	    for (i = 0; i < dbf->header->bucket_elems; i++)
+	      n[(dbf->bucket->h_table[i].hash_value
+		 & CHAIN_SPLIT_BIT (bits)) != 0]++;
+	}
+      while ((rc = _gdbm_next_bucket (dbf)) == 0);
+      if (rc == -1)
+	return -1;
+
+      if (bits < GDBM_HASH_BITS)
+	n[(hash & CHAIN_SPLIT_BIT (bits)) != 0]++;
+      if (!chain_split_p (dbf, bits, n))
+	return _gdbm_chain_bucket (dbf);
+      if (chain_split (dbf, hash))
+	return -1;
+      /* The next split of a chain of this depth will double the
+	 directory. */
+      if (dbf->bucket->bucket_bits == dbf->header->dir_bits
+	  && _gdbm_dir_prepare (dbf))
+	return -1;
+    }
+}
+
+/* Compute the number of hash bits the buckets resulting from splitting
+   the current bucket must be indexed by, so that the one that receives
+   the hash value NEXT_INSERT has room for it.  Return -1 if no split can
+   achieve that, i.e. if the bucket is filled with elements having the
+   same hash value as NEXT_INSERT. */
+static int
+split_bits (GDBM_FILE dbf, int next_insert)
+{
+  /* Number of elements sharing a prefix of exactly N bits with
+     NEXT_INSERT. */
+  int prefix_count[GDBM_HASH_BITS + 1];
+  int count;
+  int bits;
+  int i;
+
+  memset (prefix_count, 0, sizeof (prefix_count));
+  for (i = 0; i < dbf->header->bucket_elems; i++)
+    {
+      unsigned diff = dbf->bucket->h_table[i].hash_value ^ next_insert;
+      int n = GDBM_HASH_BITS;
+
+      while (diff)
+	{
+	  diff >>= 1;
+	  n--;
+	}
+      prefix_count[n]++;
+    }
+
+  /* Elements that share a prefix of BITS bits with NEXT_INSERT go to
+     the same bucket as it.  Count them for increasing values of BITS. */
+  count = dbf->header->bucket_elems;
+  for (bits = 0; bits <= dbf->bucket->bucket_bits; bits++)
+    count -= prefix_count[bits];
+  for (; bits <= GDBM_HASH_BITS; bits++)
+    {
+      if (count < dbf->header->bucket_elems)
+	return bits;
+      count -= prefix_count[bits];
+    }
+  return -1;
+}
+
 /* Split the current bucket.  This includes moving all items in the bucket to
    a new bucket.  This doesn't require any disk reads because all hash values
    are stored in the buckets.  Splitting the current bucket may require
-   doubling the size of the hash directory.  */
+   growing the hash directory.
+
+   The depth of the resulting buckets is computed in advance, and the
+   directory, if necessary, is grown to that depth at once.  If the
+   split is impossible, or would require a directory larger than the
+   maximum, GDBM_DIR_OVERFLOW is returned before anything is modified. */
 int
 _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
 {
-  off_t        old_adr[GDBM_HASH_BITS];  /* Address of the old directories. */
-  int          old_size[GDBM_HASH_BITS]; /* Size of the old directories. */
-  int	       old_count;	/* Number of old directories. */
+  off_t        old_adr = 0;	/* Address of the old directory. */
+  int          old_size = 0;	/* Size of the old directory. */
 
   int          index;		/* Used in array indexing. */
   int          index1;		/* Used in array indexing. */
+  int          bits;		/* Depth of the buckets after the split. */
+
+  bits = split_bits (dbf, next_insert);
+  if (bits == -1)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_DIR_OVERFLOW, FALSE);
+      return -1;
+    }
+  if (bits > dbf->header->dir_bits)
+    {
+      if (_gdbm_dir_grow (dbf, bits, &old_adr, &old_size))
+	return -1;
+    }
   
-  /* No directories are yet old. */
-  old_count = 0;
   while (dbf->bucket->count == dbf->header->bucket_elems)
     {
       int          new_bits;	/* The number of bits for the new buckets. */
@@ -469,12 +993,22 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
       off_t        adr_1;	/* File address of the new bucket 1. */
       avail_elem   old_bucket;	/* Avail Struct for the old bucket. */
       
-      off_t        dir_start0;	/* Used in updating the directory. */
-      off_t        dir_start1;
-      off_t        dir_end;
+      int          dir_start0;	/* Used in updating the directory. */
+      int          dir_start1;
+      int          dir_end;
 
       new_bits = dbf->bucket->bucket_bits + 1;
 
+      /* The directory has been grown to the final depth above. */
+      if (new_bits > dbf->header->dir_bits)
+	{
+	  GDBM_DEBUG (GDBM_DEBUG_ERR,
+		      "%s: split beyond the computed depth",
+		      dbf->name);
+	  GDBM_SET_ERRNO (dbf, GDBM_DIR_OVERFLOW, FALSE);
+	  return -1;
+	}
+
       /*
        * Allocate two new buckets.  They will be populated with the entries
        * from the current bucket (cache_mru->bucket), so make sure that
@@ -521,52 +1055,6 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
 	}
       _gdbm_new_bucket (dbf, newcache[1]->ca_bucket, new_bits);
 
-      /* Double the directory size if necessary. */
-      if (dbf->header->dir_bits == dbf->bucket->bucket_bits)
-	{
-	  off_t       *new_dir;		/* Pointer to the new directory. */
-	  int          dir_size;	/* Size of the new directory. */
-	  off_t        dir_adr; 	/* Address of the new directory. */
-	  
-	  if (dbf->header->dir_size >= GDBM_MAX_DIR_HALF)
-	    {
-	      GDBM_SET_ERRNO (dbf, GDBM_DIR_OVERFLOW, TRUE);
-	      _gdbm_fatal (dbf, _("directory overflow"));
-	      return -1;
-	    }
-	  dir_size = dbf->header->dir_size * 2;
-	  dir_adr  = _gdbm_alloc (dbf, dir_size);
-	  if (dir_adr == 0)
-	    return -1;
-	  new_dir = malloc (dir_size);
-	  if (new_dir == NULL)
-	    {
-	      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
-	      _gdbm_fatal (dbf, _("malloc error"));
-	      return -1;
-	    }
-
-	  for (index = 0; index < GDBM_DIR_COUNT (dbf); index++)
-	    {
-	      new_dir[2*index]   = dbf->dir[index];
-	      new_dir[2*index+1] = dbf->dir[index];
-	    }
-	  
-	  /* Update header. */
-	  old_adr[old_count] = dbf->header->dir;
-	  dbf->header->dir = dir_adr;
-	  old_size[old_count] = dbf->header->dir_size;
-	  dbf->header->dir_size = dir_size;
-	  dbf->header->dir_bits = new_bits;
-	  old_count++;
-	  
-	  /* Now update dbf.  */
-	  dbf->header_changed = TRUE;
-	  dbf->bucket_dir *= 2;
-	  free (dbf->dir);
-	  dbf->dir = new_dir;
-	}
-
       /* Copy all elements in dbf->bucket into the new buckets. */
       for (index = 0; index < dbf->header->bucket_elems; index++)
 	{
@@ -620,19 +1108,18 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
 	}
       
       /* Update the directory.  We have new file addresses for both buckets. */
-      dir_start1 = (dbf->bucket_dir >> (dbf->header->dir_bits - new_bits)) | 1;
-      dir_end = (dir_start1 + 1) << (dbf->header->dir_bits - new_bits);
-      dir_start1 = dir_start1 << (dbf->header->dir_bits - new_bits);
-      dir_start0 = dir_start1 - (dir_end - dir_start1);
-      for (index = dir_start0; index < dir_start1; index++)
-	dbf->dir[index] = adr_0;
-      for (index = dir_start1; index < dir_end; index++)
-	dbf->dir[index] = adr_1;
+      _gdbm_bucket_dir_range (dbf, dbf->bucket_dir, new_bits - 1,
+			      &dir_start0, &dir_end);
+      dir_start1 = dir_start0 + (dir_end - dir_start0) / 2;
+      if (_gdbm_dir_load (dbf, dir_start0, dir_end - dir_start0))
+	return -1;
+      if (_gdbm_dir_set (dbf, dir_start0, dir_start1, adr_0)
+	  || _gdbm_dir_set (dbf, dir_start1, dir_end, adr_1))
+	return -1;
       
       /* Set changed flags. */
-      newcache[0]->ca_changed = TRUE;
-      newcache[1]->ca_changed = TRUE;
-      dbf->directory_changed = TRUE;
+      _gdbm_cache_elem_changed (dbf, newcache[0]);
+      _gdbm_cache_elem_changed (dbf, newcache[1]);
       
       /* Update the cache! */
       dbf->bucket_dir = _gdbm_bucket_dir (dbf, next_insert);
@@ -643,63 +1130,269 @@ _gdbm_split_bucket (GDBM_FILE dbf, int next_insert)
       cache_elem_free (dbf, dbf->cache_mru);
       
       /* Set dbf->bucket to the proper bucket. */
-      if (dbf->dir[dbf->bucket_dir] != adr_0)
+      if (_gdbm_dir_entry (dbf, dbf->bucket_dir) != adr_0)
 	{
 	  cache_elem *t = newcache[0];
 	  newcache[0] = newcache[1];
 	  newcache[1] = t;
 	}
 
-      _gdbm_put_av_elem (old_bucket,
-			 newcache[1]->ca_bucket->bucket_avail,
-			 &newcache[1]->ca_bucket->av_count, 
-			 dbf->coalesce_blocks);
+      if (_gdbm_snapshot_active_p (dbf))
+	{
+	  /* The old bucket may still be read through a snapshot. */
+	  _gdbm_snapshot_fresh (dbf, adr_0);
+	  _gdbm_snapshot_fresh (dbf, adr_1);
+	  if (_gdbm_snapshot_defer_free (dbf, old_bucket.av_adr,
+					 old_bucket.av_size))
+	    return -1;
+	}
+      else
+	_gdbm_put_av_elem (old_bucket,
+			   newcache[1]->ca_bucket->bucket_avail,
+			   &newcache[1]->ca_bucket->av_count, 
+			   dbf->coalesce_blocks);
 
       lru_unlink_elem (dbf, newcache[0]);
       lru_link_elem (dbf, newcache[0], NULL);
     }
 
-  /* Get rid of old directories. */
-  for (index = 0; index < old_count; index++)
-    if (_gdbm_free (dbf, old_adr[index], old_size[index]))
-      return -1;
+  /* Get rid of the old directory. */
+  if (old_adr && _gdbm_free (dbf, old_adr, old_size))
+    return -1;
+
+  /* The next split of a bucket of this depth will double the
+     directory. */
+  if (dbf->bucket->bucket_bits == dbf->header->dir_bits)
+    return _gdbm_dir_prepare (dbf);
 
   return 0;
 }
 
 
-/* The only place where a bucket is written.  CA_ENTRY is the
-   cache entry containing the bucket to be written. */
-
+/* Create a new empty bucket of depth BITS, point the range of directory
+   entries containing DIR_INDEX to it and make it current.  The bucket
+   is kept in the cache as changed.  The buckets previously referenced
+   by these entries are not freed.  This is used to build a database
+   whose structure is known in advance (see gdbmreorg.c). */
 int
-_gdbm_write_bucket (GDBM_FILE dbf, cache_elem *ca_entry)
+_gdbm_install_bucket (GDBM_FILE dbf, int dir_index, int bits)
+{
+  cache_elem *elem;
+  off_t adr;
+  int start, end;
+
+  _gdbm_bucket_dir_range (dbf, dir_index, bits, &start, &end);
+  if (_gdbm_dir_load (dbf, start, end - start))
+    return -1;
+
+  adr = _gdbm_alloc (dbf, dbf->header->bucket_size);
+  if (adr == 0)
+    return -1;
+  _gdbm_current_bucket_changed (dbf);
+
+  switch (cache_lookup (dbf, adr, NULL, &elem))
+    {
+    case cache_new:
+      break;
+
+    case cache_found:
+      /* should not happen */
+      GDBM_SET_ERRNO (dbf, GDBM_BUCKET_CACHE_CORRUPTED, TRUE);
+      return -1;
+
+    case cache_failure:
+      return -1;
+    }
+  _gdbm_new_bucket (dbf, elem->ca_bucket, bits);
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_CHAIN))
+    {
+      bucket_chain chain;
+
+      _gdbm_bucket_chain_get (dbf, elem->ca_bucket, &chain);
+      chain.hash = start << (GDBM_HASH_BITS - dbf->header->dir_bits);
+      _gdbm_bucket_chain_put (dbf, elem->ca_bucket, &chain);
+    }
+  _gdbm_cache_elem_changed (dbf, elem);
+
+  if (_gdbm_dir_set (dbf, start, end, adr))
+    return -1;
+  dbf->bucket_dir = dir_index;
+  dbf->chain_pos = 0;
+
+  return 0;
+}
+
+/* Update the references to the BUCKET of a chained database, which is
+   moved from OLD_ADR to NEW_ADR: the directory entries, if it is the
+   first bucket of its chain, or else the trailer of its predecessor.
+   The latter is written out, unless it is a changed bucket in the cache.
+   If it can't be overwritten, because snapshots may read it, it is
+   moved in turn. */
+static int
+chain_relink (GDBM_FILE dbf, hash_bucket *bucket, off_t old_adr,
+	      off_t new_adr)
 {
+  bucket_chain chain;
+  cache_elem *elem = NULL;
+  hash_bucket *pred = NULL, *buf;
+  off_t adr, moved;
+  int dir_index, start, end;
+  size_t n;
   int rc;
-  off_t file_pos;	/* The return value for lseek. */
 
-  file_pos = gdbm_file_seek (dbf, ca_entry->ca_adr, SEEK_SET);
-  if (file_pos != ca_entry->ca_adr)
+  _gdbm_bucket_chain_get (dbf, bucket, &chain);
+  if (chain.hash < 0)
     {
-      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
-      _gdbm_fatal (dbf, _("lseek error"));
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_BUCKET, TRUE);
       return -1;
     }
-  rc = _gdbm_full_write (dbf, ca_entry->ca_bucket, dbf->header->bucket_size);
-  if (rc)
+  dir_index = _gdbm_bucket_dir (dbf, chain.hash);
+  if (_gdbm_dir_load (dbf, dir_index, 1))
+    return -1;
+  adr = _gdbm_dir_entry (dbf, dir_index);
+  if (adr == old_adr)
     {
-      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: error writing bucket: %s",
-		  dbf->name, gdbm_db_strerror (dbf));	  
-      _gdbm_fatal (dbf, gdbm_strerror (rc));
+      _gdbm_bucket_dir_range (dbf, dir_index, bucket->bucket_bits,
+			      &start, &end);
+      if (_gdbm_dir_load (dbf, start, end - start))
+	return -1;
+      return _gdbm_dir_replace (dbf, start, end, old_adr, new_adr);
+    }
+
+  buf = malloc (dbf->header->bucket_size);
+  if (!buf)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  /* Find the predecessor. */
+  for (n = 0; adr != 0 && adr != old_adr && n <= CHAIN_MAX (dbf); n++)
+    {
+      pred = bucket_peek (dbf, adr, buf, &elem);
+      if (!pred)
+	{
+	  free (buf);
+	  return -1;
+	}
+      _gdbm_bucket_chain_get (dbf, pred, &chain);
+      if (chain.next == old_adr)
+	break;
+      adr = chain.next;
+    }
+  if (!pred || chain.next != old_adr)
+    {
+      free (buf);
+      GDBM_SET_ERRNO (dbf, GDBM_BUCKET_CACHE_CORRUPTED, TRUE);
       return -1;
     }
 
-  ca_entry->ca_changed = FALSE;
+  chain.next = new_adr;
+  _gdbm_bucket_chain_put (dbf, pred, &chain);
+  if (elem)
+    rc = elem->ca_changed ? 0 : _gdbm_write_bucket (dbf, elem);
+  else if (!_gdbm_snapshot_pinned_p (dbf, adr))
+    rc = bucket_write_at (dbf, buf, adr);
+  else if ((moved = _gdbm_alloc_central (dbf, dbf->header->bucket_size)) == 0)
+    rc = -1;
+  else if ((rc = bucket_write_at (dbf, buf, moved)) == 0)
+    {
+      _gdbm_snapshot_fresh (dbf, moved);
+      rc = chain_relink (dbf, buf, adr, moved);
+      if (rc == 0)
+	rc = _gdbm_snapshot_defer_free (dbf, adr, dbf->header->bucket_size);
+    }
+  free (buf);
+  return rc;
+}
+
+/* Move the bucket in CA_ENTRY to a newly allocated block, leaving its
+   current block intact for the snapshots that may read it.  The
+   directory entries referring to the bucket are updated.  They form a
+   range, which is found from the hash value of any element in the
+   bucket, or by scanning the directory if the bucket is empty.  In
+   chained databases, the references are updated by chain_relink. */
+static int
+bucket_relocate (GDBM_FILE dbf, cache_elem *ca_entry)
+{
+  hash_bucket *bucket = ca_entry->ca_bucket;
+  off_t old_adr = ca_entry->ca_adr;
+  off_t new_adr;
+  int dir_index = -1;
+  int start, end, i;
+
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_CHAIN))
+    {
+      new_adr = _gdbm_alloc_central (dbf, dbf->header->bucket_size);
+      if (new_adr == 0 || chain_relink (dbf, bucket, old_adr, new_adr))
+	return -1;
+    }
+  else
+    {
+      for (i = 0; i < dbf->header->bucket_elems; i++)
+	if (bucket->h_table[i].hash_value >= 0)
+	  {
+	    dir_index = _gdbm_bucket_dir (dbf, bucket->h_table[i].hash_value);
+	    break;
+	  }
+      if (_gdbm_dir_load (dbf, 0, GDBM_DIR_COUNT (dbf)))
+	return -1;
+      if (dir_index == -1 || _gdbm_dir_entry (dbf, dir_index) != old_adr)
+	{
+	  for (dir_index = 0; dir_index < GDBM_DIR_COUNT (dbf); dir_index++)
+	    if (_gdbm_dir_entry (dbf, dir_index) == old_adr)
+	      break;
+	  if (dir_index == GDBM_DIR_COUNT (dbf))
+	    {
+	      GDBM_SET_ERRNO (dbf, GDBM_BUCKET_CACHE_CORRUPTED, TRUE);
+	      return -1;
+	    }
+	}
+      _gdbm_bucket_dir_range (dbf, dir_index, bucket->bucket_bits,
+			      &start, &end);
+
+      new_adr = _gdbm_alloc_central (dbf, dbf->header->bucket_size);
+      if (new_adr == 0)
+	return -1;
+
+      if (_gdbm_dir_replace (dbf, start, end, old_adr, new_adr))
+	return -1;
+    }
+
+  cache_tab_unlink (dbf, ca_entry);
+  ca_entry->ca_adr = new_adr;
+  ca_entry->ca_coll = NULL;
+  *cache_tab_lookup_slot (dbf, new_adr) = ca_entry;
+
+  _gdbm_snapshot_fresh (dbf, new_adr);
+  return _gdbm_snapshot_defer_free (dbf, old_adr, dbf->header->bucket_size);
+}
+
+/* The only place where a bucket is written.  CA_ENTRY is the
+   cache entry containing the bucket to be written.  While snapshots
+   are open, a bucket that was on disk when the last of them was taken
+   is not overwritten: it is written to a new place instead. */
+
+int
+_gdbm_write_bucket (GDBM_FILE dbf, cache_elem *ca_entry)
+{
+  if (_gdbm_snapshot_pinned_p (dbf, ca_entry->ca_adr)
+      && bucket_relocate (dbf, ca_entry))
+    return -1;
+
+  if (bucket_write_at (dbf, ca_entry->ca_bucket, ca_entry->ca_adr))
+    return -1;
+
+  if (ca_entry->ca_changed)
+    {
+      ca_entry->ca_changed = FALSE;
+      dbf->cache_dirty--;
+    }
   ca_entry->ca_data.hash_val = -1;
   ca_entry->ca_data.elem_loc = -1;
   return 0;
 }
-
+
 /* Cache manipulation interface functions. */
 
 #define INIT_CACHE_BITS 9
@@ -752,21 +1445,60 @@ _gdbm_cache_free (GDBM_FILE dbf)
 
 /*
  * Flush cache content to disk.
- * All cache elements with the changed buckets form a contiguous sequence
- * at the head of the cache list (starting with cache_mru).
+ * Unless bucket writes are deferred, all cache elements with the changed
+ * buckets form a contiguous sequence at the head of the cache list
+ * (starting with cache_mru), so that the loop stops as soon as the last
+ * of them is written.
  */
 int
 _gdbm_cache_flush (GDBM_FILE dbf)
 {
   cache_elem *elem;
-  for (elem = dbf->cache_mru; elem && elem->ca_changed; elem = elem->ca_next)
+  for (elem = dbf->cache_mru; elem && dbf->cache_dirty > 0;
+       elem = elem->ca_next)
     {
-      if (_gdbm_write_bucket (dbf, elem))
+      /* Buckets with tombstones are written after being reclaimed
+	 (see _gdbm_flush). */
+      if (elem->ca_changed && !elem->ca_tombstones
+	  && _gdbm_write_bucket (dbf, elem))
 	return -1;
     }
   return 0;
 }
 
+/* Reclaim tombstones in all cached buckets (see _gdbm_bucket_reclaim).
+   The current bucket remains current. */
+int
+_gdbm_cache_reclaim (GDBM_FILE dbf)
+{
+  cache_elem *cur = dbf->cache_mru;
+  cache_elem *elem, *next;
+  int rc = 0;
+
+  for (elem = dbf->cache_mru; elem && dbf->cache_tombstones > 0; elem = next)
+    {
+      next = elem->ca_next;
+      if (elem->ca_tombstones)
+	{
+	  /* Make the bucket current. */
+	  if (elem != dbf->cache_mru)
+	    {
+	      lru_unlink_elem (dbf, elem);
+	      lru_link_elem (dbf, elem, NULL);
+	    }
+	  if ((rc = _gdbm_bucket_reclaim (dbf)) != 0)
+	    break;
+	}
+    }
+
+  if (cur && cur != dbf->cache_mru)
+    {
+      lru_unlink_elem (dbf, cur);
+      lru_link_elem (dbf, cur, NULL);
+    }
+  return rc;
+}
+
 
 void
 gdbm_get_cache_stats (GDBM_FILE dbf,
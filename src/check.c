@@ -0,0 +1,622 @@
+/* check.c - Verify the structural consistency of a database. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.    */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+#include <stdarg.h>
+
+/* The checker never modifies the database.  It collects all the regions
+   of the file in use (the extents) in a single pass over the directory,
+   the buckets and the avail stack, sorts them by offset and then
+   verifies them in a second pass, which reads the keys of the records
+   sequentially. */
+
+enum extent_type
+  {
+    EXT_HEADER,
+    EXT_DIR,
+    EXT_BUCKET,
+    EXT_AVAIL_BLOCK,
+    EXT_FREE,
+    EXT_RECORD
+  };
+
+static char const *extent_name[] = {
+  [EXT_HEADER] = N_("header"),
+  [EXT_DIR] = N_("directory"),
+  [EXT_BUCKET] = N_("bucket"),
+  [EXT_AVAIL_BLOCK] = N_("avail block"),
+  [EXT_FREE] = N_("free block"),
+  [EXT_RECORD] = N_("key/data pair")
+};
+
+struct extent
+{
+  off_t off;              /* Offset in file. */
+  off_t size;             /* Size in bytes. */
+  enum extent_type type;
+  /* The following members are used for EXT_RECORD only. */
+  int bucket_dir;         /* First directory entry of the bucket. */
+  int bucket_bits;        /* Depth of the bucket. */
+  int elem_loc;           /* Location of the element in the bucket. */
+  int hash_value;         /* Hash value kept in the element. */
+  int key_size;
+  char key_start[SMALL];
+};
+
+/* A bucket referenced by the directory. */
+struct bucket_ref
+{
+  off_t adr;              /* Bucket address. */
+  int start;              /* Index of the first directory entry. */
+  int end;                /* Index past the last directory entry. */
+};
+
+struct check_state
+{
+  GDBM_FILE dbf;
+  gdbm_check_info *info;
+  int flags;
+  gdbm_error ec;          /* Error code of the last problem found. */
+
+  struct extent *ext;
+  size_t ext_count;
+  size_t ext_max;
+
+  char *keybuf;
+  size_t keybuf_size;
+};
+
+/* Report a problem found in the database. */
+static void
+check_error (struct check_state *cs, gdbm_error ec, char const *fmt, ...)
+{
+  cs->info->errors++;
+  cs->ec = ec;
+  if (cs->flags & GDBM_CHECK_ERRFUN)
+    {
+      char buf[512];
+      va_list ap;
+
+      va_start (ap, fmt);
+      vsnprintf (buf, sizeof buf, fmt, ap);
+      va_end (ap);
+      cs->info->errfun (cs->info->data, "%s", buf);
+    }
+}
+
+/* Add a new extent to the map and return it. */
+static struct extent *
+extent_add (struct check_state *cs, enum extent_type type,
+	    off_t off, off_t size)
+{
+  struct extent *ext;
+
+  if (cs->ext_count == cs->ext_max)
+    {
+      size_t n = cs->ext_max ? 2 * cs->ext_max : 1024;
+      struct extent *p;
+
+      if (n <= cs->ext_max || n > SIZE_T_MAX / sizeof (p[0]))
+	{
+	  GDBM_SET_ERRNO (cs->dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return NULL;
+	}
+      p = realloc (cs->ext, n * sizeof (p[0]));
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (cs->dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return NULL;
+	}
+      cs->ext = p;
+      cs->ext_max = n;
+    }
+  ext = &cs->ext[cs->ext_count++];
+  memset (ext, 0, sizeof (*ext));
+  ext->type = type;
+  ext->off = off;
+  ext->size = size;
+  return ext;
+}
+
+/* Add the entries of an avail table to the map as free blocks. */
+static int
+add_avail_table (struct check_state *cs, avail_elem *av, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (!extent_add (cs, EXT_FREE, av[i].av_adr, av[i].av_size))
+      return -1;
+  return 0;
+}
+
+static int
+avail_block_cb (avail_block *blk, off_t off, void *data)
+{
+  struct check_state *cs = data;
+  GDBM_FILE dbf = cs->dbf;
+
+  /* The active avail block (OFF == 0) is part of the header. */
+  if (off != 0
+      && !extent_add (cs, EXT_AVAIL_BLOCK, off,
+		      (((size_t)dbf->avail->size * sizeof (avail_elem)) >> 1)
+		      + sizeof (avail_block)))
+    return 1;
+  return add_avail_table (cs, blk->av_table, blk->count);
+}
+
+/* Check the key of the element ELEM_LOC in the current bucket, which is
+   given by KEY.  The bucket is referenced by the directory entries
+   START to END - 1. */
+static void
+check_key (struct check_state *cs, datum key, int hash_value,
+	   int bucket_dir, int start, int end, int elem_loc)
+{
+  GDBM_FILE dbf = cs->dbf;
+  int hash, bucket, off;
+
+  _gdbm_hash_key (dbf, key, &hash, &bucket, &off);
+  if (hash != hash_value)
+    check_error (cs, GDBM_BAD_HASH_ENTRY,
+		 _("bucket #%d, element %d: hash value mismatch"),
+		 bucket_dir, elem_loc);
+  else if (bucket < start || bucket >= end)
+    check_error (cs, GDBM_BAD_HASH_ENTRY,
+		 _("bucket #%d, element %d: key belongs to bucket #%d"),
+		 bucket_dir, elem_loc, bucket);
+}
+
+/* Check the current bucket, located at ADR, and add it, its avail table
+   and the key/data pairs it refers to, to the extent map.  The bucket is
+   the one referenced by REF, or one of its overflow buckets.  Keys
+   belong to the directory entries START to END - 1.  Return -1 on fatal
+   error, 0 otherwise. */
+static int
+check_bucket_contents (struct check_state *cs, struct bucket_ref *ref,
+		       off_t adr, int start, int end)
+{
+  GDBM_FILE dbf = cs->dbf;
+  hash_bucket *bucket = dbf->bucket;
+  int n = dbf->header->bucket_elems;
+  int i;
+
+  cs->info->buckets++;
+  if (!extent_add (cs, EXT_BUCKET, adr, dbf->header->bucket_size))
+    return -1;
+  if (add_avail_table (cs, bucket->bucket_avail, bucket->av_count))
+    return -1;
+
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_CHAIN))
+    {
+      bucket_chain chain;
+
+      _gdbm_bucket_chain_get (dbf, bucket, &chain);
+      if (chain.hash < 0 || _gdbm_bucket_dir (dbf, chain.hash) != start)
+	check_error (cs, GDBM_BAD_BUCKET,
+		     _("bucket #%d: bad chain hash value %#x"),
+		     ref->start, chain.hash);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      bucket_element *elt = &bucket->h_table[i];
+      int loc;
+
+      if (elt->hash_value == -1)
+	continue;
+      if (elt->hash_value < 0 && elt->hash_value != GDBM_TOMBSTONE)
+	{
+	  check_error (cs, GDBM_BAD_HASH_ENTRY,
+		       _("bucket #%d, element %d: bad hash value"),
+		       ref->start, i);
+	  continue;
+	}
+
+      if (elt->key_size < 0 || elt->data_size < 0)
+	{
+	  check_error (cs, GDBM_BAD_HASH_ENTRY,
+		       _("bucket #%d, element %d: bad record size"),
+		       ref->start, i);
+	  continue;
+	}
+
+      if (elt->hash_value >= 0)
+	{
+	  cs->info->keys++;
+
+	  /* The element must be reachable by linear probing from its
+	     home location. */
+	  for (loc = elt->hash_value % n; loc != i; loc = (loc + 1) % n)
+	    if (bucket->h_table[loc].hash_value == -1)
+	      {
+		check_error (cs, GDBM_BAD_HASH_ENTRY,
+			     _("bucket #%d, element %d: not reachable"
+			       " from its hash location %d"),
+			     ref->start, i, elt->hash_value % n);
+		break;
+	      }
+	}
+
+      if (_gdbm_elem_inline_p (dbf, elt))
+	{
+	  if (elt->hash_value >= 0)
+	    {
+	      datum key;
+
+	      key.dptr = _gdbm_elem_inline (elt);
+	      key.dsize = elt->key_size;
+	      check_key (cs, key, elt->hash_value, ref->start, start, end, i);
+	    }
+	}
+      else if (!off_t_sum_ok (elt->data_pointer, elt->key_size)
+	       || !off_t_sum_ok (elt->data_pointer + elt->key_size,
+				 elt->data_size))
+	check_error (cs, GDBM_BAD_HASH_ENTRY,
+		     _("bucket #%d, element %d: bad data pointer"),
+		     ref->start, i);
+      else
+	{
+	  /* Tombstones keep their file space until reclaimed. */
+	  struct extent *ext = extent_add (cs, EXT_RECORD, elt->data_pointer,
+					   (off_t) elt->key_size
+					     + elt->data_size);
+	  if (!ext)
+	    return -1;
+	  ext->bucket_dir = ref->start;
+	  ext->bucket_bits = bucket->bucket_bits;
+	  ext->elem_loc = i;
+	  ext->hash_value = elt->hash_value;
+	  ext->key_size = elt->key_size;
+	  memcpy (ext->key_start, elt->key_start, SMALL);
+	}
+    }
+  return 0;
+}
+
+/* Check the bucket referenced by REF and its overflow chain, if any
+   (see check_bucket_contents).  Return -1 on fatal error, 0 otherwise. */
+static int
+check_bucket (struct check_state *cs, struct bucket_ref *ref)
+{
+  GDBM_FILE dbf = cs->dbf;
+  int start, end;
+  int rc;
+
+  if (ref->adr < dbf->header->block_size
+      || !off_t_sum_ok (ref->adr, dbf->header->bucket_size))
+    {
+      check_error (cs, GDBM_BAD_DIR_ENTRY,
+		   _("directory entry %d: bad bucket address %lu"),
+		   ref->start, (unsigned long) ref->adr);
+      return 0;
+    }
+  if (_gdbm_get_bucket (dbf, ref->start))
+    {
+      if (gdbm_last_errno (dbf) == GDBM_MALLOC_ERROR)
+	return -1;
+      check_error (cs, gdbm_last_errno (dbf),
+		   _("can't read bucket #%d: %s"),
+		   ref->start, gdbm_db_strerror (dbf));
+      return 0;
+    }
+
+  /* Make sure the bucket is referenced by the right directory entries. */
+  _gdbm_bucket_dir_range (dbf, ref->start, dbf->bucket->bucket_bits,
+			  &start, &end);
+  if (start != ref->start || end != ref->end)
+    check_error (cs, GDBM_BAD_DIR_ENTRY,
+		 _("bucket #%d: referenced by directory entries %d-%d,"
+		   " expected %d-%d"),
+		 ref->start, ref->start, ref->end - 1, start, end - 1);
+
+  do
+    if (check_bucket_contents (cs, ref, dbf->cache_mru->ca_adr, start, end))
+      return -1;
+  while ((rc = _gdbm_next_bucket (dbf)) == 0);
+  if (rc == -1)
+    {
+      if (gdbm_last_errno (dbf) == GDBM_MALLOC_ERROR)
+	return -1;
+      check_error (cs, gdbm_last_errno (dbf),
+		   _("bucket #%d: can't read overflow bucket %d: %s"),
+		   ref->start, dbf->chain_pos + 1, gdbm_db_strerror (dbf));
+    }
+  return 0;
+}
+
+static int
+bucket_ref_cmp (const void *a, const void *b)
+{
+  struct bucket_ref const *pa = a;
+  struct bucket_ref const *pb = b;
+
+  if (pa->adr < pb->adr)
+    return -1;
+  if (pa->adr > pb->adr)
+    return 1;
+  return pa->start - pb->start;
+}
+
+/* Check the directory and all buckets it references, in the order of
+   their location in the file. */
+static int
+check_buckets (struct check_state *cs)
+{
+  GDBM_FILE dbf = cs->dbf;
+  int dir_count = GDBM_DIR_COUNT (dbf);
+  struct bucket_ref *refs;
+  size_t count = 0, i;
+  int d;
+  int rc = 0;
+
+  refs = calloc (dir_count, sizeof (refs[0]));
+  if (!refs)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  for (d = 0; d < dir_count; )
+    {
+      int next = _gdbm_next_bucket_dir (dbf, d);
+      if (_gdbm_dir_load (dbf, d, 1))
+	check_error (cs, gdbm_last_errno (dbf),
+		     _("can't read directory entry %d: %s"),
+		     d, gdbm_db_strerror (dbf));
+      else
+	{
+	  refs[count].adr = _gdbm_dir_entry (dbf, d);
+	  refs[count].start = d;
+	  refs[count].end = next;
+	  count++;
+	}
+      d = next;
+    }
+
+  qsort (refs, count, sizeof (refs[0]), bucket_ref_cmp);
+
+  for (i = 0; i < count; i++)
+    {
+      if (i > 0 && refs[i].adr == refs[i-1].adr)
+	{
+	  check_error (cs, GDBM_BAD_DIR_ENTRY,
+		       _("directory entries %d and %d refer to the same"
+			 " bucket"),
+		       refs[i-1].start, refs[i].start);
+	  continue;
+	}
+      if ((rc = check_bucket (cs, &refs[i])) != 0)
+	break;
+    }
+
+  free (refs);
+  return rc;
+}
+
+static int
+extent_cmp (const void *a, const void *b)
+{
+  struct extent const *pa = a;
+  struct extent const *pb = b;
+
+  if (pa->off < pb->off)
+    return -1;
+  if (pa->off > pb->off)
+    return 1;
+  return (int) pa->type - (int) pb->type;
+}
+
+/* Read the key of the record described by EXT and check it. */
+static int
+check_record (struct check_state *cs, struct extent *ext)
+{
+  GDBM_FILE dbf = cs->dbf;
+  datum key;
+  char key_start[SMALL];
+  int start, end;
+
+  /* Keys of tombstones need not be checked. */
+  if (ext->hash_value < 0)
+    return 0;
+
+  if ((size_t) ext->key_size > cs->keybuf_size)
+    {
+      char *p = realloc (cs->keybuf, ext->key_size);
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      cs->keybuf = p;
+      cs->keybuf_size = ext->key_size;
+    }
+
+  if (gdbm_file_seek (dbf, ext->off, SEEK_SET) != ext->off
+      || _gdbm_full_read (dbf, cs->keybuf, ext->key_size))
+    {
+      check_error (cs, GDBM_FILE_READ_ERROR,
+		   _("bucket #%d, element %d: can't read key at %lu"),
+		   ext->bucket_dir, ext->elem_loc, (unsigned long) ext->off);
+      return 0;
+    }
+
+  key.dptr = cs->keybuf;
+  key.dsize = ext->key_size;
+  if (memcmp (ext->key_start, key_start,
+	      _gdbm_key_start (dbf, key, key_start)))
+    {
+      check_error (cs, GDBM_BAD_HASH_ENTRY,
+		   _("bucket #%d, element %d: key start mismatch"),
+		   ext->bucket_dir, ext->elem_loc);
+      return 0;
+    }
+  _gdbm_bucket_dir_range (dbf, ext->bucket_dir, ext->bucket_bits,
+			  &start, &end);
+  check_key (cs, key, ext->hash_value, ext->bucket_dir, start, end,
+	     ext->elem_loc);
+  return 0;
+}
+
+/* Describe the extent EXT in a diagnostic message. */
+static char const *
+extent_descr (struct extent const *ext)
+{
+  return _(extent_name[ext->type]);
+}
+
+/* Verify the sorted extent map: make sure no two extents overlap and
+   all of them lie within the file, and check the keys of the
+   records. */
+static int
+check_extents (struct check_state *cs)
+{
+  GDBM_FILE dbf = cs->dbf;
+  off_t next_block = dbf->header->next_block;
+  struct extent *last = NULL;   /* Extent reaching farthest so far. */
+  size_t i;
+
+  qsort (cs->ext, cs->ext_count, sizeof (cs->ext[0]), extent_cmp);
+
+  for (i = 0; i < cs->ext_count; i++)
+    {
+      struct extent *ext = &cs->ext[i];
+
+      if (ext->off < 0 || ext->size < 0 || ext->size > next_block
+	  || ext->off > next_block - ext->size)
+	{
+	  check_error (cs, GDBM_BAD_FILE_OFFSET,
+		       _("%s at %lu (%lu bytes) is out of file bounds"),
+		       extent_descr (ext),
+		       (unsigned long) ext->off, (unsigned long) ext->size);
+	  continue;
+	}
+
+      if (last && ext->off < last->off + last->size)
+	check_error (cs, GDBM_BAD_AVAIL,
+		     _("%s at %lu (%lu bytes) overlaps %s at %lu (%lu bytes)"),
+		     extent_descr (ext),
+		     (unsigned long) ext->off, (unsigned long) ext->size,
+		     extent_descr (last),
+		     (unsigned long) last->off, (unsigned long) last->size);
+      if (!last || ext->off + ext->size > last->off + last->size)
+	last = ext;
+
+      if (ext->type == EXT_RECORD && check_record (cs, ext))
+	return -1;
+    }
+  return 0;
+}
+
+/* Verify the structural consistency of the database DBF without
+   modifying it.  The header, the directory, all buckets and their
+   elements, and the avail stack are checked, and all the regions of the
+   file they describe are verified not to overlap.
+
+   If INFO is not NULL, its output members are filled with the check
+   statistics.  FLAGS tell which of its input members are initialized.
+
+   Return 0 if the database is consistent and 1 if problems were found.
+   In the latter case, the error code of the last problem is returned in
+   gdbm_errno.  On error, return -1. */
+int
+gdbm_check (GDBM_FILE dbf, gdbm_check_info *info, int flags)
+{
+  struct check_state cs;
+  gdbm_check_info ci;
+  int rc;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (!info)
+    {
+      info = &ci;
+      flags = 0;
+    }
+  info->buckets = 0;
+  info->keys = 0;
+  info->errors = 0;
+
+  /* Write out pending changes, so that the file reflects the state of
+     the database. */
+  if (dbf->read_write != GDBM_READER && _gdbm_flush (dbf))
+    return -1;
+
+  memset (&cs, 0, sizeof (cs));
+  cs.dbf = dbf;
+  cs.info = info;
+  cs.flags = flags;
+
+  rc = _gdbm_validate_header (dbf);
+  if (rc == GDBM_NEED_RECOVERY)
+    check_error (&cs, rc, _("file size doesn't match the header"));
+  else if (rc)
+    {
+      /* The rest of the database can't be interpreted. */
+      check_error (&cs, rc, _("bad header: %s"), gdbm_strerror (rc));
+      goto end;
+    }
+
+  if (!extent_add (&cs, EXT_HEADER, 0, dbf->header->block_size)
+      || !extent_add (&cs, EXT_DIR, dbf->header->dir, dbf->header->dir_size)
+      || (dbf->dir_next
+	  && !extent_add (&cs, EXT_DIR, dbf->dir_next,
+			  dbf->header->dir_size * 2)))
+    {
+      rc = -1;
+      goto end;
+    }
+
+  gdbm_clear_error (dbf);
+  rc = gdbm_avail_traverse (dbf, avail_block_cb, &cs);
+  if (gdbm_last_errno (dbf) == GDBM_MALLOC_ERROR)
+    {
+      rc = -1;
+      goto end;
+    }
+  if (rc)
+    {
+      check_error (&cs, gdbm_last_errno (dbf),
+		   _("bad avail stack: %s"), gdbm_db_strerror (dbf));
+      dbf->need_recovery = FALSE;
+    }
+
+  rc = check_buckets (&cs);
+  if (rc == 0)
+    rc = check_extents (&cs);
+
+ end:
+  free (cs.ext);
+  free (cs.keybuf);
+
+  /* Problems found by the checker don't make the handle unusable. */
+  dbf->need_recovery = FALSE;
+
+  if (rc == -1)
+    return -1;
+  if (info->errors)
+    {
+      GDBM_SET_ERRNO (dbf, cs.ec, FALSE);
+      return 1;
+    }
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+  return 0;
+}
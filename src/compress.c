@@ -0,0 +1,222 @@
+/* compress.c - Encoding and compression of record data. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.    */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+#if HAVE_ZLIB
+# include <zlib.h>
+#endif
+
+/* In databases with the GDBM_FEAT_COMPRESS feature, the data part of
+   each record begins with a codec byte (see GDBM_CODEC_* in gdbmconst.h).
+   The data size kept in the bucket element includes that byte.  The
+   data cache always holds decoded data.
+
+   In databases with the GDBM_FEAT_EXPIRE feature, the data begin with
+   the expiration time of the record (see GDBM_EXPIRE_SIZE), which
+   precedes the codec byte, if any. */
+
+/* Length of the header of GDBM_CODEC_ZLIB data. */
+#define ZLIB_HDR_SIZE 5
+
+/* Make sure the scratch buffer of DBF is at least SIZE bytes long. */
+static int
+zbuf_alloc (GDBM_FILE dbf, size_t size)
+{
+  if (size > dbf->zbuf_size)
+    {
+      char *p = realloc (dbf->zbuf, size);
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      dbf->zbuf = p;
+      dbf->zbuf_size = size;
+    }
+  return 0;
+}
+
+/* Encode the data CONTENT for storing in DBF, with the expiration time
+   EXPIRE.  On success, replace CONTENT with the encoded data, which are
+   kept in the scratch buffer of DBF and remain valid until the next call
+   to this function or to _gdbm_data_decode. */
+int
+_gdbm_data_encode (GDBM_FILE dbf, datum *content, time_t expire)
+{
+  size_t size = content->dsize;
+  size_t hdr = _gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE) ? GDBM_EXPIRE_SIZE : 0;
+  int compress = _gdbm_feature_p (dbf, GDBM_FEAT_COMPRESS);
+
+#if HAVE_ZLIB
+  if (compress && size >= GDBM_COMPRESS_MIN)
+    {
+      uLongf zlen = compressBound (size);
+      unsigned char *p;
+
+      if (zbuf_alloc (dbf, hdr + ZLIB_HDR_SIZE + zlen))
+	return -1;
+      p = (unsigned char *) dbf->zbuf + hdr;
+      if (compress2 (p + ZLIB_HDR_SIZE, &zlen,
+		     (unsigned char *) content->dptr, size,
+		     Z_DEFAULT_COMPRESSION) == Z_OK
+	  && ZLIB_HDR_SIZE + zlen < size + 1
+	  && hdr + ZLIB_HDR_SIZE + zlen <= INT_MAX)
+	{
+	  p[0] = GDBM_CODEC_ZLIB;
+	  p[1] = size >> 24;
+	  p[2] = size >> 16;
+	  p[3] = size >> 8;
+	  p[4] = size;
+	  if (hdr)
+	    _gdbm_expire_encode (dbf->zbuf, expire);
+	  content->dptr = dbf->zbuf;
+	  content->dsize = hdr + ZLIB_HDR_SIZE + zlen;
+	  return 0;
+	}
+    }
+#endif
+
+  /* Store the data verbatim. */
+  if (compress)
+    hdr++;
+  if (size > INT_MAX - hdr)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALFORMED_DATA, FALSE);
+      return -1;
+    }
+  if (zbuf_alloc (dbf, size + hdr))
+    return -1;
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+    _gdbm_expire_encode (dbf->zbuf, expire);
+  if (compress)
+    dbf->zbuf[hdr - 1] = GDBM_CODEC_NONE;
+  memcpy (dbf->zbuf + hdr, content->dptr, size);
+  content->dptr = dbf->zbuf;
+  content->dsize = size + hdr;
+  return 0;
+}
+
+/* Decode the record data in the data cache entry CA.  On entry, CA->dptr
+   holds KEY_SIZE bytes of key, followed by *DATA_SIZE bytes of data, as
+   stored in the file.  On success, CA->dptr holds the key followed by
+   the decoded data, *DATA_SIZE is set to their size and CA->expire to
+   the expiration time of the record.  The buffer of CA may be
+   reallocated in the process. */
+int
+_gdbm_data_decode (GDBM_FILE dbf, data_cache_elem *ca, int key_size,
+		   int *data_size)
+{
+  unsigned char *q = (unsigned char *) ca->dptr + key_size;
+  unsigned char *p;
+  int hdr = 0;
+
+  ca->expire = 0;
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+    {
+      if (*data_size < GDBM_EXPIRE_SIZE)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	  return -1;
+	}
+      ca->expire = _gdbm_expire_decode ((char *) q);
+      hdr = GDBM_EXPIRE_SIZE;
+      *data_size -= hdr;
+    }
+  p = q + hdr;
+
+  if (!_gdbm_feature_p (dbf, GDBM_FEAT_COMPRESS))
+    {
+      memmove (q, p, *data_size);
+      return 0;
+    }
+
+  if (*data_size < 1)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+      return -1;
+    }
+
+  switch (p[0])
+    {
+    case GDBM_CODEC_NONE:
+      memmove (q, p + 1, *data_size - 1);
+      --*data_size;
+      break;
+
+#if HAVE_ZLIB
+    case GDBM_CODEC_ZLIB:
+      {
+	uLongf size;
+	size_t dsize;
+	char *tmp;
+
+	if (*data_size < ZLIB_HDR_SIZE)
+	  {
+	    GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	    return -1;
+	  }
+	size = ((uLongf) p[1] << 24) | ((uLongf) p[2] << 16)
+	        | ((uLongf) p[3] << 8) | p[4];
+	if (size > INT_MAX - key_size)
+	  {
+	    GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	    return -1;
+	  }
+
+	/* Swap the cache buffer with the scratch buffer, so that the
+	   compressed data can be decoded directly into the cache. */
+	dsize = key_size + size;
+	if (dsize == 0)
+	  dsize = 1;
+	if (zbuf_alloc (dbf, dsize))
+	  return -1;
+	tmp = ca->dptr;
+	ca->dptr = dbf->zbuf;
+	dbf->zbuf = tmp;
+	dsize = ca->dsize;
+	ca->dsize = dbf->zbuf_size;
+	dbf->zbuf_size = dsize;
+
+	memcpy (ca->dptr, dbf->zbuf, key_size);
+	p = (unsigned char *) dbf->zbuf + key_size + hdr;
+	if (uncompress ((unsigned char *) ca->dptr + key_size, &size,
+			p + ZLIB_HDR_SIZE, *data_size - ZLIB_HDR_SIZE) != Z_OK
+	    || size != (((uLongf) p[1] << 24) | ((uLongf) p[2] << 16)
+			| ((uLongf) p[3] << 8) | p[4]))
+	  {
+	    GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	    return -1;
+	  }
+	*data_size = size;
+      }
+      break;
+#else
+    case GDBM_CODEC_ZLIB:
+      GDBM_SET_ERRNO (dbf, GDBM_NOT_SUPPORTED, FALSE);
+      return -1;
+#endif
+
+    default:
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+      return -1;
+    }
+  return 0;
+}
@@ -0,0 +1,930 @@
+/* dir.c - Hash directory paging. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+#include "autoconf.h"
+#include "gdbmdefs.h"
+#include <stdint.h>
+#include <limits.h>
+
+/* The directory of an existing database is not read when the database
+   is opened.  Instead, it is divided into pages of GDBM_DIR_PAGE_SIZE
+   bytes, each of which is read from disk when one of its entries is
+   accessed for the first time.  This makes opening a database with a
+   large directory an O(1) operation.
+
+   In memory, the directory is a table of slots, one per page.  Most
+   directory entries come in long runs referring to the same bucket, so
+   the table is range-encoded at page granularity:
+
+   - A slot whose entries all refer to the same bucket keeps only the
+     bucket address.  Such a slot describes a range of entries by its
+     hash prefix (the slot index), its depth (GDBM_DIR_PAGE_BITS bits
+     less than the directory depth) and the address.
+   - Any other slot points to a page holding its entries.
+   - A slot whose page has not been read yet has neither.
+
+   When the directory grows by SHIFT bits, each slot is replaced by
+   2^SHIFT copies of itself.  The copies share its page, which keeps
+   being indexed by the depth it was built for (see _gdbm_dir_entry).
+   Growing the in-memory directory thus costs time proportional to the
+   number of slots rather than to the number of entries, and memory is
+   only allocated for the pages modified afterwards.  Snapshots share
+   pages with their database in the same way.  Shared pages are never
+   modified: a slot gets a private copy of its page before changing it.
+
+   The dir_dirty bitmap keeps track of the pages modified since the
+   directory was last written, so that only these are written back by
+   _gdbm_end_update.  On disk, the directory is an ordinary array of
+   entries.
+
+   Doubling the directory requires writing it out anew.  To avoid doing
+   so all at once, the doubled directory is prepared in the background,
+   once a bucket has the depth of the directory (see _gdbm_dir_prepare).
+   Its file space is allocated, and each call to _gdbm_end_update writes
+   a few of its pages, keeping track of the ones that change meanwhile.
+   When a split needs the doubled directory, only the pages not yet
+   written remain to be written.  The prepared space is not referenced
+   from the file header, so it is lost if the database is not closed
+   properly. */
+
+/* Number of pages read or written at once. */
+#define DIR_IO_PAGES 64
+
+/* Minimum number of pages of a directory whose doubling is prepared
+   in the background. */
+#define DIR_PREPARE_MIN_PAGES 4
+
+/* Number of pages of the prepared directory written per update. */
+#define DIR_PREPARE_STEP 2
+
+static inline size_t
+dir_page_count (GDBM_FILE dbf)
+{
+  return (GDBM_DIR_COUNT (dbf) + GDBM_DIR_PAGE_ENTRIES - 1)
+	  / GDBM_DIR_PAGE_ENTRIES;
+}
+
+/* Return the number of directory entries in the page N. */
+static inline int
+dir_page_entries (GDBM_FILE dbf, size_t n)
+{
+  size_t count = GDBM_DIR_COUNT (dbf) - n * GDBM_DIR_PAGE_ENTRIES;
+  return count < GDBM_DIR_PAGE_ENTRIES ? count : GDBM_DIR_PAGE_ENTRIES;
+}
+
+static inline size_t
+dir_bitmap_size (GDBM_FILE dbf)
+{
+  return (dir_page_count (dbf) + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+static inline int
+bit_is_set (unsigned char *bitmap, size_t n)
+{
+  return bitmap[n / CHAR_BIT] & (1 << (n % CHAR_BIT));
+}
+
+static inline void
+bit_set (unsigned char *bitmap, size_t n)
+{
+  bitmap[n / CHAR_BIT] |= 1 << (n % CHAR_BIT);
+}
+
+static inline int
+dir_slot_loaded_p (dir_slot *slot)
+{
+  return slot->page != NULL || slot->adr != 0;
+}
+
+static void
+dir_page_unref (dir_page *page)
+{
+  if (page && --page->refcount == 0)
+    free (page);
+}
+
+/* Set the slot N from the entries in ENT. */
+static int
+dir_slot_fill (GDBM_FILE dbf, size_t n, off_t *ent)
+{
+  dir_slot *slot = &dbf->dir[n];
+  int count = dir_page_entries (dbf, n);
+  int i;
+
+  for (i = 1; i < count && ent[i] == ent[0]; i++)
+    ;
+  dir_page_unref (slot->page);
+  if (i == count && ent[0] != 0)
+    {
+      slot->page = NULL;
+      slot->adr = ent[0];
+    }
+  else
+    {
+      slot->page = malloc (sizeof (*slot->page));
+      if (slot->page == NULL)
+	{
+	  slot->adr = 0;
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      slot->page->refcount = 1;
+      slot->page->depth = dbf->header->dir_bits;
+      memcpy (slot->page->ent, ent, count * sizeof (ent[0]));
+      slot->adr = 0;
+    }
+  return 0;
+}
+
+/* Store the entries of the slot N into ENT. */
+static void
+dir_slot_expand (GDBM_FILE dbf, size_t n, off_t *ent)
+{
+  dir_slot *slot = &dbf->dir[n];
+  int count = dir_page_entries (dbf, n);
+  int i;
+
+  if (slot->page == NULL)
+    for (i = 0; i < count; i++)
+      ent[i] = slot->adr;
+  else if (slot->page->depth == dbf->header->dir_bits)
+    memcpy (ent, slot->page->ent, count * sizeof (ent[0]));
+  else
+    for (i = 0; i < count; i++)
+      ent[i] = _gdbm_dir_entry (dbf, n * GDBM_DIR_PAGE_ENTRIES + i);
+}
+
+/* Make sure the slot N has a page of its own, which can be modified. */
+static int
+dir_slot_own (GDBM_FILE dbf, size_t n)
+{
+  dir_slot *slot = &dbf->dir[n];
+  dir_page *page;
+
+  if (slot->page && slot->page->refcount == 1
+      && slot->page->depth == dbf->header->dir_bits)
+    return 0;
+  page = malloc (sizeof (*page));
+  if (page == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, TRUE);
+      return -1;
+    }
+  page->refcount = 1;
+  page->depth = dbf->header->dir_bits;
+  dir_slot_expand (dbf, n, page->ent);
+  dir_page_unref (slot->page);
+  slot->page = page;
+  slot->adr = 0;
+  return 0;
+}
+
+/* Allocate the directory for an existing database.  No data are read
+   from the disk. */
+int
+_gdbm_dir_init (GDBM_FILE dbf)
+{
+  size_t npages = dir_page_count (dbf);
+
+  /* Unloaded entries are zero, i.e. invalid, so that stray accesses
+     to them would be caught by gdbm_dir_entry_valid_p. */
+  dbf->dir = calloc (npages, sizeof (dbf->dir[0]));
+  if (dbf->dir == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  dbf->dir_pages_left = npages;
+  return 0;
+}
+
+/* Create the directory of a new database, with all entries pointing to
+   the bucket at ADR. */
+int
+_gdbm_dir_create (GDBM_FILE dbf, off_t adr)
+{
+  size_t npages = dir_page_count (dbf);
+  size_t n;
+
+  dbf->dir = calloc (npages, sizeof (dbf->dir[0]));
+  if (dbf->dir == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  for (n = 0; n < npages; n++)
+    dbf->dir[n].adr = adr;
+  dbf->dir_pages_left = 0;
+  return 0;
+}
+
+/* Make the directory of DST share the one of SRC, which must be
+   entirely in memory.  DST must have a copy of the header of SRC. */
+int
+_gdbm_dir_share (GDBM_FILE dst, GDBM_FILE src)
+{
+  size_t npages = dir_page_count (src);
+  size_t n;
+
+  dst->dir = malloc (npages * sizeof (dst->dir[0]));
+  if (dst->dir == NULL)
+    return -1;
+  memcpy (dst->dir, src->dir, npages * sizeof (dst->dir[0]));
+  for (n = 0; n < npages; n++)
+    if (dst->dir[n].page)
+      dst->dir[n].page->refcount++;
+  dst->dir_pages_left = 0;
+  return 0;
+}
+
+/* Free the directory and associated memory.  The header must still be
+   present. */
+void
+_gdbm_dir_free (GDBM_FILE dbf)
+{
+  if (dbf->dir)
+    {
+      size_t npages = dir_page_count (dbf);
+      size_t n;
+
+      for (n = 0; n < npages; n++)
+	dir_page_unref (dbf->dir[n].page);
+      free (dbf->dir);
+      dbf->dir = NULL;
+    }
+  dbf->dir_pages_left = 0;
+  free (dbf->dir_dirty);
+  dbf->dir_dirty = NULL;
+  free (dbf->dir_next_dirty);
+  dbf->dir_next_dirty = NULL;
+  dbf->dir_next = 0;
+}
+
+/* Read in directory pages FIRST through LAST-1 from the disk. */
+static int
+dir_read_pages (GDBM_FILE dbf, size_t first, size_t last)
+{
+  off_t *buf;
+  int rc = 0;
+
+  buf = malloc (((last - first < DIR_IO_PAGES) ? last - first : DIR_IO_PAGES)
+		* GDBM_DIR_PAGE_SIZE);
+  if (buf == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  while (first < last)
+    {
+      off_t off = (off_t) first * GDBM_DIR_PAGE_SIZE;
+      size_t end = (last - first < DIR_IO_PAGES) ? last : first + DIR_IO_PAGES;
+      size_t size = (end - first) * GDBM_DIR_PAGE_SIZE;
+      size_t n;
+
+      if (off + size > dbf->header->dir_size)
+	size = dbf->header->dir_size - off;
+
+      if (gdbm_file_seek (dbf, dbf->header->dir + off, SEEK_SET)
+	  != dbf->header->dir + off)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, FALSE);
+	  rc = -1;
+	  break;
+	}
+
+      if (_gdbm_full_read (dbf, buf, size))
+	{
+	  GDBM_DEBUG (GDBM_DEBUG_ERR,
+		      "%s: error reading dir: %s",
+		      dbf->name, gdbm_db_strerror (dbf));
+	  rc = -1;
+	  break;
+	}
+
+      for (n = first; n < end; n++)
+	{
+	  if (dir_slot_fill (dbf, n,
+			     buf + (n - first) * GDBM_DIR_PAGE_ENTRIES))
+	    {
+	      rc = -1;
+	      break;
+	    }
+	  dbf->dir_pages_left--;
+	}
+      if (rc)
+	break;
+      first = end;
+    }
+
+  free (buf);
+  return rc;
+}
+
+/* Make sure directory entries START through START+COUNT-1 are in memory.
+   Consecutive pages that need to be read are read at once.  Don't call
+   this function directly, use _gdbm_dir_load instead. */
+int
+_gdbm_dir_read (GDBM_FILE dbf, int start, int count)
+{
+  size_t first, last, n;
+
+  if (start < 0 || count <= 0 || start + count > GDBM_DIR_COUNT (dbf))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_DIR_ENTRY, FALSE);
+      return -1;
+    }
+
+  first = start / GDBM_DIR_PAGE_ENTRIES;
+  last = (start + count - 1) / GDBM_DIR_PAGE_ENTRIES + 1;
+
+  for (n = first; n < last; )
+    {
+      size_t end;
+
+      if (dir_slot_loaded_p (&dbf->dir[n]))
+	{
+	  n++;
+	  continue;
+	}
+      for (end = n + 1; end < last && !dir_slot_loaded_p (&dbf->dir[end]);
+	   end++)
+	;
+      if (dir_read_pages (dbf, n, end))
+	return -1;
+      n = end;
+    }
+
+  return 0;
+}
+
+/* Mark COUNT directory entries starting at START as modified. */
+static void
+dir_changed (GDBM_FILE dbf, int start, int count)
+{
+  size_t n, last;
+
+  if (dbf->dir_next)
+    {
+      /* The entries are replicated twice in the prepared directory. */
+      last = ((size_t) (start + count) * 2 - 1) / GDBM_DIR_PAGE_ENTRIES;
+      for (n = (size_t) start * 2 / GDBM_DIR_PAGE_ENTRIES; n <= last; n++)
+	if (!bit_is_set (dbf->dir_next_dirty, n))
+	  {
+	    bit_set (dbf->dir_next_dirty, n);
+	    dbf->dir_next_left++;
+	  }
+    }
+
+  if (dbf->directory_changed && dbf->dir_dirty == NULL)
+    /* The entire directory will be written anyway. */
+    return;
+  
+  if (dbf->dir_dirty == NULL)
+    {
+      dbf->dir_dirty = calloc (dir_bitmap_size (dbf), 1);
+      /* On allocation failure, fall back to writing the whole
+	 directory. */
+    }
+  dbf->directory_changed = TRUE;
+
+  if (dbf->dir_dirty)
+    {
+      last = (start + count - 1) / GDBM_DIR_PAGE_ENTRIES;
+      for (n = start / GDBM_DIR_PAGE_ENTRIES; n <= last; n++)
+	bit_set (dbf->dir_dirty, n);
+    }
+}
+
+/* Point directory entries START through END-1 to the bucket at ADR.  The
+   entries must be in memory.  Slots covered entirely by the range become
+   uniform. */
+int
+_gdbm_dir_set (GDBM_FILE dbf, int start, int end, off_t adr)
+{
+  size_t n, last = (end - 1) / GDBM_DIR_PAGE_ENTRIES;
+
+  for (n = start / GDBM_DIR_PAGE_ENTRIES; n <= last; n++)
+    {
+      int base = n * GDBM_DIR_PAGE_ENTRIES;
+      int lo = start > base ? start - base : 0;
+      int hi = end - base;
+      dir_slot *slot = &dbf->dir[n];
+
+      if (hi > dir_page_entries (dbf, n))
+	hi = dir_page_entries (dbf, n);
+      if (lo == 0 && hi == dir_page_entries (dbf, n))
+	{
+	  dir_page_unref (slot->page);
+	  slot->page = NULL;
+	  slot->adr = adr;
+	}
+      else if (slot->page == NULL && slot->adr == adr)
+	continue;
+      else
+	{
+	  int i;
+
+	  if (dir_slot_own (dbf, n))
+	    return -1;
+	  for (i = lo; i < hi; i++)
+	    slot->page->ent[i] = adr;
+	}
+    }
+  dir_changed (dbf, start, end - start);
+  return 0;
+}
+
+/* Point those of the directory entries START through END-1 that refer
+   to the bucket at OLD_ADR to the bucket at NEW_ADR.  The entries must
+   be in memory. */
+int
+_gdbm_dir_replace (GDBM_FILE dbf, int start, int end,
+		   off_t old_adr, off_t new_adr)
+{
+  size_t n, last = (end - 1) / GDBM_DIR_PAGE_ENTRIES;
+
+  for (n = start / GDBM_DIR_PAGE_ENTRIES; n <= last; n++)
+    {
+      int base = n * GDBM_DIR_PAGE_ENTRIES;
+      int lo = start > base ? start - base : 0;
+      int hi = end - base;
+      dir_slot *slot = &dbf->dir[n];
+      int i;
+
+      if (hi > dir_page_entries (dbf, n))
+	hi = dir_page_entries (dbf, n);
+      if (slot->page == NULL)
+	{
+	  if (slot->adr != old_adr)
+	    continue;
+	  if (lo == 0 && hi == dir_page_entries (dbf, n))
+	    {
+	      slot->adr = new_adr;
+	      continue;
+	    }
+	}
+      if (dir_slot_own (dbf, n))
+	return -1;
+      for (i = lo; i < hi; i++)
+	if (slot->page->ent[i] == old_adr)
+	  slot->page->ent[i] = new_adr;
+    }
+  dir_changed (dbf, start, end - start);
+  return 0;
+}
+
+/* Return the index of the first directory entry after DIR_INDEX that
+   differs from it, or that can't be read.  The entry DIR_INDEX must be
+   in memory.  Uniform slots are skipped at once. */
+int
+_gdbm_dir_run_end (GDBM_FILE dbf, int dir_index)
+{
+  int dir_count = GDBM_DIR_COUNT (dbf);
+  off_t cur = _gdbm_dir_entry (dbf, dir_index);
+
+  while (++dir_index < dir_count)
+    {
+      dir_slot *slot;
+
+      if (_gdbm_dir_load (dbf, dir_index, 1))
+	break;
+      slot = &dbf->dir[dir_index / GDBM_DIR_PAGE_ENTRIES];
+      if (slot->page == NULL && dir_index % GDBM_DIR_PAGE_ENTRIES == 0)
+	{
+	  if (slot->adr != cur)
+	    break;
+	  dir_index += dir_page_entries (dbf, dir_index / GDBM_DIR_PAGE_ENTRIES)
+		       - 1;
+	}
+      else if (_gdbm_dir_entry (dbf, dir_index) != cur)
+	break;
+    }
+  return dir_index;
+}
+
+/* Mark the directory as moved to a new location in file.  It will be
+   written as a whole. */
+void
+_gdbm_dir_relocated (GDBM_FILE dbf)
+{
+  free (dbf->dir_dirty);
+  dbf->dir_dirty = NULL;
+  dbf->directory_changed = TRUE;
+}
+
+/* Start preparing the doubled directory, unless it is already being
+   prepared or the directory is too small for this to be worthwhile. */
+int
+_gdbm_dir_prepare (GDBM_FILE dbf)
+{
+  size_t npages;
+  unsigned char *bitmap;
+
+  if (dbf->dir_next
+      || dir_page_count (dbf) < DIR_PREPARE_MIN_PAGES
+      || dbf->header->dir_size > GDBM_MAX_DIR_HALF
+      || dbf->header->dir_bits == GDBM_HASH_BITS)
+    return 0;
+
+  npages = dir_page_count (dbf) * 2;
+  bitmap = malloc ((npages + CHAR_BIT - 1) / CHAR_BIT);
+  if (bitmap == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  dbf->dir_next = _gdbm_alloc_central (dbf, dbf->header->dir_size * 2);
+  if (dbf->dir_next == 0)
+    {
+      free (bitmap);
+      return -1;
+    }
+  memset (bitmap, 0xff, (npages + CHAR_BIT - 1) / CHAR_BIT);
+  dbf->dir_next_dirty = bitmap;
+  dbf->dir_next_left = npages;
+  dbf->dir_next_pos = 0;
+  return 0;
+}
+
+/* Stop preparing the doubled directory and free its file space. */
+int
+_gdbm_dir_abandon (GDBM_FILE dbf)
+{
+  off_t adr = dbf->dir_next;
+
+  if (adr == 0)
+    return 0;
+  free (dbf->dir_next_dirty);
+  dbf->dir_next_dirty = NULL;
+  dbf->dir_next = 0;
+  return _gdbm_free (dbf, adr, dbf->header->dir_size * 2);
+}
+
+/* Write pages FIRST through LAST-1 of the prepared directory. */
+static int
+dir_next_write_pages (GDBM_FILE dbf, size_t first, size_t last)
+{
+  off_t buf[GDBM_DIR_PAGE_ENTRIES * DIR_PREPARE_STEP];
+  off_t off = (off_t) first * GDBM_DIR_PAGE_SIZE;
+  size_t n;
+
+  /* The entries of the page N come from the entries N * E / 2 through
+     (N + 1) * E / 2 - 1 of the current directory, where E is the
+     number of entries per page. */
+  if (_gdbm_dir_load (dbf, first * GDBM_DIR_PAGE_ENTRIES / 2,
+		      (last - first) * GDBM_DIR_PAGE_ENTRIES / 2))
+    return -1;
+  for (n = first; n < last; n++)
+    {
+      off_t *ent = buf + (n - first) * GDBM_DIR_PAGE_ENTRIES;
+      int base = n * GDBM_DIR_PAGE_ENTRIES;
+      int i;
+
+      for (i = 0; i < GDBM_DIR_PAGE_ENTRIES; i++)
+	ent[i] = _gdbm_dir_entry (dbf, (base + i) / 2);
+    }
+
+  if (gdbm_file_seek (dbf, dbf->dir_next + off, SEEK_SET)
+      != dbf->dir_next + off)
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
+      return -1;
+    }
+  return _gdbm_full_write (dbf, buf, (last - first) * GDBM_DIR_PAGE_SIZE);
+}
+
+/* Write at most COUNT pages of the prepared directory that are not
+   written yet, starting at dir_next_pos.  If COUNT is 0, write all of
+   them. */
+static int
+dir_next_write (GDBM_FILE dbf, size_t count)
+{
+  size_t npages = dir_page_count (dbf) * 2;
+
+  while (dbf->dir_next_left > 0)
+    {
+      size_t n = dbf->dir_next_pos, end;
+
+      while (!bit_is_set (dbf->dir_next_dirty, n))
+	n = (n + 1) % npages;
+      for (end = n + 1;
+	   end < npages && end - n < DIR_PREPARE_STEP
+	     && (count == 0 || end - n < count)
+	     && bit_is_set (dbf->dir_next_dirty, end);
+	   end++)
+	;
+      if (dir_next_write_pages (dbf, n, end))
+	return -1;
+      dbf->dir_next_left -= end - n;
+      dbf->dir_next_pos = end % npages;
+      for (; n < end; n++)
+	dbf->dir_next_dirty[n / CHAR_BIT] &= ~(1 << (n % CHAR_BIT));
+
+      if (count)
+	break;
+    }
+  return 0;
+}
+
+/* Write the next few pages of the prepared directory, if any. */
+int
+_gdbm_dir_prepare_step (GDBM_FILE dbf)
+{
+  if (dbf->dir_next == 0)
+    return 0;
+  return dir_next_write (dbf, DIR_PREPARE_STEP);
+}
+
+/* Switch to the prepared directory, which is first written out in full.
+   Return the address and size of the current one in *OLD_ADR and
+   *OLD_SIZE. */
+static int
+dir_double (GDBM_FILE dbf, off_t *old_adr, int *old_size)
+{
+  size_t npages = dir_page_count (dbf);
+  size_t n;
+  dir_slot *dir;
+
+  dir = malloc (npages * 2 * sizeof (dir[0]));
+  if (dir == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  if (dir_next_write (dbf, 0))
+    {
+      free (dir);
+      return -1;
+    }
+
+  /* Pages that are not in memory are read from the new directory when
+     needed. */
+  dbf->dir_pages_left = 0;
+  for (n = 0; n < npages * 2; n++)
+    {
+      dir[n] = dbf->dir[n >> 1];
+      if (dir[n].page)
+	dir[n].page->refcount++;
+      else if (dir[n].adr == 0)
+	dbf->dir_pages_left++;
+    }
+  for (n = 0; n < npages; n++)
+    dir_page_unref (dbf->dir[n].page);
+  free (dbf->dir);
+  dbf->dir = dir;
+
+  *old_adr = dbf->header->dir;
+  *old_size = dbf->header->dir_size;
+  dbf->header->dir = dbf->dir_next;
+  dbf->header->dir_size *= 2;
+  dbf->header->dir_bits++;
+  dbf->header_changed = TRUE;
+  dbf->bucket_dir <<= 1;
+
+  /* All changes made so far are in the new directory. */
+  free (dbf->dir_next_dirty);
+  dbf->dir_next_dirty = NULL;
+  dbf->dir_next = 0;
+  free (dbf->dir_dirty);
+  dbf->dir_dirty = NULL;
+  dbf->directory_changed = FALSE;
+
+  return 0;
+}
+
+/* Grow the directory so that it is indexed by the BITS initial bits of
+   the hash value.  Each entry of the existing directory is replicated
+   2^(BITS - dir_bits) times.
+
+   In memory, only the table of slots is replicated: the new slots share
+   the pages of the old ones.  If the directory is doubled and the new
+   one was prepared in advance, the pages of the latter that are not yet
+   written are written out.  Otherwise, the new directory is written out
+   in full by the next _gdbm_end_update.  Growing by several bits at once
+   replaces a sequence of doublings, each of which would allocate and
+   write out the directory anew.
+
+   The file space for the new directory is allocated from the current
+   bucket's avail table.  The space occupied by the old directory is not
+   released: its address and size are returned in *OLD_ADR and *OLD_SIZE,
+   and the caller is responsible for freeing it when it is safe to do so. */
+int
+_gdbm_dir_grow (GDBM_FILE dbf, int bits, off_t *old_adr, int *old_size)
+{
+  int shift = bits - dbf->header->dir_bits;
+  size_t npages = dir_page_count (dbf);
+  size_t new_npages, n;
+  off_t dir_size;
+  off_t dir_adr;
+  dir_slot *dir;
+
+  if (shift <= 0 || bits > GDBM_HASH_BITS
+      || dbf->header->dir_size > (GDBM_MAX_DIR_SIZE >> shift))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_DIR_OVERFLOW, FALSE);
+      return -1;
+    }
+
+  if (dbf->dir_next)
+    {
+      if (shift == 1)
+	return dir_double (dbf, old_adr, old_size);
+      if (_gdbm_dir_abandon (dbf))
+	return -1;
+    }
+  
+  dir_size = (off_t) dbf->header->dir_size << shift;
+  new_npages = (dir_size + GDBM_DIR_PAGE_SIZE - 1) / GDBM_DIR_PAGE_SIZE;
+
+  /* The entire directory is needed to write out the new one. */
+  if (_gdbm_dir_load (dbf, 0, GDBM_DIR_COUNT (dbf)))
+    return -1;
+
+  dir = malloc (new_npages * sizeof (dir[0]));
+  if (dir == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  dir_adr = _gdbm_alloc (dbf, dir_size);
+  if (dir_adr == 0)
+    {
+      free (dir);
+      return -1;
+    }
+
+  /* The entries of the new slot N are copies of those of the old slot
+     N >> SHIFT.  A page keeps its depth, so it is indexed correctly
+     from each of the slots sharing it. */
+  for (n = 0; n < new_npages; n++)
+    {
+      dir[n] = dbf->dir[n >> shift];
+      if (dir[n].page)
+	dir[n].page->refcount++;
+    }
+  for (n = 0; n < npages; n++)
+    dir_page_unref (dbf->dir[n].page);
+  free (dbf->dir);
+
+  /* Update header. */
+  *old_adr = dbf->header->dir;
+  *old_size = dbf->header->dir_size;
+  dbf->header->dir = dir_adr;
+  dbf->header->dir_size = dir_size;
+  dbf->header->dir_bits = bits;
+  dbf->header_changed = TRUE;
+
+  /* Now update dbf. */
+  dbf->dir = dir;
+  dbf->bucket_dir <<= shift;
+  _gdbm_dir_relocated (dbf);
+
+  return 0;
+}
+
+/* Write pages FIRST through LAST-1 of the directory to the disk. */
+static int
+dir_write_pages (GDBM_FILE dbf, size_t first, size_t last)
+{
+  off_t *buf;
+  int rc = 0;
+
+  buf = malloc (((last - first < DIR_IO_PAGES) ? last - first : DIR_IO_PAGES)
+		* GDBM_DIR_PAGE_SIZE);
+  if (buf == NULL)
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, TRUE, GDBM_DEBUG_STORE);
+      return -1;
+    }
+
+  while (first < last)
+    {
+      off_t off = (off_t) first * GDBM_DIR_PAGE_SIZE;
+      size_t end = (last - first < DIR_IO_PAGES) ? last : first + DIR_IO_PAGES;
+      size_t size = (end - first) * GDBM_DIR_PAGE_SIZE;
+      size_t n;
+
+      if (off + size > dbf->header->dir_size)
+	size = dbf->header->dir_size - off;
+
+      for (n = first; n < end; n++)
+	dir_slot_expand (dbf, n, buf + (n - first) * GDBM_DIR_PAGE_ENTRIES);
+
+      if (gdbm_file_seek (dbf, dbf->header->dir + off, SEEK_SET)
+	  != dbf->header->dir + off)
+	{
+	  GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
+	  rc = -1;
+	  break;
+	}
+      if (_gdbm_full_write (dbf, buf, size))
+	{
+	  rc = -1;
+	  break;
+	}
+      first = end;
+    }
+
+  free (buf);
+  return rc;
+}
+
+/* Write the pages of the directory for which PRED returns true. */
+static int
+dir_write_if (GDBM_FILE dbf, int (*pred) (GDBM_FILE, size_t))
+{
+  size_t npages = dir_page_count (dbf);
+  size_t n;
+
+  for (n = 0; n < npages; )
+    {
+      size_t end;
+
+      if (!pred (dbf, n))
+	{
+	  n++;
+	  continue;
+	}
+      for (end = n + 1; end < npages && pred (dbf, end); end++)
+	;
+      if (dir_write_pages (dbf, n, end))
+	return -1;
+      n = end;
+    }
+  return 0;
+}
+
+static int
+dir_page_dirty_p (GDBM_FILE dbf, size_t n)
+{
+  return bit_is_set (dbf->dir_dirty, n);
+}
+
+static int
+dir_page_loaded_p (GDBM_FILE dbf, size_t n)
+{
+  return dir_slot_loaded_p (&dbf->dir[n]);
+}
+
+/* Write the modified part of the directory to the disk. */
+int
+_gdbm_dir_write (GDBM_FILE dbf)
+{
+  if (dbf->dir_dirty)
+    {
+      if (dir_write_if (dbf, dir_page_dirty_p))
+	return -1;
+      memset (dbf->dir_dirty, 0, dir_bitmap_size (dbf));
+      return 0;
+    }
+  /* Pages that were never read could not have been modified. */
+  return dir_write_if (dbf, dir_page_loaded_p);
+}
+
+/* Return the index of the first directory entry past the ones referring
+   to the current bucket.
+
+   In a consistent database, the entries referring to a bucket of depth
+   BITS form a contiguous range of 2^(dir_bits - BITS) entries, aligned
+   on its size.  This allows to skip the range without scanning it, which
+   saves reading in the directory pages it spans.  To guard against
+   inconsistencies, the range boundaries are verified and the function
+   falls back to scanning if they don't match. */
+int
+_gdbm_bucket_dir_end (GDBM_FILE dbf)
+{
+  int start, end;
+  off_t adr;
+
+  /* In chained databases, the current bucket may be an overflow one:
+     the directory refers to the first bucket of its chain. */
+  if (_gdbm_dir_load (dbf, dbf->bucket_dir, 1))
+    return _gdbm_next_bucket_dir (dbf, dbf->bucket_dir);
+  adr = _gdbm_dir_entry (dbf, dbf->bucket_dir);
+  _gdbm_bucket_dir_range (dbf, dbf->bucket_dir, dbf->bucket->bucket_bits,
+			  &start, &end);
+  if (_gdbm_dir_load (dbf, end - 1, 1) == 0
+      && _gdbm_dir_entry (dbf, end - 1) == adr
+      && (end == GDBM_DIR_COUNT (dbf)
+	  || (_gdbm_dir_load (dbf, end, 1) == 0
+	      && _gdbm_dir_entry (dbf, end) != adr)))
+    return end;
+  return _gdbm_next_bucket_dir (dbf, dbf->bucket_dir);
+}
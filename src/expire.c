@@ -0,0 +1,130 @@
+/* expire.c - Expiration of records. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.    */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+#include <stdint.h>
+
+/* In databases with the GDBM_FEAT_EXPIRE feature, each record carries
+   its expiration time (see GDBM_EXPIRE_SIZE).  Expired records are
+   treated as absent.  They are not removed from the file until found:
+   a lookup that finds an expired record in a database open for writing
+   replaces its bucket element with a tombstone, which is reclaimed
+   along with those left by lazy deletion (see gdbmdelete.c). */
+
+/* Store the expiration time EXPIRE in BUF. */
+void
+_gdbm_expire_encode (char *buf, time_t expire)
+{
+  uint64_t t = expire < 0 ? 0 : expire;
+  int i;
+
+  for (i = GDBM_EXPIRE_SIZE - 1; i >= 0; i--)
+    {
+      buf[i] = t & 0xff;
+      t >>= 8;
+    }
+}
+
+/* Return the expiration time stored in BUF. */
+time_t
+_gdbm_expire_decode (char const *buf)
+{
+  uint64_t t = 0;
+  int i;
+
+  for (i = 0; i < GDBM_EXPIRE_SIZE; i++)
+    t = (t << 8) | (unsigned char) buf[i];
+  if (t > TIME_T_MAX)
+    t = TIME_T_MAX;
+  return t;
+}
+
+/* Read the expiration time of the record at ELEM_LOC in the current
+   bucket of DBF into *PEXPIRE. */
+static int
+read_expire (GDBM_FILE dbf, int elem_loc, time_t *pexpire)
+{
+  bucket_element *elt = &dbf->bucket->h_table[elem_loc];
+  char buf[GDBM_EXPIRE_SIZE];
+  off_t adr;
+
+  if (dbf->cache_mru->ca_data.elem_loc == elem_loc)
+    {
+      *pexpire = dbf->cache_mru->ca_data.expire;
+      return 0;
+    }
+
+  if (elt->data_size < GDBM_EXPIRE_SIZE)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+      return -1;
+    }
+
+  if (_gdbm_elem_inline_p (dbf, elt))
+    memcpy (buf, _gdbm_elem_inline (elt) + elt->key_size, sizeof (buf));
+  else
+    {
+      adr = elt->data_pointer + elt->key_size;
+      if (gdbm_file_seek (dbf, adr, SEEK_SET) != adr)
+	{
+	  GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_LOOKUP);
+	  _gdbm_fatal (dbf, _("lseek error"));
+	  return -1;
+	}
+      if (_gdbm_full_read (dbf, buf, sizeof (buf)))
+	{
+	  dbf->need_recovery = TRUE;
+	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	  return -1;
+	}
+    }
+  *pexpire = _gdbm_expire_decode (buf);
+  return 0;
+}
+
+/* Check if the record at ELEM_LOC in the current bucket of DBF has
+   expired.  If so, and DBF is open for writing, replace its element with
+   a tombstone.  The bucket is not marked as changed: if it is evicted
+   from the cache before being written, the record will be found expired
+   again.
+
+   Return 1 if the record has expired, 0 if it has not, and -1 on
+   error. */
+int
+_gdbm_elem_expired (GDBM_FILE dbf, int elem_loc)
+{
+  time_t expire;
+
+  if (read_expire (dbf, elem_loc, &expire))
+    return -1;
+  if (!_gdbm_expired_p (expire))
+    return 0;
+
+  if (dbf->read_write != GDBM_READER)
+    {
+      dbf->bucket->h_table[elem_loc].hash_value = GDBM_TOMBSTONE;
+      dbf->bucket->count--;
+      if (dbf->cache_mru->ca_tombstones++ == 0)
+	dbf->cache_tombstones++;
+      dbf->cache_mru->ca_data.elem_loc = -1;
+    }
+  return 1;
+}
@@ -30,6 +30,7 @@ static avail_elem get_block (int, GDBM_FILE);
 static int push_avail_block (GDBM_FILE);
 static int pop_avail_block (GDBM_FILE);
 static int adjust_bucket_avail (GDBM_FILE);
+static int free_space (GDBM_FILE, off_t, int);
 
 int
 _gdbm_avail_block_read (GDBM_FILE dbf, avail_block *avblk, size_t size)
@@ -99,7 +100,7 @@ _gdbm_alloc (GDBM_FILE dbf, int num_bytes)
   /* Put the unused space back in the avail block. */
   av_el.av_adr += num_bytes;
   av_el.av_size -= num_bytes;
-  if (_gdbm_free (dbf, av_el.av_adr, av_el.av_size))
+  if (free_space (dbf, av_el.av_adr, av_el.av_size))
     return 0;
 
   /* Return the address. */
@@ -107,12 +108,57 @@ _gdbm_alloc (GDBM_FILE dbf, int num_bytes)
   
 }
 
+/* Allocate space in the file DBF for a block NUM_BYTES in length, taking
+   it from the header avail table or from the end of the file.  Unlike
+   _gdbm_alloc, this does not use the avail table of the current bucket,
+   so it can be called while buckets are being written (see
+   _gdbm_write_bucket).  Return 0 on error. */
+
+off_t
+_gdbm_alloc_central (GDBM_FILE dbf, int num_bytes)
+{
+  avail_elem av_el;
+
+  av_el = get_elem (num_bytes, dbf->avail->av_table, &dbf->avail->count);
+  if (av_el.av_size == 0)
+    av_el = get_block (num_bytes, dbf);
+  dbf->header_changed = TRUE;
+
+  /* Put the unused space back in the header avail table. */
+  if (av_el.av_size - num_bytes > IGNORE_SIZE)
+    {
+      avail_elem rest;
+
+      if (dbf->avail->count == dbf->avail->size && push_avail_block (dbf))
+	return 0;
+      rest.av_adr = av_el.av_adr + num_bytes;
+      rest.av_size = av_el.av_size - num_bytes;
+      _gdbm_put_av_elem (rest, dbf->avail->av_table, &dbf->avail->count,
+			 dbf->coalesce_blocks);
+    }
+
+  return av_el.av_adr;
+}
+
 /* Free space of size NUM_BYTES in the file DBF at file address FILE_ADR.  Make
    it available for reuse through _gdbm_alloc.  This routine changes the
-   avail structure. */
+   avail structure.
+
+   While snapshots of DBF are open, the space may still be read through
+   them.  It is then kept aside, and made available only when the last
+   snapshot is closed (see gdbmsnapshot.c). */
 
 int
 _gdbm_free (GDBM_FILE dbf, off_t file_adr, int num_bytes)
+{
+  if (_gdbm_snapshot_active_p (dbf))
+    return _gdbm_snapshot_defer_free (dbf, file_adr, num_bytes);
+  return free_space (dbf, file_adr, num_bytes);
+}
+
+/* Make space of size NUM_BYTES at FILE_ADR available for reuse. */
+static int
+free_space (GDBM_FILE dbf, off_t file_adr, int num_bytes)
 {
   avail_elem temp;
 
@@ -323,7 +369,7 @@ push_avail_block (GDBM_FILE dbf)
       /* Free the unneeded space. */
       new_loc.av_adr += av_size;
       new_loc.av_size -= av_size;
-      if (_gdbm_free (dbf, new_loc.av_adr, new_loc.av_size))
+      if (free_space (dbf, new_loc.av_adr, new_loc.av_size))
 	{
 	  rc = -1;
 	  break;
@@ -38,19 +38,21 @@ gdbm_offset_ok (GDBM_FILE dbf, off_t off)
 static inline int
 gdbm_bucket_element_valid_p (GDBM_FILE dbf, int elem_loc)
 {
-  return elem_loc < dbf->header->bucket_elems
-    && dbf->bucket->h_table[elem_loc].hash_value != -1
-    && dbf->bucket->h_table[elem_loc].key_size >= 0
-    && off_t_sum_ok (dbf->bucket->h_table[elem_loc].data_pointer,
-		     dbf->bucket->h_table[elem_loc].key_size)
-    && dbf->bucket->h_table[elem_loc].data_size >= 0
-    && off_t_sum_ok (dbf->bucket->h_table[elem_loc].data_pointer
-		     + dbf->bucket->h_table[elem_loc].key_size,
-		     dbf->bucket->h_table[elem_loc].data_size)
+  bucket_element *elt;
+
+  if (!(elem_loc < dbf->header->bucket_elems
+	&& dbf->bucket->h_table[elem_loc].hash_value != -1))
+    return 0;
+  elt = &dbf->bucket->h_table[elem_loc];
+  /* Inline records are always retrievable. */
+  if (_gdbm_elem_inline_p (dbf, elt))
+    return 1;
+  return elt->key_size >= 0
+    && off_t_sum_ok (elt->data_pointer, elt->key_size)
+    && elt->data_size >= 0
+    && off_t_sum_ok (elt->data_pointer + elt->key_size, elt->data_size)
     && gdbm_offset_ok (dbf,
-		       dbf->bucket->h_table[elem_loc].data_pointer
-		       + dbf->bucket->h_table[elem_loc].key_size
-		       + dbf->bucket->h_table[elem_loc].data_size);
+		       elt->data_pointer + elt->key_size + elt->data_size);
 }
   
 /* Read the data found in bucket entry ELEM_LOC in file DBF and
@@ -116,23 +118,39 @@ _gdbm_read_entry (GDBM_FILE dbf, int elem_loc)
     }
 
   /* Read into the cache. */
-  file_pos = gdbm_file_seek (dbf, dbf->bucket->h_table[elem_loc].data_pointer,
-                             SEEK_SET);
-  if (file_pos != dbf->bucket->h_table[elem_loc].data_pointer)
+  if (_gdbm_elem_inline_p (dbf, &dbf->bucket->h_table[elem_loc]))
+    memcpy (data_ca->dptr,
+	    _gdbm_elem_inline (&dbf->bucket->h_table[elem_loc]), dsize);
+  else
     {
-      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_LOOKUP);
-      _gdbm_fatal (dbf, _("lseek error"));
-      return NULL;
+      file_pos = gdbm_file_seek (dbf,
+				 dbf->bucket->h_table[elem_loc].data_pointer,
+				 SEEK_SET);
+      if (file_pos != dbf->bucket->h_table[elem_loc].data_pointer)
+	{
+	  GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_LOOKUP);
+	  _gdbm_fatal (dbf, _("lseek error"));
+	  return NULL;
+	}
+
+      rc = _gdbm_full_read (dbf, data_ca->dptr, key_size+data_size);
+      if (rc)
+	{
+	  GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_LOOKUP|GDBM_DEBUG_READ,
+		      "%s: error reading entry: %s",
+		      dbf->name, gdbm_db_strerror (dbf));
+	  dbf->need_recovery = TRUE;
+	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	  return NULL;
+	}
     }
 
-  rc = _gdbm_full_read (dbf, data_ca->dptr, key_size+data_size);
-  if (rc)
+  /* Decode the data. */
+  data_ca->expire = 0;
+  if (_gdbm_data_encoded_p (dbf)
+      && _gdbm_data_decode (dbf, data_ca, key_size, &data_size))
     {
-      GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_LOOKUP|GDBM_DEBUG_READ,
-                 "%s: error reading entry: %s",
-                 dbf->name, gdbm_db_strerror (dbf));
-      dbf->need_recovery = TRUE;
-      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      data_ca->elem_loc = -1;
       return NULL;
     }
   
@@ -145,47 +163,92 @@ _gdbm_read_entry (GDBM_FILE dbf, int elem_loc)
   return data_ca->dptr;
 }
 
-/* Find the KEY in the file and get ready to read the associated data.  The
-   return value is the location in the current hash bucket of the KEY's
-   entry.  If it is found, additional data are returned as follows:
+/* Compare the key of bucket entry ELEM_LOC in file DBF with KEY, whose
+   size is known to match.  Only the key is read from the file, so that
+   large values are not loaded into the data cache just to locate their
+   entry.  Return 0 if the keys are equal, 1 if they differ and -1 on
+   error. */
+static int
+compare_key (GDBM_FILE dbf, int elem_loc, datum key)
+{
+  bucket_element *elt = &dbf->bucket->h_table[elem_loc];
+  char buf[256];
+  char *p;
+  int rc;
 
-   If RET_DPTR is not NULL, a pointer to the actual data is stored in it.
-   If RET_HASH_VAL is not NULL, it is assigned the actual hash value.
+  if (_gdbm_elem_inline_p (dbf, elt))
+    return memcmp (_gdbm_elem_inline (elt), key.dptr, key.dsize) != 0;
 
-   If KEY is not found, the value -1 is returned and gdbm_errno is
-   set to GDBM_ITEM_NOT_FOUND.  */
-int
-_gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
+  if (!gdbm_bucket_element_valid_p (dbf, elem_loc))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_TABLE, TRUE);
+      return -1;
+    }
+
+  if (gdbm_file_seek (dbf, elt->data_pointer, SEEK_SET) != elt->data_pointer)
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_LOOKUP);
+      _gdbm_fatal (dbf, _("lseek error"));
+      return -1;
+    }
+
+  if (key.dsize <= sizeof (buf))
+    p = buf;
+  else if ((p = malloc (key.dsize)) == NULL)
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_LOOKUP);
+      return -1;
+    }
+
+  rc = _gdbm_full_read (dbf, p, key.dsize);
+  if (rc)
+    {
+      GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_LOOKUP|GDBM_DEBUG_READ,
+		  "%s: error reading key: %s",
+		  dbf->name, gdbm_db_strerror (dbf));
+      dbf->need_recovery = TRUE;
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      rc = -1;
+    }
+  else
+    rc = memcmp (p, key.dptr, key.dsize) != 0;
+
+  if (p != buf)
+    free (p);
+  return rc;
+}
+
+/* Search the current bucket for KEY, whose hash value is HASH_VAL and
+   whose home location is HOME_LOC.  KEY_START holds the first
+   KEY_START_LEN bytes of the key, as kept in bucket elements.  Return
+   the location of the KEY's entry, -2 if it is not in this bucket and
+   -1 on error, or if the entry is found but has expired (unless ANY is
+   true).  RET_DPTR is as for findkey. */
+static int
+bucket_findkey (GDBM_FILE dbf, datum key, int hash_val, int home_loc,
+		char const *key_start, int key_start_len, char **ret_dptr,
+		int any)
 {
   int    bucket_hash_val;	/* The hash value from the bucket. */
-  int    new_hash_val;          /* Computed hash value for the key */
-  char  *file_key;		/* The complete key as stored in the file. */
-  int    bucket_dir;            /* Number of the bucket in directory. */
+  char  *file_key = NULL;	/* The complete key as stored in the file. */
   int    elem_loc;		/* The location in the bucket. */
-  int    home_loc;		/* The home location in the bucket. */
   int    key_size;		/* Size of the key on the file.  */
 
-  GDBM_DEBUG_DATUM (GDBM_DEBUG_LOOKUP, key, "%s: fetching key:", dbf->name);
-  
-  /* Compute hash value and load proper bucket.  */
-  _gdbm_hash_key (dbf, key, &new_hash_val, &bucket_dir, &elem_loc);
-
-  GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: location = %#4x:%d:%d", dbf->name,
-	      new_hash_val, bucket_dir, elem_loc);
-
-  if (ret_hash_val)
-    *ret_hash_val = new_hash_val;
-  if (_gdbm_get_bucket (dbf, bucket_dir))
-    return -1;
-  
   /* Is the element the last one found for this bucket? */
   if (dbf->cache_mru->ca_data.elem_loc != -1 
-      && new_hash_val == dbf->cache_mru->ca_data.hash_val
+      && hash_val == dbf->cache_mru->ca_data.hash_val
       && dbf->cache_mru->ca_data.key_size == key.dsize
       && dbf->cache_mru->ca_data.dptr != NULL
       && memcmp (dbf->cache_mru->ca_data.dptr, key.dptr, key.dsize) == 0)
     {
       GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: found in cache", dbf->name);
+      /* Expired records are treated as absent. */
+      if (!any && _gdbm_expired_p (dbf->cache_mru->ca_data.expire))
+	{
+	  _gdbm_elem_expired (dbf, dbf->cache_mru->ca_data.elem_loc);
+	  GDBM_SET_ERRNO2 (dbf, GDBM_ITEM_NOT_FOUND, FALSE, GDBM_DEBUG_LOOKUP);
+	  return -1;
+	}
       /* This is it. Return the cache pointer. */
       if (ret_dptr)
 	*ret_dptr = dbf->cache_mru->ca_data.dptr + key.dsize;
@@ -193,15 +256,18 @@ _gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
     }
       
   /* It is not the cached value, search for element in the bucket. */
-  home_loc = elem_loc;
+  elem_loc = home_loc;
   bucket_hash_val = dbf->bucket->h_table[elem_loc].hash_value;
   while (bucket_hash_val != -1)
     {
-      key_size = dbf->bucket->h_table[elem_loc].key_size;
-      if (bucket_hash_val != new_hash_val
+      bucket_element *elt = &dbf->bucket->h_table[elem_loc];
+
+      key_size = elt->key_size;
+      if (bucket_hash_val != hash_val
 	 || key_size != key.dsize
-	 || memcmp (dbf->bucket->h_table[elem_loc].key_start, key.dptr,
-			(SMALL < key_size ? SMALL : key_size)) != 0) 
+	 || (_gdbm_elem_inline_p (dbf, elt)
+	     ? memcmp (_gdbm_elem_inline (elt), key.dptr, key_size)
+	     : memcmp (elt->key_start, key_start, key_start_len)) != 0)
 	{
 	  /* Current elem_loc is not the item, go to next item. */
 	  elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
@@ -213,14 +279,33 @@ _gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
 	{
 	  /* This may be the one we want.
 	     The only way to tell is to read it. */
-	  file_key = _gdbm_read_entry (dbf, elem_loc);
-	  if (!file_key)
+	  int rc;
+
+	  if (ret_dptr)
+	    {
+	      file_key = _gdbm_read_entry (dbf, elem_loc);
+	      rc = file_key ? memcmp (file_key, key.dptr, key_size) != 0 : -1;
+	    }
+	  else
+	    rc = compare_key (dbf, elem_loc, key);
+	  if (rc == 0 && !any && _gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+	    {
+	      /* Expired records are treated as absent. */
+	      rc = _gdbm_elem_expired (dbf, elem_loc);
+	      if (rc == 1)
+		{
+		  GDBM_SET_ERRNO2 (dbf, GDBM_ITEM_NOT_FOUND, FALSE,
+				   GDBM_DEBUG_LOOKUP);
+		  return -1;
+		}
+	    }
+	  if (rc == -1)
 	    {
 	      GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: error reading entry: %s",
 			  dbf->name, gdbm_db_strerror (dbf));
 	      return -1;
 	    }
-	  if (memcmp (file_key, key.dptr, key_size) == 0)
+	  if (rc == 0)
 	    {
 	      /* This is the item. */
 	      GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: found", dbf->name);
@@ -238,11 +323,79 @@ _gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
 	    }
 	}
       GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: next location = %#4x:%d:%d",
-		  dbf->name, bucket_hash_val, bucket_dir, elem_loc);
+		  dbf->name, bucket_hash_val, dbf->bucket_dir, elem_loc);
+    }
+  return -2;
+}
+
+/* Find the KEY in the file and get ready to read the associated data.  The
+   return value is the location in the current hash bucket of the KEY's
+   entry.  If it is found, additional data are returned as follows:
+
+   If RET_DPTR is not NULL, the entry is read into the data cache and
+   a pointer to the actual data is stored in RET_DPTR.  Otherwise, only
+   the key is read.
+   If RET_HASH_VAL is not NULL, it is assigned the actual hash value.
+
+   If KEY is not found, the value -1 is returned and gdbm_errno is
+   set to GDBM_ITEM_NOT_FOUND.  In databases with overflow chains, all
+   the buckets of the chain are searched, and the last one is left
+   current.
+
+   Unless ANY is true, expired records are treated as absent (see
+   expire.c). */
+static int
+findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val,
+	 int any)
+{
+  int    new_hash_val;          /* Computed hash value for the key */
+  int    bucket_dir;            /* Number of the bucket in directory. */
+  int    elem_loc;		/* The location in the bucket. */
+  char   key_start[SMALL];      /* Expected key_start of the element. */
+  int    key_start_len;         /* Number of significant bytes in it. */
+  int    rc;
+
+  GDBM_DEBUG_DATUM (GDBM_DEBUG_LOOKUP, key, "%s: fetching key:", dbf->name);
+  
+  /* Compute hash value and load proper bucket.  */
+  _gdbm_hash_key (dbf, key, &new_hash_val, &bucket_dir, &elem_loc);
+
+  GDBM_DEBUG (GDBM_DEBUG_LOOKUP, "%s: location = %#4x:%d:%d", dbf->name,
+	      new_hash_val, bucket_dir, elem_loc);
+
+  if (ret_hash_val)
+    *ret_hash_val = new_hash_val;
+  if (_gdbm_get_bucket (dbf, bucket_dir))
+    return -1;
+
+  key_start_len = _gdbm_key_start (dbf, key, key_start);
+  do
+    {
+      rc = bucket_findkey (dbf, key, new_hash_val, elem_loc,
+			   key_start, key_start_len, ret_dptr, any);
+      if (rc != -2)
+	return rc;
     }
+  while ((rc = _gdbm_next_bucket (dbf)) == 0);
+  if (rc == -1)
+    return -1;
 
   /* If we get here, we never found the key. */
   GDBM_SET_ERRNO2 (dbf, GDBM_ITEM_NOT_FOUND, FALSE, GDBM_DEBUG_LOOKUP);
   return -1;
 
 }
+
+int
+_gdbm_findkey (GDBM_FILE dbf, datum key, char **ret_dptr, int *ret_hash_val)
+{
+  return findkey (dbf, key, ret_dptr, ret_hash_val, FALSE);
+}
+
+/* Same as _gdbm_findkey, but find expired records as well. */
+int
+_gdbm_findkey_any (GDBM_FILE dbf, datum key, char **ret_dptr,
+		   int *ret_hash_val)
+{
+  return findkey (dbf, key, ret_dptr, ret_hash_val, TRUE);
+}
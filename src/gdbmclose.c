@@ -31,11 +31,23 @@ gdbm_close (GDBM_FILE dbf)
   
   gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
 
+  if (dbf->snapshot)
+    _gdbm_snapshot_unlink (dbf);
+  else
+    _gdbm_snapshot_detach (dbf, TRUE);
+
   if (dbf->desc != -1)
     {
       /* Make sure the database is all on disk. */
       if (dbf->read_write != GDBM_READER)
-	gdbm_file_sync (dbf);
+	{
+	  if (!dbf->need_recovery)
+	    {
+	      _gdbm_dir_abandon (dbf);
+	      _gdbm_flush (dbf);
+	    }
+	  gdbm_file_sync (dbf);
+	}
 
       _gdbmsync_done (dbf);
       
@@ -55,9 +67,11 @@ gdbm_close (GDBM_FILE dbf)
   gdbm_clear_error (dbf);
   
   free (dbf->name);
-  free (dbf->dir);
+  _gdbm_dir_free (dbf);
 
   _gdbm_cache_free (dbf);
+  free (dbf->zbuf);
+  _gdbm_journal_free (dbf);
   
   free (dbf->header);
   free (dbf);
@@ -40,6 +40,45 @@
 #define GDBM_NUMSYNC_MAGIC32_SWAP    0xd09a5713u
 #define GDBM_NUMSYNC_MAGIC64_SWAP    0xd19a5713u
 
+/* Extended format with optional features.  The header layout is the same
+   as in numsync format.  The set of features in use is kept in the
+   extended header.  A distinct magic number prevents the databases that
+   use any features from being opened by earlier versions of GDBM. */
+#define GDBM_EXT_MAGIC32        0x13579ad2u
+#define GDBM_EXT_MAGIC64        0x13579ad3u
+
+#define GDBM_EXT_MAGIC32_SWAP        0xd29a5713u
+#define GDBM_EXT_MAGIC64_SWAP        0xd39a5713u
+
+/* Features of the extended format. */
+#define GDBM_FEAT_FINGERPRINT   0x0001 /* key_start keeps a fingerprint of
+					  the key, instead of its first
+					  bytes. */
+#define GDBM_FEAT_INLINE        0x0002 /* Small records are kept in bucket
+					  elements. */
+#define GDBM_FEAT_COMPRESS      0x0004 /* Record data are compressed. */
+#define GDBM_FEAT_EXPIRE        0x0008 /* Records carry expiration times. */
+#define GDBM_FEAT_GENERATION    0x0010 /* Buckets carry the generation of
+					  their last change. */
+#define GDBM_FEAT_CHAIN         0x0020 /* Full buckets may be followed by
+					  chains of overflow buckets. */
+#define GDBM_FEAT_MASK          0x003f /* Features known to this version. */
+
+/* In databases with the GDBM_FEAT_EXPIRE feature, the data part of each
+   record begins with its expiration time: the number of seconds since
+   the Epoch, MSB first, or 0 if the record never expires.  In databases
+   that use compression as well, the codec byte follows it. */
+#define GDBM_EXPIRE_SIZE        8
+
+/* Codecs of record data in databases with the GDBM_FEAT_COMPRESS
+   feature.  The codec is stored in the first byte of the data. */
+#define GDBM_CODEC_NONE         0      /* Data stored verbatim. */
+#define GDBM_CODEC_ZLIB         1      /* 4-byte original length (MSB first),
+					  followed by zlib stream. */
+
+/* Don't try to compress data shorter than this. */
+#define GDBM_COMPRESS_MIN       64
+
 /* Size of a hash value, in bits */
 #define GDBM_HASH_BITS 31
 
@@ -56,6 +95,16 @@
 /* The number of bucket_avail entries in a hash bucket. */
 #define BUCKET_AVAIL 6
 
+/* Maximum size of the hash directory, in bytes. */
+#define GDBM_MAX_DIR_SIZE INT32_MAX
+#define GDBM_MAX_DIR_HALF (GDBM_MAX_DIR_SIZE / 2)
+
+/* Size of a hash directory page, in entries and in bytes.  Directory
+   pages are read from disk on demand (see dir.c). */
+#define GDBM_DIR_PAGE_BITS 9
+#define GDBM_DIR_PAGE_ENTRIES (1 << GDBM_DIR_PAGE_BITS)
+#define GDBM_DIR_PAGE_SIZE (GDBM_DIR_PAGE_ENTRIES * sizeof (off_t))
+
 /* The size of the bucket cache. */
 #define DEFAULT_CACHESIZE  GDBM_CACHE_AUTO
 
@@ -25,16 +25,20 @@ gdbm_count (GDBM_FILE dbf, gdbm_count_t *pcount)
 {
   int nbuckets = GDBM_DIR_COUNT (dbf);
   gdbm_count_t count = 0;
-  int i;
+  int i, rc;
   
   /* Return immediately if the database needs recovery */	
   GDBM_ASSERT_CONSISTENCY (dbf, -1);
   
-  for (i = 0; i < nbuckets; i = _gdbm_next_bucket_dir (dbf, i))
+  for (i = 0; i < nbuckets; i = _gdbm_bucket_dir_end (dbf))
     {
       if (_gdbm_get_bucket (dbf, i))
 	return -1;
-      count += dbf->bucket->count;
+      do
+	count += dbf->bucket->count;
+      while ((rc = _gdbm_next_bucket (dbf)) == 0);
+      if (rc == -1)
+	return -1;
     }
   *pcount = count;
   return 0;
@@ -51,6 +55,18 @@ gdbm_bucket_count (GDBM_FILE dbf, size_t *pcount)
   for (i = 0; i < GDBM_DIR_COUNT (dbf); i = _gdbm_next_bucket_dir (dbf, i))
     {
       ++count;
+      /* Overflow buckets can only be counted by reading the chains. */
+      if (_gdbm_feature_p (dbf, GDBM_FEAT_CHAIN))
+	{
+	  int rc;
+
+	  if (_gdbm_get_bucket (dbf, i))
+	    return -1;
+	  while ((rc = _gdbm_next_bucket (dbf)) == 0)
+	    ++count;
+	  if (rc == -1)
+	    return -1;
+	}
     }
   *pcount = count;
   return 0;
@@ -24,9 +24,11 @@
 #if SIZEOF_OFF_T == 4
 # define GDBM_MAGIC	GDBM_MAGIC32
 # define GDBM_NUMSYNC_MAGIC GDBM_NUMSYNC_MAGIC32
+# define GDBM_EXT_MAGIC GDBM_EXT_MAGIC32
 #elif SIZEOF_OFF_T == 8
 # define GDBM_MAGIC	GDBM_MAGIC64
 # define GDBM_NUMSYNC_MAGIC GDBM_NUMSYNC_MAGIC64
+# define GDBM_EXT_MAGIC GDBM_EXT_MAGIC64
 #else
 # error "Unsupported off_t size, contact GDBM maintainer.  What crazy system is this?!?"
 #endif
@@ -45,6 +47,7 @@
 
 /* Maximum value for off_t */
 #define OFF_T_MAX SIGNED_TYPE_MAXIMUM (off_t)
+#define TIME_T_MAX SIGNED_TYPE_MAXIMUM (time_t)
 
 /* Return true if both A and B are non-negative offsets and A can be added
    to B without integer overflow */
@@ -57,6 +60,11 @@ off_t_sum_ok (off_t a, off_t b)
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
+/* gdbm_open flags that select features of the extended format. */
+#define GDBM_FEATURE_FLAGS \
+  (GDBM_FINGERPRINT | GDBM_INLINE | GDBM_COMPRESS | GDBM_EXPIRE \
+   | GDBM_GENERATION | GDBM_CHAIN)
+
 /* The type definitions are next.  */
 
 /* The available file space is stored in an "avail" table.  The one with
@@ -102,7 +110,8 @@ typedef struct
 {
   int version;         /* Version number (currently 0). */
   unsigned numsync;    /* Number of synchronizations. */
-  int pad[6];          /* Reserve space for further use. */
+  unsigned features;   /* Features in use (GDBM_EXT_MAGIC only). */
+  int pad[5];          /* Reserve space for further use. */
 } gdbm_ext_header;
 
 /* Standard GDBM file header. */
@@ -124,7 +133,9 @@ typedef struct
    "pointer" to the key and data (stored together) with their sizes.  It also
    has a small part of the actual key value.  It is used to verify the first
    part of the key has the correct value without having to read the actual
-   key. */
+   key.  In databases with the GDBM_FEAT_FINGERPRINT feature, key_start
+   keeps instead a 32-bit fingerprint of the entire key, computed
+   independently of its hash value. */
 
 typedef struct
 {
@@ -136,6 +147,22 @@ typedef struct
   int   data_size;        /* Size of associated data in the file. */
 } bucket_element;
 
+/* Hash value of an element deleted in lazy mode (see GDBM_SETLAZYDELETE).
+   Such elements, called tombstones, keep their place in the hash table,
+   and their file space remains allocated, until the bucket is reclaimed
+   by _gdbm_bucket_reclaim.  Tombstones exist only in memory: a bucket
+   that contains them is never written to disk. */
+#define GDBM_TOMBSTONE (-2)
+
+/* In databases with the GDBM_FEAT_INLINE feature, a record whose key and
+   data together take at most GDBM_INLINE_SIZE bytes is kept in its bucket
+   element, in the space occupied by key_start and data_pointer: the key
+   first, immediately followed by the data.  No file space is allocated
+   for such records. */
+#define GDBM_INLINE_OFFSET offsetof (bucket_element, key_start)
+#define GDBM_INLINE_SIZE \
+  (offsetof (bucket_element, key_size) - GDBM_INLINE_OFFSET)
+
 /* A bucket is a small hash table.  This one consists of a number of
    bucket elements plus some bookkeeping fields.  The number of elements
    depends on the optimum blocksize for the storage device and on a
@@ -157,6 +184,27 @@ typedef struct
   bucket_element h_table[1]; /* The table.  Make it look like an array.*/
 } hash_bucket;
 
+/* In databases with the GDBM_FEAT_GENERATION feature, the last
+   GDBM_BUCKET_GEN_SIZE bytes of each bucket keep the generation (the
+   value of numsync in the extended header) in which the bucket was last
+   written.  The number of bucket elements is reduced accordingly. */
+#define GDBM_BUCKET_GEN_SIZE sizeof (unsigned)
+
+/* In databases with the GDBM_FEAT_CHAIN feature, a bucket that can't be
+   split usefully is followed by a chain of overflow buckets of the same
+   depth, which are not referenced by the directory.  The chain trailer,
+   kept before the generation (if any), links the buckets.  Its hash
+   value has the same prefix as the hash values of the elements of the
+   chain: it allows to locate the first bucket of the chain, even if
+   the bucket is empty. */
+typedef struct
+{
+  off_t next;          /* Address of the next bucket in the chain, or 0. */
+  int   hash;          /* A hash value with the prefix of the chain. */
+} bucket_chain;
+
+#define GDBM_BUCKET_CHAIN_SIZE sizeof (bucket_chain)
+
 /* We want to keep from reading buckets as much as possible.  The following is
    to implement a bucket cache.  When full, buckets will be dropped in a
    least recently used order.  */
@@ -176,6 +224,7 @@ typedef struct
   char    *dptr;
   size_t  dsize;
   int     elem_loc;
+  time_t  expire;       /* Expiration time of the record, or 0. */
 } data_cache_elem;
 
 typedef struct cache_elem cache_elem;
@@ -192,10 +241,31 @@ struct cache_elem
 			          available element. */
                   *ca_coll;    /* Next element in a collision sequence */
   size_t          ca_hits;     /* Number of times this element was requested */
+  int             ca_tombstones; /* Number of tombstones in the bucket */
   hash_bucket     ca_bucket[1];/* Associated  bucket (dbf->header->bucket_size
 				  bytes). */
 };
 
+/* A page of the in-memory hash directory.  Its entries are those of a
+   directory of DEPTH bits, which may be less than the current depth:
+   when the directory grows, the page is shared by all slots covering
+   its entries, until one of them is modified (see dir.c). */
+typedef struct
+{
+  size_t refcount;     /* Number of slots referring to the page. */
+  int    depth;        /* Directory depth the entries are indexed by. */
+  off_t  ent[GDBM_DIR_PAGE_ENTRIES];
+} dir_page;
+
+/* A slot of the in-memory hash directory describes GDBM_DIR_PAGE_ENTRIES
+   consecutive entries, i.e. a page of the directory on disk. */
+typedef struct
+{
+  dir_page *page;      /* The entries, or NULL if they are all equal. */
+  off_t     adr;       /* If PAGE is NULL, the bucket address shared by
+			  all entries, or 0 if the page was not read. */
+} dir_slot;
+
 /* Type of file locking in use. */
 enum lock_type
   {
@@ -242,6 +312,12 @@ struct gdbm_file_info
 
   /* Automatic bucket cache size */
   unsigned cache_auto :1;
+
+  /* Deleted elements are replaced with tombstones */
+  unsigned lazy_delete :1;
+
+  /* This is a snapshot of another database (see gdbmsnapshot.c) */
+  unsigned snapshot :1;
   
   /* Last GDBM error number */
   gdbm_error last_error;
@@ -269,8 +345,22 @@ struct gdbm_file_info
   gdbm_ext_header *xheader;
   
   /* The hash table directory from extendable hashing.  See Fagin et al, 
-     ACM Trans on Database Systems, Vol 4, No 3. Sept 1979, 315-344 */
-  off_t *dir;
+     ACM Trans on Database Systems, Vol 4, No 3. Sept 1979, 315-344.
+     It is kept in memory as a table of pages (see dir.c); use
+     _gdbm_dir_entry to access its entries. */
+  dir_slot *dir;
+
+  size_t dir_pages_left;   /* Number of directory pages not yet read. */
+  /* Bitmap of directory pages modified since the last write.  If
+     directory_changed is set and dir_dirty is NULL, all pages in
+     memory are written. */
+  unsigned char *dir_dirty;
+
+  /* The directory prepared on disk for the next doubling (see dir.c). */
+  off_t dir_next;                 /* File address, or 0 if none. */
+  unsigned char *dir_next_dirty;  /* Bitmap of its pages to be written. */
+  size_t dir_next_left;           /* Number of bits set in dir_next_dirty. */
+  size_t dir_next_pos;            /* Page to write next. */
 
   /* The bucket cache. */
   int cache_bits;          /* Address bits used for computing bucket hash */
@@ -290,6 +380,16 @@ struct gdbm_file_info
   /* The directory entry used to get the current hash bucket. */
   int bucket_dir;
 
+  /* Position of the current bucket in its overflow chain: 0 for the
+     bucket referenced by bucket_dir (see GDBM_FEAT_CHAIN). */
+  int chain_pos;
+
+  size_t cache_dirty;      /* Number of changed buckets in cache */
+  size_t flush_budget;     /* Number of changed buckets that may be kept in
+			      cache after an update.  If 0, changes are
+			      written at the end of each update. */
+  size_t cache_tombstones; /* Number of cached buckets with tombstones */
+
   /* Cache statistics */
   size_t cache_access_count; /* Number of cache accesses */
   size_t cache_hits;         /* Number of cache hits */
@@ -320,6 +420,22 @@ struct gdbm_file_info
                             support ioctl(FICLONE). */
 
 #endif /* GDBM_FAILURE_ATOMIC */
+
+  /* Scratch buffer for encoding and decoding of compressed data. */
+  char *zbuf;
+  size_t zbuf_size;
+
+  /* Change reporting (see gdbmjournal.c). */
+  gdbm_change_fn change_hook;  /* Function called after each change. */
+  void *change_closure;        /* Its closure argument. */
+  struct gdbm_journal *journal;/* Journal of changes, or NULL. */
+
+  /* Snapshots (see gdbmsnapshot.c). */
+  GDBM_FILE snapshots;         /* Open snapshots of this database. */
+  GDBM_FILE snapshot_of;       /* For a snapshot: the database it was taken
+				  of, or NULL if detached from it. */
+  GDBM_FILE snapshot_next;     /* Next snapshot of the same database. */
+  struct gdbm_pin *pin;        /* File space kept for the snapshots. */
 };
 
 #define GDBM_DIR_COUNT(db) ((db)->header->dir_size / sizeof (off_t))
@@ -342,6 +458,13 @@ struct gdbm_file_info
 
 #define _GDBM_MAX_DUMP_LINE_LEN 76
 
+/* Packed dump format (see gdbmdump.c). */
+#define _GDBM_PACKED_MAGIC      "\211GDBMPK\n"
+#define _GDBM_PACKED_MAGIC_LEN  8
+#define _GDBM_PACKED_BLOCK_HDR  13     /* Size of a block header. */
+#define _GDBM_PACKED_REC_HDR    16     /* Size of a record header. */
+#define _GDBM_PACKED_BLOCK_SIZE 65536  /* Preferred size of block payload. */
+
 /* Return immediately if the database needs recovery */	
 #define GDBM_ASSERT_CONSISTENCY(dbf, onerr)			\
   do								\
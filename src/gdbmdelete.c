@@ -29,11 +29,6 @@ int
 gdbm_delete (GDBM_FILE dbf, datum key)
 {
   int elem_loc;		/* The location in the current hash bucket. */
-  int last_loc;		/* Last location emptied by the delete.  */
-  int home;		/* Home position of an item. */
-  bucket_element elem;  /* The element to be deleted. */
-  off_t free_adr;       /* Temporary storage for address and size. */
-  int   free_size;
 
   GDBM_ASSERT_CONSISTENCY (dbf, -1);
 
@@ -52,6 +47,33 @@ gdbm_delete (GDBM_FILE dbf, datum key)
   if (elem_loc == -1)
     return -1;
 
+  return _gdbm_delete_elem (dbf, elem_loc);
+}
+
+/* Remove the element at ELEM_LOC in the current bucket of DBF, along with
+   its record, and update the file. */
+static int
+delete_elem (GDBM_FILE dbf, int elem_loc)
+{
+  int last_loc;		/* Last location emptied by the delete.  */
+  int home;		/* Home position of an item. */
+  bucket_element elem;  /* The element to be deleted. */
+  off_t free_adr;       /* Temporary storage for address and size. */
+  int   free_size;
+
+  if (dbf->lazy_delete)
+    {
+      /* Leave a tombstone in place of the element.  It is reclaimed
+	 along with other tombstones in this bucket before the bucket is
+	 written to disk. */
+      dbf->bucket->h_table[elem_loc].hash_value = GDBM_TOMBSTONE;
+      dbf->bucket->count--;
+      if (dbf->cache_mru->ca_tombstones++ == 0)
+	dbf->cache_tombstones++;
+      _gdbm_current_bucket_changed (dbf);
+      return _gdbm_end_update (dbf);
+    }
+
   /* Save the element.  */
   elem = dbf->bucket->h_table[elem_loc];
 
@@ -79,10 +101,13 @@ gdbm_delete (GDBM_FILE dbf, datum key)
     }
 
   /* Free the file space. */
-  free_adr = elem.data_pointer;
-  free_size = elem.key_size + elem.data_size;
-  if (_gdbm_free (dbf, free_adr, free_size))
-    return -1;
+  if (!_gdbm_elem_inline_p (dbf, &elem))
+    {
+      free_adr = elem.data_pointer;
+      free_size = elem.key_size + elem.data_size;
+      if (_gdbm_free (dbf, free_adr, free_size))
+	return -1;
+    }
 
   /* Set the flags. */
   _gdbm_current_bucket_changed (dbf);
@@ -95,3 +120,373 @@ gdbm_delete (GDBM_FILE dbf, datum key)
   /* Do the writes. */
   return _gdbm_end_update (dbf);
 }
+
+/* Reclaim the tombstones in the current bucket of DBF: rebuild its hash
+   table without them and free their file space. */
+int
+_gdbm_bucket_reclaim (GDBM_FILE dbf)
+{
+  int n = dbf->header->bucket_elems;
+  bucket_element *tab;
+  int i;
+
+  if (dbf->cache_mru->ca_tombstones == 0)
+    return 0;
+
+  tab = malloc (n * sizeof (tab[0]));
+  if (!tab)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  memcpy (tab, dbf->bucket->h_table, n * sizeof (tab[0]));
+
+  /* Reinsert live elements into the emptied table.  The order of
+     insertion doesn't matter for linear probing. */
+  for (i = 0; i < n; i++)
+    dbf->bucket->h_table[i].hash_value = -1;
+  for (i = 0; i < n; i++)
+    {
+      if (tab[i].hash_value >= 0)
+	{
+	  int loc = tab[i].hash_value % n;
+	  while (dbf->bucket->h_table[loc].hash_value != -1)
+	    loc = (loc + 1) % n;
+	  dbf->bucket->h_table[loc] = tab[i];
+	}
+    }
+  dbf->cache_mru->ca_tombstones = 0;
+  dbf->cache_tombstones--;
+  _gdbm_current_bucket_changed (dbf);
+
+  /* Free the file space. */
+  for (i = 0; i < n; i++)
+    {
+      if (tab[i].hash_value == GDBM_TOMBSTONE
+	  && !_gdbm_elem_inline_p (dbf, &tab[i])
+	  && _gdbm_free (dbf, tab[i].data_pointer,
+			 tab[i].key_size + tab[i].data_size))
+	{
+	  free (tab);
+	  return -1;
+	}
+    }
+  free (tab);
+  return 0;
+}
+
+/* Reclaim all tombstones left by deletions in lazy mode and update
+   the file. */
+int
+gdbm_reclaim (GDBM_FILE dbf)
+{
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_DELETE, FALSE);
+      return -1;
+    }
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  if (_gdbm_cache_reclaim (dbf))
+    return -1;
+  return _gdbm_end_update (dbf);
+}
+
+/* Read the key of the element ELT of the current bucket into the buffer
+   *PBUF of *PSIZE bytes, reallocating it as necessary, and return a
+   pointer to it.  Keys kept inline are returned in place. */
+static char *
+read_key (GDBM_FILE dbf, bucket_element *elt, char **pbuf, size_t *psize)
+{
+  if (_gdbm_elem_inline_p (dbf, elt))
+    return _gdbm_elem_inline (elt);
+
+  if (elt->key_size > *psize)
+    {
+      char *p = realloc (*pbuf, elt->key_size);
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return NULL;
+	}
+      *pbuf = p;
+      *psize = elt->key_size;
+    }
+
+  if (gdbm_file_seek (dbf, elt->data_pointer, SEEK_SET) != elt->data_pointer)
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_LOOKUP);
+      _gdbm_fatal (dbf, _("lseek error"));
+      return NULL;
+    }
+  if (_gdbm_full_read (dbf, *pbuf, elt->key_size))
+    {
+      dbf->need_recovery = TRUE;
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return NULL;
+    }
+  return *pbuf;
+}
+
+/* Remove the element at ELEM_LOC in the current bucket of DBF, along with
+   its record, update the file and report the change. */
+int
+_gdbm_delete_elem (GDBM_FILE dbf, int elem_loc)
+{
+  bucket_element *elt = &dbf->bucket->h_table[elem_loc];
+  size_t keysize;
+  char *keybuf;
+  datum key, value;
+  int rc;
+
+  if (!_gdbm_change_reported_p (dbf))
+    return delete_elem (dbf, elem_loc);
+
+  /* Save the key, which is gone after the deletion. */
+  keysize = elt->key_size;
+  keybuf = malloc (keysize ? keysize : 1);
+  if (!keybuf)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  key.dptr = read_key (dbf, elt, &keybuf, &keysize);
+  if (!key.dptr)
+    {
+      free (keybuf);
+      return -1;
+    }
+  key.dsize = elt->key_size;
+  if (key.dptr != keybuf)
+    {
+      memcpy (keybuf, key.dptr, key.dsize);
+      key.dptr = keybuf;
+    }
+
+  rc = delete_elem (dbf, elem_loc);
+  if (rc == 0)
+    {
+      value.dptr = NULL;
+      value.dsize = 0;
+      rc = _gdbm_report_change (dbf, GDBM_CHANGE_DELETE, key, value, 0);
+    }
+  free (keybuf);
+  return rc;
+}
+
+/* Delete all records for which FN (KEY, VALUE, CLOSURE) returns non-zero.
+   Unless FLAGS contains GDBM_DELETE_VALUE, only keys are read from the
+   file, and FN gets a VALUE with NULL dptr.
+
+   Each bucket is visited once: the records matched in it are removed
+   together, and the bucket is written only once.  FN must not access
+   the database.
+
+   Return the number of records deleted, or -1 on error. */
+int
+gdbm_delete_if (GDBM_FILE dbf, gdbm_delete_fn fn, void *closure, int flags)
+{
+  int dir_index;
+  char *keybuf = NULL;
+  size_t keysize = 0;
+  int count = 0;
+  int rc = 0;
+
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_DELETE, FALSE);
+      return -1;
+    }
+  if (fn == NULL || (flags & ~GDBM_DELETE_VALUE))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return -1;
+    }
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  for (dir_index = 0; rc == 0 && dir_index < GDBM_DIR_COUNT (dbf);
+       dir_index = _gdbm_bucket_dir_end (dbf))
+    {
+      if (_gdbm_get_bucket (dbf, dir_index))
+	{
+	  rc = -1;
+	  break;
+	}
+
+      /* Visit the overflow chain, if any, as well. */
+      do
+	{
+	  int n = 0;
+	  int i;
+
+	  for (i = 0; i < dbf->header->bucket_elems; i++)
+	    {
+	      bucket_element *elt = &dbf->bucket->h_table[i];
+	      datum key, value;
+
+	      if (elt->hash_value < 0)
+		continue;
+
+	      if (flags & GDBM_DELETE_VALUE)
+		{
+		  key.dptr = _gdbm_read_entry (dbf, i);
+		  if (!key.dptr)
+		    {
+		      rc = -1;
+		      break;
+		    }
+		  value.dptr = key.dptr + elt->key_size;
+		  value.dsize = dbf->cache_mru->ca_data.data_size;
+		}
+	      else
+		{
+		  key.dptr = read_key (dbf, elt, &keybuf, &keysize);
+		  if (!key.dptr)
+		    {
+		      rc = -1;
+		      break;
+		    }
+		  value.dptr = NULL;
+		  value.dsize = 0;
+		}
+	      key.dsize = elt->key_size;
+
+	      if (fn (key, value, closure))
+		{
+		  /* Leave a tombstone for now, so that the remaining elements
+		     stay in place. */
+		  elt->hash_value = GDBM_TOMBSTONE;
+		  dbf->bucket->count--;
+		  if (dbf->cache_mru->ca_tombstones++ == 0)
+		    dbf->cache_tombstones++;
+		  n++;
+
+		  if (_gdbm_change_reported_p (dbf))
+		    {
+		      value.dptr = NULL;
+		      value.dsize = 0;
+		      if (_gdbm_report_change (dbf, GDBM_CHANGE_DELETE, key,
+					       value, 0))
+			{
+			  rc = -1;
+			  break;
+			}
+		    }
+		}
+	    }
+
+	  if (n > 0)
+	    {
+	      count += n;
+	      _gdbm_current_bucket_changed (dbf);
+	      if (!dbf->lazy_delete && _gdbm_bucket_reclaim (dbf))
+		rc = -1;
+	      else if (_gdbm_end_update (dbf))
+		rc = -1;
+	    }
+	}
+      while (rc == 0 && (rc = _gdbm_next_bucket (dbf)) == 0);
+      if (rc == 1)
+	rc = 0;
+    }
+
+  free (keybuf);
+  return rc ? rc : count;
+}
+
+/* Delete all records whose hash values have PREFIX in their BITS most
+   significant bits.  This is used to apply incremental dumps (see
+   gdbmdump.c).  Return 0 on success and -1 on error. */
+int
+_gdbm_delete_range (GDBM_FILE dbf, int prefix, int bits)
+{
+  int dir_bits = dbf->header->dir_bits;
+  int dir_index, end;
+  char *keybuf = NULL;
+  size_t keysize = 0;
+  int rc = 0;
+
+  if (bits >= dir_bits)
+    {
+      dir_index = prefix >> (bits - dir_bits);
+      end = dir_index + 1;
+    }
+  else
+    {
+      dir_index = prefix << (dir_bits - bits);
+      end = dir_index + (1 << (dir_bits - bits));
+    }
+
+  for (; rc == 0 && dir_index < end; dir_index = _gdbm_bucket_dir_end (dbf))
+    {
+      if (_gdbm_get_bucket (dbf, dir_index))
+	{
+	  rc = -1;
+	  break;
+	}
+
+      /* Visit the overflow chain, if any, as well. */
+      do
+	{
+	  int n = 0;
+	  int i;
+
+	  for (i = 0; i < dbf->header->bucket_elems; i++)
+	    {
+	      bucket_element *elt = &dbf->bucket->h_table[i];
+
+	      if (elt->hash_value >= 0
+		  && elt->hash_value >> (GDBM_HASH_BITS - bits) == prefix)
+		{
+		  if (_gdbm_change_reported_p (dbf))
+		    {
+		      datum key, value;
+
+		      key.dptr = read_key (dbf, elt, &keybuf, &keysize);
+		      if (!key.dptr)
+			{
+			  rc = -1;
+			  break;
+			}
+		      key.dsize = elt->key_size;
+		      value.dptr = NULL;
+		      value.dsize = 0;
+		      if (_gdbm_report_change (dbf, GDBM_CHANGE_DELETE, key,
+					       value, 0))
+			{
+			  rc = -1;
+			  break;
+			}
+		    }
+
+		  elt->hash_value = GDBM_TOMBSTONE;
+		  dbf->bucket->count--;
+		  if (dbf->cache_mru->ca_tombstones++ == 0)
+		    dbf->cache_tombstones++;
+		  n++;
+		}
+	    }
+
+	  if (n > 0)
+	    {
+	      _gdbm_current_bucket_changed (dbf);
+	      if (!dbf->lazy_delete && _gdbm_bucket_reclaim (dbf))
+		rc = -1;
+	      else if (_gdbm_end_update (dbf))
+		rc = -1;
+	    }
+	}
+      while (rc == 0 && (rc = _gdbm_next_bucket (dbf)) == 0);
+      if (rc == 1)
+	rc = 0;
+    }
+
+  free (keybuf);
+  return rc;
+}
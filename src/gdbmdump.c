@@ -20,16 +20,22 @@
 # include <pwd.h>
 # include <grp.h>
 # include <time.h>
+# if HAVE_ZLIB
+#  include <zlib.h>
+# endif
 
 static int
-print_datum (datum const *dat, unsigned char **bufptr,
+print_datum (datum const *dat, time_t expire, unsigned char **bufptr,
 	     size_t *bufsize, FILE *fp)
 {
   int rc;
   size_t len;
   unsigned char *p;
   
-  fprintf (fp, "#:len=%lu\n", (unsigned long) dat->dsize);
+  fprintf (fp, "#:len=%lu", (unsigned long) dat->dsize);
+  if (expire)
+    fprintf (fp, ",expire=%lu", (unsigned long) expire);
+  fputc ('\n', fp);
   rc = _gdbm_base64_encode ((unsigned char*) dat->dptr, dat->dsize,
 			    bufptr, bufsize, &len);
   if (rc)
@@ -50,25 +56,22 @@ print_datum (datum const *dat, unsigned char **bufptr,
   return 0;
 }
 
-int
-_gdbm_dump_ascii (GDBM_FILE dbf, FILE *fp)
+/* Print the header of an ASCII or packed dump of DBF to FP.  If SINCE
+   is not NULL, the dump is incremental, and *SINCE is the generation it
+   starts from. */
+static int
+print_header (GDBM_FILE dbf, FILE *fp, unsigned const *since)
 {
   time_t t;
   int fd;
   struct stat st;
   struct passwd *pw;
   struct group *gr;
-  datum key;
-  size_t count = 0;
-  unsigned char *buffer = NULL;
-  size_t bufsize = 0;
-  int rc = 0;
 
   fd = gdbm_fdesc (dbf);
   if (fstat (fd, &st))
     return GDBM_FILE_STAT_ERROR;
 
-  /* Print header */
   time (&t);
   fprintf (fp, "# GDBM dump file created by %s on %s",
 	   gdbm_version, ctime (&t));
@@ -84,8 +87,30 @@ _gdbm_dump_ascii (GDBM_FILE dbf, FILE *fp)
   if (gr)
     fprintf (fp, "group=%s,", gr->gr_name);
   fprintf (fp, "mode=%03o\n", st.st_mode & 0777);
-  fprintf (fp, "#:format=%s\n", dbf->xheader ? "numsync" : "standard");
+  fprintf (fp, "#:format=");
+  _gdbm_fmt_print (fp, _gdbm_format_flags (dbf));
+  fputc ('\n', fp);
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_GENERATION))
+    fprintf (fp, "#:generation=%u\n", dbf->xheader->numsync);
+  if (since)
+    fprintf (fp, "#:since=%u\n", *since);
   fprintf (fp, "# End of header\n");
+  return 0;
+}
+
+int
+_gdbm_dump_ascii (GDBM_FILE dbf, FILE *fp)
+{
+  datum key;
+  size_t count = 0;
+  unsigned char *buffer = NULL;
+  size_t bufsize = 0;
+  int rc = 0;
+
+  /* Print header */
+  rc = print_header (dbf, fp, NULL);
+  if (rc)
+    return rc;
   
   key = gdbm_firstkey (dbf);
 
@@ -95,8 +120,11 @@ _gdbm_dump_ascii (GDBM_FILE dbf, FILE *fp)
       datum data = gdbm_fetch (dbf, key);
       if (data.dptr)
  	{
-	  if ((rc = print_datum (&key, &buffer, &bufsize, fp)) ||
-	      (rc = print_datum (&data, &buffer, &bufsize, fp)))
+	  /* The fetch has left the record in the data cache. */
+	  time_t expire = dbf->cache_mru->ca_data.expire;
+
+	  if ((rc = print_datum (&key, 0, &buffer, &bufsize, fp)) ||
+	      (rc = print_datum (&data, expire, &buffer, &bufsize, fp)))
 	    {
 	      free (key.dptr);
 	      free (data.dptr);
@@ -133,6 +161,425 @@ _gdbm_dump_ascii (GDBM_FILE dbf, FILE *fp)
   return rc ? -1 : 0;
 }
 
+/* Packed dump format.
+
+   The file begins with the magic string _GDBM_PACKED_MAGIC, followed by
+   the same header as in ASCII dumps, terminated by an empty line.  The
+   rest of the file is a sequence of blocks of records.  Each block is:
+
+     1 byte    codec of the payload (GDBM_CODEC_NONE or GDBM_CODEC_ZLIB)
+     4 bytes   number of records in the block
+     4 bytes   size of the payload, as stored
+     4 bytes   size of the decoded payload
+     N bytes   payload
+     4 bytes   CRC-32 of the first 13 bytes of the block, followed by
+	       the decoded payload
+
+   Each record in the decoded payload is:
+
+     4 bytes   key size
+     4 bytes   data size
+     8 bytes   expiration time of the record, or 0
+     key and data
+
+   All numbers are stored MSB first.  A block with no records marks the
+   end of the dump. */
+
+struct packed_writer
+{
+  FILE *fp;
+  int compress;           /* Compress blocks. */
+  unsigned char *buf;     /* Payload of the current block. */
+  size_t size;            /* Size of buf. */
+  size_t level;           /* Number of bytes used in buf. */
+  uint32_t count;         /* Number of records in buf. */
+  unsigned char *zbuf;    /* Compressed payload. */
+  size_t zsize;           /* Size of zbuf. */
+};
+
+static void
+put_u32 (unsigned char *p, uint32_t n)
+{
+  p[0] = n >> 24;
+  p[1] = n >> 16;
+  p[2] = n >> 8;
+  p[3] = n;
+}
+
+/* Write out the current block. */
+static int
+packed_flush (struct packed_writer *w)
+{
+  unsigned char hdr[_GDBM_PACKED_BLOCK_HDR];
+  unsigned char crc[4];
+  unsigned char *payload = w->buf;
+  size_t size = w->level;
+
+  hdr[0] = GDBM_CODEC_NONE;
+#if HAVE_ZLIB
+  if (w->compress && w->level > 0)
+    {
+      uLongf zlen = compressBound (w->level);
+
+      if (zlen > w->zsize)
+	{
+	  unsigned char *p = realloc (w->zbuf, zlen);
+	  if (!p)
+	    return GDBM_MALLOC_ERROR;
+	  w->zbuf = p;
+	  w->zsize = zlen;
+	}
+      if (compress2 (w->zbuf, &zlen, w->buf, w->level,
+		     Z_DEFAULT_COMPRESSION) == Z_OK
+	  && zlen < w->level)
+	{
+	  hdr[0] = GDBM_CODEC_ZLIB;
+	  payload = w->zbuf;
+	  size = zlen;
+	}
+    }
+#endif
+  put_u32 (hdr + 1, w->count);
+  put_u32 (hdr + 5, size);
+  put_u32 (hdr + 9, w->level);
+  put_u32 (crc, _gdbm_crc32 (_gdbm_crc32 (0, hdr, sizeof (hdr)),
+			     w->buf, w->level));
+
+  if (fwrite (hdr, sizeof (hdr), 1, w->fp) != 1
+      || (size > 0 && fwrite (payload, size, 1, w->fp) != 1)
+      || fwrite (crc, sizeof (crc), 1, w->fp) != 1)
+    return GDBM_FILE_WRITE_ERROR;
+
+  w->level = 0;
+  w->count = 0;
+  return 0;
+}
+
+/* Add a record to the current block, starting a new one if it is
+   full.  DPTR points to KEY_SIZE bytes of key followed by DATA_SIZE
+   bytes of data. */
+static int
+packed_add (struct packed_writer *w, char const *dptr,
+	    int key_size, int data_size, time_t expire)
+{
+  size_t n = _GDBM_PACKED_REC_HDR + (size_t) key_size + data_size;
+  unsigned char *p;
+  int rc;
+
+  if (n > UINT32_MAX)
+    return GDBM_MALFORMED_DATA;
+  if (w->level > 0 && w->level + n > _GDBM_PACKED_BLOCK_SIZE
+      && (rc = packed_flush (w)) != 0)
+    return rc;
+  if (w->level + n > w->size)
+    {
+      size_t size = w->level + n;
+
+      if (size < _GDBM_PACKED_BLOCK_SIZE)
+	size = _GDBM_PACKED_BLOCK_SIZE;
+      p = realloc (w->buf, size);
+      if (!p)
+	return GDBM_MALLOC_ERROR;
+      w->buf = p;
+      w->size = size;
+    }
+
+  p = w->buf + w->level;
+  put_u32 (p, key_size);
+  put_u32 (p + 4, data_size);
+  _gdbm_expire_encode ((char *) p + 8, expire);
+  memcpy (p + _GDBM_PACKED_REC_HDR, dptr, (size_t) key_size + data_size);
+  w->level += n;
+  w->count++;
+  return 0;
+}
+
+struct elem_ref
+{
+  off_t adr;              /* Offset of the record in file. */
+  int loc;                /* Its location in the bucket. */
+};
+
+static int
+elem_ref_cmp (const void *a, const void *b)
+{
+  struct elem_ref const *ra = a;
+  struct elem_ref const *rb = b;
+  if (ra->adr < rb->adr)
+    return -1;
+  if (ra->adr > rb->adr)
+    return 1;
+  return 0;
+}
+
+/* Fill REFS with the locations of the live elements of the current
+   bucket of DBF, in the order of the offsets of their records.  Return
+   the number of elements. */
+static int
+bucket_refs (GDBM_FILE dbf, struct elem_ref *refs)
+{
+  int i, n = 0;
+
+  for (i = 0; i < dbf->header->bucket_elems; i++)
+    {
+      bucket_element *elt = &dbf->bucket->h_table[i];
+
+      /* Skip empty slots and tombstones. */
+      if (elt->hash_value < 0)
+	continue;
+      refs[n].adr = _gdbm_elem_inline_p (dbf, elt) ? 0 : elt->data_pointer;
+      refs[n].loc = i;
+      n++;
+    }
+  qsort (refs, n, sizeof (refs[0]), elem_ref_cmp);
+  return n;
+}
+
+/* Write all live records of DBF to W.  Buckets are visited in directory
+   order, and the records of each bucket in the order of their offsets.
+   Records are copied from the data cache, without allocating a copy
+   for each of them. */
+static int
+packed_records (GDBM_FILE dbf, struct packed_writer *w)
+{
+  struct elem_ref *refs;
+  int dir_count = GDBM_DIR_COUNT (dbf);
+  int d;
+  int rc = 0;
+
+  refs = calloc (dbf->header->bucket_elems, sizeof (refs[0]));
+  if (!refs)
+    return GDBM_MALLOC_ERROR;
+
+  for (d = 0; rc == 0 && d < dir_count; d = _gdbm_next_bucket_dir (dbf, d))
+    {
+      int i, n, next;
+
+      if (_gdbm_get_bucket (dbf, d))
+	{
+	  rc = gdbm_last_errno (dbf);
+	  break;
+	}
+
+      /* Visit the overflow chain, if any, as well. */
+      do
+	{
+	  n = bucket_refs (dbf, refs);
+	  for (i = 0; i < n; i++)
+	    {
+	      data_cache_elem *ca = &dbf->cache_mru->ca_data;
+	      char *dptr = _gdbm_read_entry (dbf, refs[i].loc);
+
+	      if (!dptr)
+		{
+		  rc = gdbm_last_errno (dbf);
+		  break;
+		}
+	      if (_gdbm_expired_p (ca->expire))
+		continue;
+	      rc = packed_add (w, dptr, ca->key_size, ca->data_size,
+			       ca->expire);
+	      if (rc)
+		break;
+	    }
+	}
+      while (rc == 0 && (next = _gdbm_next_bucket (dbf)) == 0);
+      if (rc == 0 && next == -1)
+	rc = gdbm_last_errno (dbf);
+    }
+
+  free (refs);
+  return rc;
+}
+
+static int
+_gdbm_dump_packed (GDBM_FILE dbf, FILE *fp, int compress)
+{
+  struct packed_writer w;
+  int rc;
+
+#if !HAVE_ZLIB
+  if (compress)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_NOT_SUPPORTED, FALSE);
+      return -1;
+    }
+#endif
+
+  memset (&w, 0, sizeof (w));
+  w.fp = fp;
+  w.compress = compress;
+
+  if (fwrite (_GDBM_PACKED_MAGIC, _GDBM_PACKED_MAGIC_LEN, 1, fp) != 1)
+    rc = GDBM_FILE_WRITE_ERROR;
+  else if ((rc = print_header (dbf, fp, NULL)) == 0)
+    {
+      fputc ('\n', fp);
+      rc = packed_records (dbf, &w);
+      /* Write out the last block and the end marker. */
+      if (rc == 0 && w.level > 0)
+	rc = packed_flush (&w);
+      if (rc == 0)
+	rc = packed_flush (&w);
+    }
+
+  free (w.buf);
+  free (w.zbuf);
+  if (rc)
+    {
+      GDBM_SET_ERRNO (dbf, rc, FALSE);
+      return -1;
+    }
+  return 0;
+}
+
+/* Return 1 if the bucket referenced by the directory entry D, or any
+   bucket of its overflow chain, has changed in generation SINCE or later,
+   0 if none has and -1 on error.  The first bucket of the chain must be
+   current, and is left current. */
+static int
+chain_changed_p (GDBM_FILE dbf, int d, unsigned since)
+{
+  int changed = 0;
+  int rc;
+
+  do
+    /* Buckets changed by this handle are not stamped until written. */
+    if (dbf->cache_mru->ca_changed
+	|| _gdbm_bucket_generation (dbf, dbf->bucket) >= since)
+      {
+	changed = 1;
+	break;
+      }
+  while ((rc = _gdbm_next_bucket (dbf)) == 0);
+  if (!changed && rc == -1)
+    return -1;
+  if (dbf->chain_pos > 0 && _gdbm_get_bucket (dbf, d))
+    return -1;
+  return changed;
+}
+
+/* Incremental dumps.
+
+   An incremental dump is an ASCII dump of the buckets written in the
+   given generation or later (see GDBM_FEAT_GENERATION).  The records of
+   each such bucket are preceded by the parameter "clear=PREFIX/BITS",
+   which tells gdbm_load to delete the records whose hash values have
+   PREFIX in their BITS most significant bits, i.e. those that belonged
+   to the bucket, before loading the new ones.  This way deletions are
+   carried over as well.  The header of the dump contains the "since"
+   parameter, and its records replace existing ones on loading. */
+static int
+_gdbm_dump_delta (GDBM_FILE dbf, FILE *fp, unsigned since)
+{
+  struct elem_ref *refs;
+  unsigned char *buffer = NULL;
+  size_t bufsize = 0;
+  size_t count = 0;
+  int dir_count = GDBM_DIR_COUNT (dbf);
+  int d;
+  int rc;
+
+  rc = print_header (dbf, fp, &since);
+  if (rc)
+    return rc;
+
+  refs = calloc (dbf->header->bucket_elems, sizeof (refs[0]));
+  if (!refs)
+    return GDBM_MALLOC_ERROR;
+
+  for (d = 0; rc == 0 && d < dir_count; d = _gdbm_next_bucket_dir (dbf, d))
+    {
+      int bits, i, n, next;
+
+      if (_gdbm_get_bucket (dbf, d))
+	{
+	  rc = gdbm_last_errno (dbf);
+	  break;
+	}
+      switch (chain_changed_p (dbf, d, since))
+	{
+	case 0:
+	  continue;
+
+	case -1:
+	  rc = gdbm_last_errno (dbf);
+	  continue;
+	}
+
+      bits = dbf->bucket->bucket_bits;
+      fprintf (fp, "#:clear=%d/%d\n",
+	       d >> (dbf->header->dir_bits - bits), bits);
+
+      /* The records of the whole overflow chain go under a single
+	 "clear" parameter. */
+      do
+	{
+	  n = bucket_refs (dbf, refs);
+	  for (i = 0; i < n; i++)
+	    {
+	      data_cache_elem *ca = &dbf->cache_mru->ca_data;
+	      datum key, data;
+
+	      key.dptr = _gdbm_read_entry (dbf, refs[i].loc);
+	      if (!key.dptr)
+		{
+		  rc = gdbm_last_errno (dbf);
+		  break;
+		}
+	      if (_gdbm_expired_p (ca->expire))
+		continue;
+	      key.dsize = ca->key_size;
+	      data.dptr = key.dptr + ca->key_size;
+	      data.dsize = ca->data_size;
+	      if ((rc = print_datum (&key, 0, &buffer, &bufsize, fp)) != 0
+		  || (rc = print_datum (&data, ca->expire, &buffer, &bufsize,
+					fp)) != 0)
+		break;
+	      count++;
+	    }
+	}
+      while (rc == 0 && (next = _gdbm_next_bucket (dbf)) == 0);
+      if (rc == 0 && next == -1)
+	rc = gdbm_last_errno (dbf);
+    }
+
+  fprintf (fp, "#:count=%lu\n", (unsigned long) count);
+  fprintf (fp, "# End of data\n");
+
+  free (refs);
+  free (buffer);
+  return rc;
+}
+
+/* Write to FP an incremental ASCII dump of DBF, containing the changes
+   made in generation SINCE and later.  DBF must have been created with
+   the GDBM_GENERATION flag. */
+int
+gdbm_dump_delta_to_file (GDBM_FILE dbf, FILE *fp, unsigned since)
+{
+  int rc;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (!_gdbm_feature_p (dbf, GDBM_FEAT_GENERATION))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_NOT_SUPPORTED, FALSE);
+      return -1;
+    }
+
+  rc = _gdbm_dump_delta (dbf, fp, since);
+  if (rc == 0 && ferror (fp))
+    rc = GDBM_FILE_WRITE_ERROR;
+  if (rc)
+    {
+      GDBM_SET_ERRNO (dbf, rc, FALSE);
+      return -1;
+    }
+  return 0;
+}
+
 int
 gdbm_dump_to_file (GDBM_FILE dbf, FILE *fp, int format)
 {
@@ -151,6 +598,11 @@ gdbm_dump_to_file (GDBM_FILE dbf, FILE *fp, int format)
       rc = _gdbm_dump_ascii (dbf, fp);
       break;
 
+    case GDBM_DUMP_FMT_PACKED:
+    case GDBM_DUMP_FMT_PACKED | GDBM_DUMP_COMPRESS:
+      rc = _gdbm_dump_packed (dbf, fp, format & GDBM_DUMP_COMPRESS);
+      break;
+
     default:
       GDBM_SET_ERRNO (NULL, GDBM_BAD_OPEN_FLAGS, FALSE);
       return EINVAL;
@@ -145,6 +145,9 @@ const char * const gdbm_errlist[_GDBM_MAX_ERRNO+1] = {
   [GDBM_ERR_SNAPSHOT_CLONE]     = N_("Reflink failed"),
   [GDBM_ERR_REALPATH]           = N_("Failed to resolve real path name"),
   [GDBM_ERR_USAGE]              = N_("Function usage error"),
+  [GDBM_NOT_SUPPORTED]          = N_("Feature not supported"),
+  [GDBM_BAD_RECORD]             = N_("Malformed data record"),
+  [GDBM_BAD_CHECKSUM]           = N_("Checksum mismatch"),
 };
 
 const char *
@@ -51,7 +51,7 @@ gdbm_fetch (GDBM_FILE dbf, datum key)
   if (elem_loc >= 0)
     {
       /* This is the item.  Return the associated data. */
-      return_val.dsize = dbf->bucket->h_table[elem_loc].data_size;
+      return_val.dsize = dbf->cache_mru->ca_data.data_size;
       if (return_val.dsize == 0)
 	return_val.dptr = (char *) malloc (1);
       else
@@ -0,0 +1,258 @@
+/* gdbmjournal.c - Reporting changes to the database. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+/* Each successful change to the database is reported to the change hook,
+   if one is installed, and appended to the journal, if one is open.
+
+   The journal is a sequence of entries in the ASCII dump format (see
+   gdbmdump.c).  A stored record is represented by its key and value,
+   exactly as in a dump.  A deleted record is represented by its key
+   alone, with the "op=delete" parameter.  A journal started in an empty
+   file begins with a header carrying the "journal" parameter, which makes
+   gdbm_load replace existing records.  Thus, a journal can be applied to
+   another database by gdbm_load.
+
+   Each entry is built in memory and appended by a single write call.
+   The size of the journal file after a change is thus an entry boundary:
+   a consumer can remember it, and later apply the rest of the file to
+   bring its copy up to date. */
+
+struct gdbm_journal
+{
+  int fd;                /* Journal file descriptor. */
+  char *buf;             /* Entry being built. */
+  size_t size;           /* Size of buf. */
+  size_t level;          /* Number of bytes used in buf. */
+  unsigned char *b64;    /* Base64 encoding buffer. */
+  size_t b64size;        /* Its size. */
+};
+
+static char const journal_header[] =
+  "# GDBM journal\n"
+  "#:version=1.1\n"
+  "#:journal=1\n"
+  "# End of header\n";
+
+/* Install FN as the change hook of DBF.  After each change to DBF, it is
+   called with the kind of the change (GDBM_CHANGE_STORE or
+   GDBM_CHANGE_DELETE), the key, the new value of the record and its
+   expiration time.  For deleted records, the value has NULL dptr.  A
+   NULL FN removes the hook. */
+void
+gdbm_set_change_hook (GDBM_FILE dbf, gdbm_change_fn fn, void *closure)
+{
+  dbf->change_hook = fn;
+  dbf->change_closure = closure;
+}
+
+void
+_gdbm_journal_free (GDBM_FILE dbf)
+{
+  if (dbf->journal)
+    {
+      free (dbf->journal->buf);
+      free (dbf->journal->b64);
+      free (dbf->journal);
+      dbf->journal = NULL;
+    }
+}
+
+/* Make sure the entry buffer of JR can hold SIZE more bytes. */
+static int
+journal_reserve (struct gdbm_journal *jr, size_t size)
+{
+  if (jr->level + size > jr->size)
+    {
+      size_t n = jr->size ? jr->size : 512;
+      char *p;
+
+      while (n < jr->level + size)
+	n *= 2;
+      p = realloc (jr->buf, n);
+      if (!p)
+	return GDBM_MALLOC_ERROR;
+      jr->buf = p;
+      jr->size = n;
+    }
+  return 0;
+}
+
+/* Append datum DAT to the entry being built in JR, preceded by its
+   parameter line.  OP is the operation parameter, or NULL.  EXPIRE is
+   the expiration time, if not 0. */
+static int
+journal_datum (struct gdbm_journal *jr, char const *op, datum const *dat,
+	       time_t expire)
+{
+  char hdr[128];
+  size_t len;
+  unsigned char *p;
+  int n, rc;
+
+  n = snprintf (hdr, sizeof hdr, "#:%s%slen=%lu",
+		op ? op : "", op ? "," : "", (unsigned long) dat->dsize);
+  if (expire)
+    n += snprintf (hdr + n, sizeof hdr - n, ",expire=%lu",
+		   (unsigned long) expire);
+  hdr[n++] = '\n';
+  rc = _gdbm_base64_encode ((unsigned char *) dat->dptr, dat->dsize,
+			    &jr->b64, &jr->b64size, &len);
+  if (rc)
+    return rc;
+  rc = journal_reserve (jr, n + len + len / _GDBM_MAX_DUMP_LINE_LEN + 1);
+  if (rc)
+    return rc;
+
+  memcpy (jr->buf + jr->level, hdr, n);
+  jr->level += n;
+  p = jr->b64;
+  while (len)
+    {
+      size_t k = len;
+      if (k > _GDBM_MAX_DUMP_LINE_LEN)
+	k = _GDBM_MAX_DUMP_LINE_LEN;
+      memcpy (jr->buf + jr->level, p, k);
+      jr->level += k;
+      jr->buf[jr->level++] = '\n';
+      len -= k;
+      p += k;
+    }
+  return 0;
+}
+
+/* Write SIZE bytes from BUF to the journal of DBF.  On error, journaling
+   is stopped, since the journal is no longer in sync with the
+   database. */
+static int
+journal_write (GDBM_FILE dbf, char const *buf, size_t size)
+{
+  int fd = dbf->journal->fd;
+
+  while (size)
+    {
+      ssize_t n = write (fd, buf, size);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      if (n == 0)
+	{
+	  errno = ENOSPC;
+	  break;
+	}
+      buf += n;
+      size -= n;
+    }
+  if (size == 0 && (dbf->fast_write || fsync (fd) == 0))
+    return 0;
+
+  _gdbm_journal_free (dbf);
+  GDBM_SET_ERRNO (dbf, GDBM_FILE_WRITE_ERROR, FALSE);
+  return -1;
+}
+
+/* Start appending the changes to DBF to the file FD, which must be open
+   for writing in append mode.  If the file is empty, the journal header
+   is written first.  FD is not closed by GDBM.  If FD is -1, journaling
+   is stopped. */
+int
+gdbm_set_journal (GDBM_FILE dbf, int fd)
+{
+  struct stat st;
+
+  _gdbm_journal_free (dbf);
+  if (fd == -1)
+    return 0;
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+  if (fstat (fd, &st))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_STAT_ERROR, FALSE);
+      return -1;
+    }
+
+  dbf->journal = calloc (1, sizeof (*dbf->journal));
+  if (!dbf->journal)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  dbf->journal->fd = fd;
+
+  if (st.st_size == 0)
+    return journal_write (dbf, journal_header, sizeof journal_header - 1);
+  return 0;
+}
+
+/* Report the change OP to the record KEY, whose new value is VALUE and
+   expiration time EXPIRE. */
+int
+_gdbm_report_change (GDBM_FILE dbf, int op, datum key, datum value,
+		     time_t expire)
+{
+  struct gdbm_journal *jr = dbf->journal;
+
+  if (dbf->change_hook)
+    dbf->change_hook (op, key, value, expire, dbf->change_closure);
+
+  if (jr)
+    {
+      int rc;
+
+      jr->level = 0;
+      if (op == GDBM_CHANGE_DELETE)
+	rc = journal_datum (jr, "op=delete", &key, 0);
+      else if ((rc = journal_datum (jr, NULL, &key, 0)) == 0)
+	rc = journal_datum (jr, NULL, &value, expire);
+      if (rc)
+	{
+	  _gdbm_journal_free (dbf);
+	  GDBM_SET_ERRNO (dbf, rc, FALSE);
+	  return -1;
+	}
+      return journal_write (dbf, jr->buf, jr->level);
+    }
+  return 0;
+}
+
+/* Report storing KEY, which has been modified without going through
+   _gdbm_store_elem.  Its value is looked up in the database. */
+int
+_gdbm_report_stored (GDBM_FILE dbf, datum key)
+{
+  char *dptr;
+  datum value;
+
+  if (_gdbm_findkey (dbf, key, &dptr, NULL) == -1)
+    return -1;
+  value.dptr = dptr;
+  value.dsize = dbf->cache_mru->ca_data.data_size;
+  return _gdbm_report_change (dbf, GDBM_CHANGE_STORE, key, value,
+			      dbf->cache_mru->ca_data.expire);
+}
@@ -20,6 +20,9 @@
 # include <sys/types.h>
 # include <pwd.h>
 # include <grp.h>
+# if HAVE_ZLIB
+#  include <zlib.h>
+# endif
 
 struct datbuf
 {
@@ -32,10 +35,22 @@ struct dump_file
   FILE *fp;
   size_t line;
 
-  char *linebuf;
-  size_t lbsize;
-  size_t lblevel;
-  
+  /* Input buffer.  The dump is read in large chunks, and lines are
+     parsed in place. */
+  char *ibuf;
+  size_t ibsize;
+  size_t ibstart;        /* Start of the unread data. */
+  size_t iblevel;        /* End of the data. */
+  off_t iboff;           /* Input offset of ibuf[0]. */
+
+  /* The current line, if have_line is set.  It is NUL-terminated and
+     remains in the input buffer until consumed. */
+  char *cur_line;
+  size_t cur_len;
+  int have_line;
+  int nonl;              /* The last line lacks a newline. */
+  int err;               /* Input buffer allocation error. */
+
   char *buffer;
   size_t bufsize;
   size_t buflevel;
@@ -46,16 +61,34 @@ struct dump_file
   char *header;
 };
 
+/* Size of a chunk read from the dump file. */
+#define DUMP_CHUNK_SIZE 65536
+
 static void
 dump_file_free (struct dump_file *file)
 {
-  free (file->linebuf);
+  free (file->ibuf);
   free (file->buffer);
   free (file->data[0].buffer);
   free (file->data[1].buffer);
   free (file->header);
 }
 
+/* Make sure the buffer DB is at least SIZE bytes long. */
+static int
+datbuf_alloc (struct datbuf *db, size_t size)
+{
+  if (size > db->size)
+    {
+      unsigned char *p = realloc (db->buffer, size);
+      if (!p)
+	return GDBM_MALLOC_ERROR;
+      db->buffer = p;
+      db->size = size;
+    }
+  return 0;
+}
+
 static const char *
 getparm (const char *buf, const char *parm)
 {
@@ -73,99 +106,253 @@ getparm (const char *buf, const char *parm)
   return NULL;
 }
 
-static size_t
-get_dump_line (struct dump_file *file)
+/* Read the next chunk of the dump into the input buffer, retaining the
+   unread data.  One byte is always left free for terminating the last
+   line.  Return 1 if new data were read, 0 at the end of file and -1 on
+   error. */
+static int
+fill_input (struct dump_file *file)
 {
-  char buf[80];
-  
-  if (file->lblevel == 0)
+  size_t n = file->iblevel - file->ibstart;
+
+  if (file->ibstart > 0)
+    {
+      memmove (file->ibuf, file->ibuf + file->ibstart, n);
+      file->iboff += file->ibstart;
+      file->ibstart = 0;
+      file->iblevel = n;
+    }
+  if (file->ibsize - n < DUMP_CHUNK_SIZE / 2)
+    {
+      size_t size = file->ibsize + DUMP_CHUNK_SIZE;
+      char *p = realloc (file->ibuf, size);
+      if (!p)
+	{
+	  file->err = GDBM_MALLOC_ERROR;
+	  return -1;
+	}
+      file->ibuf = p;
+      file->ibsize = size;
+    }
+  n = fread (file->ibuf + file->iblevel, 1,
+	     file->ibsize - file->iblevel - 1, file->fp);
+  file->iblevel += n;
+  if (n == 0 && ferror (file->fp))
+    return -1;
+  return n > 0;
+}
+
+/* Return the error code of the last input operation on FILE. */
+static int
+dump_error (struct dump_file *file)
+{
+  if (file->err)
+    return file->err;
+  return ferror (file->fp) ? GDBM_FILE_READ_ERROR : 0;
+}
+
+/* Return true if the whole dump has been consumed. */
+static int
+dump_eof (struct dump_file *file)
+{
+  return !file->have_line && file->ibstart == file->iblevel
+         && feof (file->fp);
+}
+
+/* Return the current line of the dump, without the trailing newline, and
+   store its length in *PLEN.  Read the next line, if the current one has
+   been consumed.  Return NULL at the end of file or on error. */
+static char *
+get_dump_line (struct dump_file *file, size_t *plen)
+{
+  if (!file->have_line)
     {
-      while (fgets (buf, sizeof buf, file->fp))
+      size_t scanned = 0;
+      char *nl;
+
+      while (1)
 	{
-	  size_t n = strlen (buf);
-	  
-	  if (buf[n-1] == '\n')
+	  size_t avail = file->iblevel - file->ibstart;
+
+	  if (avail > scanned
+	      && (nl = memchr (file->ibuf + file->ibstart + scanned, '\n',
+			       avail - scanned)) != NULL)
 	    {
 	      file->line++;
-	      --n;
-	    }
-	  
-	  if (n + 1 + file->lblevel > file->lbsize)
-	    {
-	      size_t s = ((file->lblevel + n + _GDBM_MAX_DUMP_LINE_LEN)
-			  / _GDBM_MAX_DUMP_LINE_LEN)
-		          * _GDBM_MAX_DUMP_LINE_LEN;
-	      char *newp = realloc (file->linebuf, s);
-	      if (!newp)
-		return GDBM_MALLOC_ERROR;
-	      file->linebuf = newp;
-	      file->lbsize = s;
+	      break;
 	    }
-	  
-	  memcpy (file->linebuf + file->lblevel, buf, n);
-	  file->lblevel += n;
-	  if (buf[n])
+	  scanned = avail;
+	  switch (fill_input (file))
 	    {
-	      file->linebuf[file->lblevel] = 0;
-	      break;
+	    case 1:
+	      continue;
+	    case -1:
+	      return NULL;
 	    }
+	  if (scanned == 0)
+	    return NULL;
+	  /* Last line lacks a newline. */
+	  nl = file->ibuf + file->iblevel;
+	  file->nonl = 1;
+	  break;
 	}
+
+      *nl = 0;
+      file->cur_line = file->ibuf + file->ibstart;
+      file->cur_len = nl - file->cur_line;
+      file->ibstart = file->cur_len + 1 + file->ibstart;
+      if (file->ibstart > file->iblevel)
+	file->ibstart = file->iblevel;
+      file->have_line = 1;
     }
-  return file->lblevel;
+  *plen = file->cur_len;
+  return file->cur_line;
 }
 
+/* Return the input offset of the first unconsumed line of FILE. */
+static off_t
+dump_tell (struct dump_file *file)
+{
+  return file->iboff
+         + (file->have_line ? file->cur_line - file->ibuf : file->ibstart);
+}
+
+/* Mark the current line as consumed. */
+static inline void
+consume_line (struct dump_file *file)
+{
+  file->have_line = 0;
+}
+
+/* Read SIZE bytes from FILE into BUF. */
 static int
-get_data (struct dump_file *file)
+dump_read (struct dump_file *file, void *buf, size_t size)
 {
+  size_t n = file->iblevel - file->ibstart;
+
+  if (n > size)
+    n = size;
+  if (n > 0)
+    {
+      memcpy (buf, file->ibuf + file->ibstart, n);
+      file->ibstart += n;
+    }
+  if (n < size && fread ((char *) buf + n, size - n, 1, file->fp) != 1)
+    return ferror (file->fp) ? GDBM_FILE_READ_ERROR : GDBM_MALFORMED_DATA;
+  return 0;
+}
+
+/* Decode SIZE bytes of base64 input IN, appending the result to DB at
+   offset *PLEVEL. */
+static int
+decode_chunk (struct datbuf *db, size_t *plevel,
+	      unsigned char const *in, size_t size)
+{
+  unsigned char *out;
+  size_t outsize, inbytes, outbytes;
+  int rc;
+
+  /* Make sure the decoder doesn't need to reallocate the buffer. */
+  rc = datbuf_alloc (db, *plevel + size);
+  if (rc)
+    return rc;
+  out = db->buffer + *plevel;
+  outsize = db->size - *plevel;
+  rc = _gdbm_base64_decode (in, size, &out, &outsize, &inbytes, &outbytes);
+  if (rc)
+    return rc;
+  if (inbytes != size)
+    return GDBM_MALFORMED_DATA;
+  *plevel += outbytes;
+  return 0;
+}
+
+/* Read the base64 lines of a datum from FILE and decode them into DB.
+   Lines are decoded directly from the input buffer.  Return the number
+   of decoded bytes in *PLEN. */
+static int
+get_data (struct dump_file *file, struct datbuf *db, size_t *plen)
+{
+  char *line;
   size_t n;
+  unsigned char carry[4];
+  size_t ncarry = 0;
+  size_t level = 0;
+  int rc;
 
-  file->buflevel = 0;
   file->parmc = 0;
   
-  while ((n = get_dump_line (file)))
+  while ((line = get_dump_line (file, &n)) != NULL)
     {
-      if (file->linebuf[0] == '#')
-	return 0;
-      if (n + file->buflevel > file->bufsize)
+      unsigned char *p = (unsigned char *) line;
+      size_t k;
+
+      if (n == 0)
 	{
-	  size_t s = ((file->buflevel + n + _GDBM_MAX_DUMP_LINE_LEN - 1)
-		      / _GDBM_MAX_DUMP_LINE_LEN)
-	              * _GDBM_MAX_DUMP_LINE_LEN;
-	  char *newp = realloc (file->buffer, s);
-	  if (!newp)
-	    return GDBM_MALLOC_ERROR;
-	  file->buffer = newp;
-	  file->bufsize = s;
+	  consume_line (file);
+	  break;
 	}
-      memcpy (file->buffer + file->buflevel, file->linebuf, n);
-      file->buflevel += n;
-      file->lblevel = 0;
+      if (line[0] == '#')
+	break;
+
+      /* Complete the quartet left over from the previous line. */
+      if (ncarry)
+	{
+	  k = 4 - ncarry;
+	  if (k > n)
+	    k = n;
+	  memcpy (carry + ncarry, p, k);
+	  ncarry += k;
+	  p += k;
+	  n -= k;
+	  if (ncarry == 4)
+	    {
+	      if ((rc = decode_chunk (db, &level, carry, 4)) != 0)
+		return rc;
+	      ncarry = 0;
+	    }
+	}
+
+      k = n - n % 4;
+      if (k > 0 && (rc = decode_chunk (db, &level, p, k)) != 0)
+	return rc;
+      memcpy (carry + ncarry, p + k, n - k);
+      ncarry += n - k;
+      consume_line (file);
     }
-  return ferror (file->fp) ? GDBM_FILE_READ_ERROR : 0;
+  if ((rc = dump_error (file)) != 0)
+    return rc;
+  if (ncarry)
+    return GDBM_MALFORMED_DATA;
+  *plen = level;
+  return 0;
 }
 
 static int
 get_parms (struct dump_file *file)
 {
+  char *p;
   size_t n;
 
   file->buflevel = 0;
   file->parmc = 0;
-  while ((n = get_dump_line (file)))
+  while ((p = get_dump_line (file, &n)) != NULL)
     {
-      char *p;
-
-      p = file->linebuf;
+      if (n == 0)
+	{
+	  consume_line (file);
+	  break;
+	}
       if (*p != '#')
-	return 0;
-      if (n == 0 || *++p != ':')
+	break;
+      if (*++p != ':')
 	{
-	  file->lblevel = 0;
+	  consume_line (file);
 	  continue;
 	}
       if (--n == 0)
 	{
-	  file->lblevel = 0;
+	  consume_line (file);
 	  continue;
 	}
       
@@ -217,13 +404,13 @@ get_parms (struct dump_file *file)
 	  else
 	    break;
 	}
-      file->lblevel = 0;
+      consume_line (file);
     }
 
   if (file->buffer)
     file->buffer[file->buflevel] = 0;
   
-  return ferror (file->fp) ? GDBM_FILE_READ_ERROR : 0;
+  return dump_error (file);
 }
 
 static int
@@ -247,11 +434,39 @@ get_len (const char *param, size_t *plen)
   return GDBM_MALFORMED_DATA;
 }
 
+/* Get the expiration time of a record from its parameters PARAM. */
+static int
+get_expire (const char *param, time_t *pexpire)
+{
+  unsigned long n;
+  const char *p = getparm (param, "expire");
+  char *end;
+
+  if (!p)
+    {
+      *pexpire = 0;
+      return 0;
+    }
+
+  errno = 0;
+  n = strtoul (p, &end, 10);
+  if (*end == 0 && errno == 0)
+    {
+      *pexpire = n;
+      return 0;
+    }
+
+  return GDBM_MALFORMED_DATA;
+}
+
+/* Read the Nth datum of a record from FILE into DAT.  If PEXPIRE is not
+   NULL, store there the expiration time of the record. */
 static int
-read_record (struct dump_file *file, char *param, int n, datum *dat)
+read_record (struct dump_file *file, char *param, int n, datum *dat,
+	     time_t *pexpire)
 {
   int rc;
-  size_t len, consumed_size, decoded_size;
+  size_t len, decoded_size;
 
   if (!param)
     {
@@ -265,18 +480,17 @@ read_record (struct dump_file *file, char *param, int n, datum *dat)
   rc = get_len (param, &len);
   if (rc)
     return rc;
-  dat->dsize = len; /* FIXME: data type mismatch */
-  rc = get_data (file);
+  if (pexpire && (rc = get_expire (param, pexpire)) != 0)
+    return rc;
+  rc = datbuf_alloc (&file->data[n], len ? len : 1);
   if (rc)
     return rc;
-
-  rc = _gdbm_base64_decode ((unsigned char *)file->buffer, file->buflevel,
-			    &file->data[n].buffer, &file->data[n].size,
-			    &consumed_size, &decoded_size);
+  rc = get_data (file, &file->data[n], &decoded_size);
   if (rc)
     return rc;
-  if (consumed_size != file->buflevel || decoded_size != len)
+  if (decoded_size != len)
     return GDBM_MALFORMED_DATA;
+  dat->dsize = len; /* FIXME: data type mismatch */
   dat->dptr = (void*) file->data[n].buffer;
   return 0;
 }
@@ -390,25 +604,328 @@ _set_gdbm_meta_info (GDBM_FILE dbf, char *param, int meta_mask)
   return 0;
 }
 
+/* Database format names. */
+static struct
+{
+  char const *name;
+  int flags;
+} format_tab[] = {
+  { "standard",    0 },
+  { "numsync",     GDBM_NUMSYNC },
+  { "fingerprint", GDBM_NUMSYNC | GDBM_FINGERPRINT },
+  { "inline",      GDBM_NUMSYNC | GDBM_INLINE },
+  { "compress",    GDBM_NUMSYNC | GDBM_COMPRESS },
+  { "expire",      GDBM_NUMSYNC | GDBM_EXPIRE },
+  { "generation",  GDBM_NUMSYNC | GDBM_GENERATION },
+  { "chain",       GDBM_NUMSYNC | GDBM_CHAIN },
+  { NULL }
+};
+
+/* Convert the format description STR to gdbm_open flags.  STR is a
+   comma-separated list of format names from format_tab. */
 int
 _gdbm_str2fmt (char const *str)
 {
-  if (strcmp (str, "numsync") == 0)
-    return GDBM_NUMSYNC;
-  if (strcmp (str, "standard") == 0)
+  int flags = 0;
+
+  do
+    {
+      size_t len = strcspn (str, ",");
+      int i;
+
+      for (i = 0; format_tab[i].name; i++)
+	if (strlen (format_tab[i].name) == len
+	    && memcmp (format_tab[i].name, str, len) == 0)
+	  break;
+      if (!format_tab[i].name)
+	return -1;
+      flags |= format_tab[i].flags;
+      str += len;
+    }
+  while (*str++);
+  
+  return flags;
+}
+
+/* Print the format description of FLAGS (see _gdbm_str2fmt) to FP.
+   The description is quoted if it consists of several names. */
+void
+_gdbm_fmt_print (FILE *fp, int flags)
+{
+  int i, n = 0, quote;
+
+  for (i = 0; format_tab[i].name; i++)
+    if ((format_tab[i].flags & GDBM_FEATURE_FLAGS)
+	&& (flags & format_tab[i].flags) == format_tab[i].flags)
+      n++;
+
+  if (n == 0)
+    {
+      fputs ((flags & GDBM_NUMSYNC) ? "numsync" : "standard", fp);
+      return;
+    }
+
+  quote = n > 1;
+  if (quote)
+    fputc ('"', fp);
+  for (i = 0; format_tab[i].name; i++)
+    if ((format_tab[i].flags & GDBM_FEATURE_FLAGS)
+	&& (flags & format_tab[i].flags) == format_tab[i].flags)
+      {
+	fputs (format_tab[i].name, fp);
+	if (--n)
+	  fputc (',', fp);
+      }
+  if (quote)
+    fputc ('"', fp);
+}
+
+/* Records are loaded with bucket writes deferred, as with an unlimited
+   flush budget (see _gdbm_end_update): a bucket is written when it is
+   evicted from the cache, or at the end of the load, instead of after
+   each stored record.  The previous budget of DBF is saved in *BUDGET. */
+static void
+load_begin (GDBM_FILE dbf, size_t *budget)
+{
+  *budget = dbf->flush_budget;
+  dbf->flush_budget = SIZE_MAX;
+}
+
+/* Restore the flush budget of DBF and write out the changes, as
+   required by it. */
+static int
+load_end (GDBM_FILE dbf, size_t budget)
+{
+  dbf->flush_budget = budget;
+  return _gdbm_end_update (dbf);
+}
+
+/* Store a record loaded from a dump file in DBF.  Expired records are
+   skipped.  Expiration times are dropped when loading into an existing
+   database without the GDBM_EXPIRE feature. */
+static int
+load_record (GDBM_FILE dbf, datum key, datum content, int replace,
+	     time_t expire)
+{
+  if (_gdbm_expired_p (expire))
     return 0;
-  return -1;
+  if (!_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+    expire = 0;
+  if (gdbm_store_expire (dbf, key, content, replace, expire))
+    return gdbm_errno;
+  return 0;
+}
+
+/* Delete a record, as requested by a journal entry (see gdbmjournal.c).
+   A missing record is not an error. */
+static int
+delete_record (GDBM_FILE dbf, datum key)
+{
+  if (gdbm_delete (dbf, key))
+    {
+      if (gdbm_errno != GDBM_ITEM_NOT_FOUND)
+	return gdbm_errno;
+      gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+    }
+  return 0;
+}
+
+/* Delete the records in the hash ranges given by the "clear" parameters
+   in PARAM (see gdbmdump.c). */
+static int
+clear_ranges (GDBM_FILE dbf, const char *param)
+{
+  for (; *param; param += strlen (param) + 1)
+    {
+      unsigned long prefix, bits;
+      char *end;
+
+      if (strncmp (param, "clear=", 6))
+	continue;
+      errno = 0;
+      prefix = strtoul (param + 6, &end, 10);
+      if (errno || *end != '/')
+	return GDBM_MALFORMED_DATA;
+      bits = strtoul (end + 1, &end, 10);
+      if (errno || *end || bits > GDBM_HASH_BITS || (prefix >> bits) != 0)
+	return GDBM_MALFORMED_DATA;
+      if (_gdbm_delete_range (dbf, prefix, bits))
+	return gdbm_errno;
+    }
+  return 0;
+}
+
+static int
+load_ascii_data (struct dump_file *file, GDBM_FILE dbf, int replace)
+{
+  char *param = file->header;
+  int rc;
+
+  while (1)
+    {
+      datum key, content;
+      time_t expire;
+      const char *op;
+
+      if (!param)
+	{
+	  rc = get_parms (file);
+	  if (rc)
+	    break;
+	  if (file->parmc == 0)
+	    {
+	      if (!dump_eof (file))
+		rc = GDBM_ITEM_NOT_FOUND;
+	      break;
+	    }
+	  param = file->buffer;
+	}
+      rc = clear_ranges (dbf, param);
+      if (rc)
+	break;
+
+      op = getparm (param, "op");
+      rc = read_record (file, param, 0, &key, NULL);
+      if (rc)
+	{
+	  if (rc == GDBM_ITEM_NOT_FOUND && dump_eof (file))
+	    rc = 0;
+	  break;
+	}
+      param = NULL;
+
+      if (op)
+	{
+	  if (strcmp (op, "delete"))
+	    rc = GDBM_MALFORMED_DATA;
+	  else
+	    rc = delete_record (dbf, key);
+	  if (rc)
+	    break;
+	  continue;
+	}
+
+      rc = read_record (file, NULL, 1, &content, &expire);
+      if (rc)
+	break;
+
+      rc = load_record (dbf, key, content, replace, expire);
+      if (rc)
+	break;
+    }
+  return rc;
+}
+
+static uint32_t
+get_u32 (unsigned char const *p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+         | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/* Load the data blocks of a packed dump (see gdbmdump.c).  Records are
+   stored directly from the block buffer.  FILE->line is set to the
+   ordinal number of the block being loaded. */
+static int
+load_packed_data (struct dump_file *file, GDBM_FILE dbf, int replace)
+{
+  file->line = 0;
+  while (1)
+    {
+      unsigned char hdr[_GDBM_PACKED_BLOCK_HDR];
+      unsigned char crc[4];
+      uint32_t count, size, dsize;
+      unsigned char *p, *end;
+      int rc;
+
+      file->line++;
+      if ((rc = dump_read (file, hdr, sizeof (hdr))) != 0)
+	return rc;
+      count = get_u32 (hdr + 1);
+      size = get_u32 (hdr + 5);
+      dsize = get_u32 (hdr + 9);
+
+      if ((rc = datbuf_alloc (&file->data[0], size ? size : 1)) != 0)
+	return rc;
+      if ((rc = dump_read (file, file->data[0].buffer, size)) != 0
+	  || (rc = dump_read (file, crc, sizeof (crc))) != 0)
+	return rc;
+
+      switch (hdr[0])
+	{
+	case GDBM_CODEC_NONE:
+	  if (size != dsize)
+	    return GDBM_MALFORMED_DATA;
+	  p = file->data[0].buffer;
+	  break;
+
+#if HAVE_ZLIB
+	case GDBM_CODEC_ZLIB:
+	  {
+	    uLongf len = dsize;
+
+	    if ((rc = datbuf_alloc (&file->data[1], dsize ? dsize : 1)) != 0)
+	      return rc;
+	    p = file->data[1].buffer;
+	    if (uncompress (p, &len, file->data[0].buffer, size) != Z_OK
+		|| len != dsize)
+	      return GDBM_MALFORMED_DATA;
+	  }
+	  break;
+#else
+	case GDBM_CODEC_ZLIB:
+	  return GDBM_NOT_SUPPORTED;
+#endif
+
+	default:
+	  return GDBM_MALFORMED_DATA;
+	}
+
+      if (get_u32 (crc) != _gdbm_crc32 (_gdbm_crc32 (0, hdr, sizeof (hdr)),
+					p, dsize))
+	return GDBM_BAD_CHECKSUM;
+
+      if (count == 0)
+	return dsize == 0 ? 0 : GDBM_MALFORMED_DATA;
+
+      end = p + dsize;
+      while (count--)
+	{
+	  uint32_t key_size, data_size;
+	  datum key, content;
+
+	  if (end - p < _GDBM_PACKED_REC_HDR)
+	    return GDBM_MALFORMED_DATA;
+	  key_size = get_u32 (p);
+	  data_size = get_u32 (p + 4);
+	  if (key_size > INT_MAX || data_size > INT_MAX
+	      || end - p - _GDBM_PACKED_REC_HDR < (size_t) key_size + data_size)
+	    return GDBM_MALFORMED_DATA;
+
+	  key.dptr = (char *) p + _GDBM_PACKED_REC_HDR;
+	  key.dsize = key_size;
+	  content.dptr = key.dptr + key_size;
+	  content.dsize = data_size;
+	  rc = load_record (dbf, key, content, replace,
+			    _gdbm_expire_decode ((char *) p + 8));
+	  if (rc)
+	    return rc;
+	  p = (unsigned char *) content.dptr + data_size;
+	}
+      if (p != end)
+	return GDBM_MALFORMED_DATA;
+    }
 }
 
 static int
 _gdbm_load_file (struct dump_file *file, GDBM_FILE dbf, GDBM_FILE *ofp,
-		 int replace, int meta_mask)
+		 int replace, int meta_mask, int packed)
 {
-  char *param = NULL;
   int rc;
   GDBM_FILE tmp = NULL;
   int format = 0;
   const char *p;
+  size_t budget;
   
   rc = get_parms (file);
   if (rc)
@@ -423,6 +940,10 @@ _gdbm_load_file (struct dump_file *file, GDBM_FILE dbf, GDBM_FILE *ofp,
   else
     return GDBM_MALFORMED_DATA;
 
+  /* Incremental dumps and journals update an existing database. */
+  if (getparm (file->header, "since") || getparm (file->header, "journal"))
+    replace = 1;
+
   if ((p = getparm (file->header, "format")) != NULL)
     {
       int n = _gdbm_str2fmt (p);
@@ -445,6 +966,9 @@ _gdbm_load_file (struct dump_file *file, GDBM_FILE dbf, GDBM_FILE *ofp,
       dbf = tmp;
     }
 
+  /* Features cannot be changed in an existing database.  The records are
+     loaded anyway. */
+  format &= ~GDBM_FEATURE_FLAGS;
   if (format)
     {
       /*
@@ -459,30 +983,20 @@ _gdbm_load_file (struct dump_file *file, GDBM_FILE dbf, GDBM_FILE *ofp,
 	  return rc;
 	}
     }	  
-  
-  param = file->header;
-  while (1)
-    {
-      datum key, content;
-      rc = read_record (file, param, 0, &key);
-      if (rc)
-	{
-	  if (rc == GDBM_ITEM_NOT_FOUND && feof (file->fp))
-	    rc = 0;
-	  break;
-	}
-      param = NULL;
 
-      rc = read_record (file, NULL, 1, &content);
-      if (rc)
-	break;
-      
-      if (gdbm_store (dbf, key, content, replace))
-	{
-	  rc = gdbm_errno;
-	  break;
-	}
+  load_begin (dbf, &budget);
+  if (packed)
+    {
+      /* The header is terminated by an empty line. */
+      if (file->have_line)
+	rc = GDBM_MALFORMED_DATA;
+      else
+	rc = load_packed_data (file, dbf, replace);
     }
+  else
+    rc = load_ascii_data (file, dbf, replace);
+  if (load_end (dbf, budget) && rc == 0)
+    rc = gdbm_errno;
 
   if (rc == 0)
     {
@@ -498,17 +1012,17 @@ _gdbm_load_file (struct dump_file *file, GDBM_FILE dbf, GDBM_FILE *ofp,
 static int
 read_bdb_header (struct dump_file *file)
 {    
-  char buf[256];
+  char *line;
+  size_t n;
   
-  file->line = 1;
-  if (!fgets (buf, sizeof (buf), file->fp))
-    return -1;
-  if (strcmp (buf, "VERSION=3\n"))
+  if ((line = get_dump_line (file, &n)) == NULL
+      || strcmp (line, "VERSION=3"))
     return -1;
-  while (fgets (buf, sizeof (buf), file->fp))
+  consume_line (file);
+  while ((line = get_dump_line (file, &n)) != NULL)
     {
-      ++file->line;
-      if (strcmp (buf, "HEADER=END\n") == 0)
+      consume_line (file);
+      if (strcmp (line, "HEADER=END") == 0)
 	return 0;
     }
   return -1;
@@ -517,88 +1031,77 @@ read_bdb_header (struct dump_file *file)
 static int
 c2x (int c)
 {
-  static char xdig[] = "0123456789abcdef";
-  char *p = strchr (xdig, c);
-  if (!p)
-    return -1;
-  return p - xdig;
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
 } 
 
-#define DINCR 128
-
+/* Decode N hex digits from STR into DB and return the datum in D. */
 static int
-xdatum_read (FILE *fp, datum *d, size_t *pdmax)
+xdatum_decode (char const *str, size_t n, struct datbuf *db, datum *d)
 {
-  int c;
-  size_t dmax = *pdmax;
-  
-  d->dsize = 0;
-  while ((c = fgetc (fp)) != EOF && c != '\n')
-    {
-      int t, n;
-      
-      t = c2x (c);
-      if (t == -1)
-	return EOF;
-      t <<= 4;
-
-      if ((c = fgetc (fp)) == EOF)
-	break;
-    
-      n = c2x (c);
-      if (n == -1)
-	return EOF;
-      t += n;
+  unsigned char *q;
+  size_t i;
+  int rc;
 
-      if (d->dsize == dmax)
-	{
-	  char *np = realloc (d->dptr, dmax + DINCR);
-	  if (!np)
-	    return GDBM_MALLOC_ERROR;
-	  d->dptr = np;
-	  dmax += DINCR;
-	}
-      d->dptr[d->dsize++] = t;
+  if (n % 2)
+    return GDBM_MALFORMED_DATA;
+  if ((rc = datbuf_alloc (db, n ? n / 2 : 1)) != 0)
+    return rc;
+  q = db->buffer;
+  for (i = 0; i < n; i += 2)
+    {
+      int hi = c2x ((unsigned char) str[i]);
+      int lo = c2x ((unsigned char) str[i + 1]);
+      if (hi == -1 || lo == -1)
+	return GDBM_MALFORMED_DATA;
+      *q++ = (hi << 4) | lo;
     }
-  *pdmax = dmax;
-  if (c == '\n')
-    return 0;
-  return c;
+  d->dptr = (char *) db->buffer;
+  d->dsize = n / 2;
+  return 0;
 }
 
 static int
 gdbm_load_bdb_dump (struct dump_file *file, GDBM_FILE dbf, int replace)
 {
   datum xd[2];
-  size_t xs[2];
-  int rc, c;
+  char *line;
+  size_t n, budget;
+  int rc;
   int i;
   
   if (read_bdb_header (file))
     return -1;
-  memset (&xd, 0, sizeof (xd));
-  xs[0] = xs[1] = 0;
   i = 0;
   rc = 0;
-  while ((c = fgetc (file->fp)) == ' ')
+  load_begin (dbf, &budget);
+  while ((line = get_dump_line (file, &n)) != NULL && line[0] == ' ')
     {
-      rc = xdatum_read (file->fp, &xd[i], &xs[i]);
+      rc = xdatum_decode (line + 1, n - 1, &file->data[i], &xd[i]);
       if (rc)
 	break;
-      ++file->line;
+      consume_line (file);
 
       if (i == 1)
 	{
 	  if (gdbm_store (dbf, xd[0], xd[1], replace))
-	    return gdbm_errno;
+	    {
+	      rc = gdbm_errno;
+	      break;
+	    }
 	}
       i = !i;
     }
   //FIXME: Read "DATA=END"
-  free (xd[0].dptr);
-  free (xd[1].dptr);
+  if (rc == 0)
+    rc = dump_error (file);
+  if (load_end (dbf, budget) && rc == 0)
+    rc = gdbm_errno;
   if (rc == 0 && i)
-    rc = EOF;
+    rc = GDBM_MALFORMED_DATA;
     
   return rc;
 }
@@ -634,7 +1137,17 @@ gdbm_load_from_file (GDBM_FILE *pdbf, FILE *fp, int replace,
   memset (&df, 0, sizeof df);
   df.fp = fp;
 
-  if (rc == 'V')
+  if (rc == (unsigned char) _GDBM_PACKED_MAGIC[0])
+    {
+      char magic[_GDBM_PACKED_MAGIC_LEN];
+
+      if (fread (magic, sizeof (magic), 1, fp) != 1
+	  || memcmp (magic, _GDBM_PACKED_MAGIC, sizeof (magic)) != 0)
+	rc = GDBM_MALFORMED_DATA;
+      else
+	rc = _gdbm_load_file (&df, *pdbf, pdbf, replace, meta_mask, 1);
+    }
+  else if (rc == 'V')
     {
       if (!*pdbf)
 	{
@@ -644,7 +1157,7 @@ gdbm_load_from_file (GDBM_FILE *pdbf, FILE *fp, int replace,
       rc = gdbm_load_bdb_dump (&df, *pdbf, replace);
     }
   else
-    rc = _gdbm_load_file (&df, *pdbf, pdbf, replace, meta_mask);
+    rc = _gdbm_load_file (&df, *pdbf, pdbf, replace, meta_mask, 0);
   dump_file_free (&df);
   if (rc)
     {
@@ -675,3 +1188,276 @@ gdbm_load (GDBM_FILE *pdbf, const char *filename, int replace,
   return rc;
 }
 
+
+/* Applying journals in batches.
+
+   gdbm_apply reads the changes from a journal (see gdbmjournal.c) or an
+   ASCII dump into memory, in batches of up to APPLY_BATCH_RECORDS changes
+   or APPLY_BATCH_SIZE bytes of data.  Each batch is sorted by hash value,
+   which groups the changes by bucket, and applied with bucket writes
+   deferred (see load_begin).  Thus, each bucket is read and written once
+   per batch, instead of once per change.  Changes to the same key keep
+   their order, and only the last of them is applied. */
+
+#define APPLY_BATCH_RECORDS 16384
+#define APPLY_BATCH_SIZE    (8 * 1024 * 1024)
+
+struct apply_entry
+{
+  int hash;          /* Hash value of the key. */
+  size_t seq;        /* Sequence number in the batch. */
+  int op;            /* GDBM_CHANGE_STORE or GDBM_CHANGE_DELETE. */
+  time_t expire;     /* Expiration time of the record. */
+  size_t off;        /* Offset of the key in the data buffer.  For stored
+			records, the key is followed by the value. */
+  int key_size;
+  int data_size;
+};
+
+struct apply_batch
+{
+  struct apply_entry *tab;
+  size_t count;
+  size_t max;
+  char *data;
+  size_t level;
+  size_t size;
+};
+
+/* Add the change OP to KEY to the batch BT.  VALUE and EXPIRE are the new
+   value and expiration time of a stored record. */
+static int
+batch_add (struct apply_batch *bt, int op, datum key, datum value,
+	   time_t expire)
+{
+  struct apply_entry *ent;
+  size_t n = key.dsize + value.dsize;
+
+  if (bt->count == bt->max)
+    {
+      size_t max = bt->max ? bt->max * 2 : 256;
+      struct apply_entry *p = realloc (bt->tab, max * sizeof (bt->tab[0]));
+      if (!p)
+	return GDBM_MALLOC_ERROR;
+      bt->tab = p;
+      bt->max = max;
+    }
+  if (bt->level + n > bt->size)
+    {
+      size_t size = bt->size ? bt->size : DUMP_CHUNK_SIZE;
+      char *p;
+
+      while (size < bt->level + n)
+	size *= 2;
+      p = realloc (bt->data, size);
+      if (!p)
+	return GDBM_MALLOC_ERROR;
+      bt->data = p;
+      bt->size = size;
+    }
+
+  ent = &bt->tab[bt->count];
+  ent->hash = _gdbm_hash (key);
+  ent->seq = bt->count++;
+  ent->op = op;
+  ent->expire = expire;
+  ent->off = bt->level;
+  ent->key_size = key.dsize;
+  ent->data_size = value.dsize;
+  memcpy (bt->data + bt->level, key.dptr, key.dsize);
+  memcpy (bt->data + bt->level + key.dsize, value.dptr, value.dsize);
+  bt->level += n;
+  return 0;
+}
+
+static int
+apply_entry_cmp (void const *a, void const *b)
+{
+  struct apply_entry const *ea = a;
+  struct apply_entry const *eb = b;
+
+  if (ea->hash != eb->hash)
+    return ea->hash < eb->hash ? -1 : 1;
+  return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+/* Apply the changes collected in BT to DBF and empty the batch. */
+static int
+batch_apply (GDBM_FILE dbf, struct apply_batch *bt)
+{
+  size_t i, budget;
+  int rc = 0;
+
+  if (bt->count == 0)
+    return 0;
+
+  qsort (bt->tab, bt->count, sizeof (bt->tab[0]), apply_entry_cmp);
+
+  load_begin (dbf, &budget);
+  for (i = 0; i < bt->count; i++)
+    {
+      struct apply_entry *ent = &bt->tab[i];
+      datum key, value;
+
+      key.dptr = bt->data + ent->off;
+      key.dsize = ent->key_size;
+
+      /* Skip the change if the next one is to the same key. */
+      if (i + 1 < bt->count
+	  && ent[1].hash == ent->hash
+	  && ent[1].key_size == ent->key_size
+	  && memcmp (bt->data + ent[1].off, key.dptr, key.dsize) == 0)
+	continue;
+
+      if (ent->op == GDBM_CHANGE_DELETE)
+	rc = delete_record (dbf, key);
+      else
+	{
+	  value.dptr = key.dptr + key.dsize;
+	  value.dsize = ent->data_size;
+	  rc = load_record (dbf, key, value, GDBM_REPLACE, ent->expire);
+	}
+      if (rc)
+	break;
+    }
+  if (load_end (dbf, budget) && rc == 0)
+    rc = gdbm_errno;
+
+  bt->count = 0;
+  bt->level = 0;
+  return rc;
+}
+
+/* Read the changes from FILE and apply them to DBF in batches.  Store in
+   *PEND the input offset past the last complete entry. */
+static int
+apply_file (struct dump_file *file, GDBM_FILE dbf, struct apply_batch *bt,
+	    off_t *pend)
+{
+  int rc;
+
+  while (1)
+    {
+      datum key, content;
+      time_t expire = 0;
+      const char *op;
+      char *param;
+      int has_len;
+
+      rc = get_parms (file);
+      if (rc)
+	break;
+      if (file->parmc == 0)
+	{
+	  if (!dump_eof (file))
+	    rc = GDBM_MALFORMED_DATA;
+	  break;
+	}
+      param = file->buffer;
+
+      if (getparm (param, "clear"))
+	{
+	  /* Deletions of hash ranges can't be reordered with other
+	     changes. */
+	  if ((rc = batch_apply (dbf, bt)) != 0
+	      || (rc = clear_ranges (dbf, param)) != 0)
+	    break;
+	}
+
+      /* The parameters are overwritten when reading the value. */
+      op = getparm (param, "op");
+      has_len = getparm (param, "len") != NULL;
+      rc = read_record (file, param, 0, &key, NULL);
+      if (rc == 0 && !op)
+	rc = read_record (file, NULL, 1, &content, &expire);
+      if (rc)
+	{
+	  /* An error at the end of input means that the last entry is
+	     incomplete: it is left for the next call.  Parameters without
+	     a record are the header of an empty journal or dump. */
+	  if (dump_eof (file))
+	    {
+	      if (!file->nonl && !has_len)
+		*pend = dump_tell (file);
+	      rc = 0;
+	    }
+	  break;
+	}
+      if (file->nonl)
+	break;
+
+      if (op)
+	{
+	  if (strcmp (op, "delete"))
+	    {
+	      rc = GDBM_MALFORMED_DATA;
+	      break;
+	    }
+	  content.dptr = NULL;
+	  content.dsize = 0;
+	}
+      rc = batch_add (bt, op ? GDBM_CHANGE_DELETE : GDBM_CHANGE_STORE,
+		      key, content, expire);
+      if (rc)
+	break;
+      *pend = dump_tell (file);
+
+      if (bt->count == APPLY_BATCH_RECORDS || bt->level >= APPLY_BATCH_SIZE)
+	{
+	  rc = batch_apply (dbf, bt);
+	  if (rc)
+	    break;
+	}
+    }
+
+  if (rc == 0)
+    rc = batch_apply (dbf, bt);
+  return rc;
+}
+
+/* Apply the changes from the journal or ASCII dump FP to DBF.  Records
+   always replace existing ones.  An incomplete entry at the end of FP is
+   not applied.  If POFFSET is not NULL, the number of bytes read from FP
+   up to the end of the last applied entry is stored there. */
+int
+gdbm_apply (GDBM_FILE dbf, FILE *fp, off_t *poffset)
+{
+  struct dump_file df;
+  struct apply_batch bt;
+  off_t end = 0;
+  int rc;
+
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+  if (!fp)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return -1;
+    }
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  memset (&df, 0, sizeof df);
+  df.fp = fp;
+  memset (&bt, 0, sizeof bt);
+
+  rc = apply_file (&df, dbf, &bt, &end);
+
+  dump_file_free (&df);
+  free (bt.tab);
+  free (bt.data);
+
+  if (rc)
+    {
+      GDBM_SET_ERRNO (dbf, rc, FALSE);
+      return -1;
+    }
+  if (poffset)
+    *poffset = end;
+  return 0;
+}
@@ -64,6 +64,7 @@ gdbm_header_avail (gdbm_file_header *hdr,
       break;
       
     case GDBM_NUMSYNC_MAGIC:
+    case GDBM_EXT_MAGIC:
       *exhdr = &((gdbm_file_extended_header*)hdr)->ext;
       *avail_ptr = &((gdbm_file_extended_header*)hdr)->avail;
       *avail_size = (hdr->block_size -
@@ -99,7 +100,7 @@ validate_header_std (gdbm_file_header const *hdr, struct stat const *st)
   if (!(hdr->dir > 0
 	&& hdr->dir < st->st_size
 	&& hdr->dir_size > 0
-	&& hdr->dir + hdr->dir_size < st->st_size))
+	&& hdr->dir + hdr->dir_size <= st->st_size))
     return GDBM_BAD_HEADER;
 
   compute_directory_size (hdr->block_size, &dir_size, &dir_bits);
@@ -145,7 +146,7 @@ validate_header_numsync (gdbm_file_header const *hdr, struct stat const *st)
   if (!(hdr->dir > 0
 	&& hdr->dir < st->st_size
 	&& hdr->dir_size > 0
-	&& hdr->dir + hdr->dir_size < st->st_size))
+	&& hdr->dir + hdr->dir_size <= st->st_size))
     return GDBM_BAD_HEADER;
 
   compute_directory_size (hdr->block_size, &dir_size, &dir_bits);
@@ -158,7 +159,21 @@ validate_header_numsync (gdbm_file_header const *hdr, struct stat const *st)
   if (!(hdr->bucket_size > 0 && hdr->bucket_size > sizeof (hash_bucket)))
     return GDBM_BAD_HEADER;
 
-  if (hdr->bucket_elems != bucket_element_count (hdr->bucket_size))
+  /* Buckets of the extended format may be shorter by the generation
+     number and the chain trailer.  This is verified in
+     validate_features. */
+  if (hdr->bucket_elems != bucket_element_count (hdr->bucket_size)
+      && !(hdr->header_magic == GDBM_EXT_MAGIC
+	   && (hdr->bucket_elems
+	         == bucket_element_count (hdr->bucket_size
+					  - GDBM_BUCKET_GEN_SIZE)
+	       || hdr->bucket_elems
+	            == bucket_element_count (hdr->bucket_size
+					     - GDBM_BUCKET_CHAIN_SIZE)
+	       || hdr->bucket_elems
+	            == bucket_element_count (hdr->bucket_size
+					     - GDBM_BUCKET_CHAIN_SIZE
+					     - GDBM_BUCKET_GEN_SIZE))))
     return GDBM_BAD_HEADER;
 
   return result;
@@ -175,6 +190,7 @@ validate_header (gdbm_file_header const *hdr, struct stat const *st)
       return validate_header_std (hdr, st);
       
     case GDBM_NUMSYNC_MAGIC:
+    case GDBM_EXT_MAGIC:
       return validate_header_numsync (hdr, st);
 
     default:
@@ -185,12 +201,16 @@ validate_header (gdbm_file_header const *hdr, struct stat const *st)
 	case GDBM_MAGIC64_SWAP:
 	case GDBM_NUMSYNC_MAGIC32_SWAP:
 	case GDBM_NUMSYNC_MAGIC64_SWAP:
+	case GDBM_EXT_MAGIC32_SWAP:
+	case GDBM_EXT_MAGIC64_SWAP:
 	  return GDBM_BYTE_SWAPPED;
 
 	case GDBM_MAGIC32:
 	case GDBM_MAGIC64:
 	case GDBM_NUMSYNC_MAGIC32:
 	case GDBM_NUMSYNC_MAGIC64:
+	case GDBM_EXT_MAGIC32:
+	case GDBM_EXT_MAGIC64:
 	  return GDBM_BAD_FILE_OFFSET;
 
 	default:
@@ -199,6 +219,38 @@ validate_header (gdbm_file_header const *hdr, struct stat const *st)
     }
 }
 
+/* Return the number of bytes at the end of each bucket that are kept
+   apart from the hash table in databases with the given FEATURES. */
+static size_t
+bucket_trailer_size (unsigned features)
+{
+  size_t size = 0;
+
+  if (features & GDBM_FEAT_GENERATION)
+    size += GDBM_BUCKET_GEN_SIZE;
+  if (features & GDBM_FEAT_CHAIN)
+    size += GDBM_BUCKET_CHAIN_SIZE;
+  return size;
+}
+
+/* Make sure the database doesn't use any features unknown to this
+   version of GDBM. */
+static int
+validate_features (GDBM_FILE dbf)
+{
+  if (dbf->header->header_magic == GDBM_EXT_MAGIC)
+    {
+      if (dbf->xheader->features & ~GDBM_FEAT_MASK)
+	return GDBM_BAD_HEADER;
+      if (dbf->header->bucket_elems
+	  != bucket_element_count (dbf->header->bucket_size
+				   - bucket_trailer_size (dbf->xheader
+							    ->features)))
+	return GDBM_BAD_HEADER;
+    }
+  return GDBM_NO_ERROR;
+}
+
 int
 _gdbm_validate_header (GDBM_FILE dbf)
 {
@@ -209,6 +261,8 @@ _gdbm_validate_header (GDBM_FILE dbf)
     return GDBM_FILE_STAT_ERROR;
 
   rc = validate_header (dbf->header, &file_stat);
+  if (rc == 0)
+    rc = validate_features (dbf);
   if (rc == 0)
     {
       if (gdbm_avail_block_validate (dbf, dbf->avail, dbf->avail_size))
@@ -217,6 +271,34 @@ _gdbm_validate_header (GDBM_FILE dbf)
   return rc;
 }
 
+/* Return the gdbm_open flags describing the format of the database. */
+int
+_gdbm_format_flags (GDBM_FILE dbf)
+{
+  int flags = 0;
+
+  switch (dbf->header->header_magic)
+    {
+    case GDBM_EXT_MAGIC:
+      if (dbf->xheader->features & GDBM_FEAT_FINGERPRINT)
+	flags |= GDBM_FINGERPRINT;
+      if (dbf->xheader->features & GDBM_FEAT_INLINE)
+	flags |= GDBM_INLINE;
+      if (dbf->xheader->features & GDBM_FEAT_COMPRESS)
+	flags |= GDBM_COMPRESS;
+      if (dbf->xheader->features & GDBM_FEAT_EXPIRE)
+	flags |= GDBM_EXPIRE;
+      if (dbf->xheader->features & GDBM_FEAT_GENERATION)
+	flags |= GDBM_GENERATION;
+      if (dbf->xheader->features & GDBM_FEAT_CHAIN)
+	flags |= GDBM_CHAIN;
+      /* fall through */
+    case GDBM_NUMSYNC_MAGIC:
+      flags |= GDBM_NUMSYNC;
+    }
+  return flags;
+}
+
 /* Do we have ftruncate? */
 static inline int
 _gdbm_ftruncate (GDBM_FILE dbf)
@@ -238,8 +320,6 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 {
   GDBM_FILE dbf;		/* The record to return. */
   struct stat file_stat;	/* Space for the stat information. */
-  off_t       file_pos;		/* Used with seeks. */
-  int 	      index;		/* Used as a loop index. */
   
   /* Initialize the gdbm_errno variable. */
   gdbm_set_errno (NULL, GDBM_NO_ERROR, FALSE);
@@ -268,6 +348,7 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
   /* Initialize some fields for known values.  This is done so gdbm_close
      will work if called before allocating some structures. */
   dbf->dir  = NULL;
+  dbf->dir_dirty = NULL;
   dbf->bucket = NULL;
   dbf->header = NULL;
 
@@ -378,6 +459,19 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
     {
       /* This is a new file.  Create an empty database.  */
       int dir_size, dir_bits;
+
+#if !HAVE_ZLIB
+      /* Compressed databases can't be created without zlib.  They can
+	 still be opened, though: records stored verbatim are readable. */
+      if (flags & GDBM_COMPRESS)
+	{
+	  if (!(flags & GDBM_CLOERROR))
+	    dbf->desc = -1;
+	  gdbm_close (dbf);
+	  GDBM_SET_ERRNO2 (NULL, GDBM_NOT_SUPPORTED, FALSE, GDBM_DEBUG_OPEN);
+	  return NULL;
+	}
+#endif
       
       /* Start with the blocksize. */
       if (block_size < GDBM_MIN_BLOCK_SIZE)
@@ -418,7 +512,9 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
 
       /* Set the magic number and the block_size. */
-      if (flags & GDBM_NUMSYNC)
+      if (flags & GDBM_FEATURE_FLAGS)
+	dbf->header->header_magic = GDBM_EXT_MAGIC;
+      else if (flags & GDBM_NUMSYNC)
 	dbf->header->header_magic = GDBM_NUMSYNC_MAGIC;
       else
 	dbf->header->header_magic = GDBM_MAGIC;
@@ -428,12 +524,26 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
        */
       dbf->header->block_size = block_size;
       gdbm_header_avail (dbf->header, &dbf->avail, &dbf->avail_size, &dbf->xheader);
+      if (flags & GDBM_FINGERPRINT)
+	dbf->xheader->features |= GDBM_FEAT_FINGERPRINT;
+      if (flags & GDBM_INLINE)
+	dbf->xheader->features |= GDBM_FEAT_INLINE;
+      if (flags & GDBM_COMPRESS)
+	dbf->xheader->features |= GDBM_FEAT_COMPRESS;
+      if (flags & GDBM_EXPIRE)
+	dbf->xheader->features |= GDBM_FEAT_EXPIRE;
+      if (flags & GDBM_GENERATION)
+	dbf->xheader->features |= GDBM_FEAT_GENERATION;
+      if (flags & GDBM_CHAIN)
+	dbf->xheader->features |= GDBM_FEAT_CHAIN;
       dbf->header->dir_size = dir_size;
       dbf->header->dir_bits = dir_bits;
 
-      /* Allocate the space for the directory. */
-      dbf->dir = (off_t *) malloc (dbf->header->dir_size);
-      if (dbf->dir == NULL)
+      dbf->header->dir = dbf->header->block_size;
+
+      /* Create the directory, with all entries pointing to the first
+	 and only hash bucket. */
+      if (_gdbm_dir_create (dbf, 2*dbf->header->block_size))
 	{
 	  if (!(flags & GDBM_CLOERROR))
 	    dbf->desc = -1;
@@ -441,10 +551,13 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	  GDBM_SET_ERRNO2 (NULL, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_OPEN);
 	  return NULL;
 	}
-      dbf->header->dir = dbf->header->block_size;
 
       /* Create the first and only hash bucket. */
-      dbf->header->bucket_elems = bucket_element_count (dbf->header->block_size);
+      dbf->header->bucket_elems =
+	bucket_element_count (dbf->header->block_size
+			      - (dbf->xheader
+				 ? bucket_trailer_size (dbf->xheader->features)
+				 : 0));
       dbf->header->bucket_size  = dbf->header->block_size;
       dbf->bucket = calloc (1, dbf->header->bucket_size);
       if (dbf->bucket == NULL)
@@ -460,10 +573,6 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
       dbf->bucket->bucket_avail[0].av_adr = 3*dbf->header->block_size;
       dbf->bucket->bucket_avail[0].av_size = dbf->header->block_size;
 
-      /* Set table entries to point to hash buckets. */
-      for (index = 0; index < GDBM_DIR_COUNT (dbf); index++)
-	dbf->dir[index] = 2*dbf->header->block_size;
-
       /* Initialize the active avail block. */
       dbf->avail->size = (dbf->avail_size - offsetof(avail_block, av_table))
 	                  / sizeof (avail_elem);
@@ -486,7 +595,7 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
 
       /* Block 1 is the initial bucket directory. */
-      if (_gdbm_full_write (dbf, dbf->dir, dbf->header->dir_size))
+      if (_gdbm_dir_write (dbf))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_OPEN|GDBM_DEBUG_ERR,
 		      "%s: error writing directory: %s",
@@ -582,6 +691,16 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	}
       gdbm_header_avail (dbf->header, &dbf->avail, &dbf->avail_size, &dbf->xheader);
 
+      rc = validate_features (dbf);
+      if (rc != GDBM_NO_ERROR)
+	{
+	  if (!(flags & GDBM_CLOERROR))
+	    dbf->desc = -1;
+	  gdbm_close (dbf);
+	  GDBM_SET_ERRNO2 (NULL, rc, FALSE, GDBM_DEBUG_OPEN);
+	  return NULL;
+	}
+
       if (((dbf->header->block_size -
 	    (GDBM_HEADER_AVAIL_OFFSET (dbf) +
 	     sizeof (avail_block))) / sizeof (avail_elem) + 1) != dbf->avail->size)
@@ -601,39 +720,16 @@ gdbm_fd_open (int fd, const char *file_name, int block_size,
 	  return NULL;
 	}
       
-      /* Allocate space for the hash table directory.  */
-      dbf->dir = malloc (dbf->header->dir_size);
-      if (dbf->dir == NULL)
-	{
-	  if (!(flags & GDBM_CLOERROR))
-	    dbf->desc = -1;
-	  gdbm_close (dbf);
-	  GDBM_SET_ERRNO2 (NULL, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_OPEN);
-	  return NULL;
-	}
-
-      /* Read the hash table directory. */
-      file_pos = gdbm_file_seek (dbf, dbf->header->dir, SEEK_SET);
-      if (file_pos != dbf->header->dir)
+      /* Allocate space for the hash table directory.  Its pages will
+	 be read on demand. */
+      if (_gdbm_dir_init (dbf))
 	{
 	  if (!(flags & GDBM_CLOERROR))
 	    dbf->desc = -1;
 	  SAVE_ERRNO (gdbm_close (dbf));
-	  GDBM_SET_ERRNO2 (NULL, GDBM_FILE_SEEK_ERROR, FALSE, GDBM_DEBUG_OPEN);
-	  return NULL;
-	}
-
-      if (_gdbm_full_read (dbf, dbf->dir, dbf->header->dir_size))
-	{
-	  GDBM_DEBUG (GDBM_DEBUG_ERR|GDBM_DEBUG_OPEN,
-		      "%s: error reading dir: %s",
-		      dbf->name, gdbm_db_strerror (dbf));
-	  if (!(flags & GDBM_CLOERROR))
-	    dbf->desc = -1;
-	  SAVE_ERRNO (gdbm_close (dbf));
+	  GDBM_SET_ERRNO2 (NULL, GDBM_MALLOC_ERROR, FALSE, GDBM_DEBUG_OPEN);
 	  return NULL;
 	}
-
     }
 
   if (_gdbm_cache_init (dbf, DEFAULT_CACHESIZE))
@@ -893,7 +989,7 @@ gdbm_convert (GDBM_FILE dbf, int flag)
       return -1;
     }
 
-  switch (flag)
+  switch (flag & ~GDBM_FEATURE_FLAGS)
     {
     case 0:
     case GDBM_NUMSYNC:
@@ -905,6 +1001,16 @@ gdbm_convert (GDBM_FILE dbf, int flag)
       return -1;
     }
 
+  /* Features change the layout of the buckets, so they cannot be
+     added or removed in place. */
+  if ((flag & ~_gdbm_format_flags (dbf) & GDBM_FEATURE_FLAGS)
+      || (flag == 0 && dbf->header->header_magic == GDBM_EXT_MAGIC))
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_MALFORMED_DATA, FALSE,
+		       GDBM_DEBUG_STORE);
+      return -1;
+    }
+  
   rc = 0;
   switch (dbf->header->header_magic)
     {
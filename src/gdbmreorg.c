@@ -19,22 +19,389 @@
 /* Include system configuration before all else. */
 #include "autoconf.h"
 #include "gdbmdefs.h"
+#include <stdint.h>
 
-/* Reorganize the database.  This requires creating a new file and inserting
-   all the elements in the old file DBF into the new file.  The new file
-   is then renamed to the same name as the old file and DBF is updated to
-   contain all the correct information about the new file.  If an error
-   is detected, the return value is negative.  The value zero is returned
-   after a successful reorganization. */
+/* Size of the buffer used for copying records. */
+#define REORG_BUFSIZE (1024 * 1024)
+
+struct reorg
+{
+  GDBM_FILE dbf;            /* Database being reorganized. */
+  GDBM_FILE new_dbf;        /* New database. */
+  bucket_element *elems;    /* Elements of the current bucket whose records
+			       are kept outside of it. */
+  char *buf;                /* Copy buffer. */
+  size_t bufsize;           /* Size of buf. */
+};
+
+static int
+elem_cmp (const void *a, const void *b)
+{
+  bucket_element const *ea = a;
+  bucket_element const *eb = b;
+  if (ea->data_pointer < eb->data_pointer)
+    return -1;
+  if (ea->data_pointer > eb->data_pointer)
+    return 1;
+  return 0;
+}
+
+/* Return the size of the record referred to by ELT, as stored in file. */
+static inline size_t
+elem_size (bucket_element const *elt)
+{
+  return (size_t) elt->key_size + elt->data_size;
+}
+
+/* Return true if the record data DPTR of DATA_SIZE bytes, as stored in
+   DBF, carry an expiration time that has passed. */
+static int
+data_expired (GDBM_FILE dbf, char const *dptr, int data_size)
+{
+  return _gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE)
+         && data_size >= GDBM_EXPIRE_SIZE
+         && _gdbm_expired_p (_gdbm_expire_decode (dptr));
+}
+
+static int
+read_at (GDBM_FILE dbf, off_t off, void *buf, size_t size)
+{
+  if (gdbm_file_seek (dbf, off, SEEK_SET) != off)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+      return -1;
+    }
+  return _gdbm_full_read (dbf, buf, size);
+}
+
+static int
+write_at (GDBM_FILE dbf, off_t off, void *buf, size_t size)
+{
+  if (gdbm_file_seek (dbf, off, SEEK_SET) != off)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+      return -1;
+    }
+  return _gdbm_full_write (dbf, buf, size);
+}
+
+/* Insert ELT into the current bucket of DBF. */
+static void
+insert_elem (GDBM_FILE dbf, bucket_element *elt)
+{
+  int loc = elt->hash_value % dbf->header->bucket_elems;
+
+  while (dbf->bucket->h_table[loc].hash_value != -1)
+    loc = (loc + 1) % dbf->header->bucket_elems;
+  dbf->bucket->h_table[loc] = *elt;
+  dbf->bucket->count++;
+}
+
+/* Copy COUNT records, starting at R->elems[FIRST], which fit into the
+   copy buffer together.  Records adjacent in the old file are read at
+   once, and all of them are written to a single block in the new
+   file. */
+static int
+copy_group (struct reorg *r, int first, int count)
+{
+  bucket_element *elems = r->elems + first;
+  size_t off, total;
+  off_t adr;
+  int i, j;
+
+  off = 0;
+  for (i = 0; i < count; i = j)
+    {
+      off_t start = elems[i].data_pointer;
+      off_t end = start + elem_size (&elems[i]);
+
+      for (j = i + 1; j < count && elems[j].data_pointer == end; j++)
+	end += elem_size (&elems[j]);
+      if (read_at (r->dbf, start, r->buf + off, end - start))
+	return -1;
+      off += end - start;
+    }
+
+  /* Drop expired records. */
+  off = total = 0;
+  for (i = j = 0; i < count; i++)
+    {
+      size_t size = elem_size (&elems[i]);
+
+      if (!data_expired (r->dbf, r->buf + off + elems[i].key_size,
+			 elems[i].data_size))
+	{
+	  if (total != off)
+	    memmove (r->buf + total, r->buf + off, size);
+	  elems[j++] = elems[i];
+	  total += size;
+	}
+      off += size;
+    }
+  count = j;
+
+  adr = 0;
+  if (total > 0)
+    {
+      adr = _gdbm_alloc (r->new_dbf, total);
+      if (adr == 0)
+	return -1;
+      if (write_at (r->new_dbf, adr, r->buf, total))
+	return -1;
+    }
+  for (i = 0; i < count; i++)
+    {
+      elems[i].data_pointer = adr;
+      adr += elem_size (&elems[i]);
+      insert_elem (r->new_dbf, &elems[i]);
+    }
+  return 0;
+}
+
+/* Copy the record of ELT, which is larger than the copy buffer. */
+static int
+copy_large (struct reorg *r, bucket_element *elt)
+{
+  off_t src = elt->data_pointer;
+  off_t dst;
+  size_t size = elem_size (elt);
+
+  if (_gdbm_feature_p (r->dbf, GDBM_FEAT_EXPIRE)
+      && elt->data_size >= GDBM_EXPIRE_SIZE)
+    {
+      char stamp[GDBM_EXPIRE_SIZE];
+
+      if (read_at (r->dbf, src + elt->key_size, stamp, sizeof (stamp)))
+	return -1;
+      if (_gdbm_expired_p (_gdbm_expire_decode (stamp)))
+	return 0;
+    }
+
+  dst = _gdbm_alloc (r->new_dbf, size);
+  if (dst == 0)
+    return -1;
+  elt->data_pointer = dst;
+  while (size > 0)
+    {
+      size_t n = size < r->bufsize ? size : r->bufsize;
+
+      if (read_at (r->dbf, src, r->buf, n)
+	  || write_at (r->new_dbf, dst, r->buf, n))
+	return -1;
+      src += n;
+      dst += n;
+      size -= n;
+    }
+  insert_elem (r->new_dbf, elt);
+  return 0;
+}
+
+/* Copy live records from the current bucket of the old database to the
+   current bucket of the new one.  Inline records are copied with their
+   elements.  The rest are read in the order of their offsets, so that
+   the old file is scanned sequentially. */
+static int
+copy_bucket (struct reorg *r)
+{
+  GDBM_FILE dbf = r->dbf;
+  int i, count;
+
+  count = 0;
+  for (i = 0; i < dbf->header->bucket_elems; i++)
+    {
+      bucket_element *elt = &dbf->bucket->h_table[i];
+
+      /* Skip empty slots and tombstones. */
+      if (elt->hash_value < 0)
+	continue;
+      if (_gdbm_elem_inline_p (dbf, elt))
+	{
+	  if (!data_expired (dbf, _gdbm_elem_inline (elt) + elt->key_size,
+			     elt->data_size))
+	    insert_elem (r->new_dbf, elt);
+	}
+      else
+	r->elems[count++] = *elt;
+    }
+  qsort (r->elems, count, sizeof (r->elems[0]), elem_cmp);
+
+  i = 0;
+  while (i < count)
+    {
+      if (elem_size (&r->elems[i]) > r->bufsize)
+	{
+	  if (copy_large (r, &r->elems[i]))
+	    return -1;
+	  i++;
+	}
+      else
+	{
+	  int first = i;
+	  size_t total = 0;
+
+	  while (i < count && elem_size (&r->elems[i]) <= r->bufsize - total)
+	    total += elem_size (&r->elems[i++]);
+	  if (copy_group (r, first, i - first))
+	    return -1;
+	}
+    }
+  return 0;
+}
+
+/* Copy the contents of DBF to the empty database NEW_DBF, bucket by
+   bucket, retaining the directory structure.  Return 0 on success, -1
+   on error, and 1 if the structure of DBF can't be reproduced (in which
+   case NEW_DBF is left unchanged). */
+static int
+reorg_copy (GDBM_FILE dbf, GDBM_FILE new_dbf)
+{
+  struct reorg r;
+  int dir_count;
+  int d, start, end;
+  int rc = 0;
+
+  if (dbf->header->bucket_size != new_dbf->header->bucket_size
+      || dbf->header->bucket_elems != new_dbf->header->bucket_elems
+      || dbf->header->dir_bits < new_dbf->header->dir_bits
+      || _gdbm_feature_p (dbf, GDBM_FEAT_CHAIN)
+           != _gdbm_feature_p (new_dbf, GDBM_FEAT_CHAIN))
+    return 1;
+
+  r.dbf = dbf;
+  r.new_dbf = new_dbf;
+  r.bufsize = REORG_BUFSIZE;
+  r.buf = malloc (r.bufsize);
+  r.elems = calloc (dbf->header->bucket_elems, sizeof (r.elems[0]));
+  if (!r.buf || !r.elems)
+    {
+      free (r.buf);
+      free (r.elems);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+
+  /* Buckets are written once, when the new database is flushed. */
+  new_dbf->flush_budget = SIZE_MAX;
+
+  if (_gdbm_get_bucket (new_dbf, 0))
+    rc = -1;
+  else if (dbf->header->dir_bits > new_dbf->header->dir_bits)
+    {
+      /* Size the directory to match the old one. */
+      off_t old_adr;
+      int old_size;
+
+      if (_gdbm_dir_grow (new_dbf, dbf->header->dir_bits,
+			  &old_adr, &old_size)
+	  || _gdbm_free (new_dbf, old_adr, old_size))
+	rc = -1;
+    }
+
+  dir_count = GDBM_DIR_COUNT (dbf);
+  for (d = 0; rc == 0 && d < dir_count; d = end)
+    {
+      int bits;
+
+      if (_gdbm_get_bucket (dbf, d))
+	{
+	  rc = -1;
+	  break;
+	}
+      bits = dbf->bucket->bucket_bits;
+      _gdbm_bucket_dir_range (dbf, d, bits, &start, &end);
+      if (start != d || _gdbm_next_bucket_dir (dbf, d) != end)
+	{
+	  rc = 1;
+	  break;
+	}
+
+      if (d == 0)
+	{
+	  /* Reuse the initial bucket of the new database. */
+	  if (_gdbm_get_bucket (new_dbf, 0))
+	    {
+	      rc = -1;
+	      break;
+	    }
+	  new_dbf->bucket->bucket_bits = bits;
+	  _gdbm_current_bucket_changed (new_dbf);
+	}
+      else if (_gdbm_install_bucket (new_dbf, d, bits))
+	rc = -1;
+
+      if (rc == 0 && copy_bucket (&r))
+	rc = -1;
+
+      /* Reproduce the overflow chain, if any. */
+      while (rc == 0 && (rc = _gdbm_next_bucket (dbf)) == 0)
+	{
+	  if (_gdbm_chain_bucket (new_dbf) || copy_bucket (&r))
+	    rc = -1;
+	}
+      if (rc == 1)
+	rc = 0;
+    }
+
+  free (r.buf);
+  free (r.elems);
+  return rc;
+}
+
+/* Reorganize the database.  This requires creating a new file and
+   copying all the live records from the old file DBF to it.  The new
+   file is then renamed to the same name as the old file and DBF is
+   updated to contain all the correct information about the new file.
+
+   Records are copied bucket by bucket, in the order of their offsets,
+   so that both files are accessed mostly sequentially.  The new
+   directory has the size of the old one, and each bucket is written
+   once.  Expired records and tombstones are dropped.  If the directory
+   of DBF is irregular, the records are reinserted one by one, as by
+   gdbm_recover.
+
+   If an error is detected, the return value is negative.  The value
+   zero is returned after a successful reorganization. */
 
 int
 gdbm_reorganize (GDBM_FILE dbf)
 {
   gdbm_recovery rcvr;
-  
-  /* Return immediately if the database needs recovery */	
+  GDBM_FILE new_dbf;
+  int rc;
+
+  /* Return immediately if the database needs recovery */
   GDBM_ASSERT_CONSISTENCY (dbf, -1);
 
+  /* Readers can not reorganize! */
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_REORGANIZE, FALSE);
+      return -1;
+    }
+
+  /* Write out pending changes. */
+  if (_gdbm_flush (dbf))
+    return -1;
+  gdbm_clear_error (dbf);
+
+  new_dbf = _gdbm_open_temp (dbf);
+  if (new_dbf == NULL)
+    return -1;
+
+  rc = reorg_copy (dbf, new_dbf);
+  if (rc == 0)
+    {
+      rcvr.backup_name = NULL;
+      return _gdbm_finish_transfer (dbf, new_dbf, &rcvr, 0);
+    }
+
+  if (rc == -1 && gdbm_last_errno (dbf) == GDBM_NO_ERROR)
+    GDBM_SET_ERRNO (dbf, gdbm_last_errno (new_dbf), FALSE);
+  SAVE_ERRNO (unlink (new_dbf->name); gdbm_close (new_dbf));
+  if (rc == -1)
+    return -1;
+
+  gdbm_clear_error (dbf);
   rcvr.max_failures = 0;
   return gdbm_recover (dbf, &rcvr, GDBM_RCVR_MAX_FAILURES|GDBM_RCVR_FORCE);
 }
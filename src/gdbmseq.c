@@ -31,7 +31,7 @@ gdbm_valid_key_p (GDBM_FILE dbf, char *key_ptr, int key_size, int elem_loc)
   key.dsize = key_size;
   _gdbm_hash_key (dbf, key, &hash, &bucket, &offset);
   if (gdbm_dir_entry_valid_p (dbf, bucket) &&
-      dbf->dir[bucket] == dbf->dir[dbf->bucket_dir] &&
+      _gdbm_dir_entry (dbf, bucket) == _gdbm_dir_entry (dbf, dbf->bucket_dir) &&
       hash == dbf->bucket->h_table[elem_loc].hash_value)
     return 1;
   GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_ENTRY, TRUE);
@@ -63,29 +63,46 @@ get_next_key (GDBM_FILE dbf, int elem_loc, datum *return_val)
       if (elem_loc == dbf->header->bucket_elems)
 	{
 	  /* We have finished the current bucket, get the next bucket.  */
-	  elem_loc = 0;
+	  int rc;
 
-	  /* Find the next bucket.  It is possible several entries in
-	     the bucket directory point to the same bucket. */
-	  while (dbf->bucket_dir < GDBM_DIR_COUNT (dbf)
-		 && dbf->cache_mru->ca_adr == dbf->dir[dbf->bucket_dir])
-	    dbf->bucket_dir++;
+	  elem_loc = 0;
 
-	  /* Check to see if there was a next bucket. */
-	  if (dbf->bucket_dir < GDBM_DIR_COUNT (dbf))
-	    {
-	      if (_gdbm_get_bucket (dbf, dbf->bucket_dir))
-		return;
-	    }
-	  else
+	  /* Continue with the overflow chain, if any. */
+	  rc = _gdbm_next_bucket (dbf);
+	  if (rc == -1)
+	    return;
+	  if (rc == 1)
 	    {
-	      /* No next key, just return. */
-	      GDBM_SET_ERRNO2 (dbf, GDBM_ITEM_NOT_FOUND, FALSE,
-			       GDBM_DEBUG_LOOKUP);
-	      return;
+	      /* Find the next bucket.  It is possible several entries in
+		 the bucket directory point to the same bucket. */
+	      dbf->bucket_dir = _gdbm_bucket_dir_end (dbf);
+
+	      /* Check to see if there was a next bucket. */
+	      if (dbf->bucket_dir < GDBM_DIR_COUNT (dbf))
+		{
+		  if (_gdbm_get_bucket (dbf, dbf->bucket_dir))
+		    return;
+		}
+	      else
+		{
+		  /* No next key, just return. */
+		  GDBM_SET_ERRNO2 (dbf, GDBM_ITEM_NOT_FOUND, FALSE,
+				   GDBM_DEBUG_LOOKUP);
+		  return;
+		}
 	    }
 	}
-      found = dbf->bucket->h_table[elem_loc].hash_value != -1;
+      /* Skip empty slots and tombstones. */
+      found = dbf->bucket->h_table[elem_loc].hash_value >= 0;
+
+      /* Skip expired records. */
+      if (found && _gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+	{
+	  int rc = _gdbm_elem_expired (dbf, elem_loc);
+	  if (rc == -1)
+	    return;
+	  found = !rc;
+	}
     }
   
   /* Found the next key, read it into return_val. */
@@ -177,8 +194,8 @@ gdbm_nextkey (GDBM_FILE dbf, datum key)
       return return_val;
     }
   
-  /* Find the key.  */
-  elem_loc = _gdbm_findkey (dbf, key, NULL, NULL);
+  /* Find the key.  It may have expired since it was returned. */
+  elem_loc = _gdbm_findkey_any (dbf, key, NULL, NULL);
   if (elem_loc == -1) return return_val;
   
   /* Find the next key. */  
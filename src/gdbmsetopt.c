@@ -59,6 +59,9 @@ setopt_gdbm_setcachesize (GDBM_FILE dbf, void *optval, int optlen)
       GDBM_SET_ERRNO (dbf, GDBM_OPT_BADVAL, FALSE);
       return -1;
     }  
+  /* Buckets with tombstones must not be dropped from the cache. */
+  if (_gdbm_cache_reclaim (dbf))
+    return -1;
   return _gdbm_cache_init (dbf, sz);
 }
 
@@ -295,8 +298,7 @@ setopt_gdbm_getflags (GDBM_FILE dbf, void *optval, int optlen)
       if (dbf->cloexec)
 	flags |= GDBM_CLOEXEC;
       
-      if (dbf->header->header_magic == GDBM_NUMSYNC_MAGIC)
-	flags |= GDBM_NUMSYNC;
+      flags |= _gdbm_format_flags (dbf);
       
       *(int*) optval = flags;
     }
@@ -342,16 +344,7 @@ setopt_gdbm_getdbformat (GDBM_FILE dbf, void *optval, int optlen)
 {
   if (optval && optlen == sizeof (int))
     {
-      switch (dbf->header->header_magic)
-	{
-	case GDBM_OMAGIC:
-	case GDBM_MAGIC:
-	  *(int*)optval = 0;
-	  break;
-      
-	case GDBM_NUMSYNC_MAGIC:
-	  *(int*)optval = GDBM_NUMSYNC;
-	}
+      *(int*)optval = _gdbm_format_flags (dbf);
       return 0;
     }
   
@@ -385,6 +378,112 @@ setopt_gdbm_getbucketsize (GDBM_FILE dbf, void *optval, int optlen)
   return -1;
 }
 
+static int
+setopt_gdbm_setdirdepth (GDBM_FILE dbf, void *optval, int optlen)
+{
+  int bits;
+  off_t old_adr;
+  int old_size;
+  
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_BADVAL, FALSE);
+      return -1;
+    }
+  bits = *(int*) optval;
+  if (bits < 0 || bits > GDBM_HASH_BITS)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_BADVAL, FALSE);
+      return -1;
+    }
+  
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+
+  /* The directory never shrinks. */
+  if (bits <= dbf->header->dir_bits)
+    return 0;
+
+  /* Space for the new directory is allocated from the avail table of
+     the current bucket. */
+  if (_gdbm_get_bucket (dbf, 0))
+    return -1;
+  
+  if (_gdbm_dir_grow (dbf, bits, &old_adr, &old_size))
+    return -1;
+  _gdbm_current_bucket_changed (dbf);
+  if (_gdbm_free (dbf, old_adr, old_size))
+    return -1;
+  
+  return _gdbm_end_update (dbf);
+}
+
+static int
+setopt_gdbm_setflushbudget (GDBM_FILE dbf, void *optval, int optlen)
+{
+  size_t n;
+
+  if (get_size (optval, optlen, &n))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_BADVAL, FALSE);
+      return -1;
+    }
+  dbf->flush_budget = n;
+  /* Write out the changes that exceed the new budget. */
+  if (dbf->read_write != GDBM_READER
+      && (n == 0 || dbf->cache_dirty > n))
+    return _gdbm_flush (dbf);
+  return 0;
+}
+
+static int
+setopt_gdbm_getflushbudget (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (size_t))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_BADVAL, FALSE);
+      return -1;
+    }
+  *(size_t*) optval = dbf->flush_budget;
+  return 0;
+}
+
+static int
+setopt_gdbm_setlazydelete (GDBM_FILE dbf, void *optval, int optlen)
+{
+  int n;
+
+  if ((n = getbool (optval, optlen)) == -1)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_BADVAL, FALSE);
+      return -1;
+    }
+  dbf->lazy_delete = n;
+  /* Reclaim the tombstones left so far. */
+  if (!n && dbf->cache_tombstones > 0)
+    {
+      if (_gdbm_cache_reclaim (dbf))
+	return -1;
+      return _gdbm_end_update (dbf);
+    }
+  return 0;
+}
+
+static int
+setopt_gdbm_getlazydelete (GDBM_FILE dbf, void *optval, int optlen)
+{
+  if (!optval || optlen != sizeof (int))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_OPT_BADVAL, FALSE);
+      return -1;
+    }
+  *(int*) optval = !!dbf->lazy_delete;
+  return 0;
+}
+
 typedef int (*setopt_handler) (GDBM_FILE, void *, int);
 
 static setopt_handler setopt_handler_tab[] = {
@@ -411,6 +510,11 @@ static setopt_handler setopt_handler_tab[] = {
   [GDBM_GETBUCKETSIZE]   = setopt_gdbm_getbucketsize,
   [GDBM_GETCACHEAUTO]    = setopt_gdbm_getcacheauto,
   [GDBM_SETCACHEAUTO]    = setopt_gdbm_setcacheauto,
+  [GDBM_SETDIRDEPTH]     = setopt_gdbm_setdirdepth,
+  [GDBM_SETFLUSHBUDGET]  = setopt_gdbm_setflushbudget,
+  [GDBM_GETFLUSHBUDGET]  = setopt_gdbm_getflushbudget,
+  [GDBM_SETLAZYDELETE]   = setopt_gdbm_setlazydelete,
+  [GDBM_GETLAZYDELETE]   = setopt_gdbm_getlazydelete,
 };
   
 int
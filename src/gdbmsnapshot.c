@@ -0,0 +1,363 @@
+/* gdbmsnapshot.c - Point-in-time snapshots of a database. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+#include <stdint.h>
+
+/* A snapshot is a read-only GDBM_FILE that shows the database as it was
+   when the snapshot was taken.  It has its own copy of the file header
+   and of the directory, and opens the database file anew.
+   Buckets and records are read from the file, as usual.
+
+   To keep them intact, the database the snapshot was taken of changes
+   the way it uses the file, for as long as any of its snapshots is open:
+
+   1. File space that becomes free is not reused.  It is kept in a list,
+      and made available on the first flush of the database after the
+      last snapshot is closed (see _gdbm_free and
+      _gdbm_snapshot_release).  Closing a snapshot thus never writes to
+      the database.
+   2. A bucket that was on disk when the last snapshot was taken is not
+      overwritten.  When it is to be written, it is moved to a new block
+      instead, which is remembered as "fresh" (see _gdbm_write_bucket).
+      Fresh buckets and the buckets created by splits can be written in
+      place, since no snapshot refers to them.
+   3. Records are never updated in place.
+
+   The header and the directory are still written in place: snapshots
+   don't read them from disk. */
+
+/* File space kept for the snapshots. */
+struct gdbm_pin
+{
+  avail_elem *deferred;  /* Space freed while snapshots are open. */
+  size_t ndeferred;      /* Number of entries in deferred. */
+  size_t maxdeferred;    /* Its capacity. */
+  off_t *fresh;          /* Hash table of buckets written since the last
+			    snapshot was taken (0 marks a free slot). */
+  size_t nfresh;         /* Number of entries in fresh. */
+  int fresh_bits;        /* Capacity of fresh is 2^fresh_bits. */
+};
+
+#define FRESH_INIT_BITS 6
+
+static inline size_t
+fresh_hash (off_t adr, int bits)
+{
+  return ((uint64_t) adr * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+}
+
+static void
+fresh_insert (off_t *tab, int bits, off_t adr)
+{
+  size_t mask = ((size_t) 1 << bits) - 1;
+  size_t i;
+
+  for (i = fresh_hash (adr, bits); tab[i] != 0; i = (i + 1) & mask)
+    if (tab[i] == adr)
+      return;
+  tab[i] = adr;
+}
+
+/* Return true if the bucket at ADR has been written to a new place since
+   the last snapshot of DBF was taken. */
+int
+_gdbm_snapshot_fresh_p (GDBM_FILE dbf, off_t adr)
+{
+  struct gdbm_pin *pin = dbf->pin;
+  size_t mask, i;
+
+  if (!pin || !pin->fresh)
+    return 0;
+  mask = ((size_t) 1 << pin->fresh_bits) - 1;
+  for (i = fresh_hash (adr, pin->fresh_bits); pin->fresh[i] != 0;
+       i = (i + 1) & mask)
+    if (pin->fresh[i] == adr)
+      return 1;
+  return 0;
+}
+
+/* Remember that the bucket at ADR is not read by any snapshot of DBF.
+   If memory is short, the bucket is not remembered, which means only
+   that it will be moved once more. */
+void
+_gdbm_snapshot_fresh (GDBM_FILE dbf, off_t adr)
+{
+  struct gdbm_pin *pin = dbf->pin;
+
+  if (!pin)
+    return;
+  if (!pin->fresh || (pin->nfresh + 1) * 2 > ((size_t) 1 << pin->fresh_bits))
+    {
+      int bits = pin->fresh ? pin->fresh_bits + 1 : FRESH_INIT_BITS;
+      off_t *tab = calloc ((size_t) 1 << bits, sizeof (tab[0]));
+      size_t i;
+
+      if (!tab)
+	return;
+      if (pin->fresh)
+	{
+	  for (i = 0; i < ((size_t) 1 << pin->fresh_bits); i++)
+	    if (pin->fresh[i])
+	      fresh_insert (tab, bits, pin->fresh[i]);
+	  free (pin->fresh);
+	}
+      pin->fresh = tab;
+      pin->fresh_bits = bits;
+    }
+  fresh_insert (pin->fresh, pin->fresh_bits, adr);
+  pin->nfresh++;
+}
+
+/* Keep SIZE bytes at ADR, freed while snapshots of DBF are open, until
+   the last of them is closed.  Return 0 on success and -1 if memory is
+   short.  */
+int
+_gdbm_snapshot_defer_free (GDBM_FILE dbf, off_t adr, int size)
+{
+  struct gdbm_pin *pin = dbf->pin;
+
+  if (size <= IGNORE_SIZE)
+    return 0;
+  if (pin->ndeferred == pin->maxdeferred)
+    {
+      size_t n = pin->maxdeferred ? pin->maxdeferred * 2 : 64;
+      avail_elem *p = realloc (pin->deferred, n * sizeof (p[0]));
+
+      if (!p)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return -1;
+	}
+      pin->deferred = p;
+      pin->maxdeferred = n;
+    }
+  pin->deferred[pin->ndeferred].av_adr = adr;
+  pin->deferred[pin->ndeferred].av_size = size;
+  pin->ndeferred++;
+  return 0;
+}
+
+/* Free the file space kept for the snapshots of DBF.  If RELEASE is true,
+   make it available for reuse first.  Return 0 on success and -1 if
+   the space could not be released. */
+static int
+pin_free (GDBM_FILE dbf, int release)
+{
+  struct gdbm_pin *pin = dbf->pin;
+  int rc = 0;
+
+  if (!pin)
+    return 0;
+  dbf->pin = NULL;
+
+  if (release && pin->ndeferred > 0
+      && dbf->desc != -1 && !dbf->need_recovery)
+    {
+      if (dbf->bucket != NULL || (rc = _gdbm_get_bucket (dbf, 0)) == 0)
+	{
+	  size_t i;
+
+	  for (i = 0; i < pin->ndeferred; i++)
+	    if ((rc = _gdbm_free (dbf, pin->deferred[i].av_adr,
+				  pin->deferred[i].av_size)) != 0)
+	      break;
+	  _gdbm_current_bucket_changed (dbf);
+	}
+    }
+
+  free (pin->deferred);
+  free (pin->fresh);
+  free (pin);
+  return rc;
+}
+
+/* If all snapshots of DBF have been closed, make the file space kept for
+   them available for reuse.  This is called when DBF is flushed, rather
+   than when the last snapshot is closed, so that closing a snapshot
+   doesn't change the database. */
+int
+_gdbm_snapshot_release (GDBM_FILE dbf)
+{
+  if (!dbf->pin || dbf->snapshots || dbf->read_write == GDBM_READER)
+    return 0;
+  return pin_free (dbf, TRUE);
+}
+
+/* Take a snapshot of DBF.  Pending changes are written first. */
+GDBM_FILE
+gdbm_snapshot_open (GDBM_FILE dbf)
+{
+  GDBM_FILE snap;
+  struct stat st, snap_st;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, NULL);
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  if (dbf->snapshot)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return NULL;
+    }
+
+  /* Bring the file up to date and read in the entire directory. */
+  if (dbf->read_write != GDBM_READER && _gdbm_flush (dbf))
+    return NULL;
+  if (_gdbm_dir_load (dbf, 0, GDBM_DIR_COUNT (dbf)))
+    return NULL;
+
+  if (!dbf->pin)
+    {
+      dbf->pin = calloc (1, sizeof (*dbf->pin));
+      if (!dbf->pin)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  return NULL;
+	}
+    }
+
+  snap = calloc (1, sizeof (*snap));
+  if (!snap)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return NULL;
+    }
+  snap->desc = -1;
+  snap->file_size = -1;
+  snap->mapped_size_max = SIZE_T_MAX;
+  snap->fatal_err = dbf->fatal_err;
+  snap->fast_write = TRUE;
+  snap->read_write = GDBM_READER;
+  snap->snapshot = TRUE;
+  snap->cloexec = dbf->cloexec;
+  _gdbmsync_init (snap);
+
+  snap->name = strdup (dbf->name);
+  snap->header = malloc (dbf->header->block_size);
+  if (!snap->name || !snap->header)
+    {
+      gdbm_close (snap);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return NULL;
+    }
+  memcpy (snap->header, dbf->header, dbf->header->block_size);
+  snap->avail = (avail_block *) ((char *) snap->header
+				 + GDBM_HEADER_AVAIL_OFFSET (dbf));
+  snap->avail_size = dbf->avail_size;
+  if (dbf->xheader)
+    snap->xheader = (gdbm_ext_header *) ((char *) snap->header
+					 + ((char *) dbf->xheader
+					    - (char *) dbf->header));
+  /* The directory pages are shared with the database, which copies
+     them before modifying. */
+  if (_gdbm_dir_share (snap, dbf))
+    {
+      gdbm_close (snap);
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return NULL;
+    }
+
+  /* The snapshot opens the file anew, so that it has its own file offset
+     and can be read independently of the database.  The descriptor keeps
+     the file open after the database is closed or reorganized. */
+  snap->desc = open (dbf->name, O_RDONLY | (snap->cloexec ? O_CLOEXEC : 0));
+  if (snap->desc == -1)
+    {
+      gdbm_close (snap);
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_OPEN_ERROR, FALSE);
+      return NULL;
+    }
+  if (fstat (snap->desc, &snap_st) || fstat (dbf->desc, &st))
+    {
+      gdbm_close (snap);
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_STAT_ERROR, FALSE);
+      return NULL;
+    }
+  if (snap_st.st_dev != st.st_dev || snap_st.st_ino != st.st_ino)
+    {
+      /* The file has been renamed or replaced since it was opened. */
+      gdbm_close (snap);
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_OPEN_ERROR, FALSE);
+      return NULL;
+    }
+
+  if (_gdbm_cache_init (snap, DEFAULT_CACHESIZE))
+    {
+      int ec = gdbm_last_errno (snap);
+      gdbm_close (snap);
+      GDBM_SET_ERRNO (dbf, ec, FALSE);
+      return NULL;
+    }
+
+  /* All buckets on disk are now read by the new snapshot. */
+  if (dbf->pin->fresh)
+    memset (dbf->pin->fresh, 0,
+	    ((size_t) 1 << dbf->pin->fresh_bits) * sizeof (off_t));
+  dbf->pin->nfresh = 0;
+
+  snap->snapshot_of = dbf;
+  snap->snapshot_next = dbf->snapshots;
+  dbf->snapshots = snap;
+
+  return snap;
+}
+
+/* Remove the snapshot SNAP from the list of its database.  The space
+   kept for the snapshots is released by the next flush of the database
+   (see _gdbm_snapshot_release). */
+void
+_gdbm_snapshot_unlink (GDBM_FILE snap)
+{
+  GDBM_FILE dbf = snap->snapshot_of;
+  GDBM_FILE *pp;
+
+  if (!dbf)
+    return;
+  for (pp = &dbf->snapshots; *pp; pp = &(*pp)->snapshot_next)
+    if (*pp == snap)
+      {
+	*pp = snap->snapshot_next;
+	break;
+      }
+  snap->snapshot_of = NULL;
+
+  /* Nothing to release if no space has been freed. */
+  if (dbf->snapshots == NULL && dbf->pin && dbf->pin->ndeferred == 0)
+    pin_free (dbf, FALSE);
+}
+
+/* Detach all snapshots from DBF, which is being closed or replaced with
+   a new file.  The snapshots remain readable.  If RELEASE is true, the
+   space kept for them is made available for reuse. */
+void
+_gdbm_snapshot_detach (GDBM_FILE dbf, int release)
+{
+  while (dbf->snapshots)
+    {
+      GDBM_FILE snap = dbf->snapshots;
+      dbf->snapshots = snap->snapshot_next;
+      snap->snapshot_of = NULL;
+      snap->snapshot_next = NULL;
+    }
+  pin_free (dbf, release);
+}
@@ -22,6 +22,69 @@
 #include "gdbmdefs.h"
 
 
+/* Write the record KEY/CONTENT to the file at address FILE_ADR. */
+static int
+write_record (GDBM_FILE dbf, off_t file_adr, datum key, datum content)
+{
+  off_t file_pos;		/* The position after a lseek. */
+  int rc;
+
+  file_pos = gdbm_file_seek (dbf, file_adr, SEEK_SET);
+  if (file_pos != file_adr)
+    {
+      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
+		  "%s: lseek: %s", dbf->name, strerror (errno));      
+      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
+      _gdbm_fatal (dbf, _("lseek error"));
+      return -1;
+    }
+
+  rc = _gdbm_full_write (dbf, key.dptr, key.dsize);
+  if (rc)
+    {
+      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
+		  "%s: error writing key: %s",
+		  dbf->name, gdbm_db_strerror (dbf));      
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return -1;
+    }
+
+  rc = _gdbm_full_write (dbf, content.dptr, content.dsize);
+  if (rc)
+    {
+      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
+		  "%s: error writing content: %s",
+		  dbf->name, gdbm_db_strerror (dbf));      
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return -1;
+    }
+  return 0;
+}
+
+/* Find a free slot for an element with hash value HASH_VAL in the current
+   bucket, claim it and return its index.  Return -1 on error. */
+static int
+new_element (GDBM_FILE dbf, int hash_val)
+{
+  int elem_loc, start_loc;
+
+  elem_loc = start_loc = hash_val % dbf->header->bucket_elems;
+  while (dbf->bucket->h_table[elem_loc].hash_value != -1)
+    {
+      elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
+      if (elem_loc == start_loc)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_TABLE, TRUE);
+	  return -1;
+	}
+    }
+      
+  /* We now have another element in the bucket.  Add the new information.*/
+  dbf->bucket->count++;
+  dbf->bucket->h_table[elem_loc].hash_value = hash_val;
+  return elem_loc;
+}
+
 /* Add a new element to the database.  CONTENT is keyed by KEY.  The
    file on disk is updated to reflect the structure of the new database
    before returning from this procedure.  The FLAGS define the action to
@@ -37,15 +100,19 @@
 
 int
 gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
+{
+  return gdbm_store_expire (dbf, key, content, flags, 0);
+}
+
+/* Same as gdbm_store, but the record expires at the time EXPIRE, unless
+   it is 0.  Expiration times can be set only in databases created with
+   the GDBM_EXPIRE flag. */
+int
+gdbm_store_expire (GDBM_FILE dbf, datum key, datum content, int flags,
+		   time_t expire)
 {
   int  new_hash_val;		/* The new hash value. */
   int  elem_loc;		/* The location in hash bucket. */
-  off_t file_adr;		/* The address of new space in the file.  */
-  off_t file_pos;		/* The position after a lseek. */
-  off_t free_adr;		/* For keeping track of a freed section. */
-  int  free_size;
-  int   new_size;		/* Used in allocating space. */
-  int rc;
 
   GDBM_DEBUG_DATUM (GDBM_DEBUG_STORE, key, "%s: storing key:", dbf->name);
 
@@ -68,6 +135,11 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
 		       GDBM_DEBUG_STORE);
       return -1;
     }
+  if (expire != 0 && !_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+    {
+      GDBM_SET_ERRNO2 (dbf, GDBM_NOT_SUPPORTED, FALSE, GDBM_DEBUG_STORE);
+      return -1;
+    }
 
   /* Initialize the gdbm_errno variable. */
   gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
@@ -76,20 +148,61 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
      A side effect loads the correct bucket and calculates the hash value. */
   elem_loc = _gdbm_findkey (dbf, key, NULL, &new_hash_val);
 
+  /* Did we find the item? */
+  if (elem_loc != -1)
+    {
+      if (flags != GDBM_REPLACE)
+	{
+	  GDBM_SET_ERRNO2 (dbf, GDBM_CANNOT_REPLACE, FALSE,
+			   GDBM_DEBUG_STORE);
+	  return 1;
+	}
+    }
+  else if (gdbm_errno == GDBM_ITEM_NOT_FOUND)
+    gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE); /* clear error state */
+  else
+    return -1;
+
+  return _gdbm_store_elem (dbf, key, content, elem_loc, new_hash_val,
+			   expire);
+}
+
+/* Store CONTENT as the value of KEY in the current bucket of DBF and
+   update the file.  ELEM_LOC is the location of the element of KEY, which
+   is replaced, or -1 if KEY is not in the database.  NEW_HASH_VAL is the
+   hash value of KEY.  EXPIRE is the expiration time of the record. */
+int
+_gdbm_store_elem (GDBM_FILE dbf, datum key, datum content, int elem_loc,
+		  int new_hash_val, time_t expire)
+{
+  off_t file_adr;		/* The address of new space in the file.  */
+  off_t free_adr;		/* For keeping track of a freed section. */
+  int  free_size;
+  int   new_size;		/* Used in allocating space. */
+  int   inline_rec;		/* Is the record kept in the bucket? */
+  bucket_element *elt;		/* Bucket element of the record. */
+  datum value = content;	/* The data as supplied by the caller. */
+
+  /* Encode the data. */
+  if (_gdbm_data_encoded_p (dbf)
+      && _gdbm_data_encode (dbf, &content, expire))
+    return -1;
+
   /* Initialize these. */
   file_adr = 0;
   new_size = key.dsize + content.dsize;
+  inline_rec = _gdbm_inline_p (dbf, key.dsize, content.dsize);
 
-  /* Did we find the item? */
   if (elem_loc != -1)
     {
-      if (flags == GDBM_REPLACE)
+      /* Just replace the data. */
+      elt = &dbf->bucket->h_table[elem_loc];
+      if (!_gdbm_elem_inline_p (dbf, elt))
 	{
-	  /* Just replace the data. */
-	  free_adr = dbf->bucket->h_table[elem_loc].data_pointer;
-	  free_size = dbf->bucket->h_table[elem_loc].key_size
-	              + dbf->bucket->h_table[elem_loc].data_size;
-	  if (free_size != new_size)
+	  free_adr = elt->data_pointer;
+	  free_size = elt->key_size + elt->data_size;
+	  if (inline_rec || free_size != new_size
+	      || _gdbm_snapshot_active_p (dbf))
 	    {
 	      if (_gdbm_free (dbf, free_adr, free_size))
 		return -1;
@@ -100,21 +213,18 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
 	      file_adr = free_adr;
 	    }
 	}
-      else
-	{
-	  GDBM_SET_ERRNO2 (dbf, GDBM_CANNOT_REPLACE, FALSE,
-			   GDBM_DEBUG_STORE);
-	  return 1;
-	}
     }
-  else if (gdbm_errno == GDBM_ITEM_NOT_FOUND)
-    gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE); /* clear error state */
-  else
+
+  /* Make room for the new entry, reclaiming tombstones and splitting
+     the current bucket as needed.  This is done before allocating space
+     for the data, so that a failure to split leaves the database
+     intact. */
+  if (elem_loc == -1 && _gdbm_bucket_room (dbf, new_hash_val))
     return -1;
 
   /* Get the file address for the new space.
      (Current bucket's free space is first place to look.) */
-  if (file_adr == 0)
+  if (!inline_rec && file_adr == 0)
     {
       file_adr = _gdbm_alloc (dbf, new_size);
       if (file_adr == 0)
@@ -124,74 +234,90 @@ gdbm_store (GDBM_FILE dbf, datum key, datum content, int flags)
   /* If this is a new entry in the bucket, we need to do special things. */
   if (elem_loc == -1)
     {
-      int start_loc;
-      
-      if (dbf->bucket->count == dbf->header->bucket_elems)
-	{
-	  /* Split the current bucket. */
-	  if (_gdbm_split_bucket (dbf, new_hash_val))
-	    return -1;
-	}
-      
       /* Find space to insert into bucket and set elem_loc to that place. */
-      elem_loc = start_loc = new_hash_val % dbf->header->bucket_elems;
-      while (dbf->bucket->h_table[elem_loc].hash_value != -1)
-	{
-	  elem_loc = (elem_loc + 1) % dbf->header->bucket_elems;
-	  if (elem_loc == start_loc)
-	    {
-	      GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_TABLE, TRUE);
-	      return -1;
-	    }
-	}
-      
-      /* We now have another element in the bucket.  Add the new information.*/
-      dbf->bucket->count++;
-      dbf->bucket->h_table[elem_loc].hash_value = new_hash_val;
-      memcpy (dbf->bucket->h_table[elem_loc].key_start, key.dptr,
-	     (SMALL < key.dsize ? SMALL : key.dsize));
+      elem_loc = new_element (dbf, new_hash_val);
+      if (elem_loc == -1)
+	return -1;
     }
 
-
-  /* Update current bucket data pointer and sizes. */
-  dbf->bucket->h_table[elem_loc].data_pointer = file_adr;
-  dbf->bucket->h_table[elem_loc].key_size = key.dsize;
-  dbf->bucket->h_table[elem_loc].data_size = content.dsize;
-
-  /* Write the data to the file. */
-  file_pos = gdbm_file_seek (dbf, file_adr, SEEK_SET);
-  if (file_pos != file_adr)
+  /* Update current bucket element. */
+  elt = &dbf->bucket->h_table[elem_loc];
+  elt->key_size = key.dsize;
+  elt->data_size = content.dsize;
+  if (inline_rec)
     {
-      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: lseek: %s", dbf->name, strerror (errno));      
-      GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
-      _gdbm_fatal (dbf, _("lseek error"));
-      return -1;
+      /* Keep the record in the bucket element. */
+      memcpy (_gdbm_elem_inline (elt), key.dptr, key.dsize);
+      memcpy (_gdbm_elem_inline (elt) + key.dsize, content.dptr,
+	      content.dsize);
     }
-
-  rc = _gdbm_full_write (dbf, key.dptr, key.dsize);
-  if (rc)
+  else
     {
-      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: error writing key: %s",
-		  dbf->name, gdbm_db_strerror (dbf));      
-      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
-      return -1;
-    }
+      _gdbm_key_start (dbf, key, elt->key_start);
+      elt->data_pointer = file_adr;
 
-  rc = _gdbm_full_write (dbf, content.dptr, content.dsize);
-  if (rc)
-    {
-      GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
-		  "%s: error writing content: %s",
-		  dbf->name, gdbm_db_strerror (dbf));      
-      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
-      return -1;
+      /* Write the data to the file. */
+      if (write_record (dbf, file_adr, key, content))
+	return -1;
     }
 
   /* Current bucket has changed. */
   _gdbm_current_bucket_changed (dbf);
 
   /* Write everything that is needed to the disk. */
+  if (_gdbm_end_update (dbf))
+    return -1;
+
+  if (_gdbm_change_reported_p (dbf))
+    return _gdbm_report_change (dbf, GDBM_CHANGE_STORE, key, value, expire);
+  return 0;
+}
+
+/* Link the record KEY, which has already been written to the file at
+   address FILE_ADR, followed by DATA_SIZE bytes of data (as stored in
+   the file), into the database.  FLAGS and the return value are as for
+   gdbm_store.  The space at FILE_ADR is not freed on failure. */
+int
+_gdbm_store_at (GDBM_FILE dbf, datum key, off_t file_adr, int data_size,
+		int flags)
+{
+  int  new_hash_val;		/* The new hash value. */
+  int  elem_loc;		/* The location in hash bucket. */
+  bucket_element *elt;		/* Bucket element of the record. */
+
+  elem_loc = _gdbm_findkey (dbf, key, NULL, &new_hash_val);
+  if (elem_loc != -1)
+    {
+      if (flags != GDBM_REPLACE)
+	{
+	  GDBM_SET_ERRNO2 (dbf, GDBM_CANNOT_REPLACE, FALSE,
+			   GDBM_DEBUG_STORE);
+	  return 1;
+	}
+      elt = &dbf->bucket->h_table[elem_loc];
+      if (!_gdbm_elem_inline_p (dbf, elt)
+	  && _gdbm_free (dbf, elt->data_pointer,
+			 elt->key_size + elt->data_size))
+	return -1;
+    }
+  else if (gdbm_errno == GDBM_ITEM_NOT_FOUND)
+    {
+      gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+      if (_gdbm_bucket_room (dbf, new_hash_val))
+	return -1;
+      elem_loc = new_element (dbf, new_hash_val);
+      if (elem_loc == -1)
+	return -1;
+    }
+  else
+    return -1;
+
+  elt = &dbf->bucket->h_table[elem_loc];
+  elt->key_size = key.dsize;
+  elt->data_size = data_size;
+  _gdbm_key_start (dbf, key, elt->key_start);
+  elt->data_pointer = file_adr;
+
+  _gdbm_current_bucket_changed (dbf);
   return _gdbm_end_update (dbf);
 }
@@ -464,13 +464,17 @@ gdbm_sync (GDBM_FILE dbf)
   /* Initialize the gdbm_errno variable. */
   gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
 
+  /* A snapshot is never written. */
+  if (dbf->snapshot)
+    return 0;
+
   if (dbf->xheader)
     {
       dbf->xheader->numsync++;
       dbf->header_changed = TRUE;
     }
   
-  _gdbm_end_update (dbf);
+  _gdbm_flush (dbf);
   
   /* Do the sync on the file. */
   return gdbm_file_sync (dbf);
@@ -0,0 +1,330 @@
+/* gdbmupdate.c - Read-modify-write operations on records. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+/* Replace the value at ELEM_LOC with its copy, in which DATA.dsize bytes
+   starting at OFFSET are replaced by DATA.  This is used when the value
+   can't be modified in place. */
+static int
+update_copy (GDBM_FILE dbf, datum key, int elem_loc, int offset, datum data)
+{
+  char *dptr;
+  datum content;
+  int rc;
+
+  dptr = _gdbm_read_entry (dbf, elem_loc);
+  if (!dptr)
+    return -1;
+  content.dsize = dbf->cache_mru->ca_data.data_size;
+  if (offset > content.dsize)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return -1;
+    }
+  if (data.dsize > INT_MAX - offset)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALFORMED_DATA, FALSE);
+      return -1;
+    }
+  if (offset + data.dsize > content.dsize)
+    content.dsize = offset + data.dsize;
+  content.dptr = malloc (content.dsize ? content.dsize : 1);
+  if (!content.dptr)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return -1;
+    }
+  memcpy (content.dptr, dptr + key.dsize,
+	  dbf->cache_mru->ca_data.data_size);
+  memcpy (content.dptr + offset, data.dptr, data.dsize);
+  rc = _gdbm_store_elem (dbf, key, content, elem_loc,
+			 dbf->bucket->h_table[elem_loc].hash_value,
+			 dbf->cache_mru->ca_data.expire);
+  free (content.dptr);
+  return rc;
+}
+
+/* Replace DATA.dsize bytes of the value of KEY, starting at OFFSET, with
+   DATA.  If the range extends past the end of the value, the value is
+   extended.  OFFSET must not exceed the value size.
+
+   Values stored verbatim are patched in place, as long as their size
+   doesn't change.  Otherwise, the value is rewritten as by gdbm_store.
+   In databases with generations, the bucket is rewritten in either
+   case, to record the generation of the change.
+
+   Return 0 on success and -1 on error. */
+int
+gdbm_update_range (GDBM_FILE dbf, datum key, int offset, datum data)
+{
+  int elem_loc;
+  bucket_element *elt;
+  off_t adr;
+  int size;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -1;
+    }
+
+  if (key.dptr == NULL || data.dptr == NULL || data.dsize < 0)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALFORMED_DATA, FALSE);
+      return -1;
+    }
+  if (offset < 0)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return -1;
+    }
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  /* Locate the entry without reading its data. */
+  elem_loc = _gdbm_findkey (dbf, key, NULL, NULL);
+  if (elem_loc == -1)
+    return -1;
+
+  elt = &dbf->bucket->h_table[elem_loc];
+  if (_gdbm_elem_inline_p (dbf, elt))
+    return update_copy (dbf, key, elem_loc, offset, data);
+
+  adr = elt->data_pointer + elt->key_size;
+  size = elt->data_size;
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+    {
+      /* Skip the expiration time. */
+      if (size < GDBM_EXPIRE_SIZE)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	  return -1;
+	}
+      adr += GDBM_EXPIRE_SIZE;
+      size -= GDBM_EXPIRE_SIZE;
+    }
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_COMPRESS))
+    {
+      /* Only values stored verbatim can be patched in place. */
+      unsigned char codec;
+
+      if (gdbm_file_seek (dbf, adr, SEEK_SET) != adr)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+	  _gdbm_fatal (dbf, _("lseek error"));
+	  return -1;
+	}
+      if (size < 1)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	  return -1;
+	}
+      if (_gdbm_full_read (dbf, &codec, 1))
+	return -1;
+      if (codec != GDBM_CODEC_NONE)
+	return update_copy (dbf, key, elem_loc, offset, data);
+      adr++;
+      size--;
+    }
+
+  if (offset > size)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return -1;
+    }
+  /* Records read by snapshots must not be modified. */
+  if (data.dsize > size - offset || _gdbm_snapshot_active_p (dbf))
+    return update_copy (dbf, key, elem_loc, offset, data);
+
+  /* Patch the value in place. */
+  if (dbf->cache_mru->ca_data.elem_loc == elem_loc)
+    dbf->cache_mru->ca_data.elem_loc = -1;
+
+  adr += offset;
+  if (gdbm_file_seek (dbf, adr, SEEK_SET) != adr)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+      _gdbm_fatal (dbf, _("lseek error"));
+      return -1;
+    }
+  if (_gdbm_full_write (dbf, data.dptr, data.dsize))
+    {
+      _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+      return -1;
+    }
+
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_GENERATION))
+    {
+      /* Rewrite the bucket, so that its generation stamp shows the
+	 change to incremental dumps. */
+      _gdbm_current_bucket_changed (dbf);
+      if (_gdbm_end_update (dbf))
+	return -1;
+    }
+  else if (dbf->fast_write == FALSE)
+    /* Sync the file if fast_write is FALSE. */
+    gdbm_file_sync (dbf);
+
+  if (_gdbm_change_reported_p (dbf))
+    return _gdbm_report_stored (dbf, key);
+  return 0;
+}
+
+/* Look up KEY in DBF for a read-modify-write operation.  On success,
+   return the location of its element, or -1 if it is not found.  In the
+   latter case, gdbm_errno is cleared.  The value of the key, its hash
+   value and expiration time are returned in *VALUE, *HASH_VAL and
+   *EXPIRE.  On error, return -2. */
+static int
+rmw_lookup (GDBM_FILE dbf, datum key, datum *value, int *hash_val,
+	    time_t *expire)
+{
+  int elem_loc;
+  char *dptr;
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return -2;
+    }
+  if (key.dptr == NULL)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALFORMED_DATA, FALSE);
+      return -2;
+    }
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  elem_loc = _gdbm_findkey (dbf, key, &dptr, hash_val);
+  if (elem_loc == -1)
+    {
+      if (gdbm_errno != GDBM_ITEM_NOT_FOUND)
+	return -2;
+      gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+      value->dptr = NULL;
+      value->dsize = 0;
+      *expire = 0;
+    }
+  else
+    {
+      value->dptr = dptr;
+      value->dsize = dbf->cache_mru->ca_data.data_size;
+      *expire = dbf->cache_mru->ca_data.expire;
+    }
+  return elem_loc;
+}
+
+/* Compare-and-swap.  If the current value of KEY equals EXPECTED, replace
+   it with NEWVAL.  An EXPECTED with NULL dptr stands for a missing key,
+   and a NEWVAL with NULL dptr requests deleting the key.
+
+   Return 0 if the value was swapped, 1 if the current value differs from
+   EXPECTED (gdbm_errno is set to GDBM_CANNOT_REPLACE), and -1 on
+   error. */
+int
+gdbm_cas (GDBM_FILE dbf, datum key, datum expected, datum newval)
+{
+  int elem_loc;
+  int hash_val;
+  time_t expire;
+  datum value;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  elem_loc = rmw_lookup (dbf, key, &value, &hash_val, &expire);
+  if (elem_loc == -2)
+    return -1;
+
+  if (expected.dptr == NULL
+      ? value.dptr != NULL
+      : (value.dptr == NULL
+	 || value.dsize != expected.dsize
+	 || memcmp (value.dptr, expected.dptr, value.dsize) != 0))
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_CANNOT_REPLACE, FALSE);
+      return 1;
+    }
+
+  if (newval.dptr == NULL)
+    return elem_loc == -1 ? 0 : _gdbm_delete_elem (dbf, elem_loc);
+  return _gdbm_store_elem (dbf, key, newval, elem_loc, hash_val, expire);
+}
+
+/* Update the value of KEY by calling FN (KEY, &VALUE, CLOSURE), where VALUE
+   is the current value of KEY or, if it is not in the database, a datum
+   with NULL dptr.  The value points to the internal data cache and may be
+   modified in place; unless it is stored, the cached copy is then
+   discarded.  The return value of FN tells what to do next:
+
+     GDBM_UPDATE_KEEP     leave the record unchanged;
+     GDBM_UPDATE_STORE    store VALUE, as modified by FN, as the new value
+                          of KEY;
+     GDBM_UPDATE_DELETE   delete the record.
+
+   Any other value aborts the operation, and is returned to the caller.
+   Otherwise, return 0 on success and -1 on error. */
+int
+gdbm_update (GDBM_FILE dbf, datum key, gdbm_update_fn fn, void *closure)
+{
+  int elem_loc;
+  int hash_val;
+  time_t expire;
+  datum value;
+  int rc;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  elem_loc = rmw_lookup (dbf, key, &value, &hash_val, &expire);
+  if (elem_loc == -2)
+    return -1;
+
+  rc = fn (key, &value, closure);
+  /* FN may have modified the cached value.  Drop it from the cache,
+     unless it is going to be stored. */
+  if (elem_loc != -1
+      && (rc != GDBM_UPDATE_STORE || value.dptr == NULL || value.dsize < 0))
+    dbf->cache_mru->ca_data.elem_loc = -1;
+  switch (rc)
+    {
+    case GDBM_UPDATE_KEEP:
+      return 0;
+
+    case GDBM_UPDATE_STORE:
+      if (value.dptr == NULL || value.dsize < 0)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALFORMED_DATA, FALSE);
+	  return -1;
+	}
+      return _gdbm_store_elem (dbf, key, value, elem_loc, hash_val, expire);
+
+    case GDBM_UPDATE_DELETE:
+      if (elem_loc == -1)
+	return 0;
+      return _gdbm_delete_elem (dbf, elem_loc);
+    }
+  return rc;
+}
@@ -0,0 +1,413 @@
+/* gdbmvalue.c - Streaming access to record values. */
+
+/* This file is part of GDBM, the GNU data base manager.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.   */
+
+/* Include system configuration before all else. */
+#include "autoconf.h"
+
+#include "gdbmdefs.h"
+
+/* A value handle.  Values stored verbatim in the file are read and
+   written directly at their file offset, bypassing the data cache.
+   Values that can't be accessed this way (inline and compressed ones)
+   are kept in a memory buffer. */
+struct gdbm_value
+{
+  GDBM_FILE dbf;       /* Database the value belongs to. */
+  int writer;          /* True if the handle was created for writing. */
+  int flags;           /* For writers: GDBM_INSERT or GDBM_REPLACE. */
+  datum key;           /* For writers: copy of the key. */
+  off_t rec_adr;       /* For writers: address of the record, or 0. */
+  int rec_size;        /* For writers: size of the record, as stored. */
+  off_t adr;           /* File address of the value, or 0 if buffered. */
+  char *buf;           /* Value buffer, if adr is 0. */
+  size_t size;         /* Size of the value. */
+  size_t pos;          /* Current position. */
+};
+
+static GDBM_VALUE
+value_alloc (GDBM_FILE dbf, size_t size)
+{
+  GDBM_VALUE val = calloc (1, sizeof (*val));
+  if (!val)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      return NULL;
+    }
+  val->dbf = dbf;
+  val->size = size;
+  return val;
+}
+
+static void
+value_free (GDBM_VALUE val)
+{
+  free (val->key.dptr);
+  free (val->buf);
+  free (val);
+}
+
+/* Open the value of KEY for reading. */
+GDBM_VALUE
+gdbm_value_open (GDBM_FILE dbf, datum key)
+{
+  int elem_loc;
+  bucket_element *elt;
+  off_t adr;
+  int size;
+  GDBM_VALUE val;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, NULL);
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  /* Locate the entry without reading its data. */
+  elem_loc = _gdbm_findkey (dbf, key, NULL, NULL);
+  if (elem_loc == -1)
+    return NULL;
+
+  elt = &dbf->bucket->h_table[elem_loc];
+  adr = elt->data_pointer + elt->key_size;
+  size = elt->data_size;
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+    {
+      /* Skip the expiration time. */
+      if (size < GDBM_EXPIRE_SIZE)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	  return NULL;
+	}
+      adr += GDBM_EXPIRE_SIZE;
+      size -= GDBM_EXPIRE_SIZE;
+    }
+  if (!_gdbm_elem_inline_p (dbf, elt)
+      && _gdbm_feature_p (dbf, GDBM_FEAT_COMPRESS))
+    {
+      /* Look at the codec byte. */
+      unsigned char codec;
+
+      if (gdbm_file_seek (dbf, adr, SEEK_SET) != adr)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+	  _gdbm_fatal (dbf, _("lseek error"));
+	  return NULL;
+	}
+      if (size < 1 || _gdbm_full_read (dbf, &codec, 1))
+	{
+	  if (size < 1)
+	    GDBM_SET_ERRNO (dbf, GDBM_BAD_RECORD, FALSE);
+	  return NULL;
+	}
+      if (codec == GDBM_CODEC_NONE)
+	{
+	  adr++;
+	  size--;
+	}
+      else
+	adr = 0;
+    }
+  else if (_gdbm_elem_inline_p (dbf, elt))
+    adr = 0;
+
+  if (adr == 0)
+    {
+      /* Decode the value and keep a copy of it. */
+      char *dptr = _gdbm_read_entry (dbf, elem_loc);
+      if (!dptr)
+	return NULL;
+      val = value_alloc (dbf, dbf->cache_mru->ca_data.data_size);
+      if (!val)
+	return NULL;
+      val->buf = malloc (val->size ? val->size : 1);
+      if (!val->buf)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  value_free (val);
+	  return NULL;
+	}
+      memcpy (val->buf, dptr + key.dsize, val->size);
+    }
+  else
+    {
+      val = value_alloc (dbf, size);
+      if (!val)
+	return NULL;
+      val->adr = adr;
+    }
+  return val;
+}
+
+/* Create a value of SIZE bytes for KEY.  The value is supplied by
+   subsequent calls to gdbm_value_write, and is stored in the database
+   when the handle is closed.  FLAGS is GDBM_INSERT or GDBM_REPLACE, as
+   for gdbm_store.  The record never expires. */
+GDBM_VALUE
+gdbm_value_create (GDBM_FILE dbf, datum key, size_t size, int flags)
+{
+  int elem_loc;
+  int hdr_size;       /* Size of the data header: expiration time and
+			 codec byte. */
+  GDBM_VALUE val;
+
+  /* Return immediately if the database needs recovery */
+  GDBM_ASSERT_CONSISTENCY (dbf, NULL);
+
+  if (dbf->read_write == GDBM_READER)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_READER_CANT_STORE, FALSE);
+      return NULL;
+    }
+
+  hdr_size = 0;
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+    hdr_size += GDBM_EXPIRE_SIZE;
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_COMPRESS))
+    hdr_size++;
+  if (key.dptr == NULL || key.dsize < 0
+      || size > INT_MAX - hdr_size
+      || key.dsize > INT_MAX - hdr_size - (int) size)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALFORMED_DATA, FALSE);
+      return NULL;
+    }
+
+  gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+
+  elem_loc = _gdbm_findkey (dbf, key, NULL, NULL);
+  if (elem_loc != -1)
+    {
+      if (flags != GDBM_REPLACE)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_CANNOT_REPLACE, FALSE);
+	  return NULL;
+	}
+    }
+  else if (gdbm_errno == GDBM_ITEM_NOT_FOUND)
+    gdbm_set_errno (dbf, GDBM_NO_ERROR, FALSE);
+  else
+    return NULL;
+
+  val = value_alloc (dbf, size);
+  if (!val)
+    return NULL;
+  val->writer = TRUE;
+  val->flags = flags;
+  val->key.dptr = malloc (key.dsize ? key.dsize : 1);
+  if (!val->key.dptr)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+      value_free (val);
+      return NULL;
+    }
+  memcpy (val->key.dptr, key.dptr, key.dsize);
+  val->key.dsize = key.dsize;
+
+  if (_gdbm_inline_p (dbf, key.dsize, size + hdr_size))
+    {
+      /* The record will be kept in its bucket element.  Collect the
+	 value in memory and store it on close. */
+      val->buf = malloc (size ? size : 1);
+      if (!val->buf)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, FALSE);
+	  value_free (val);
+	  return NULL;
+	}
+    }
+  else
+    {
+      /* Allocate space for the record and write its key and data
+	 header.  The latter consists of zero expiration time, if
+	 any, and GDBM_CODEC_NONE, which is 0 as well. */
+      char hdr[GDBM_EXPIRE_SIZE + 1] = { 0 };
+
+      val->rec_size = size + hdr_size;
+      val->rec_adr = _gdbm_alloc (dbf, key.dsize + val->rec_size);
+      if (val->rec_adr == 0)
+	{
+	  value_free (val);
+	  return NULL;
+	}
+      _gdbm_current_bucket_changed (dbf);
+      if (_gdbm_end_update (dbf))
+	{
+	  value_free (val);
+	  return NULL;
+	}
+
+      if (gdbm_file_seek (dbf, val->rec_adr, SEEK_SET) != val->rec_adr)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+	  _gdbm_fatal (dbf, _("lseek error"));
+	  value_free (val);
+	  return NULL;
+	}
+      if (_gdbm_full_write (dbf, key.dptr, key.dsize)
+	  || (hdr_size && _gdbm_full_write (dbf, hdr, hdr_size)))
+	{
+	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	  value_free (val);
+	  return NULL;
+	}
+      val->adr = val->rec_adr + key.dsize + hdr_size;
+    }
+  return val;
+}
+
+/* Return the size of the value. */
+size_t
+gdbm_value_size (GDBM_VALUE val)
+{
+  return val->size;
+}
+
+/* Read at most SIZE bytes of the value into BUF.  Return the number
+   of bytes read, 0 at the end of the value, or -1 on error. */
+ssize_t
+gdbm_value_read (GDBM_VALUE val, void *buf, size_t size)
+{
+  GDBM_FILE dbf = val->dbf;
+
+  if (val->writer)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return -1;
+    }
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (size > val->size - val->pos)
+    size = val->size - val->pos;
+  if (size == 0)
+    return 0;
+  if (val->adr == 0)
+    memcpy (buf, val->buf + val->pos, size);
+  else
+    {
+      off_t off = val->adr + val->pos;
+      if (gdbm_file_seek (dbf, off, SEEK_SET) != off)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+	  _gdbm_fatal (dbf, _("lseek error"));
+	  return -1;
+	}
+      if (_gdbm_full_read (dbf, buf, size))
+	return -1;
+    }
+  val->pos += size;
+  return size;
+}
+
+/* Append SIZE bytes from BUF to the value.  Return the number of bytes
+   written, or -1 on error.  Writing past the size given when creating
+   the value is an error. */
+ssize_t
+gdbm_value_write (GDBM_VALUE val, const void *buf, size_t size)
+{
+  GDBM_FILE dbf = val->dbf;
+
+  if (!val->writer || size > val->size - val->pos)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+      return -1;
+    }
+  GDBM_ASSERT_CONSISTENCY (dbf, -1);
+
+  if (size == 0)
+    return 0;
+  if (val->adr == 0)
+    memcpy (val->buf + val->pos, buf, size);
+  else
+    {
+      off_t off = val->adr + val->pos;
+      if (gdbm_file_seek (dbf, off, SEEK_SET) != off)
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_FILE_SEEK_ERROR, TRUE);
+	  _gdbm_fatal (dbf, _("lseek error"));
+	  return -1;
+	}
+      if (_gdbm_full_write (dbf, (void *) buf, size))
+	{
+	  _gdbm_fatal (dbf, gdbm_db_strerror (dbf));
+	  return -1;
+	}
+    }
+  val->pos += size;
+  return size;
+}
+
+/* Close the value handle VAL.  For a handle created by gdbm_value_create,
+   store the value in the database if it has been written completely, or
+   discard it otherwise.  Return 0 on success, 1 if the key exists and
+   GDBM_REPLACE was not given, and -1 on error. */
+int
+gdbm_value_close (GDBM_VALUE val)
+{
+  GDBM_FILE dbf = val->dbf;
+  int rc = 0;
+
+  if (val->writer)
+    {
+      if (val->pos != val->size)
+	{
+	  /* Incomplete value: discard it. */
+	  GDBM_SET_ERRNO (dbf, GDBM_ERR_USAGE, FALSE);
+	  rc = -1;
+	}
+      else if (val->adr == 0)
+	{
+	  datum content;
+
+	  content.dptr = val->buf;
+	  content.dsize = val->size;
+	  rc = gdbm_store (dbf, val->key, content, val->flags);
+	}
+      else if (!dbf->need_recovery)
+	{
+	  rc = _gdbm_store_at (dbf, val->key, val->rec_adr, val->rec_size,
+			       val->flags);
+	  if (rc == 0 && _gdbm_change_reported_p (dbf)
+	      && _gdbm_report_stored (dbf, val->key))
+	    {
+	      /* The record is stored: keep its space. */
+	      val->rec_adr = 0;
+	      rc = -1;
+	    }
+	}
+      else
+	{
+	  GDBM_SET_ERRNO (dbf, GDBM_NEED_RECOVERY, TRUE);
+	  rc = -1;
+	}
+
+      /* Release the space allocated for an unused record. */
+      if (rc != 0 && val->rec_adr != 0 && !dbf->need_recovery)
+	{
+	  int ec = gdbm_last_errno (dbf);
+	  if (_gdbm_get_bucket (dbf, 0) == 0
+	      && _gdbm_free (dbf, val->rec_adr,
+			     val->key.dsize + val->rec_size) == 0)
+	    {
+	      _gdbm_current_bucket_changed (dbf);
+	      _gdbm_end_update (dbf);
+	    }
+	  GDBM_SET_ERRNO (dbf, ec, FALSE);
+	}
+    }
+  value_free (val);
+  return rc;
+}
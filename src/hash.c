@@ -20,6 +20,7 @@
 #include "autoconf.h"
 
 #include "gdbmdefs.h"
+#include <stdint.h>
 
 /* This hash function computes a GDBM_HASH_BITS-bit value.  The value is used
    to index the hash directory using the top n bits.  It is also used in a
@@ -43,6 +44,44 @@ _gdbm_hash (datum key)
   return((int) value);
 }
 
+/* Compute the 32-bit fingerprint of KEY.  It is used instead of the
+   first bytes of the key in databases with the GDBM_FEAT_FINGERPRINT
+   feature.  The algorithm (FNV-1a) is independent of the one used by
+   _gdbm_hash, so that keys with equal hash values are very unlikely to
+   have equal fingerprints. */
+static uint32_t
+fingerprint (datum key)
+{
+  uint32_t value = 2166136261u;
+  int index;
+
+  for (index = 0; index < key.dsize; index++)
+    {
+      value ^= (unsigned char) key.dptr[index];
+      value *= 16777619u;
+    }
+  return value;
+}
+
+/* Store in BUF the value the key_start field of a bucket element
+   must have for KEY.  Return the number of significant bytes. */
+int
+_gdbm_key_start (GDBM_FILE dbf, datum key, char *buf)
+{
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_FINGERPRINT))
+    {
+      uint32_t fp = fingerprint (key);
+      memcpy (buf, &fp, SMALL);
+      return SMALL;
+    }
+  else
+    {
+      int n = SMALL < key.dsize ? SMALL : key.dsize;
+      memcpy (buf, key.dptr, n);
+      return n;
+    }
+}
+
 int
 _gdbm_bucket_dir (GDBM_FILE dbf, int hash)
 {
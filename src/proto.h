@@ -20,63 +20,287 @@
 /* From bucket.c */
 void _gdbm_new_bucket	(GDBM_FILE, hash_bucket *, int);
 int _gdbm_get_bucket	(GDBM_FILE, int);
+int _gdbm_next_bucket	(GDBM_FILE);
+int _gdbm_chain_bucket	(GDBM_FILE);
+int _gdbm_bucket_room	(GDBM_FILE, int);
 
 int _gdbm_split_bucket (GDBM_FILE, int);
 int _gdbm_write_bucket (GDBM_FILE, cache_elem *);
 int _gdbm_cache_init   (GDBM_FILE, size_t);
 void _gdbm_cache_free  (GDBM_FILE dbf);
 int _gdbm_cache_flush  (GDBM_FILE dbf);
+int _gdbm_cache_reclaim (GDBM_FILE dbf);
+int _gdbm_install_bucket (GDBM_FILE dbf, int dir_index, int bits);
 
-/* Mark current bucket as changed. */
+/* Mark cache element ELEM as changed. */
+static inline void
+_gdbm_cache_elem_changed (GDBM_FILE dbf, cache_elem *elem)
+{
+  if (!elem->ca_changed)
+    {
+      elem->ca_changed = TRUE;
+      dbf->cache_dirty++;
+    }
+}
+
+/* Mark current bucket as changed.  Its data cache entry becomes stale. */
 static inline void
 _gdbm_current_bucket_changed (GDBM_FILE dbf)
 {
-  dbf->cache_mru->ca_changed = TRUE;
+  _gdbm_cache_elem_changed (dbf, dbf->cache_mru);
+  dbf->cache_mru->ca_data.elem_loc = -1;
+}
+
+/* From dir.c */
+int _gdbm_dir_init (GDBM_FILE dbf);
+int _gdbm_dir_create (GDBM_FILE dbf, off_t adr);
+int _gdbm_dir_share (GDBM_FILE dst, GDBM_FILE src);
+void _gdbm_dir_free (GDBM_FILE dbf);
+int _gdbm_dir_read (GDBM_FILE dbf, int start, int count);
+int _gdbm_dir_write (GDBM_FILE dbf);
+int _gdbm_dir_set (GDBM_FILE dbf, int start, int end, off_t adr);
+int _gdbm_dir_replace (GDBM_FILE dbf, int start, int end,
+		       off_t old_adr, off_t new_adr);
+int _gdbm_dir_run_end (GDBM_FILE dbf, int dir_index);
+void _gdbm_dir_relocated (GDBM_FILE dbf);
+int _gdbm_dir_prepare (GDBM_FILE dbf);
+int _gdbm_dir_prepare_step (GDBM_FILE dbf);
+int _gdbm_dir_abandon (GDBM_FILE dbf);
+int _gdbm_dir_grow (GDBM_FILE dbf, int bits, off_t *old_adr, int *old_size);
+int _gdbm_bucket_dir_end (GDBM_FILE dbf);
+
+/* Make sure COUNT directory entries starting at START are in memory. */
+static inline int
+_gdbm_dir_load (GDBM_FILE dbf, int start, int count)
+{
+  if (dbf->dir_pages_left == 0)
+    return 0;
+  return _gdbm_dir_read (dbf, start, count);
+}
+
+/* Return the directory entry DIR_INDEX, which must be in memory.  The
+   page holding it may have been built for a smaller directory, in which
+   case it is indexed by the initial bits of DIR_INDEX (see dir.c). */
+static inline off_t
+_gdbm_dir_entry (GDBM_FILE dbf, int dir_index)
+{
+  dir_slot *slot = &dbf->dir[dir_index >> GDBM_DIR_PAGE_BITS];
+
+  if (slot->page == NULL)
+    return slot->adr;
+  return slot->page->ent[(dir_index >> (dbf->header->dir_bits
+					- slot->page->depth))
+			 & (GDBM_DIR_PAGE_ENTRIES - 1)];
+}
+
+/* Compute the range of directory entries referring to the bucket of
+   depth BITS, which contains the entry DIR_INDEX.  Return the index of
+   its first entry in *START, and the index past its last entry in *END. */
+static inline void
+_gdbm_bucket_dir_range (GDBM_FILE dbf, int dir_index, int bits,
+			int *start, int *end)
+{
+  int shift = dbf->header->dir_bits - bits;
+  *start = (dir_index >> shift) << shift;
+  *end = *start + (1 << shift);
 }
 
 /* Return true if the directory entry at DIR_INDEX can be considered
    valid. This means that DIR_INDEX is in the valid range for addressing
-   the dir array, and the offset stored in dir[DIR_INDEX] points past
+   the directory, and the offset stored in its entry points past
    first two blocks in file. This does not necessarily mean that there's
    a valid bucket or data block at that offset. All this implies is that
    it is safe to use the offset for look up in the bucket cache and to
-   attempt to read a block at that offset. */
+   attempt to read a block at that offset.
+
+   The directory page containing DIR_INDEX is read in, if necessary. */
 static inline int
 gdbm_dir_entry_valid_p (GDBM_FILE dbf, int dir_index)
 {
   return dir_index >= 0
          && dir_index < GDBM_DIR_COUNT (dbf)
-         && dbf->dir[dir_index] >= dbf->header->block_size;
+         && _gdbm_dir_load (dbf, dir_index, 1) == 0
+         && _gdbm_dir_entry (dbf, dir_index) >= dbf->header->block_size;
 }
 
 
 /* From falloc.c */
 off_t _gdbm_alloc       (GDBM_FILE, int);
+off_t _gdbm_alloc_central (GDBM_FILE, int);
 int  _gdbm_free         (GDBM_FILE, off_t, int);
 void _gdbm_put_av_elem  (avail_elem, avail_elem [], int *, int);
 int _gdbm_avail_block_read (GDBM_FILE dbf, avail_block *avblk, size_t size);
 
+/* From compress.c */
+int _gdbm_data_encode (GDBM_FILE dbf, datum *content, time_t expire);
+int _gdbm_data_decode (GDBM_FILE dbf, data_cache_elem *ca, int key_size,
+		       int *data_size);
+
+/* From expire.c */
+void _gdbm_expire_encode (char *buf, time_t expire);
+time_t _gdbm_expire_decode (char const *buf);
+int _gdbm_elem_expired (GDBM_FILE dbf, int elem_loc);
+
+/* Return true if the expiration time EXPIRE has passed. */
+static inline int
+_gdbm_expired_p (time_t expire)
+{
+  return expire != 0 && expire <= time (NULL);
+}
+
 /* From findkey.c */
 char *_gdbm_read_entry  (GDBM_FILE, int);
 int _gdbm_findkey       (GDBM_FILE, datum, char **, int *);
+int _gdbm_findkey_any   (GDBM_FILE, datum, char **, int *);
 
 /* From hash.c */
 int _gdbm_hash (datum);
 void _gdbm_hash_key (GDBM_FILE dbf, datum key, int *hash, int *bucket,
 		     int *offset);
 int _gdbm_bucket_dir (GDBM_FILE dbf, int hash);
+int _gdbm_key_start (GDBM_FILE dbf, datum key, char *buf);
 
 /* From update.c */
 int _gdbm_end_update   (GDBM_FILE);
+int _gdbm_flush        (GDBM_FILE);
 void _gdbm_fatal	(GDBM_FILE, const char *);
 
+/* From gdbmdelete.c */
+int _gdbm_delete_elem (GDBM_FILE dbf, int elem_loc);
+int _gdbm_bucket_reclaim (GDBM_FILE dbf);
+int _gdbm_delete_range (GDBM_FILE dbf, int prefix, int bits);
+
+/* From gdbmstore.c */
+int _gdbm_store_elem (GDBM_FILE dbf, datum key, datum content, int elem_loc,
+		      int new_hash_val, time_t expire);
+int _gdbm_store_at (GDBM_FILE dbf, datum key, off_t file_adr, int data_size,
+		    int flags);
+
+/* From gdbmjournal.c */
+int _gdbm_report_change (GDBM_FILE dbf, int op, datum key, datum value,
+			 time_t expire);
+int _gdbm_report_stored (GDBM_FILE dbf, datum key);
+void _gdbm_journal_free (GDBM_FILE dbf);
+
+/* Return true if changes to DBF are reported to a hook or journal. */
+static inline int
+_gdbm_change_reported_p (GDBM_FILE dbf)
+{
+  return dbf->change_hook != NULL || dbf->journal != NULL;
+}
+
+/* From gdbmsnapshot.c */
+int _gdbm_snapshot_defer_free (GDBM_FILE dbf, off_t adr, int size);
+void _gdbm_snapshot_fresh (GDBM_FILE dbf, off_t adr);
+int _gdbm_snapshot_fresh_p (GDBM_FILE dbf, off_t adr);
+void _gdbm_snapshot_unlink (GDBM_FILE snap);
+void _gdbm_snapshot_detach (GDBM_FILE dbf, int release);
+int _gdbm_snapshot_release (GDBM_FILE dbf);
+
+/* Return true if snapshots of DBF are open.  While they are, file space
+   that was in use when the last of them was taken must not be
+   overwritten. */
+static inline int
+_gdbm_snapshot_active_p (GDBM_FILE dbf)
+{
+  return dbf->snapshots != NULL;
+}
+
+/* Return true if the bucket at ADR may be read by a snapshot of DBF. */
+static inline int
+_gdbm_snapshot_pinned_p (GDBM_FILE dbf, off_t adr)
+{
+  return _gdbm_snapshot_active_p (dbf) && !_gdbm_snapshot_fresh_p (dbf, adr);
+}
+
 /* From gdbmopen.c */
 int _gdbm_validate_header (GDBM_FILE dbf);
+int _gdbm_format_flags (GDBM_FILE dbf);
+
+/* Return true if the database uses the extended format feature FEAT. */
+static inline int
+_gdbm_feature_p (GDBM_FILE dbf, unsigned feat)
+{
+  return dbf->header->header_magic == GDBM_EXT_MAGIC
+         && (dbf->xheader->features & feat);
+}
+
+/* Return true if record data in DBF are stored encoded (see compress.c). */
+static inline int
+_gdbm_data_encoded_p (GDBM_FILE dbf)
+{
+  return _gdbm_feature_p (dbf, GDBM_FEAT_COMPRESS | GDBM_FEAT_EXPIRE);
+}
+
+/* Return true if a record of KEY_SIZE and DATA_SIZE bytes is kept inline
+   in its bucket element. */
+static inline int
+_gdbm_inline_p (GDBM_FILE dbf, int key_size, int data_size)
+{
+  return _gdbm_feature_p (dbf, GDBM_FEAT_INLINE)
+         && key_size >= 0 && data_size >= 0
+         && key_size <= GDBM_INLINE_SIZE
+         && data_size <= GDBM_INLINE_SIZE - key_size;
+}
+
+/* Return true if the bucket element ELT keeps its record inline. */
+static inline int
+_gdbm_elem_inline_p (GDBM_FILE dbf, bucket_element const *elt)
+{
+  return _gdbm_inline_p (dbf, elt->key_size, elt->data_size);
+}
+
+/* Return a pointer to the record kept inline in ELT. */
+static inline char *
+_gdbm_elem_inline (bucket_element *elt)
+{
+  return (char *) elt + GDBM_INLINE_OFFSET;
+}
+
+/* Return the generation in which BUCKET was last written.  The database
+   must use the GDBM_FEAT_GENERATION feature. */
+static inline unsigned
+_gdbm_bucket_generation (GDBM_FILE dbf, hash_bucket const *bucket)
+{
+  unsigned gen;
+  memcpy (&gen, (char const *) bucket + dbf->header->bucket_size
+	  - GDBM_BUCKET_GEN_SIZE, sizeof (gen));
+  return gen;
+}
+
+/* Return the offset of the chain trailer in the buckets of DBF.  The
+   database must use the GDBM_FEAT_CHAIN feature. */
+static inline size_t
+_gdbm_bucket_chain_offset (GDBM_FILE dbf)
+{
+  return dbf->header->bucket_size - GDBM_BUCKET_CHAIN_SIZE
+         - (_gdbm_feature_p (dbf, GDBM_FEAT_GENERATION)
+	    ? GDBM_BUCKET_GEN_SIZE : 0);
+}
+
+/* Copy the chain trailer of BUCKET to *CHAIN. */
+static inline void
+_gdbm_bucket_chain_get (GDBM_FILE dbf, hash_bucket const *bucket,
+			bucket_chain *chain)
+{
+  memcpy (chain, (char const *) bucket + _gdbm_bucket_chain_offset (dbf),
+	  sizeof (*chain));
+}
+
+/* Set the chain trailer of BUCKET from *CHAIN. */
+static inline void
+_gdbm_bucket_chain_put (GDBM_FILE dbf, hash_bucket *bucket,
+			bucket_chain const *chain)
+{
+  memcpy ((char *) bucket + _gdbm_bucket_chain_offset (dbf), chain,
+	  sizeof (*chain));
+}
 
 int _gdbm_file_size (GDBM_FILE dbf, off_t *psize);
 
 /* From gdbmload.c */
 int _gdbm_str2fmt (char const *str);
+void _gdbm_fmt_print (FILE *fp, int flags);
 
 /* From mmap.c */
 int _gdbm_mapped_init	(GDBM_FILE);
@@ -106,8 +330,14 @@ int _gdbm_base64_decode (const unsigned char *input, size_t input_len,
 int _gdbm_load (FILE *fp, GDBM_FILE *pdbf, unsigned long *line);
 int _gdbm_dump (GDBM_FILE dbf, FILE *fp);
 
+/* From crc32.c */
+uint32_t _gdbm_crc32 (uint32_t crc, void const *buf, size_t size);
+
 /* From recover.c */
 int _gdbm_next_bucket_dir (GDBM_FILE dbf, int bucket_dir);
+GDBM_FILE _gdbm_open_temp (GDBM_FILE dbf);
+int _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
+			   gdbm_recovery *rcvr, int flags);
 
 
 /* avail.c */
@@ -16,6 +16,7 @@
 
 #include "autoconf.h"
 #include "gdbmdefs.h"
+#include <stdint.h>
 
 #define TMPSUF ".XXXXXX"
 
@@ -87,12 +88,61 @@ backup_name (char const *name)
   return buf;
 }  
 
-static int
+/* Create a new database in a temporary file next to DBF, with the same
+   block size and format.  Return NULL on error. */
+GDBM_FILE
+_gdbm_open_temp (GDBM_FILE dbf)
+{
+  GDBM_FILE new_dbf;
+  char *new_name;
+  int fd;
+
+  new_name = malloc (strlen (dbf->name) + sizeof (TMPSUF));
+  if (!new_name)
+    {
+      GDBM_SET_ERRNO (NULL, GDBM_MALLOC_ERROR, FALSE);
+      return NULL;
+    }
+  strcat (strcpy (new_name, dbf->name), TMPSUF);
+  
+  fd = mkstemp (new_name);
+  if (fd == -1)
+    {
+      GDBM_SET_ERRNO (NULL, GDBM_FILE_OPEN_ERROR, FALSE);
+      free (new_name);
+      return NULL;
+    }
+  
+  new_dbf = gdbm_fd_open (fd, new_name, dbf->header->block_size,
+			  GDBM_WRCREAT
+			  | (dbf->cloexec ? GDBM_CLOEXEC : 0)
+			  | _gdbm_format_flags (dbf)
+			  | GDBM_CLOERROR, dbf->fatal_err);
+  
+  SAVE_ERRNO (free (new_name));
+  
+  if (new_dbf == NULL)
+    GDBM_SET_ERRNO (NULL, GDBM_REORGANIZE_FAILED, FALSE);
+  else if (_gdbm_feature_p (new_dbf, GDBM_FEAT_GENERATION))
+    {
+      /* Carry the generation over.  Every bucket of the new file is
+	 written in it, the initial one included, so that incremental
+	 dumps taken against the old file remain valid. */
+      new_dbf->xheader->numsync = dbf->xheader->numsync;
+      new_dbf->header_changed = TRUE;
+      if (_gdbm_get_bucket (new_dbf, 0) == 0)
+	_gdbm_current_bucket_changed (new_dbf);
+    }
+  return new_dbf;
+}
+
+/* Replace DBF with the database NEW_DBF, which is freed. */
+int
 _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
 		       gdbm_recovery *rcvr, int flags)
 {
   /* Write everything. */
-  if (_gdbm_end_update (new_dbf))
+  if (_gdbm_flush (new_dbf))
     {
       gdbm_close (new_dbf);
       return -1;
@@ -140,12 +190,15 @@ _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
       return -1;
     }
 
+  /* The snapshots keep reading the old file. */
+  _gdbm_snapshot_detach (dbf, FALSE);
+
   /* Fix up DBF to have the correct information for the new file. */
   if (dbf->file_locking)
     _gdbm_unlock_file (dbf);
   close (dbf->desc);
+  _gdbm_dir_free (dbf);
   free (dbf->header);
-  free (dbf->dir);
 
   _gdbm_cache_flush (dbf);
   _gdbm_cache_free (dbf);
@@ -154,6 +207,12 @@ _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
   dbf->desc              = new_dbf->desc;
   dbf->header            = new_dbf->header;
   dbf->dir               = new_dbf->dir;
+  dbf->dir_pages_left    = new_dbf->dir_pages_left;
+  dbf->dir_dirty         = new_dbf->dir_dirty;
+  dbf->dir_next          = new_dbf->dir_next;
+  dbf->dir_next_dirty    = new_dbf->dir_next_dirty;
+  dbf->dir_next_left     = new_dbf->dir_next_left;
+  dbf->dir_next_pos      = new_dbf->dir_next_pos;
   dbf->bucket            = new_dbf->bucket;
   dbf->bucket_dir        = new_dbf->bucket_dir;
 
@@ -182,6 +241,7 @@ _gdbm_finish_transfer (GDBM_FILE dbf, GDBM_FILE new_dbf,
   dbf->mmap_preread      = new_dbf->mmap_preread;        
     
   free (new_dbf->name);
+  free (new_dbf->zbuf);
   free (new_dbf);
    
   /* Make sure the new database is all on disk. */
@@ -197,12 +257,11 @@ _gdbm_next_bucket_dir (GDBM_FILE dbf, int bucket_dir)
   int dir_count = GDBM_DIR_COUNT (dbf);
   if (bucket_dir < 0 || bucket_dir >= dir_count)
     bucket_dir = dir_count;
+  else if (_gdbm_dir_load (dbf, bucket_dir, 1))
+    /* Let the caller discover the error when accessing the next entry. */
+    bucket_dir++;
   else
-    {
-      off_t cur = dbf->dir[bucket_dir];
-      while (++bucket_dir < dir_count && cur == dbf->dir[bucket_dir])
-	;
-    }
+    bucket_dir = _gdbm_dir_run_end (dbf, bucket_dir);
   return bucket_dir;
 }
 
@@ -221,145 +280,308 @@ check_db (GDBM_FILE dbf)
 	return 1;
       else
 	{
-	  if (dbf->bucket->count < 0
-	      || dbf->bucket->count > dbf->header->bucket_elems)
-	    return 1;
-	  for (i = 0; i < dbf->header->bucket_elems; i++)
+	  int next;
+
+	  do
 	    {
-	      char *dptr;
-	      datum key;
-	      int hashval, bucket, off;
-
-	      if (dbf->bucket->h_table[i].hash_value == -1)
-		continue;
-	      dptr = _gdbm_read_entry (dbf, i);
-	      if (!dptr)
+	      if (dbf->bucket->count < 0
+		  || dbf->bucket->count > dbf->header->bucket_elems)
 		return 1;
+	      for (i = 0; i < dbf->header->bucket_elems; i++)
+		{
+		  char *dptr;
+		  datum key;
+		  int hashval, bucket, off;
+		  char key_start[SMALL];
+		  int key_start_len;
+
+		  /* Skip empty slots and tombstones. */
+		  if (dbf->bucket->h_table[i].hash_value < 0)
+		    continue;
+		  dptr = _gdbm_read_entry (dbf, i);
+		  if (!dptr)
+		    return 1;
 	      
-	      key.dptr   = dptr;
-	      key.dsize  = dbf->bucket->h_table[i].key_size;
+		  key.dptr   = dptr;
+		  key.dsize  = dbf->bucket->h_table[i].key_size;
 
-	      if (memcmp (dbf->bucket->h_table[i].key_start, key.dptr,
-			  (SMALL < key.dsize ? SMALL : key.dsize)))
-		return 1;
+		  if (!_gdbm_elem_inline_p (dbf, &dbf->bucket->h_table[i]))
+		    {
+		      key_start_len = _gdbm_key_start (dbf, key, key_start);
+		      if (memcmp (dbf->bucket->h_table[i].key_start, key_start,
+				  key_start_len))
+			return 1;
+		    }
 	      
-	      _gdbm_hash_key (dbf, key, &hashval, &bucket, &off);
-	      if (bucket >= nbuckets)
-		return 1;
-	      if (hashval != dbf->bucket->h_table[i].hash_value)
-		return 1;
-	      if (dbf->dir[bucket] != dbf->dir[bucket_dir])
-		return 1;
+		  _gdbm_hash_key (dbf, key, &hashval, &bucket, &off);
+		  if (bucket >= nbuckets)
+		    return 1;
+		  if (_gdbm_dir_load (dbf, bucket, 1))
+		    return 1;
+		  if (hashval != dbf->bucket->h_table[i].hash_value)
+		    return 1;
+		  if (_gdbm_dir_entry (dbf, bucket)
+		      != _gdbm_dir_entry (dbf, bucket_dir))
+		    return 1;
+		}
 	    }
+	  while ((next = _gdbm_next_bucket (dbf)) == 0);
+	  if (next == -1)
+	    return 1;
 	}
     }
   return 0;
 }
 
+/* A bucket to recover: its address in the file and the index of its
+   first directory entry. */
+struct rcvr_bucket
+{
+  off_t adr;
+  int dir;
+};
+
+static int
+rcvr_bucket_cmp (const void *a, const void *b)
+{
+  struct rcvr_bucket const *pa = a;
+  struct rcvr_bucket const *pb = b;
+
+  if (pa->adr < pb->adr)
+    return -1;
+  if (pa->adr > pb->adr)
+    return 1;
+  return pa->dir - pb->dir;
+}
+
+/* Collect the buckets referenced by the directory of DBF, sorted by their
+   address in the file, so that they can be read in a single sequential
+   pass.  Buckets referenced from several parts of a damaged directory
+   are listed once.  The entries that can't be read are listed with the
+   address 0, so that the attempt to read their bucket fails and is
+   accounted for.  Return the number of buckets in *PCOUNT. */
+static struct rcvr_bucket *
+collect_buckets (GDBM_FILE dbf, size_t *pcount)
+{
+  int dir_count = GDBM_DIR_COUNT (dbf);
+  int bucket_dir;
+  struct rcvr_bucket *buckets;
+  size_t count = 0, i, j;
+
+  buckets = calloc (dir_count, sizeof (buckets[0]));
+  if (!buckets)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_MALLOC_ERROR, dbf->need_recovery);
+      return NULL;
+    }
+
+  for (bucket_dir = 0; bucket_dir < dir_count;
+       bucket_dir = _gdbm_next_bucket_dir (dbf, bucket_dir))
+    {
+      buckets[count].adr = _gdbm_dir_load (dbf, bucket_dir, 1) == 0
+			     ? _gdbm_dir_entry (dbf, bucket_dir) : 0;
+      buckets[count].dir = bucket_dir;
+      count++;
+    }
+
+  qsort (buckets, count, sizeof (buckets[0]), rcvr_bucket_cmp);
+
+  /* Remove duplicates. */
+  for (i = j = 0; i < count; i++)
+    {
+      if (j > 0 && buckets[i].adr != 0 && buckets[i].adr == buckets[j-1].adr)
+	continue;
+      buckets[j++] = buckets[i];
+    }
+
+  *pcount = j;
+  return buckets;
+}
+
+/* Read the key/data pair at ELEM_LOC in the current bucket of DBF and make
+   sure its key matches the hash value kept in the bucket.  Return a
+   pointer to the pair or NULL on error. */
+static char *
+read_valid_entry (GDBM_FILE dbf, int elem_loc)
+{
+  char *dptr;
+  datum key;
+  int hashval, bucket, off;
+
+  dptr = _gdbm_read_entry (dbf, elem_loc);
+  if (!dptr)
+    return NULL;
+
+  key.dptr = dptr;
+  key.dsize = dbf->bucket->h_table[elem_loc].key_size;
+  _gdbm_hash_key (dbf, key, &hashval, &bucket, &off);
+  if (hashval != dbf->bucket->h_table[elem_loc].hash_value)
+    {
+      GDBM_SET_ERRNO (dbf, GDBM_BAD_HASH_ENTRY, TRUE);
+      return NULL;
+    }
+  return dptr;
+}
+
+/* Account for a bucket of DBF that can't be read, reporting it with the
+   message FMT, which takes the directory index BUCKET_DIR and the error
+   description.  Return -1 if the limit of failures is reached, 0
+   otherwise. */
+static int
+bucket_failed (GDBM_FILE dbf, gdbm_recovery *rcvr, int flags,
+	       char const *fmt, int bucket_dir)
+{
+  if (flags & GDBM_RCVR_ERRFUN)
+    rcvr->errfun (rcvr->data, fmt, bucket_dir, gdbm_db_strerror (dbf));
+  rcvr->failed_buckets++;
+  if (((flags & GDBM_RCVR_MAX_FAILED_BUCKETS)
+       && rcvr->failed_buckets == rcvr->max_failed_buckets)
+      || ((flags & GDBM_RCVR_MAX_FAILURES)
+	  && (rcvr->failed_buckets + rcvr->failed_keys)
+	       == rcvr->max_failures))
+    return -1;
+  return 0;
+}
+
 static int
 run_recovery (GDBM_FILE dbf, GDBM_FILE new_dbf, gdbm_recovery *rcvr, int flags)
 {
+  struct rcvr_bucket *buckets;
+  size_t nbuckets, n;
   int bucket_dir, i;
-  int nbuckets = GDBM_DIR_COUNT (dbf);
+  int rc = 0;
 
-  for (bucket_dir = 0; bucket_dir < nbuckets;
-       bucket_dir = _gdbm_next_bucket_dir (dbf, bucket_dir))
+  buckets = collect_buckets (dbf, &nbuckets);
+  if (!buckets)
+    return -1;
+
+  /* Keep the changed buckets of the new database in memory.  They are
+     written out when evicted from the cache and, finally, by
+     _gdbm_finish_transfer, instead of after each gdbm_store. */
+  new_dbf->flush_budget = SIZE_MAX;
+
+  for (n = 0; n < nbuckets; n++)
     {
-      
+      bucket_dir = buckets[n].dir;
+
+      if (flags & GDBM_RCVR_PROGRESS)
+	rcvr->progress (rcvr->data, n, nbuckets);
+
       if (_gdbm_get_bucket (dbf, bucket_dir))
 	{
-	  if (flags & GDBM_RCVR_ERRFUN)
-	    rcvr->errfun (rcvr->data, _("can't read bucket #%d: %s"),
-			  bucket_dir,
-			  gdbm_db_strerror (dbf));
-	  rcvr->failed_buckets++;
-	  if ((flags & GDBM_RCVR_MAX_FAILED_BUCKETS)
-	      && rcvr->failed_buckets == rcvr->max_failed_buckets)
-	    return -1;
-	  if ((flags & GDBM_RCVR_MAX_FAILURES)
-	      && (rcvr->failed_buckets + rcvr->failed_keys) == rcvr->max_failures)
-	    return -1;
+	  if (bucket_failed (dbf, rcvr, flags, _("can't read bucket #%d: %s"),
+			     bucket_dir))
+	    {
+	      rc = -1;
+	      goto end;
+	    }
 	}
       else
 	{
-	  rcvr->recovered_buckets++;
-	  for (i = 0; i < dbf->header->bucket_elems; i++)
+	  int next;
+
+	  /* Recover the overflow chain, if any, as well. */
+	  do
 	    {
-	      char *dptr;
-	      datum key, data;
-	    
-	      if (dbf->bucket->h_table[i].hash_value == -1)
-		continue;
-	      dptr = _gdbm_read_entry (dbf, i);
-	      if (dptr)
-		rcvr->recovered_keys++;
-	      else
+	      rcvr->recovered_buckets++;
+	      for (i = 0; i < dbf->header->bucket_elems; i++)
 		{
-		  if (flags & GDBM_RCVR_ERRFUN)
-		    rcvr->errfun (rcvr->data,
-				  _("can't read key pair %d:%d (%lu:%d): %s"),
-				  bucket_dir, i,
-				  (unsigned long) dbf->bucket->h_table[i].data_pointer,
-				  dbf->bucket->h_table[i].key_size
-				    + dbf->bucket->h_table[i].data_size,
-				  gdbm_db_strerror (dbf));
-		  rcvr->failed_keys++;
-		  if ((flags & GDBM_RCVR_MAX_FAILED_KEYS)
-		      && rcvr->failed_keys == rcvr->max_failed_keys)
-		    return -1;
-		  if ((flags & GDBM_RCVR_MAX_FAILURES)
-		      && (rcvr->failed_buckets + rcvr->failed_keys) == rcvr->max_failures)
-		    return -1;
-		  continue;
-		}
-
-	      key.dptr   = dptr;
-	      key.dsize  = dbf->bucket->h_table[i].key_size;
-
-	      data.dptr  = dptr + key.dsize;
-	      data.dsize = dbf->bucket->h_table[i].data_size;
+		  char *dptr;
+		  datum key, data;
 	    
-	      if (gdbm_store (new_dbf, key, data, GDBM_INSERT) != 0)
-		{
-		  switch (gdbm_last_errno (new_dbf))
+		  /* Skip empty slots and tombstones. */
+		  if (dbf->bucket->h_table[i].hash_value < 0)
+		    continue;
+		  dptr = read_valid_entry (dbf, i);
+		  if (dptr)
+		    rcvr->recovered_keys++;
+		  else
 		    {
-		    case GDBM_CANNOT_REPLACE:
-		      rcvr->duplicate_keys++;
-		      if (flags & GDBM_RCVR_ERRFUN)
-			rcvr->errfun (rcvr->data,
-		          _("ignoring duplicate key %d:%d (%lu:%d)"),
-			  bucket_dir, i,
-			  (unsigned long) dbf->bucket->h_table[i].data_pointer,
-			  dbf->bucket->h_table[i].key_size
-				      + dbf->bucket->h_table[i].data_size);
-		      break;
-		      
-		    default:
 		      if (flags & GDBM_RCVR_ERRFUN)
 			rcvr->errfun (rcvr->data,
-			  _("fatal: can't store element %d:%d (%lu:%d): %s"),
-			  bucket_dir, i,
-			  (unsigned long) dbf->bucket->h_table[i].data_pointer,
-			  dbf->bucket->h_table[i].key_size
-				    + dbf->bucket->h_table[i].data_size,
-			  gdbm_db_strerror (new_dbf));
-		      return -1;
+				      _("can't read key pair %d:%d (%lu:%d): %s"),
+				      bucket_dir, i,
+				      (unsigned long) dbf->bucket->h_table[i].data_pointer,
+				      dbf->bucket->h_table[i].key_size
+					+ dbf->bucket->h_table[i].data_size,
+				      gdbm_db_strerror (dbf));
+		      rcvr->failed_keys++;
+		      if (((flags & GDBM_RCVR_MAX_FAILED_KEYS)
+			   && rcvr->failed_keys == rcvr->max_failed_keys)
+			  || ((flags & GDBM_RCVR_MAX_FAILURES)
+			      && (rcvr->failed_buckets + rcvr->failed_keys)
+				   == rcvr->max_failures))
+			{
+			  rc = -1;
+			  goto end;
+			}
+		      continue;
 		    }
-		}	
+
+		  key.dptr   = dptr;
+		  key.dsize  = dbf->bucket->h_table[i].key_size;
+
+		  data.dptr  = dptr + key.dsize;
+		  data.dsize = dbf->cache_mru->ca_data.data_size;
+
+		  /* Drop expired records. */
+		  if (_gdbm_expired_p (dbf->cache_mru->ca_data.expire))
+		    continue;
+	    
+		  if (gdbm_store_expire (new_dbf, key, data, GDBM_INSERT,
+					 dbf->cache_mru->ca_data.expire) != 0)
+		    {
+		      switch (gdbm_last_errno (new_dbf))
+			{
+			case GDBM_CANNOT_REPLACE:
+			  rcvr->duplicate_keys++;
+			  if (flags & GDBM_RCVR_ERRFUN)
+			    rcvr->errfun (rcvr->data,
+			      _("ignoring duplicate key %d:%d (%lu:%d)"),
+			      bucket_dir, i,
+			      (unsigned long) dbf->bucket->h_table[i].data_pointer,
+			      dbf->bucket->h_table[i].key_size
+					  + dbf->bucket->h_table[i].data_size);
+			  break;
+		      
+			default:
+			  if (flags & GDBM_RCVR_ERRFUN)
+			    rcvr->errfun (rcvr->data,
+			      _("fatal: can't store element %d:%d (%lu:%d): %s"),
+			      bucket_dir, i,
+			      (unsigned long) dbf->bucket->h_table[i].data_pointer,
+			      dbf->bucket->h_table[i].key_size
+					+ dbf->bucket->h_table[i].data_size,
+			      gdbm_db_strerror (new_dbf));
+			  rc = -1;
+			  goto end;
+			}
+		    }	
+		}
+	    }
+	  while ((next = _gdbm_next_bucket (dbf)) == 0);
+	  if (next == -1
+	      && bucket_failed (dbf, rcvr, flags,
+				_("can't read overflow bucket of #%d: %s"),
+				bucket_dir))
+	    {
+	      rc = -1;
+	      goto end;
 	    }
 	}
     }
-  
-  return 0;
+
+  if (flags & GDBM_RCVR_PROGRESS)
+    rcvr->progress (rcvr->data, nbuckets, nbuckets);
+ end:
+  free (buckets);
+  return rc;
 }
 
 int
 gdbm_recover (GDBM_FILE dbf, gdbm_recovery *rcvr, int flags)
 { 
   GDBM_FILE new_dbf;	     /* The new file. */
-  char *new_name;	     /* A temporary name. */
-  size_t len;
-  int fd;
   int rc;
   gdbm_recovery rs;
   
@@ -383,40 +605,17 @@ gdbm_recover (GDBM_FILE dbf, gdbm_recovery *rcvr, int flags)
   rcvr->duplicate_keys = 0;
   rcvr->backup_name = NULL;
 
+  /* Write out pending changes. */
+  if (!dbf->need_recovery && _gdbm_flush (dbf))
+    return -1;
+
   rc = 0;
   if ((flags & GDBM_RCVR_FORCE) || check_db (dbf))
     {
       gdbm_clear_error (dbf);
-      len = strlen (dbf->name);
-      new_name = malloc (len + sizeof (TMPSUF));
-      if (!new_name)
-	{
-	  GDBM_SET_ERRNO (NULL, GDBM_MALLOC_ERROR, FALSE);
-	  return -1;
-	}
-      strcat (strcpy (new_name, dbf->name), TMPSUF);
-  
-      fd = mkstemp (new_name);
-      if (fd == -1)
-	{
-	  GDBM_SET_ERRNO (NULL, GDBM_FILE_OPEN_ERROR, FALSE);
-	  free (new_name);
-	  return -1;
-	}
-  
-      new_dbf = gdbm_fd_open (fd, new_name, dbf->header->block_size,
-			      GDBM_WRCREAT
-			      | (dbf->cloexec ? GDBM_CLOEXEC : 0)
-			      | (dbf->xheader ? GDBM_NUMSYNC : 0)
-			      | GDBM_CLOERROR, dbf->fatal_err);
-  
-      SAVE_ERRNO (free (new_name));
-  
+      new_dbf = _gdbm_open_temp (dbf);
       if (new_dbf == NULL)
-	{
-	  GDBM_SET_ERRNO (NULL, GDBM_REORGANIZE_FAILED, FALSE);
-	  return -1;
-	}
+	return -1;
 
       rc = run_recovery (dbf, new_dbf, rcvr, flags);
       
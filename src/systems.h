@@ -34,6 +34,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifndef SEEK_SET
 # define SEEK_SET        0
@@ -55,30 +55,25 @@ write_header (GDBM_FILE dbf)
 }
 
 
-/* After all changes have been made in memory, we now write them
-   all to disk. */
+/* Write all changes made in memory to disk. */
 int
-_gdbm_end_update (GDBM_FILE dbf)
+_gdbm_flush (GDBM_FILE dbf)
 {
-  off_t file_pos;	/* Return value for lseek. */
-  int rc;
-  
+  /* Reclaim tombstones, so that their buckets can be written. */
+  if (dbf->cache_tombstones > 0 && _gdbm_cache_reclaim (dbf))
+    return -1;
+
+  /* Reuse the space kept for the snapshots closed since. */
+  if (_gdbm_snapshot_release (dbf))
+    return -1;
+
   /* Write the changed buckets if there are any. */
   _gdbm_cache_flush (dbf);
   
   /* Write the directory. */
   if (dbf->directory_changed)
     {
-      file_pos = gdbm_file_seek (dbf, dbf->header->dir, SEEK_SET);
-      if (file_pos != dbf->header->dir)
-	{
-	  GDBM_SET_ERRNO2 (dbf, GDBM_FILE_SEEK_ERROR, TRUE, GDBM_DEBUG_STORE);
-	  _gdbm_fatal (dbf, _("lseek error"));
-	  return -1;
-	}
-
-      rc = _gdbm_full_write (dbf, dbf->dir, dbf->header->dir_size);
-      if (rc)
+      if (_gdbm_dir_write (dbf))
 	{
 	  GDBM_DEBUG (GDBM_DEBUG_STORE|GDBM_DEBUG_ERR,
 		      "%s: error writing directory: %s",
@@ -105,6 +100,35 @@ _gdbm_end_update (GDBM_FILE dbf)
   return 0;
 }
 
+/* After all changes have been made in memory, we now write them
+   all to disk.  If the database is not synchronized on each update and
+   a flush budget is set (see GDBM_SETFLUSHBUDGET), the changes are kept
+   in memory until the number of changed buckets exceeds the budget.
+   They are written when the changed buckets are evicted from the
+   cache, or by _gdbm_flush, which is called by gdbm_sync and
+   gdbm_close.  Buckets with tombstones are reclaimed before being
+   written.  Note that an evicted bucket is written without the header
+   and the directory, so the file is not consistent on disk until the
+   next full flush. */
+int
+_gdbm_end_update (GDBM_FILE dbf)
+{
+  /* Advance the preparation of the doubled directory. */
+  if (_gdbm_dir_prepare_step (dbf))
+    return -1;
+
+  if (dbf->flush_budget > 0 && dbf->fast_write
+      && dbf->cache_dirty <= dbf->flush_budget)
+    {
+      /* Buckets with tombstones can't be evicted from the cache.  Make
+	 sure they don't occupy more than half of it. */
+      if (dbf->cache_tombstones * 2 >= dbf->cache_size)
+	return _gdbm_cache_reclaim (dbf);
+      return 0;
+    }
+  return _gdbm_flush (dbf);
+}
+
 
 /* For backward compatibility, if the caller defined fatal_err function,
    call it upon fatal error and exit. */
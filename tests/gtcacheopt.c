@@ -108,8 +108,8 @@ dir_index (GDBM_FILE dbf, off_t adr)
 {
   int i;
 
-  for (i = 0; i < dbf->header->dir_size; i++)
-    if (dbf->dir[i] == adr)
+  for (i = 0; i < GDBM_DIR_COUNT (dbf); i++)
+    if (_gdbm_dir_entry (dbf, i) == adr)
       return i;
   fprintf (stderr, "%lu: can't find bucket in directory\n", adr);
   exit (1);
@@ -0,0 +1,214 @@
+/* This file is part of GDBM test suite.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "autoconf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "gdbm.h"
+#include "progname.h"
+
+/* Usage: gtcas DBFILE KEY EXPECTED NEWVAL
+          gtcas -append DBFILE KEY STRING
+          gtcas -upcase DBFILE KEY
+          gtcas -scribble DBFILE KEY keep|abort
+
+   The first form replaces the value of KEY with NEWVAL if it equals
+   EXPECTED.  A single dash in place of EXPECTED stands for a missing key.
+   A single dash in place of NEWVAL deletes the key.
+
+   The second form appends STRING to the value of KEY, creating it if
+   necessary.  If STRING is empty, KEY is deleted.
+
+   The third form converts the value of KEY to upper case in place.
+
+   The fourth form overwrites the first byte of the value passed to the
+   update function, which then leaves the record unchanged or aborts the
+   update.  The value of KEY is fetched and printed afterwards.  */
+
+enum { MODE_CAS, MODE_APPEND, MODE_UPCASE, MODE_SCRIBBLE };
+
+static int
+append_value (datum key, datum *value, void *closure)
+{
+  char **pstr = closure;
+  char *str = *pstr;
+  size_t len = strlen (str);
+  char *p;
+
+  if (len == 0)
+    return GDBM_UPDATE_DELETE;
+  p = malloc (value->dsize + len);
+  if (!p)
+    return -2;
+  if (value->dptr)
+    memcpy (p, value->dptr, value->dsize);
+  else
+    value->dsize = 0;
+  memcpy (p + value->dsize, str, len);
+  value->dptr = p;
+  value->dsize += len;
+  *pstr = p;
+  return GDBM_UPDATE_STORE;
+}
+
+static int
+upcase_value (datum key, datum *value, void *closure)
+{
+  int i;
+
+  if (!value->dptr)
+    return GDBM_UPDATE_KEEP;
+  for (i = 0; i < value->dsize; i++)
+    value->dptr[i] = toupper (value->dptr[i]);
+  return GDBM_UPDATE_STORE;
+}
+
+static int
+scribble_value (datum key, datum *value, void *closure)
+{
+  if (value->dptr && value->dsize > 0)
+    value->dptr[0] = 'X';
+  return *(int*) closure;
+}
+
+static datum
+optdatum (char *arg)
+{
+  datum d;
+
+  if (strcmp (arg, "-") == 0)
+    {
+      d.dptr = NULL;
+      d.dsize = 0;
+    }
+  else
+    {
+      d.dptr = arg;
+      d.dsize = strlen (arg);
+    }
+  return d;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *progname = canonical_progname (argv[0]);
+  int mode = MODE_CAS;
+  datum key;
+  GDBM_FILE dbf;
+  int rc = 0;
+
+  if (argc > 1 && argv[1][0] == '-')
+    {
+      if (strcmp (argv[1], "-h") == 0)
+	{
+	  printf ("usage: %s DBFILE KEY EXPECTED NEWVAL\n", progname);
+	  printf ("       %s -append DBFILE KEY STRING\n", progname);
+	  printf ("       %s -upcase DBFILE KEY\n", progname);
+	  printf ("       %s -scribble DBFILE KEY keep|abort\n", progname);
+	  exit (0);
+	}
+      else if (strcmp (argv[1], "-append") == 0)
+	mode = MODE_APPEND;
+      else if (strcmp (argv[1], "-upcase") == 0)
+	mode = MODE_UPCASE;
+      else if (strcmp (argv[1], "-scribble") == 0)
+	mode = MODE_SCRIBBLE;
+      else
+	{
+	  fprintf (stderr, "%s: unknown option %s\n", progname, argv[1]);
+	  exit (1);
+	}
+      argc--;
+      argv++;
+    }
+
+  if (argc != (mode == MODE_CAS ? 5
+	       : mode == MODE_APPEND || mode == MODE_SCRIBBLE ? 4 : 3))
+    {
+      fprintf (stderr, "%s: wrong arguments\n", progname);
+      exit (1);
+    }
+
+  dbf = gdbm_open (argv[1], 0, GDBM_WRITER, 00664, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open failed: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  key.dptr = argv[2];
+  key.dsize = strlen (argv[2]);
+  switch (mode)
+    {
+    case MODE_CAS:
+      rc = gdbm_cas (dbf, key, optdatum (argv[3]), optdatum (argv[4]));
+      if (rc == 1)
+	fprintf (stderr, "%s: value mismatch\n", progname);
+      break;
+
+    case MODE_APPEND:
+      {
+	char *buf = argv[3];
+	rc = gdbm_update (dbf, key, append_value, &buf);
+	if (buf != argv[3])
+	  free (buf);
+      }
+      break;
+
+    case MODE_UPCASE:
+      rc = gdbm_update (dbf, key, upcase_value, NULL);
+      break;
+
+    case MODE_SCRIBBLE:
+      {
+	int ret = strcmp (argv[3], "abort") == 0 ? -3 : GDBM_UPDATE_KEEP;
+	datum content;
+
+	rc = gdbm_update (dbf, key, scribble_value, &ret);
+	content = gdbm_fetch (dbf, key);
+	if (content.dptr)
+	  {
+	    fwrite (content.dptr, content.dsize, 1, stdout);
+	    putchar ('\n');
+	    free (content.dptr);
+	  }
+      }
+      break;
+    }
+
+  if (rc == -1)
+    {
+      fprintf (stderr, "%s: %s\n", progname, gdbm_strerror (gdbm_errno));
+      rc = 2;
+    }
+  else if (rc < 0)
+    {
+      fprintf (stderr, "%s: update aborted\n", progname);
+      rc = 2;
+    }
+
+  if (gdbm_close (dbf))
+    {
+      fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
+	       strerror (errno));
+      rc = 3;
+    }
+  exit (rc);
+}
@@ -0,0 +1,123 @@
+/* This file is part of GDBM test suite.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "autoconf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include "gdbm.h"
+#include "progname.h"
+
+/* Usage: gtcheck [OPTIONS] DBFILE
+
+   Check the consistency of DBFILE.  Print the number of keys checked
+   and the number of problems found.  Problems are reported on stderr if
+   the -verbose option is given. */
+
+const char *progname;
+
+void
+err_printer (void *data, char const *fmt, ...)
+{
+  va_list ap;
+
+  fprintf (stderr, "%s: ", progname);
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+  fprintf (stderr, "\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  GDBM_FILE dbf;
+  int open_flags = GDBM_READER;
+  gdbm_check_info info;
+  int flags = 0;
+  int rc;
+
+  progname = canonical_progname (argv[0]);
+  while (--argc)
+    {
+      char *arg = *++argv;
+
+      if (strcmp (arg, "-h") == 0)
+	{
+	  printf ("usage: %s [-nolock] [-nommap] [-writer] [-verbose] DBFILE\n",
+		  progname);
+	  exit (0);
+	}
+      else if (strcmp (arg, "-nolock") == 0)
+	open_flags |= GDBM_NOLOCK;
+      else if (strcmp (arg, "-nommap") == 0)
+	open_flags |= GDBM_NOMMAP;
+      else if (strcmp (arg, "-writer") == 0)
+	open_flags = (open_flags & ~GDBM_OPENMASK) | GDBM_WRITER;
+      else if (strcmp (arg, "-verbose") == 0)
+	{
+	  info.errfun = err_printer;
+	  flags |= GDBM_CHECK_ERRFUN;
+	}
+      else if (strcmp (arg, "--") == 0)
+	{
+	  --argc;
+	  ++argv;
+	  break;
+	}
+      else if (arg[0] == '-')
+	{
+	  fprintf (stderr, "%s: unknown option %s\n", progname, arg);
+	  exit (1);
+	}
+      else
+	break;
+    }
+
+  if (argc != 1)
+    {
+      fprintf (stderr, "%s: wrong arguments\n", progname);
+      exit (1);
+    }
+
+  dbf = gdbm_open (argv[0], 0, open_flags, 0, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open failed: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  rc = gdbm_check (dbf, &info, flags);
+  if (rc == -1)
+    {
+      fprintf (stderr, "%s: gdbm_check: %s\n", progname,
+	       gdbm_strerror (gdbm_errno));
+      rc = 3;
+    }
+  else
+    printf ("keys: %lu, errors: %lu\n",
+	    (unsigned long) info.keys, (unsigned long) info.errors);
+
+  if (gdbm_close (dbf))
+    {
+      fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
+	       strerror (errno));
+      rc = 3;
+    }
+  exit (rc);
+}
@@ -19,9 +19,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "gdbm.h"
 #include "progname.h"
 
+/* Predicates for gdbm_delete_if. */
+static int
+key_prefix (datum key, datum value, void *closure)
+{
+  char const *prefix = closure;
+  size_t len = strlen (prefix);
+  return key.dsize >= len && memcmp (key.dptr, prefix, len) == 0;
+}
+
+static int
+value_contains (datum key, datum value, void *closure)
+{
+  char const *str = closure;
+  size_t len = strlen (str);
+  int i;
+
+  for (i = 0; i + len <= value.dsize; i++)
+    if (memcmp (value.dptr + i, str, len) == 0)
+      return 1;
+  return 0;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -31,6 +55,13 @@ main (int argc, char **argv)
   int flags = 0;
   GDBM_FILE dbf;
   int data_z = 0;
+  int lazy = 0;
+  size_t flush_budget = 0;
+  gdbm_delete_fn pred = NULL;
+  char *journal = NULL;
+  int jfd = -1;
+  char *snapshot = NULL;
+  GDBM_FILE snap = NULL;
   int rc = 0;
   
   while (--argc)
@@ -39,7 +70,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-null] [-nolock] [-nommap] [-sync] DBFILE KEY [KEY...]\n",
+	  printf ("usage: %s [-null] [-nolock] [-nommap] [-sync] [-lazy] [-flushbudget=N] [-journal=FILE] [-snapshot=FILE] [-prefix|-value] DBFILE KEY [KEY...]\n",
 		  progname);
 	  exit (0);
 	}
@@ -51,6 +82,18 @@ main (int argc, char **argv)
 	flags |= GDBM_NOMMAP;
       else if (strcmp (arg, "-sync") == 0)
 	flags |= GDBM_SYNC;
+      else if (strcmp (arg, "-lazy") == 0)
+	lazy = 1;
+      else if (strncmp (arg, "-flushbudget=", 13) == 0)
+	flush_budget = strtoul (arg + 13, NULL, 10);
+      else if (strncmp (arg, "-journal=", 9) == 0)
+	journal = arg + 9;
+      else if (strncmp (arg, "-snapshot=", 10) == 0)
+	snapshot = arg + 10;
+      else if (strcmp (arg, "-prefix") == 0)
+	pred = key_prefix;
+      else if (strcmp (arg, "-value") == 0)
+	pred = value_contains;
       else if (strcmp (arg, "--") == 0)
 	{
 	  --argc;
@@ -80,10 +123,69 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  if (lazy && gdbm_setopt (dbf, GDBM_SETLAZYDELETE, &lazy, sizeof (lazy)))
+    {
+      fprintf (stderr, "GDBM_SETLAZYDELETE failed: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  if (flush_budget
+      && gdbm_setopt (dbf, GDBM_SETFLUSHBUDGET, &flush_budget,
+		      sizeof (flush_budget)))
+    {
+      fprintf (stderr, "GDBM_SETFLUSHBUDGET failed: %s\n",
+	       gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  if (journal)
+    {
+      jfd = open (journal, O_WRONLY|O_APPEND|O_CREAT, 0644);
+      if (jfd == -1)
+	{
+	  fprintf (stderr, "%s: can't open %s: %s\n", progname, journal,
+		   strerror (errno));
+	  exit (1);
+	}
+      if (gdbm_set_journal (dbf, jfd))
+	{
+	  fprintf (stderr, "gdbm_set_journal failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
+
+  if (snapshot)
+    {
+      snap = gdbm_snapshot_open (dbf);
+      if (!snap)
+	{
+	  fprintf (stderr, "gdbm_snapshot_open failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
+
   while (--argc)
     {
       char *arg = *++argv;
 
+      if (pred)
+	{
+	  int n = gdbm_delete_if (dbf, pred, arg,
+				  pred == value_contains
+				    ? GDBM_DELETE_VALUE : 0);
+	  if (n == -1)
+	    {
+	      fprintf (stderr, "%s: gdbm_delete_if %s: %s\n",
+		       progname, arg, gdbm_strerror (gdbm_errno));
+	      rc = 2;
+	    }
+	  else
+	    printf ("%s: %d\n", arg, n);
+	  continue;
+	}
+
       key.dptr = arg;
       key.dsize = strlen (arg) + !!data_z;
 
@@ -94,11 +196,28 @@ main (int argc, char **argv)
 	  rc = 2;
 	}
     }
+  if (snap)
+    {
+      if (gdbm_dump (snap, snapshot, GDBM_DUMP_FMT_ASCII, GDBM_NEWDB, 0600))
+	{
+	  fprintf (stderr, "%s: can't dump snapshot: %s\n", progname,
+		   gdbm_strerror (gdbm_errno));
+	  exit (3);
+	}
+      if (gdbm_close (snap))
+	{
+	  fprintf (stderr, "%s: can't close snapshot: %s\n", progname,
+		   gdbm_strerror (gdbm_errno));
+	  exit (3);
+	}
+    }
   if (gdbm_close (dbf))
     {
       fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
 	       strerror (errno));
       rc = 3;
     }
+  if (jfd != -1)
+    close (jfd);
   exit (rc);
 }
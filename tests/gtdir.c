@@ -0,0 +1,279 @@
+/*
+  NAME
+    gtdir - test lazy loading of the hash directory.
+
+  SYNOPSIS
+    gtdir [-v]
+
+  DESCRIPTION
+    When an existing database is opened, its hash directory is not read
+    in.  Directory pages are read from disk when their entries are
+    accessed for the first time.
+
+    This test program verifies that:
+
+    1) No directory pages are read when the database is opened.
+    2) A lookup reads in exactly one directory page.
+    3) All records can be retrieved, and the directory is entirely
+       in memory after a full bucket traversal (gdbm_count).
+    4) Modifications made with a partially loaded directory are correctly
+       written to disk.
+    5) Once the directory has MIN_DIR_PAGES pages, its next doubling is
+       prepared in the background, and the prepared directory is used
+       when the directory doubles.
+    6) When the directory grows, its pages are shared rather than copied,
+       and pages whose entries all refer to the same bucket take no
+       memory.
+
+  OPTIONS
+     -v   Verbosely print what's being done.
+
+  EXIT CODE
+     0    success
+     1    failure
+     2    usage error
+
+  LICENSE
+    This file is part of GDBM test suite.
+    Copyright (C) 2022 Free Software Foundation, Inc.
+
+    GDBM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    GDBM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "autoconf.h"
+#include "gdbmdefs.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+char dbname[] = "a.db";
+
+/* Minimal number of directory pages in the test database */
+#define MIN_DIR_PAGES 4
+
+static size_t
+dir_pages (GDBM_FILE dbf)
+{
+  return (dbf->header->dir_size + GDBM_DIR_PAGE_SIZE - 1) / GDBM_DIR_PAGE_SIZE;
+}
+
+/* Return the number of directory slots holding a page.  If OWN is set,
+   count only the pages indexed by the current depth. */
+static size_t
+count_pages (GDBM_FILE dbf, int own)
+{
+  size_t n, count = 0;
+
+  for (n = 0; n < dir_pages (dbf); n++)
+    if (dbf->dir[n].page
+	&& (!own || dbf->dir[n].page->depth == dbf->header->dir_bits))
+      count++;
+  return count;
+}
+
+static GDBM_FILE
+open_db (int flags)
+{
+  GDBM_FILE dbf = gdbm_open (dbname, GDBM_MIN_BLOCK_SIZE, flags, 0644, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+  return dbf;
+}
+
+static int
+check_keys (GDBM_FILE dbf, int nkeys)
+{
+  int i;
+  datum key, content;
+
+  key.dsize = sizeof (i);
+  key.dptr = (char*) &i;
+  for (i = 0; i < nkeys; i++)
+    {
+      content = gdbm_fetch (dbf, key);
+      if (content.dptr == NULL)
+	{
+	  fprintf (stderr, "key %d: %s\n", i, gdbm_db_strerror (dbf));
+	  return 1;
+	}
+      if (content.dsize != sizeof (i) || memcmp (content.dptr, &i, sizeof (i)))
+	{
+	  fprintf (stderr, "key %d: wrong content\n", i);
+	  return 1;
+	}
+      free (content.dptr);
+    }
+  return 0;
+}
+
+static void
+store_key (GDBM_FILE dbf, int i)
+{
+  datum key;
+
+  key.dsize = sizeof (i);
+  key.dptr = (char*) &i;
+  if (gdbm_store (dbf, key, key, GDBM_REPLACE))
+    {
+      fprintf (stderr, "gdbm_store: %s\n", gdbm_db_strerror (dbf));
+      exit (1);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  GDBM_FILE dbf;
+  int nkeys;
+  size_t npages;
+  gdbm_count_t count;
+  int i;
+  int verbose = 0;
+  
+  while ((i = getopt (argc, argv, "v")) != EOF)
+    {
+      switch (i)
+	{
+	case 'v':
+	  verbose++;
+	  break;
+
+	default:
+	  return 2;
+	}
+    }
+
+  /* Make sure we create new database */
+  unlink (dbname);
+
+  if (verbose)
+    printf ("populating database\n");
+  dbf = open_db (GDBM_NEWDB);
+  for (nkeys = 0; dir_pages (dbf) < MIN_DIR_PAGES; nkeys++)
+    store_key (dbf, nkeys);
+  /* Store more keys until the directory doubles.  It may grow by more
+     than one bit at once, in which case the prepared directory is not
+     used. */
+  npages = dir_pages (dbf);
+  for (;;)
+    {
+      off_t next = dbf->dir_next;
+
+      store_key (dbf, nkeys++);
+      if (dir_pages (dbf) == npages * 2)
+	{
+	  if (next == 0 || dbf->header->dir != next)
+	    {
+	      fprintf (stderr, "directory doubling not prepared\n");
+	      return 1;
+	    }
+	  break;
+	}
+      npages = dir_pages (dbf);
+    }
+  npages = dir_pages (dbf);
+  gdbm_close (dbf);
+  if (verbose)
+    printf ("%d keys, %lu directory pages\n", nkeys, (unsigned long) npages);
+
+  dbf = open_db (GDBM_READER);
+  if (dbf->dir_pages_left != npages)
+    {
+      fprintf (stderr, "directory read at open\n");
+      return 1;
+    }
+
+  if (check_keys (dbf, 1))
+    return 1;
+  if (dbf->dir_pages_left != npages - 1)
+    {
+      fprintf (stderr, "lookup read %lu directory pages\n",
+	       (unsigned long) (npages - dbf->dir_pages_left));
+      return 1;
+    }
+
+  if (check_keys (dbf, nkeys))
+    return 1;
+  
+  if (gdbm_count (dbf, &count))
+    {
+      fprintf (stderr, "gdbm_count: %s\n", gdbm_db_strerror (dbf));
+      return 1;
+    }
+  if (count != nkeys)
+    {
+      fprintf (stderr, "gdbm_count returned %lu, expected %d\n",
+	       (unsigned long) count, nkeys);
+      return 1;
+    }
+  if (dbf->dir_pages_left != 0)
+    {
+      fprintf (stderr, "directory not loaded after gdbm_count\n");
+      return 1;
+    }
+  gdbm_close (dbf);
+
+  if (verbose)
+    printf ("updating database\n");
+  dbf = open_db (GDBM_WRITER);
+  for (i = 0; i < nkeys / 10 && dbf->dir_pages_left; i++)
+    store_key (dbf, nkeys++);
+  gdbm_close (dbf);
+  
+  if (verbose)
+    printf ("verifying %d keys\n", nkeys);
+  dbf = open_db (GDBM_READER);
+  if (check_keys (dbf, nkeys))
+    return 1;
+  gdbm_close (dbf);
+
+  /* Grow the directory so that each old entry fills a page. */
+  dbf = open_db (GDBM_WRITER);
+  i = dbf->header->dir_bits + GDBM_DIR_PAGE_BITS;
+  if (verbose)
+    printf ("growing directory to %d bits\n", i);
+  if (gdbm_setopt (dbf, GDBM_SETDIRDEPTH, &i, sizeof (i)))
+    {
+      fprintf (stderr, "GDBM_SETDIRDEPTH: %s\n", gdbm_db_strerror (dbf));
+      return 1;
+    }
+  if (count_pages (dbf, 1) != 0)
+    {
+      fprintf (stderr, "directory pages copied on growth\n");
+      return 1;
+    }
+  if (check_keys (dbf, nkeys))
+    return 1;
+  gdbm_close (dbf);
+
+  if (verbose)
+    printf ("verifying %d keys\n", nkeys);
+  dbf = open_db (GDBM_READER);
+  if (check_keys (dbf, nkeys))
+    return 1;
+  if (_gdbm_dir_load (dbf, 0, GDBM_DIR_COUNT (dbf)))
+    {
+      fprintf (stderr, "_gdbm_dir_load: %s\n", gdbm_db_strerror (dbf));
+      return 1;
+    }
+  if (count_pages (dbf, 0) != 0)
+    {
+      fprintf (stderr, "uniform directory pages kept in memory\n");
+      return 1;
+    }
+  gdbm_close (dbf);
+
+  return 0;
+}
@@ -21,6 +21,8 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "gdbm.h"
 #include "progname.h"
 
@@ -97,6 +99,13 @@ main (int argc, char **argv)
   gdbm_recovery rcvr;
   int rcvr_flags = 0;
   size_t cache_size = 0;
+  size_t flush_budget = 0;
+  time_t expire = 0;
+  int sync_after = 0;
+  char *journal = NULL;
+  int jfd = -1;
+  char *snapshot = NULL;
+  GDBM_FILE snap = NULL;
   
   progname = canonical_progname (argv[0]);
 #ifdef GDBM_DEBUG_ENABLE
@@ -109,7 +118,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-replace] [-clear] [-blocksize=N] [-bsexact] [-verbose] [-null] [-nolock] [-nommap] [-maxmap=N] [-sync] [-delim=CHR] DBFILE\n", progname);
+	  printf ("usage: %s [-replace] [-clear] [-blocksize=N] [-bsexact] [-verbose] [-null] [-nolock] [-nommap] [-maxmap=N] [-sync] [-delim=CHR] [-journal=FILE] [-snapshot=FILE] DBFILE\n", progname);
 	  exit (0);
 	}
       else if (strcmp (arg, "-replace") == 0)
@@ -138,6 +147,8 @@ main (int argc, char **argv)
 	recover = 1;
       else if (strncmp (arg, "-cachesize=", 11) == 0)
 	cache_size = read_size (arg + 11);
+      else if (strncmp (arg, "-flushbudget=", 13) == 0)
+	flush_budget = read_size (arg + 13);
       else if (strcmp (arg, "-verbose") == 0)
 	{
 	  verbose = 1;
@@ -163,6 +174,27 @@ main (int argc, char **argv)
 	}
       else if (strncmp (arg, "-numsync", 8) == 0)
 	flags = GDBM_NUMSYNC;
+      else if (strcmp (arg, "-fingerprint") == 0)
+	flags |= GDBM_FINGERPRINT;
+      else if (strcmp (arg, "-inline") == 0)
+	flags |= GDBM_INLINE;
+      else if (strcmp (arg, "-compress") == 0)
+	flags |= GDBM_COMPRESS;
+      else if (strcmp (arg, "-expire") == 0)
+	flags |= GDBM_EXPIRE;
+      else if (strcmp (arg, "-generation") == 0)
+	flags |= GDBM_GENERATION;
+      else if (strcmp (arg, "-sync-after") == 0)
+	sync_after = 1;
+      else if (strncmp (arg, "-journal=", 9) == 0)
+	journal = arg + 9;
+      else if (strncmp (arg, "-snapshot=", 10) == 0)
+	snapshot = arg + 10;
+      else if (strncmp (arg, "-expire=", 8) == 0)
+	{
+	  flags |= GDBM_EXPIRE;
+	  expire = strtoul (arg + 8, NULL, 10);
+	}
 #ifdef GDBM_DEBUG_ENABLE
       else if (strncmp (arg, "-debug=", 7) == 0)
 	{
@@ -227,6 +259,44 @@ main (int argc, char **argv)
 	  exit (1);
 	}
     }	  
+  if (flush_budget)
+    {
+      if (gdbm_setopt (dbf, GDBM_SETFLUSHBUDGET, &flush_budget,
+		       sizeof (flush_budget)))
+	{
+	  fprintf (stderr, "GDBM_SETFLUSHBUDGET failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
+
+  if (journal)
+    {
+      jfd = open (journal, O_WRONLY|O_APPEND|O_CREAT, 0644);
+      if (jfd == -1)
+	{
+	  fprintf (stderr, "%s: can't open %s: %s\n", progname, journal,
+		   strerror (errno));
+	  exit (1);
+	}
+      if (gdbm_set_journal (dbf, jfd))
+	{
+	  fprintf (stderr, "gdbm_set_journal failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
+
+  if (snapshot)
+    {
+      snap = gdbm_snapshot_open (dbf);
+      if (!snap)
+	{
+	  fprintf (stderr, "gdbm_snapshot_open failed: %s\n",
+		   gdbm_strerror (gdbm_errno));
+	  exit (1);
+	}
+    }
 
   if (verbose)
     {
@@ -277,7 +347,9 @@ main (int argc, char **argv)
       key.dsize = j + data_z;
       data.dptr = buf + i + 1;
       data.dsize = strlen (data.dptr) + data_z;
-      if (gdbm_store (dbf, key, data, replace) != 0)
+      if ((expire
+	   ? gdbm_store_expire (dbf, key, data, replace, expire)
+	   : gdbm_store (dbf, key, data, replace)) != 0)
 	{
 	  fprintf (stderr, "%s: %d: item not inserted: %s\n",
 		   progname, line, gdbm_db_strerror (dbf));
@@ -301,11 +373,33 @@ main (int argc, char **argv)
 	    }
 	}
     }
+  if (snap)
+    {
+      if (gdbm_dump (snap, snapshot, GDBM_DUMP_FMT_ASCII, GDBM_NEWDB, 0600))
+	{
+	  fprintf (stderr, "%s: can't dump snapshot: %s\n", progname,
+		   gdbm_strerror (gdbm_errno));
+	  exit (3);
+	}
+      if (gdbm_close (snap))
+	{
+	  fprintf (stderr, "%s: can't close snapshot: %s\n", progname,
+		   gdbm_strerror (gdbm_errno));
+	  exit (3);
+	}
+    }
+  if (sync_after && gdbm_sync (dbf))
+    {
+      fprintf (stderr, "gdbm_sync: %s\n", gdbm_strerror (gdbm_errno));
+      exit (3);
+    }
   if (gdbm_close (dbf))
     {
       fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
 	       strerror (errno));
       exit (3);
     }
+  if (jfd != -1)
+    close (jfd);
   exit (0);
 }
@@ -85,6 +85,7 @@ char *string;
 size_t size;
 int intval;
 int retbool;
+int dirdepth;
 
 /* Individual test and initialization functions */
 
@@ -194,6 +195,18 @@ test_mmap_group (void *valptr)
 #endif
 }
 
+void
+init_dirdepth (void *valptr, int valsize)
+{
+  *(int*) valptr = dirdepth + 2;
+}
+
+int
+test_dirdepth (void *valptr)
+{
+  return *(int*) valptr == dirdepth + 2 ? RES_PASS : RES_FAIL;
+}
+
 /* Create a group of testcases for testing a boolean option.
    Arguments:
 
@@ -263,6 +276,23 @@ struct optest optest_tab[] = {
     test_maxmapsize, NULL },
   
   
+  { "DIRDEPTH" },
+  { "DIRDEPTH", "initial GDBM_GETDIRDEPTH", GDBM_GETDIRDEPTH,
+    &dirdepth, sizeof (dirdepth), 0,
+    NULL, NULL },
+  { "DIRDEPTH", "GDBM_SETDIRDEPTH", GDBM_SETDIRDEPTH,
+    &intval, sizeof (intval), 0,
+    NULL, init_dirdepth },
+  { "DIRDEPTH", "GDBM_GETDIRDEPTH", GDBM_GETDIRDEPTH,
+    &intval, sizeof (intval), 0,
+    test_dirdepth, NULL },
+  { "DIRDEPTH", "GDBM_SETDIRDEPTH smaller", GDBM_SETDIRDEPTH,
+    &intval, sizeof (intval), 0,
+    NULL, init_false },
+  { "DIRDEPTH", "GDBM_GETDIRDEPTH", GDBM_GETDIRDEPTH,
+    &intval, sizeof (intval), 0,
+    test_dirdepth, NULL },
+  
   { "GETDBNAME", "GDBM_GETDBNAME", GDBM_GETDBNAME,
     &string, sizeof (string), 0,
     test_dbname, NULL },
@@ -0,0 +1,262 @@
+/*
+  NAME
+    gtrec - show how records are stored in a database.
+
+  SYNOPSIS
+    gtrec [-f] [-t] DBFILE KEY [KEY...]
+
+  DESCRIPTION
+    Opens DBFILE for reading and, for each KEY, prints a line telling
+    how its record is stored:
+
+      KEY: inline
+	The record is kept in its bucket element (see GDBM_INLINE).
+      KEY: file
+	The record occupies file space of its own.  In databases with
+	the compression feature, the codec of the data follows, as
+	"codec none" or "codec zlib".
+      KEY: not found
+	There is no such key.
+
+    With the -t option, looks up the "twin" of each KEY instead: a
+    different key of the same length, with the same hash value and the
+    same first four bytes.  KEY must be at least TWIN_MIN_LEN bytes long.
+    Prints whether the twin was found and whether any record was read
+    from the file in the process:
+
+      KEY: twin not found, record read
+      KEY: twin not found, nothing read
+
+    In databases with key fingerprints, nothing should be read.
+
+  OPTIONS
+     -f   Begin with a line listing the features of the database
+	  ("features: none" if it is not in extended format).
+     -t   Look up the twins of the keys.
+
+  EXIT CODE
+     0    success
+     1    failure
+     2    usage error
+
+  LICENSE
+    This file is part of GDBM test suite.
+    Copyright (C) 2022 Free Software Foundation, Inc.
+
+    GDBM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    GDBM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "autoconf.h"
+#include "gdbmdefs.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/* Bytes 4 and 28 of a key are shifted by the same number of bits (20)
+   in _gdbm_hash.  Moving one unit from the former to the latter keeps
+   the hash value, the length and the first four bytes of the key. */
+#define TWIN_LO 4
+#define TWIN_HI 28
+#define TWIN_MIN_LEN (TWIN_HI + 1)
+
+static struct
+{
+  unsigned feat;
+  char const *name;
+} feature_names[] = {
+  { GDBM_FEAT_FINGERPRINT, "fingerprint" },
+  { GDBM_FEAT_INLINE,      "inline" },
+  { GDBM_FEAT_COMPRESS,    "compress" },
+  { GDBM_FEAT_EXPIRE,      "expire" },
+  { GDBM_FEAT_GENERATION,  "generation" },
+  { GDBM_FEAT_CHAIN,       "chain" },
+};
+
+static void
+print_features (GDBM_FILE dbf)
+{
+  int i, n = 0;
+
+  printf ("features:");
+  if (dbf->xheader)
+    for (i = 0; i < sizeof (feature_names) / sizeof (feature_names[0]); i++)
+      if (dbf->xheader->features & feature_names[i].feat)
+	{
+	  printf (" %s", feature_names[i].name);
+	  n++;
+	}
+  if (n == 0)
+    printf (" none");
+  putchar ('\n');
+}
+
+/* Print how the record with KEY is stored. */
+static int
+show_record (GDBM_FILE dbf, datum key)
+{
+  bucket_element *elt;
+  int elem_loc;
+
+  elem_loc = _gdbm_findkey (dbf, key, NULL, NULL);
+  if (elem_loc == -1)
+    {
+      if (gdbm_last_errno (dbf) != GDBM_ITEM_NOT_FOUND)
+	{
+	  fprintf (stderr, "%s: %s\n", key.dptr, gdbm_db_strerror (dbf));
+	  return 1;
+	}
+      printf ("%s: not found\n", key.dptr);
+      return 0;
+    }
+
+  elt = &dbf->bucket->h_table[elem_loc];
+  if (_gdbm_elem_inline_p (dbf, elt))
+    {
+      printf ("%s: inline\n", key.dptr);
+      return 0;
+    }
+
+  printf ("%s: file", key.dptr);
+  if (_gdbm_feature_p (dbf, GDBM_FEAT_COMPRESS))
+    {
+      off_t off = elt->data_pointer + elt->key_size;
+      unsigned char codec;
+
+      if (_gdbm_feature_p (dbf, GDBM_FEAT_EXPIRE))
+	off += GDBM_EXPIRE_SIZE;
+      if (pread (dbf->desc, &codec, 1, off) != 1)
+	{
+	  fprintf (stderr, "%s: can't read codec\n", key.dptr);
+	  return 1;
+	}
+      switch (codec)
+	{
+	case GDBM_CODEC_NONE:
+	  printf (", codec none");
+	  break;
+
+	case GDBM_CODEC_ZLIB:
+	  printf (", codec zlib");
+	  break;
+
+	default:
+	  printf (", codec %d", codec);
+	}
+    }
+  putchar ('\n');
+  return 0;
+}
+
+/* Look up the twin of KEY and print whether any record was read. */
+static int
+show_twin (GDBM_FILE dbf, datum key)
+{
+  datum twin, content;
+  char *buf;
+  int rc = 0;
+
+  if (key.dsize < TWIN_MIN_LEN || key.dptr[TWIN_LO] == 0
+      || key.dptr[TWIN_HI] == 127)
+    {
+      fprintf (stderr, "%s: can't make twin\n", key.dptr);
+      return 2;
+    }
+  buf = malloc (key.dsize);
+  if (!buf)
+    abort ();
+  memcpy (buf, key.dptr, key.dsize);
+  buf[TWIN_LO]--;
+  buf[TWIN_HI]++;
+  twin.dptr = buf;
+  twin.dsize = key.dsize;
+  if (_gdbm_hash (twin) != _gdbm_hash (key))
+    {
+      fprintf (stderr, "%s: twin has different hash value\n", key.dptr);
+      free (buf);
+      return 1;
+    }
+
+  content = gdbm_fetch (dbf, twin);
+  if (content.dptr)
+    {
+      printf ("%s: twin found\n", key.dptr);
+      free (content.dptr);
+    }
+  else if (gdbm_last_errno (dbf) != GDBM_ITEM_NOT_FOUND)
+    {
+      fprintf (stderr, "%s: %s\n", key.dptr, gdbm_db_strerror (dbf));
+      rc = 1;
+    }
+  else
+    /* The data cache of the bucket keeps the last record read from it. */
+    printf ("%s: twin not found, %s\n", key.dptr,
+	    dbf->cache_mru->ca_data.elem_loc != -1
+	      ? "record read" : "nothing read");
+  free (buf);
+  return rc;
+}
+
+int
+main (int argc, char **argv)
+{
+  GDBM_FILE dbf;
+  int features = 0;
+  int twins = 0;
+  int i, rc = 0;
+
+  while ((i = getopt (argc, argv, "ft")) != EOF)
+    {
+      switch (i)
+	{
+	case 'f':
+	  features = 1;
+	  break;
+
+	case 't':
+	  twins = 1;
+	  break;
+
+	default:
+	  return 2;
+	}
+    }
+  argc -= optind;
+  argv += optind;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: gtrec [-f] [-t] DBFILE KEY [KEY...]\n");
+      return 2;
+    }
+
+  dbf = gdbm_open (argv[0], 0, GDBM_READER | GDBM_NOMMAP, 0, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open: %s\n", gdbm_strerror (gdbm_errno));
+      return 1;
+    }
+
+  if (features)
+    print_features (dbf);
+
+  for (i = 1; i < argc && rc == 0; i++)
+    {
+      datum key;
+
+      key.dptr = argv[i];
+      key.dsize = strlen (argv[i]);
+      rc = twins ? show_twin (dbf, key) : show_record (dbf, key);
+    }
+
+  gdbm_close (dbf);
+  return rc;
+}
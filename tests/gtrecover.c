@@ -38,6 +38,33 @@ err_printer (void *data, char const *fmt, ...)
   fprintf (stderr, "\n");
 }
 
+/* Progress reporting state. */
+struct progress
+{
+  size_t done;
+  size_t total;
+  int calls;
+};
+
+void
+progress_checker (void *data, size_t done, size_t total)
+{
+  struct progress *pr = data;
+
+  if (pr->calls == 0 ? done != 0
+      : (done != pr->done + 1 || total != pr->total || done > total))
+    {
+      fprintf (stderr, "%s: unexpected progress %lu/%lu after %lu/%lu\n",
+	       progname,
+	       (unsigned long) done, (unsigned long) total,
+	       (unsigned long) pr->done, (unsigned long) pr->total);
+      exit (2);
+    }
+  pr->done = done;
+  pr->total = total;
+  pr->calls++;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -47,6 +74,8 @@ main (int argc, char **argv)
   int open_flags = GDBM_WRITER;
   gdbm_recovery rcvr;
   int rcvr_flags = 0;
+  struct progress pr = { 0, 0, 0 };
+  int reorganize = 0;
   char *p;
   
   progname = canonical_progname (argv[0]);
@@ -56,7 +85,7 @@ main (int argc, char **argv)
 
       if (strcmp (arg, "-h") == 0)
 	{
-	  printf ("usage: %s [-nolock] [-nommap] [-verbose] [-backup] [-max-failures=N] [-max-failed-keys=N] [-max-failed-buckets=N] DBFILE\n",
+	  printf ("usage: %s [-nolock] [-nommap] [-verbose] [-progress] [-force] [-reorganize] [-backup] [-max-failures=N] [-max-failed-keys=N] [-max-failed-buckets=N] DBFILE\n",
 		  progname);
 	  exit (0);
 	}
@@ -69,6 +98,16 @@ main (int argc, char **argv)
 	  rcvr.errfun = err_printer;
 	  rcvr_flags |= GDBM_RCVR_ERRFUN;
 	}
+      else if (strcmp (arg, "-progress") == 0)
+	{
+	  rcvr.data = &pr;
+	  rcvr.progress = progress_checker;
+	  rcvr_flags |= GDBM_RCVR_PROGRESS;
+	}
+      else if (strcmp (arg, "-force") == 0)
+	rcvr_flags |= GDBM_RCVR_FORCE;
+      else if (strcmp (arg, "-reorganize") == 0)
+	reorganize = 1;
       else if (strcmp (arg, "-backup") == 0)
 	rcvr_flags |= GDBM_RCVR_BACKUP;
       else if (strncmp (arg, "-max-failures=", 14) == 0)
@@ -118,7 +157,28 @@ main (int argc, char **argv)
       exit (1);
     }
 
-  rc = gdbm_recover (dbf, &rcvr, rcvr_flags);
+  if (reorganize)
+    {
+      rc = gdbm_reorganize (dbf);
+      if (rc)
+	fprintf (stderr, "%s: gdbm_reorganize: %s\n", progname,
+		 gdbm_strerror (gdbm_errno));
+    }
+  else if ((rc = gdbm_recover (dbf, &rcvr, rcvr_flags)) != 0)
+    fprintf (stderr, "%s: gdbm_recover: %s\n", progname,
+	     gdbm_strerror (gdbm_errno));
+  else if (rcvr_flags & GDBM_RCVR_PROGRESS)
+    {
+      if (pr.calls == 0 || pr.done != pr.total
+	  || pr.total != rcvr.recovered_buckets + rcvr.failed_buckets)
+	{
+	  fprintf (stderr, "%s: incomplete progress report\n", progname);
+	  rc = 2;
+	}
+      printf ("recovered %lu keys, %lu failed\n",
+	      (unsigned long) rcvr.recovered_keys,
+	      (unsigned long) rcvr.failed_keys);
+    }
 
   if (gdbm_close (dbf))
     {
@@ -0,0 +1,362 @@
+/*
+  NAME
+    gtsplit - test splitting of buckets with clustered hash values.
+
+  SYNOPSIS
+    gtsplit [-cv] DEPTH
+
+  DESCRIPTION
+    Creates a database with the minimal block size and fills its only
+    bucket with keys having the same hash value.  Then stores one more
+    key, whose hash value differs from it in the DEPTH-th bit (counting
+    from the most significant one).
+
+    Keys with the requested hash values are constructed by inverting
+    the hash function.
+
+    If DEPTH is 0, the last key has the same hash value as the others.
+    Verifies that storing it fails with GDBM_DIR_OVERFLOW, without
+    rendering the database unusable.
+
+    Otherwise, verifies that the key is stored, and that the directory
+    is grown exactly to DEPTH bits.
+
+    In both cases, verifies that all stored keys can be retrieved.
+
+    With the -c option, the database is created with overflow chains
+    (GDBM_CHAIN).  Then storing the last key must succeed for any DEPTH,
+    without growing the directory: the bucket is split while the
+    directory allows it, and a chain is started for the rest.  The
+    database must pass gdbm_check, and all keys must still be retrieved
+    after gdbm_reorganize.
+
+  OPTIONS
+     -c   Create the database with overflow chains.
+     -v   Verbosely print what's being done.
+
+  EXIT CODE
+     0    success
+     1    failure
+     2    usage error
+
+  LICENSE
+    This file is part of GDBM test suite.
+    Copyright (C) 2022 Free Software Foundation, Inc.
+
+    GDBM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    GDBM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "autoconf.h"
+#include "gdbmdefs.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+char dbname[] = "a.db";
+
+/* Hash value of the keys filling the bucket. */
+#define BASE_HASH 0x2aaaaaaa
+
+/* Constants of _gdbm_hash. */
+#define HASH_MASK 0x7FFFFFFFu
+#define HASH_LEN_MUL 0x238F13AFu
+#define HASH_MUL 1103515243u
+#define HASH_ADD 12345u
+
+/* Number of bytes needed to use every shift of the hash function once. */
+#define KEY_MIN_LEN 24
+
+/* Largest byte value used in keys (char may be signed). */
+#define KEY_MAX_BYTE 127
+
+/* Fill KEY, of length LEN, so that its hash value is HASH.  Return 0 on
+   success and -1 if no such key of that length can be built. */
+static int
+make_key (char *key, int len, unsigned hash)
+{
+  unsigned inv, x;
+  int i;
+
+  /* Invert the final linear congruential step. */
+  inv = HASH_MUL;
+  for (i = 0; i < 5; i++)
+    inv *= 2 - HASH_MUL * inv;
+  x = (inv * (hash - HASH_ADD)) & HASH_MASK;
+
+  /* The sum of the key bytes, shifted by index * 5 % 24 bits.  The
+     first KEY_MIN_LEN bytes use each shift from 0 to 23 exactly once. */
+  x = (x - HASH_LEN_MUL * len) & HASH_MASK;
+  memset (key, 0, len);
+  for (i = 23; i >= 0; i--)
+    {
+      int n;
+      unsigned b = x >> i;
+
+      if (b > KEY_MAX_BYTE)
+	b = KEY_MAX_BYTE;
+      x -= b << i;
+      for (n = 0; n * 5 % 24 != i; n++)
+	;
+      key[n] = b;
+    }
+  return x == 0 ? 0 : -1;
+}
+
+/* Store into DBF a new key with hash value HASH.  Use the lengths from
+   *PLEN up, to make each key unique. */
+static int
+store_key (GDBM_FILE dbf, unsigned hash, int *plen)
+{
+  char buf[KEY_MIN_LEN + GDBM_HASH_BITS + 256];
+  datum key;
+
+  key.dptr = buf;
+  for (;;)
+    {
+      key.dsize = (*plen)++;
+      if (key.dsize > sizeof (buf))
+	{
+	  fprintf (stderr, "can't build key with hash %#x\n", hash);
+	  exit (1);
+	}
+      if (make_key (buf, key.dsize, hash) == 0)
+	break;
+    }
+  if (_gdbm_hash (key) != hash)
+    {
+      fprintf (stderr, "built key has hash %#x instead of %#x\n",
+	       _gdbm_hash (key), hash);
+      exit (1);
+    }
+  return gdbm_store (dbf, key, key, GDBM_INSERT);
+}
+
+/* Look up in DBF the keys with hash values HASH0 and HASH1, of lengths
+   from KEY_MIN_LEN to LEN - 1.  Verify that those found are intact, and
+   return their number. */
+static int
+check_keys (GDBM_FILE dbf, int len, unsigned hash0, unsigned hash1)
+{
+  char buf[KEY_MIN_LEN + GDBM_HASH_BITS + 256];
+  datum key, content;
+  int n = 0;
+
+  key.dptr = buf;
+  for (key.dsize = KEY_MIN_LEN; key.dsize < len; key.dsize++)
+    {
+      int i;
+
+      for (i = 0; i < 2; i++)
+	{
+	  if (i == 1 && hash1 == hash0)
+	    break;
+	  if (make_key (buf, key.dsize, i ? hash1 : hash0) != 0)
+	    continue;
+	  content = gdbm_fetch (dbf, key);
+	  if (content.dptr == NULL)
+	    continue;
+	  if (content.dsize != key.dsize
+	      || memcmp (content.dptr, key.dptr, key.dsize))
+	    {
+	      fprintf (stderr, "key of length %d: wrong content\n",
+		       key.dsize);
+	      exit (1);
+	    }
+	  free (content.dptr);
+	  n++;
+	}
+    }
+  return n;
+}
+
+/* Verify that DBF holds exactly the keys stored by main: EXPECTED keys
+   of lengths below LEN, with hash values BASE_HASH and LAST_HASH. */
+static void
+verify_keys (GDBM_FILE dbf, int len, unsigned last_hash, int expected)
+{
+  gdbm_count_t count;
+  int n;
+
+  n = check_keys (dbf, len, BASE_HASH, last_hash);
+  if (gdbm_count (dbf, &count))
+    {
+      fprintf (stderr, "gdbm_count: %s\n", gdbm_db_strerror (dbf));
+      exit (1);
+    }
+  if (count != expected || n != expected)
+    {
+      fprintf (stderr, "%lu keys in database, %d found, expected %d\n",
+	       (unsigned long) count, n, expected);
+      exit (1);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  GDBM_FILE dbf;
+  int depth;
+  int chain = 0;
+  int verbose = 0;
+  int len = KEY_MIN_LEN;
+  int i, rc;
+  int dir_bits;
+  unsigned last_hash;
+
+  while ((i = getopt (argc, argv, "cv")) != EOF)
+    {
+      switch (i)
+	{
+	case 'c':
+	  chain = 1;
+	  break;
+
+	case 'v':
+	  verbose++;
+	  break;
+
+	default:
+	  return 2;
+	}
+    }
+  argc -= optind;
+  argv += optind;
+
+  if (argc != 1)
+    {
+      fprintf (stderr, "usage: gtsplit [-cv] DEPTH\n");
+      return 2;
+    }
+  depth = atoi (argv[0]);
+  if (depth < 0 || depth > GDBM_HASH_BITS)
+    {
+      fprintf (stderr, "depth out of range\n");
+      return 2;
+    }
+
+  /* Make sure we create new database */
+  unlink (dbname);
+  dbf = gdbm_open (dbname, GDBM_MIN_BLOCK_SIZE,
+		   GDBM_NEWDB | (chain ? GDBM_CHAIN : 0), 0644, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open: %s\n", gdbm_strerror (gdbm_errno));
+      return 1;
+    }
+  dir_bits = dbf->header->dir_bits;
+
+  if (verbose)
+    printf ("filling the bucket with %d keys\n", dbf->header->bucket_elems);
+  for (i = 0; i < dbf->header->bucket_elems; i++)
+    if (store_key (dbf, BASE_HASH, &len))
+      {
+	fprintf (stderr, "gdbm_store: %s\n", gdbm_db_strerror (dbf));
+	return 1;
+      }
+
+  last_hash = depth ? BASE_HASH ^ (1u << (GDBM_HASH_BITS - depth))
+                    : BASE_HASH;
+  if (verbose)
+    printf ("storing key with hash %#x\n", last_hash);
+  rc = store_key (dbf, last_hash, &len);
+  if (chain)
+    {
+      gdbm_check_info info;
+
+      if (rc)
+	{
+	  fprintf (stderr, "gdbm_store: %s\n", gdbm_db_strerror (dbf));
+	  return 1;
+	}
+      if (dbf->header->dir_bits != dir_bits)
+	{
+	  fprintf (stderr, "directory depth %d, expected %d\n",
+		   dbf->header->dir_bits, dir_bits);
+	  return 1;
+	}
+      if (gdbm_check (dbf, &info, 0))
+	{
+	  fprintf (stderr, "gdbm_check: %s\n", gdbm_db_strerror (dbf));
+	  return 1;
+	}
+      if (info.errors != 0)
+	{
+	  fprintf (stderr, "gdbm_check: %lu errors\n",
+		   (unsigned long) info.errors);
+	  return 1;
+	}
+    }
+  else if (depth == 0)
+    {
+      if (rc == 0)
+	{
+	  fprintf (stderr, "gdbm_store succeeded unexpectedly\n");
+	  return 1;
+	}
+      if (gdbm_last_errno (dbf) != GDBM_DIR_OVERFLOW)
+	{
+	  fprintf (stderr, "gdbm_store: %s\n", gdbm_db_strerror (dbf));
+	  return 1;
+	}
+      if (gdbm_needs_recovery (dbf))
+	{
+	  fprintf (stderr, "database needs recovery\n");
+	  return 1;
+	}
+    }
+  else
+    {
+      if (rc)
+	{
+	  fprintf (stderr, "gdbm_store: %s\n", gdbm_db_strerror (dbf));
+	  return 1;
+	}
+      if (dbf->header->dir_bits != depth)
+	{
+	  fprintf (stderr, "directory depth %d, expected %d\n",
+		   dbf->header->dir_bits, depth);
+	  return 1;
+	}
+    }
+
+  if (gdbm_close (dbf))
+    {
+      fprintf (stderr, "gdbm_close: %s\n", gdbm_strerror (gdbm_errno));
+      return 1;
+    }
+
+  if (verbose)
+    printf ("verifying keys\n");
+  dbf = gdbm_open (dbname, 0, chain ? GDBM_WRITER : GDBM_READER, 0, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open: %s\n", gdbm_strerror (gdbm_errno));
+      return 1;
+    }
+  rc = dbf->header->bucket_elems + (chain || depth ? 1 : 0);
+  verify_keys (dbf, len, last_hash, rc);
+
+  if (chain)
+    {
+      if (verbose)
+	printf ("reorganizing\n");
+      if (gdbm_reorganize (dbf))
+	{
+	  fprintf (stderr, "gdbm_reorganize: %s\n", gdbm_db_strerror (dbf));
+	  return 1;
+	}
+      verify_keys (dbf, len, last_hash, rc);
+    }
+  gdbm_close (dbf);
+
+  return 0;
+}
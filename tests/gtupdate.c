@@ -0,0 +1,72 @@
+/* This file is part of GDBM test suite.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "autoconf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "gdbm.h"
+#include "progname.h"
+
+/* Usage: gtupdate DBFILE KEY OFFSET DATA
+
+   Replace the part of the value of KEY starting at OFFSET with DATA. */
+
+int
+main (int argc, char **argv)
+{
+  const char *progname = canonical_progname (argv[0]);
+  datum key, data;
+  GDBM_FILE dbf;
+  int rc = 0;
+
+  if (argc == 2 && strcmp (argv[1], "-h") == 0)
+    {
+      printf ("usage: %s DBFILE KEY OFFSET DATA\n", progname);
+      exit (0);
+    }
+  if (argc != 5)
+    {
+      fprintf (stderr, "%s: wrong arguments\n", progname);
+      exit (1);
+    }
+
+  dbf = gdbm_open (argv[1], 0, GDBM_WRITER, 00664, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open failed: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  key.dptr = argv[2];
+  key.dsize = strlen (argv[2]);
+  data.dptr = argv[4];
+  data.dsize = strlen (argv[4]);
+  if (gdbm_update_range (dbf, key, atoi (argv[3]), data))
+    {
+      fprintf (stderr, "%s: %s\n", progname, gdbm_strerror (gdbm_errno));
+      rc = 2;
+    }
+
+  if (gdbm_close (dbf))
+    {
+      fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
+	       strerror (errno));
+      rc = 3;
+    }
+  exit (rc);
+}
@@ -0,0 +1,173 @@
+/* This file is part of GDBM test suite.
+   Copyright (C) 2022 Free Software Foundation, Inc.
+
+   GDBM is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   GDBM is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GDBM. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "autoconf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "gdbm.h"
+#include "progname.h"
+
+/* Usage: gtvalue [OPTIONS] DBFILE KEY [FILE]
+
+   Without FILE, copy the value of KEY to stdout.  With FILE, store its
+   content as the value of KEY.  Values are transferred in chunks of
+   the size given by the -chunk option. */
+
+int
+main (int argc, char **argv)
+{
+  const char *progname = canonical_progname (argv[0]);
+  const char *dbname;
+  const char *input = NULL;
+  datum key;
+  int flags = 0;
+  int store_flags = GDBM_INSERT;
+  size_t chunk = 1024;
+  char *buf;
+  ssize_t n;
+  GDBM_FILE dbf;
+  GDBM_VALUE val;
+  int rc = 0;
+
+  while (--argc)
+    {
+      char *arg = *++argv;
+
+      if (strcmp (arg, "-h") == 0)
+	{
+	  printf ("usage: %s [-replace] [-chunk=N] [-inline] [-compress] DBFILE KEY [FILE]\n",
+		  progname);
+	  exit (0);
+	}
+      else if (strcmp (arg, "-replace") == 0)
+	store_flags = GDBM_REPLACE;
+      else if (strncmp (arg, "-chunk=", 7) == 0)
+	chunk = strtoul (arg + 7, NULL, 10);
+      else if (strcmp (arg, "-inline") == 0)
+	flags |= GDBM_INLINE;
+      else if (strcmp (arg, "-compress") == 0)
+	flags |= GDBM_COMPRESS;
+      else if (strcmp (arg, "--") == 0)
+	{
+	  --argc;
+	  ++argv;
+	  break;
+	}
+      else if (arg[0] == '-')
+	{
+	  fprintf (stderr, "%s: unknown option %s\n", progname, arg);
+	  exit (1);
+	}
+      else
+	break;
+    }
+
+  if (argc < 2 || argc > 3 || chunk == 0)
+    {
+      fprintf (stderr, "%s: wrong arguments\n", progname);
+      exit (1);
+    }
+  dbname = argv[0];
+  key.dptr = argv[1];
+  key.dsize = strlen (argv[1]);
+  if (argc == 3)
+    input = argv[2];
+
+  buf = malloc (chunk);
+  if (!buf)
+    {
+      fprintf (stderr, "%s: out of memory\n", progname);
+      exit (1);
+    }
+
+  dbf = gdbm_open (dbname, 0, (input ? GDBM_WRCREAT : GDBM_READER) | flags,
+		   00664, NULL);
+  if (!dbf)
+    {
+      fprintf (stderr, "gdbm_open failed: %s\n", gdbm_strerror (gdbm_errno));
+      exit (1);
+    }
+
+  if (input)
+    {
+      FILE *fp;
+      struct stat st;
+
+      fp = fopen (input, "r");
+      if (!fp || fstat (fileno (fp), &st))
+	{
+	  fprintf (stderr, "%s: %s: %s\n", progname, input, strerror (errno));
+	  exit (1);
+	}
+      val = gdbm_value_create (dbf, key, st.st_size, store_flags);
+      if (!val)
+	{
+	  fprintf (stderr, "%s: gdbm_value_create: %s\n", progname,
+		   gdbm_strerror (gdbm_errno));
+	  exit (2);
+	}
+      while ((n = fread (buf, 1, chunk, fp)) > 0)
+	{
+	  if (gdbm_value_write (val, buf, n) != n)
+	    {
+	      fprintf (stderr, "%s: gdbm_value_write: %s\n", progname,
+		       gdbm_strerror (gdbm_errno));
+	      rc = 2;
+	      break;
+	    }
+	}
+      fclose (fp);
+    }
+  else
+    {
+      val = gdbm_value_open (dbf, key);
+      if (!val)
+	{
+	  if (gdbm_errno == GDBM_ITEM_NOT_FOUND)
+	    fprintf (stderr, "%s: %s: not found\n", progname, key.dptr);
+	  else
+	    fprintf (stderr, "%s: gdbm_value_open: %s\n", progname,
+		     gdbm_strerror (gdbm_errno));
+	  exit (2);
+	}
+      while ((n = gdbm_value_read (val, buf, chunk)) > 0)
+	fwrite (buf, n, 1, stdout);
+      if (n < 0)
+	{
+	  fprintf (stderr, "%s: gdbm_value_read: %s\n", progname,
+		   gdbm_strerror (gdbm_errno));
+	  rc = 2;
+	}
+    }
+
+  if (gdbm_value_close (val) && rc == 0)
+    {
+      fprintf (stderr, "%s: gdbm_value_close: %s\n", progname,
+	       gdbm_strerror (gdbm_errno));
+      rc = 2;
+    }
+
+  if (gdbm_close (dbf))
+    {
+      fprintf (stderr, "gdbm_close: %s; %s\n", gdbm_strerror (gdbm_errno),
+	       strerror (errno));
+      rc = 3;
+    }
+  exit (rc);
+}
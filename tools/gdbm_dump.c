@@ -22,11 +22,17 @@
 char *parseopt_program_doc = N_("dump a GDBM database to a file");
 char *parseopt_program_args = N_("DB_FILE [FILE]");
 struct gdbm_option optab[] = {
-  { 'H', "format", "binary|ascii|0|1", N_("select dump format") },
+  { 'H', "format", "binary|ascii|packed|0|1|2", N_("select dump format") },
+  { 'z', "compress", NULL, N_("compress packed dump") },
+  { 's', "since", N_("GEN"),
+    N_("dump only the changes made in generation GEN and later") },
   { 0 }
 };
 
 int format = GDBM_DUMP_FMT_ASCII;
+int compress = 0;
+int delta = 0;
+unsigned since;
 
 int
 main (int argc, char **argv)
@@ -55,6 +61,8 @@ main (int argc, char **argv)
 	  format = GDBM_DUMP_FMT_BINARY;
 	else if (strcmp (optarg, "ascii") == 0)
 	  format = GDBM_DUMP_FMT_ASCII;
+	else if (strcmp (optarg, "packed") == 0)
+	  format = GDBM_DUMP_FMT_PACKED;
 	else
 	  {
 	    format = atoi (optarg);
@@ -62,6 +70,7 @@ main (int argc, char **argv)
 	      {
 	      case GDBM_DUMP_FMT_BINARY:
 	      case GDBM_DUMP_FMT_ASCII:
+	      case GDBM_DUMP_FMT_PACKED:
 		break;
 	      default:
 		error (_("unknown dump format"));
@@ -69,6 +78,27 @@ main (int argc, char **argv)
 	      }
 	  }
 	break;
+
+      case 'z':
+	compress = GDBM_DUMP_COMPRESS;
+	break;
+
+      case 's':
+	{
+	  char *p;
+	  unsigned long n;
+
+	  errno = 0;
+	  n = strtoul (optarg, &p, 10);
+	  if (errno || *p || n > UINT_MAX)
+	    {
+	      error (_("invalid generation number: %s"), optarg);
+	      exit (EXIT_USAGE);
+	    }
+	  since = n;
+	  delta = 1;
+	}
+	break;
 	
       default:
 	error (_("unknown option"));
@@ -79,6 +109,22 @@ main (int argc, char **argv)
   argc -= optind;
   argv += optind;
 
+  if (compress)
+    {
+      if (format != GDBM_DUMP_FMT_PACKED)
+	{
+	  error (_("--compress requires packed format"));
+	  exit (EXIT_USAGE);
+	}
+      format |= compress;
+    }
+
+  if (delta && format != GDBM_DUMP_FMT_ASCII)
+    {
+      error (_("--since requires ascii format"));
+      exit (EXIT_USAGE);
+    }
+
   if (argc == 0)
     {
       parseopt_print_help ();
@@ -119,7 +165,10 @@ main (int argc, char **argv)
       exit (EXIT_FATAL);
     }
 
-  rc = gdbm_dump_to_file (dbf, fp, format);
+  if (delta)
+    rc = gdbm_dump_delta_to_file (dbf, fp, since);
+  else
+    rc = gdbm_dump_to_file (dbf, fp, format);
   if (rc)
     {
       gdbm_perror (_("dump error"), filename);
@@ -24,6 +24,8 @@
 int replace = 0;
 int meta_mask = 0;
 int no_meta_option;
+int apply_option;
+off_t start_offset;
 
 int mode;
 uid_t owner_uid;
@@ -39,6 +41,10 @@ struct gdbm_option optab[] = {
   { 'M', "mmap", NULL, N_("use memory mapping") },
   { 'c', "cache-size", N_("NUM"), N_("set the cache size") },
   { 'b', "block-size", N_("NUM"), N_("set the block size") },
+  { 'a', "apply", NULL,
+    N_("apply a journal to the existing database and print the offset"
+       " of its end") },
+  { 'o', "offset", N_("NUM"), N_("start reading FILE at offset NUM") },
   { 0 }
 };
 
@@ -210,6 +216,20 @@ main (int argc, char **argv)
       case 'M':
 	oflags &= ~GDBM_NOMMAP;
 	break;
+
+      case 'a':
+	apply_option = 1;
+	break;
+
+      case 'o':
+	errno = 0;
+	start_offset = strtoull (optarg, &end, 10);
+	if (*end || errno || start_offset < 0)
+	  {
+	    error (_("invalid number: %s"), optarg);
+	    exit (EXIT_USAGE);
+	  }
+	break;
 	
       default:
 	error (_("unknown option"));
@@ -235,6 +255,11 @@ main (int argc, char **argv)
   filename = argv[0];
   if (argc == 2)
     dbname = argv[1];
+  else if (apply_option)
+    {
+      error (_("--apply requires database name"));
+      exit (EXIT_USAGE);
+    }
   else
     dbname = NULL;
 
@@ -252,6 +277,43 @@ main (int argc, char **argv)
 	  exit (EXIT_FATAL);
 	}
     }
+
+  if (start_offset && fseeko (fp, start_offset, SEEK_SET))
+    {
+      sys_perror (errno, _("cannot seek in %s"), filename);
+      exit (EXIT_FATAL);
+    }
+
+  if (apply_option)
+    {
+      off_t off;
+
+      dbf = gdbm_open (dbname, block_size,
+		       (oflags & ~GDBM_OPENMASK) | GDBM_WRCREAT, 0600, NULL);
+      if (!dbf)
+	{
+	  gdbm_perror (_("gdbm_open failed"));
+	  exit (EXIT_FATAL);
+	}
+      if (cache_size &&
+	  gdbm_setopt (dbf, GDBM_SETCACHESIZE, &cache_size, sizeof (int)) == -1)
+	error (_("gdbm_setopt failed: %s"), gdbm_strerror (gdbm_errno));
+
+      rc = EXIT_OK;
+      if (gdbm_apply (dbf, fp, &off))
+	{
+	  gdbm_perror (_("cannot apply %s"), filename);
+	  rc = EXIT_FATAL;
+	}
+      else
+	printf ("%llu\n", (unsigned long long) (start_offset + off));
+      if (gdbm_close (dbf))
+	{
+	  gdbm_perror (_("gdbm_close failed"));
+	  rc = EXIT_FATAL;
+	}
+      exit (rc);
+    }
   
   if (dbname)
     {
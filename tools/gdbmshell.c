@@ -197,7 +197,8 @@ checkdb_begin (struct command_param *param GDBM_ARG_UNUSED,
 static size_t
 bucket_print_lines (hash_bucket *bucket)
 {
-  return 10 + gdbm_file->header->bucket_elems + 3 + bucket->av_count;
+  return 10 + gdbm_file->header->bucket_elems + 3 + bucket->av_count
+    + (_gdbm_feature_p (gdbm_file, GDBM_FEAT_CHAIN) ? 1 : 0);
 }
 
 static void
@@ -206,6 +207,14 @@ format_key_start (FILE *fp, bucket_element *elt)
   int size = SMALL < elt->key_size ? SMALL : elt->key_size;
   int i;
 
+  if (_gdbm_feature_p (gdbm_file, GDBM_FEAT_FINGERPRINT)
+      && !_gdbm_elem_inline_p (gdbm_file, elt))
+    {
+      for (i = 0; i < SMALL; i++)
+	fprintf (fp, "%02x", (unsigned char) elt->key_start[i]);
+      return;
+    }
+  
   for (i = 0; i < size; i++)
     {
       if (isprint (elt->key_start[i]))
@@ -241,7 +250,7 @@ print_bucket (FILE *fp)
 {
   int index;
   int hash_prefix;
-  off_t adr = gdbm_file->dir[gdbm_file->bucket_dir];
+  off_t adr = gdbm_file->cache_mru->ca_adr;
   hash_bucket *bucket = gdbm_file->bucket;
   int start = bucket_dir_start ();
   int dircount = bucket_refcount ();
@@ -265,6 +274,14 @@ print_bucket (FILE *fp)
       fprintf (fp, " (%d-%d)", start, start + dircount - 1);
     }
   fprintf (fp, "\n");
+  if (_gdbm_feature_p (gdbm_file, GDBM_FEAT_CHAIN))
+    {
+      bucket_chain chain;
+
+      _gdbm_bucket_chain_get (gdbm_file, bucket, &chain);
+      fprintf (fp, _("overflow    = %d (next %lu)\n"),
+	       gdbm_file->chain_pos, (unsigned long) chain.next);
+    }
 	     
   fprintf (fp,
 	   _("count       = %d\n"
@@ -277,11 +294,17 @@ print_bucket (FILE *fp)
 	   _("    #    hash value     key size    data size     data adr home  key start\n"));
   for (index = 0; index < gdbm_file->header->bucket_elems; index++)
     {
-      fprintf (fp, " %4d  %12x  %11d  %11d  %11lu %4d", index,
+      fprintf (fp, " %4d  %12x  %11d  %11d  ", index,
 	       bucket->h_table[index].hash_value,
 	       bucket->h_table[index].key_size,
-	       bucket->h_table[index].data_size,
-	       (unsigned long) bucket->h_table[index].data_pointer,
+	       bucket->h_table[index].data_size);
+      if (bucket->h_table[index].hash_value != -1
+	  && _gdbm_elem_inline_p (gdbm_file, &bucket->h_table[index]))
+	fprintf (fp, "%11s", "inline");
+      else
+	fprintf (fp, "%11lu",
+		 (unsigned long) bucket->h_table[index].data_pointer);
+      fprintf (fp, " %4d",
 	       bucket->h_table[index].hash_value %
 	       gdbm_file->header->bucket_elems);
       if (bucket->h_table[index].key_size)
@@ -764,6 +787,52 @@ recover_handler (struct command_param *param, struct command_environ *cenv)
   return rc;
 }  
 
+/* check [verbose] */
+static int
+check_handler (struct command_param *param, struct command_environ *cenv)
+{
+  gdbm_check_info info;
+  int flags = 0;
+  int rc;
+  int i;
+
+  for (i = 0; i < param->argc; i++)
+    {
+      char *arg = PARAM_STRING (param, i);
+      if (strcmp (arg, "verbose") == 0)
+	{
+	  info.errfun = err_printer;
+	  flags |= GDBM_CHECK_ERRFUN;
+	}
+      else
+	{
+	  terror (_("unrecognized argument: %s"), arg);
+	  return GDBMSHELL_SYNTAX;
+	}
+    }
+
+  rc = gdbm_check (gdbm_file, &info, flags);
+  switch (rc)
+    {
+    case 0:
+      fprintf (cenv->fp, _("Database is consistent.\n"));
+      break;
+
+    case 1:
+      fprintf (cenv->fp, _("Problems found: %lu\n"),
+	       (unsigned long) info.errors);
+      rc = GDBMSHELL_GDBM_ERR;
+      break;
+
+    default:
+      dberror ("%s", _("Consistency check failed"));
+      return GDBMSHELL_GDBM_ERR;
+    }
+  fprintf (cenv->fp, _("Buckets checked: %lu, keys checked: %lu\n"),
+	   (unsigned long) info.buckets, (unsigned long) info.keys);
+  return rc;
+}
+
 /* avail - print available list */
 static int
 avail_begin (struct command_param *param GDBM_ARG_UNUSED,
@@ -968,13 +1037,19 @@ print_dir_handler (struct command_param *param GDBM_ARG_UNUSED,
 	   gdbm_file->header->dir_bits,
 	   bucket_count ());
 
+  if (_gdbm_dir_load (gdbm_file, 0, GDBM_DIR_COUNT (gdbm_file)))
+    {
+      dberror (_("%s failed"), "_gdbm_dir_load");
+      return GDBMSHELL_GDBM_ERR;
+    }
+
   fprintf (cenv->fp, "#%11s  %8s  %s\n",
 	   _("Index"), _("Hash Pfx"), _("Bucket address"));
   for (i = 0; i < GDBM_DIR_COUNT (gdbm_file); i++)
     fprintf (cenv->fp, "  %10d: %08x %12lu\n",
 	     i,
 	     i << (GDBM_HASH_BITS - gdbm_file->header->dir_bits),
-	     (unsigned long) gdbm_file->dir[i]);
+	     (unsigned long) _gdbm_dir_entry (gdbm_file, i));
 
   return GDBMSHELL_OK;
 }
@@ -1002,6 +1077,10 @@ print_header_begin (struct command_param *param GDBM_ARG_UNUSED,
       n = 19;
       break;
 
+    case GDBM_EXT_MAGIC:
+      n = 20;
+      break;
+
     default:
       abort ();
     }
@@ -1033,6 +1112,10 @@ print_header_handler (struct command_param *param GDBM_ARG_UNUSED,
       type = "GDBM (numsync)";
       break;
 
+    case GDBM_EXT_MAGIC:
+      type = "GDBM (extended)";
+      break;
+
     default:
       abort ();
     }
@@ -1060,6 +1143,9 @@ print_header_handler (struct command_param *param GDBM_ARG_UNUSED,
       fprintf (fp, _("\nExtended Header: \n\n"));
       fprintf (fp, _("      version = %d\n"), gdbm_file->xheader->version);  
       fprintf (fp, _("      numsync = %u\n"), gdbm_file->xheader->numsync);
+      if (gdbm_file->header->header_magic == GDBM_EXT_MAGIC)
+	fprintf (fp, _("     features = %#x\n"),
+		 gdbm_file->xheader->features);
     }
 
   return GDBMSHELL_OK;
@@ -1556,6 +1642,8 @@ export_handler (struct command_param *param,
 	 format = GDBM_DUMP_FMT_BINARY;
       else if (strcmp (PARAM_STRING (param, i), "ascii") == 0)
 	 format = GDBM_DUMP_FMT_ASCII;
+      else if (strcmp (PARAM_STRING (param, i), "packed") == 0)
+	 format = GDBM_DUMP_FMT_PACKED;
       else
 	 {
 	   terror (_("unrecognized argument: %s"), PARAM_STRING (param, i));
@@ -1976,7 +2064,7 @@ static struct command command_tab[] = {
     .args = {
       { N_("FILE"), GDBM_ARG_STRING },
       { "[truncate]", GDBM_ARG_STRING },
-      { "[binary|ascii]", GDBM_ARG_STRING },
+      { "[binary|ascii|packed]", GDBM_ARG_STRING },
       { NULL }
     },
     .doc = N_("export"),
@@ -2090,6 +2178,19 @@ static struct command command_tab[] = {
     .variadic = FALSE,
     .repeat = REPEAT_NEVER,
   },
+  {
+    .name = "check",
+    .args = {
+      { "[verbose]", GDBM_ARG_STRING },
+      { NULL }
+    },
+    .doc = N_("check database consistency"),
+    .tok = T_CMD,
+    .begin = checkdb_begin,
+    .handler = check_handler,
+    .variadic = FALSE,
+    .repeat = REPEAT_NEVER,
+  },
   {
     .name = "avail",
     .doc = N_("print avail list"),
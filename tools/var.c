@@ -706,6 +706,9 @@ const char * const errname[_GDBM_MAX_ERRNO+1] = {
   [GDBM_ERR_SNAPSHOT_CLONE]     = "GDBM_ERR_SNAPSHOT_CLONE",
   [GDBM_ERR_REALPATH]           = "GDBM_ERR_REALPATH",
   [GDBM_ERR_USAGE]              = "GDBM_ERR_USAGE",
+  [GDBM_NOT_SUPPORTED]          = "GDBM_NOT_SUPPORTED",
+  [GDBM_BAD_RECORD]             = "GDBM_BAD_RECORD",
+  [GDBM_BAD_CHECKSUM]           = "GDBM_BAD_CHECKSUM",
 };
 
 static int